@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#ifndef __DISPARITY_ENGINE_H__
+#define __DISPARITY_ENGINE_H__
+
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include <yarp/os/all.h>
+
+#include <iCub/stereoVision/elasWrapper.h>
+#include <iCub/stereoVision/stageStats.h>
+
+/**
+* \ingroup StereoVisionLib
+*
+* The parameters of StereoCamera::computeDisparity(), each engine uses the ones it understands.
+*/
+struct DisparityParams
+{
+    bool best;
+    int uniquenessRatio;
+    int speckleWindowSize;
+    int speckleRange;
+    int numberOfDisparities;
+    int SADWindowSize;
+    int minDisparity;
+    int preFilterCap;
+    int disp12MaxDiff;
+};
+
+
+/**
+* \ingroup StereoVisionLib
+*
+* Interface of the algorithms used by StereoCamera to rectify a stereo pair
+* and compute its disparity.
+*/
+class DisparityEngine
+{
+protected:
+    StageStats *stats;
+
+public:
+    DisparityEngine() : stats(NULL) { }
+    virtual ~DisparityEngine() { }
+
+    /**
+    * Sets where the durations of the stages of compute() are recorded; the
+    * engine registers its stages there, they are recorded by the thread
+    * calling compute().
+    * @param stats the statistics, NULL to stop recording.
+    */
+    virtual void setStageStats(StageStats *stats) { this->stats=stats; }
+
+    /**
+    * @return the name of the engine, as given in the configuration.
+    */
+    virtual std::string getName() const=0;
+
+    /**
+    * Rectifies the images and computes the disparity of the left one.
+    * The maps are the fixed-point ones of cv::convertMaps(); a map with the
+    * same data pointer of the previous call is the same map.
+    * @param left the left image (gray or color).
+    * @param right the right image.
+    * @param mapL1 the first rectification map of the left camera.
+    * @param mapL2 the second rectification map of the left camera.
+    * @param mapR1 the first rectification map of the right camera.
+    * @param mapR2 the second rectification map of the right camera.
+    * @param rectL the rectified left image, same type of left.
+    * @param rectR the rectified right image, same type of right.
+    * @param disp the disparity of rectL, CV_16S scaled by 16 or CV_32F in pixels (negative where
+    * not valid); a CV_16S disp of the right size is written in place.
+    * @param params the disparity parameters.
+    * @return true on success.
+    */
+    virtual bool compute(const cv::Mat &left, const cv::Mat &right,
+                         const cv::Mat &mapL1, const cv::Mat &mapL2,
+                         const cv::Mat &mapR1, const cv::Mat &mapR2,
+                         cv::Mat &rectL, cv::Mat &rectR, cv::Mat &disp,
+                         const DisparityParams &params)=0;
+
+    /**
+    * Creates an engine:
+    * - \e elas: LIBELAS (see elasWrapper, configured by the \e elas_* options);
+    * - \e sgbm: OpenCV's StereoSGBM (3-way variant with \e sgbm_3way);
+    * - \e cuda_sgm: OpenCV's cuda::StereoSGM, the maps and the images stay on the
+    *   device (OpenCV 4.2 or greater built with the CUDA stereo module).
+    * @param name the engine name.
+    * @param rf the configuration.
+    * @return the engine, NULL if unknown or not available in this build.
+    */
+    static DisparityEngine* create(const std::string &name, yarp::os::ResourceFinder &rf);
+};
+
+
+/**
+* \ingroup StereoVisionLib
+*
+* LIBELAS: without io scaling, the rectification (or the color
+* conversion) writes straight into the aligned input buffers of
+* the wrapper and no further copy is done.
+* The state of LIBELAS (temporal prior, triangulations, workspace) is
+* kept per disparity window (see StereoCamera::setDisparityROIs()), the
+* windows being told apart by their place in the rectification maps; the
+* temporal prior of a window is reset whenever its rectification or its
+* place change.
+*/
+class ElasDisparityEngine : public DisparityEngine
+{
+    struct Window
+    {
+        elasWrapper *elas;
+        cv::Mat mapL1;          // the left map of the window, within the whole rectification
+        int lastUsed;
+    };
+
+    static const int maxWindows=4;
+
+    elasWrapper *elaswrap;      // the parameters, and the state of the first window
+    std::vector<Window> windows;
+    int clock;
+    int stageRectify,stageCoarse;
+    int stageElas[Elas::NUM_STAGES];
+
+    elasWrapper* getWindow(const cv::Mat &mapL1);
+
+public:
+
+    ElasDisparityEngine(yarp::os::ResourceFinder &rf);
+    ~ElasDisparityEngine();
+
+    std::string getName() const { return "elas"; }
+
+    /**
+    * Stages: \e rectify, \e elas_coarse (coarse-to-fine setting) and the ones of
+    * Elas (\e elas_descriptor, \e elas_support, ...).
+    */
+    void setStageStats(StageStats *stats);
+
+    bool compute(const cv::Mat &left, const cv::Mat &right,
+                 const cv::Mat &mapL1, const cv::Mat &mapL2,
+                 const cv::Mat &mapR1, const cv::Mat &mapR2,
+                 cv::Mat &rectL, cv::Mat &rectR, cv::Mat &disp,
+                 const DisparityParams &params);
+
+    /**
+    * @return the wrapped LIBELAS instance, whose parameters apply to all the windows.
+    */
+    elasWrapper* getElas() { return elaswrap; }
+};
+
+
+/**
+* \ingroup StereoVisionLib
+*
+* OpenCV's semi-global block matching on the CPU. The matcher, and so its
+* buffers (the cost volume of the full variant), persists across frames
+* and its parameters are set again only when they change.
+*/
+class SgbmDisparityEngine : public DisparityEngine
+{
+    bool threeWay;
+    cv::Ptr<cv::StereoSGBM> sgbm;
+    DisparityParams current;
+    int channels;
+    int stageRectify,stageMatch;
+
+    void configure(const DisparityParams &params, const int cn);
+
+public:
+
+    /**
+    * Constructor.
+    * @param threeWay if true the 3-way variant of SGBM (faster, OpenCV 3.1 or greater)
+    * is used whatever DisparityParams::best is.
+    */
+    SgbmDisparityEngine(const bool threeWay=false);
+
+    std::string getName() const { return "sgbm"; }
+
+    /**
+    * Stages: \e rectify and \e sgbm.
+    */
+    void setStageStats(StageStats *stats);
+
+    bool compute(const cv::Mat &left, const cv::Mat &right,
+                 const cv::Mat &mapL1, const cv::Mat &mapL2,
+                 const cv::Mat &mapR1, const cv::Mat &mapR2,
+                 cv::Mat &rectL, cv::Mat &rectR, cv::Mat &disp,
+                 const DisparityParams &params);
+};
+
+#endif
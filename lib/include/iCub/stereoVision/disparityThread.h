@@ -17,6 +17,8 @@
  */
 
 #include <iCub/stereoVision/stereoCamera.h>
+#include <iCub/stereoVision/jobHandle.h>
+#include <iCub/stereoVision/stageStats.h>
 #include <yarp/dev/PolyDriver.h>
 #include <iCub/iKin/iKinFwd.h>
 #include <yarp/dev/GazeControl.h>
@@ -41,13 +43,17 @@ using namespace iCub::iKin;
 *
 * The class defining the disparity computation.
 * It computes the depth map and it updates the icub's eye relative positions.
+* The thread sleeps until setImages() submits a new pair.
 */
-class DisparityThread : public RateThread
+class DisparityThread : public yarp::os::Thread
 {
 private:
     StereoCamera *stereo;
-    bool done;
+    JobHandle job;
     bool work;
+    Mat pendingLeft,pendingRight;   // the pair of the job, taken by run()
+    yarp::os::Mutex mutexJob;
+    yarp::os::Semaphore jobAvailable;
     bool init;
     bool success;
     bool useCalibrated;
@@ -98,6 +104,10 @@ private:
     string moduleName;
     string robotName;
 
+    // stages of the jobs, recorded by the thread
+    StageStats stats;
+    int stageJob,stageCalibration,stageDisparity;
+
     Mat buildRotTras(Mat &R, Mat &T);
     bool loadStereoParameters(yarp::os::ResourceFinder &rf, Mat &KL, Mat &KR, Mat &DistL, Mat &DistR, Mat &Ro, Mat &To);
     Matrix getCameraHGazeCtrl(int camera);
@@ -107,13 +117,16 @@ private:
     void convert(Mat& mat, Matrix& matrix);
     void updateViaGazeCtrl(const bool update);
     void updateViaKinematics(const yarp::sig::Vector& deyes);
+    void installImages(Mat &left, Mat &right);
     bool loadExtrinsics(yarp::os::ResourceFinder& rf, Mat& Ro, Mat& To, yarp::sig::Vector& eyes);
 
 public:
     DisparityThread(const string &name, yarp::os::ResourceFinder &rf, bool useHorn=true, bool updateCamera=false, bool rectify=true);
     ~DisparityThread() { };
 
-    void setImages(Mat &left, Mat &right);
+    JobHandle setImages(Mat &left, Mat &right);
+
+    // the getters share the matrices of the last computation: they must not be modified
     void getDisparity(Mat &Disp);
     Point3f get3DPointMatch(double u1, double v1, double u2, double v2, string drive);
     void getDisparityFloat(Mat &Disp);
@@ -125,6 +138,14 @@ public:
     void getRootTransformation(Mat & Trans,int eye=LEFT);
     bool isOpen();
     void setDispParameters(bool _useBestDisp, int _uniquenessRatio, int _speckleWindowSize,int _speckleRange, int _numberOfDisparities, int _SADWindowSize, int _minDisparity, int _preFilterCap, int _disp12MaxDiff);
+    bool setDisparityEngine(const string &name, yarp::os::ResourceFinder &rf);
+
+    /**
+    * @return the latency statistics of the jobs: \e job (the whole job),
+    * \e calibration (online update of the cameras), \e disparity and
+    * the stages of StereoCamera::computeDisparity().
+    */
+    StageStats& getStageStats() { return stats; }
 
     void updateCamerasOnce();
     void startUpdate();
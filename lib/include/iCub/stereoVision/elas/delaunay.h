@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+// Delaunay triangulation of integer points that is kept across frames:
+// update() only removes the points that disappeared or moved and inserts the
+// new ones (Bowyer-Watson insertion, removal by ear clipping of the star of
+// the vertex), a full rebuild is done when too many points changed.
+// The predicates are exact (64 bit integer arithmetic). The points lie in an
+// enclosing triangle; the triangles touching its corners are not returned,
+// so thin slivers along the convex hull may be missing compared to a plain
+// Delaunay triangulation, and cocircular points may be split differently.
+
+#ifndef __DELAUNAY_H__
+#define __DELAUNAY_H__
+
+#include <vector>
+#include <map>
+
+// define fixed-width datatypes for Visual Studio projects
+#ifndef _MSC_VER
+  #include <stdint.h>
+#else
+  typedef __int32           int32_t;
+  typedef __int64           int64_t;
+  typedef unsigned __int32  uint32_t;
+#endif
+
+class IncrementalDelaunay {
+
+public:
+
+  // coordinates must lie in [-max_coord,max_coord] (the predicates do not overflow)
+  static const int32_t max_coord = 2048;
+
+  IncrementalDelaunay ();
+
+  // forgets the triangulation, the next update() rebuilds it
+  void reset ();
+
+  // brings the triangulation to the points (x[i],y[i]); key[i] identifies a
+  // point across calls (unique within a call): a known key at a new position
+  // is moved. Points at the position of another one are left out (and tried
+  // again at the next call). The triangulation is rebuilt from scratch when
+  // more than rebuild_ratio of the points changed.
+  // returns true if the triangulation was rebuilt
+  bool update (const std::vector<int32_t> &key,const std::vector<int32_t> &x,
+               const std::vector<int32_t> &y,float rebuild_ratio);
+
+  // triangles of the last update(): corners (CCW) as indices of its points
+  int32_t numTriangles () const { return (int32_t)out_slot.size(); }
+  const int32_t* corners (int32_t i) const { return &out_corners[3*i]; }
+
+  // a triangle keeps its stamp as long as it exists with the same corners,
+  // e.g. to cache values computed from them
+  uint32_t stamp (int32_t i) const { return tris[out_slot[i]].stamp; }
+  int32_t  slot (int32_t i) const { return out_slot[i]; }
+
+  // number of slots, an upper bound of slot()
+  int32_t numSlots () const { return (int32_t)tris.size(); }
+
+private:
+
+  struct vertex {
+    int32_t x,y;
+    int32_t tri;        // an incident triangle
+    int32_t index;      // index in the points of the current update()
+    int32_t key;
+    bool    used;       // false = free slot
+    bool    inserted;   // false if left out (duplicate position)
+  };
+
+  struct tri {
+    int32_t  v[3];      // vertices, counter-clockwise
+    int32_t  n[3];      // n[i] is the neighbor across the edge opposite v[i] (-1 = none)
+    uint32_t stamp;     // 0 = free slot
+  };
+
+  int32_t newVertex (int32_t key,int32_t x,int32_t y);
+  int32_t newTriangle (int32_t a,int32_t b,int32_t c);
+  void    freeVertex (int32_t v);
+  void    freeTriangle (int32_t t);
+  void    link (int32_t t,int32_t side,int32_t t_nb,int32_t side_nb);
+  int32_t side (int32_t t,int32_t t_nb) const;
+
+  int32_t locate (int32_t x,int32_t y);
+  bool    insert (int32_t v);
+  bool    remove (int32_t v);
+  void    rebuild (const std::vector<int32_t> &key,const std::vector<int32_t> &x,
+                   const std::vector<int32_t> &y);
+
+  std::vector<vertex>  verts;       // verts[0..2] are the enclosing triangle
+  std::vector<tri>     tris;
+  std::vector<int32_t> free_verts,free_tris;
+  std::map<int32_t,int32_t> key_vertex;
+
+  int32_t  last;                    // start of the point location walk
+  uint32_t next_stamp;
+  uint32_t rand_state;
+
+  // scratch of update(), insert() and remove()
+  std::vector<int32_t> seen,changed,cavity,marks,edges,ring,ears;
+
+  std::vector<int32_t> out_corners,out_slot;
+};
+
+#endif
@@ -52,6 +52,12 @@ public:
   
   // constructor creates filters
   Descriptor(uint8_t* I,int32_t width,int32_t height,int32_t bpl,bool half_resolution);
+
+  // constructor creates filters into caller-owned buffers (16-byte aligned):
+  // I_desc (16*width*height), I_du and I_dv (bpl*height), I_tmp (2*bpl*height);
+  // nothing is released at destruction
+  Descriptor(uint8_t* I,int32_t width,int32_t height,int32_t bpl,bool half_resolution,
+             uint8_t* I_desc,uint8_t* I_du,uint8_t* I_dv,int16_t* I_tmp);
   
   // deconstructor releases memory
   ~Descriptor();
@@ -61,6 +67,9 @@ public:
   
 private:
 
+  // true if I_desc has been allocated by this object
+  bool owns_desc;
+
   // build descriptor I_desc from I_du and I_dv
   void createDescriptor(uint8_t* I_du,uint8_t* I_dv,int32_t width,int32_t height,int32_t bpl,bool half_resolution);
 
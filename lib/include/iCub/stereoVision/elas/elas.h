@@ -29,7 +29,8 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
 #include <string.h>
 #include <stdlib.h>
 #include <vector>
-#include <emmintrin.h>
+#include "kernels.h"
+#include "delaunay.h"
 //#define PROFILE 1
 
 // define fixed-width datatypes for Visual Studio projects
@@ -83,6 +84,17 @@ public:
     bool    subsampling;            // saves time by only computing disparities for each 2nd pixel
                                     // note: for this option D1 and D2 must be passed with size
                                     //       width/2 x height/2 (rounded towards zero)
+    int32_t num_threads;            // number of threads of the OpenMP implementation (0 = OpenMP default)
+                                    // note: its output does not depend on the number of threads, but it
+                                    //       is not checked to be bit-identical to the serial implementation
+    bool    temporal_prior;         // search the support points and the disparities of the previous frame
+                                    // again (in a narrow range)
+    int32_t prior_radius;           // disparity search radius around the previous support points and disparities
+    int32_t prior_refresh;          // frames between two full searches of the support points
+    float   prior_min_ratio;        // min. ratio of the support points of the last full search confirmed
+                                    // (else full search)
+    bool    incremental_delaunay;   // keep the triangulations across frames and only update the changed
+                                    // support points (pays off with temporal_prior, see delaunay.h)
 
     // constructor
     parameters (setting s=ROBOTICS) {
@@ -114,6 +126,12 @@ public:
         filter_adaptive_mean  = 1;
         postprocess_only_left = 1;
         subsampling           = 0;
+        num_threads           = 0;
+        temporal_prior        = 0;
+        prior_radius          = 3;
+        prior_refresh         = 10;
+        prior_min_ratio       = 0.6;
+        incremental_delaunay  = 0;
 
       // default settings for middlebury benchmark
       // (interpolate all missing disparities)
@@ -141,15 +159,23 @@ public:
         filter_adaptive_mean  = 0;
         postprocess_only_left = 0;
         subsampling           = 0;
+        num_threads           = 0;
+        temporal_prior        = 0;
+        prior_radius          = 3;
+        prior_refresh         = 10;
+        prior_min_ratio       = 0.6;
+        incremental_delaunay  = 0;
       }
     }
   };
 
   // constructor, input: parameters
-  Elas (parameters param) : param(param) {}
+  Elas (parameters param) : param(param),I1(0),I2(0),copies_saved(0),kern(&kernels::get()),prior_used(false) {
+    startStages();
+  }
 
-  // deconstructor
-  ~Elas () {}
+  // deconstructor, releases the persistent workspace
+  ~Elas () { releaseWorkspace(); }
 
   // matching function
   // inputs: pointers to left (I1) and right (I2) intensity image (uint8, input)
@@ -160,8 +186,54 @@ public:
   //         note: D1 and D2 must be allocated before (bytes per line = width)
   //               if subsampling is not active their size is width x height,
   //               otherwise width/2 x height/2 (rounded towards zero)
+  //         note: I1 and I2 are used in place (no copy) if they are 16-byte
+  //               aligned and dims[2] equals getAlignedBytesPerLine(width);
+  //               their padding columns must then be zero
   bool process (uint8_t* I1,uint8_t* I2,float* D1,float* D2,const int32_t* dims);
 
+  // refinement of a prior disparity map (coarse-to-fine matching)
+  // inputs: I1, I2, D1, D2 and dims as for process()
+  //         D_prior = disparity prior of I1, width x height (negative = unknown),
+  //                   e.g. the upsampled disparity map of a coarser pyramid level
+  //         radius  = each pixel is only matched within +/- radius of its prior
+  //         note: the support points and the disparity planes are not computed,
+  //               the L/R check and the postprocessing are those of process();
+  //               subsampling is not supported (returns false)
+  bool refine (uint8_t* I1,uint8_t* I2,const float* D_prior,const int32_t radius,float* D1,float* D2,const int32_t* dims);
+
+  // bytes per line of the internal 16-byte aligned image layout
+  static int32_t getAlignedBytesPerLine (int32_t width) {
+    return width + 15-(width-1)%16;
+  }
+
+  // number of input image copies avoided during the last call to process()
+  int32_t getInputCopiesSaved () const { return copies_saved; }
+
+  // name of the SIMD kernel variant selected for this CPU
+  const char* getKernelsName () const { return kern->name; }
+
+  // forgets the support points of the previous frame (e.g. after a recalibration),
+  // the next frame does a full search
+  void resetPrior () { prior = temporal(); }
+
+  // true if the support points of the last frame were seeded by the previous ones
+  bool isPriorUsed () const { return prior_used; }
+
+  // stages of process() and refine(), their durations are always measured
+  enum stage {STAGE_DESCRIPTOR,STAGE_SUPPORT,STAGE_TRIANGULATION,STAGE_MATCHING,
+              STAGE_LR_CHECK,STAGE_POSTPROCESS,NUM_STAGES};
+
+  // duration (ms) of a stage during the last call to process() or refine()
+  // (0 if the stage was not run)
+  float getStageTime (int32_t s) const { return stage_time[s]; }
+
+  // name of a stage
+  static const char* getStageName (int32_t s) {
+    static const char* names[NUM_STAGES] = {"descriptor","support","triangulation",
+                                            "matching","lr_check","postprocess"};
+    return names[s];
+  }
+
 private:
 
   struct support_pt {
@@ -191,25 +263,36 @@ private:
   void removeRedundantSupportPoints (int16_t* D_can,int32_t D_can_width,int32_t D_can_height,
                                      int32_t redun_max_dist, int32_t redun_threshold, bool vertical);
   void addCornerSupportPoints (std::vector<support_pt> &p_support);
-  inline int16_t computeMatchingDisparity (const int32_t &u,const int32_t &v,uint8_t* I1_desc,uint8_t* I2_desc,const bool &right_image);
+  inline int16_t computeMatchingDisparity (const int32_t &u,const int32_t &v,uint8_t* I1_desc,uint8_t* I2_desc,const bool &right_image,
+                                           const int32_t &d_lo,const int32_t &d_hi);
+  inline int16_t computeSupportCandidate (const int32_t &u,const int32_t &v,uint8_t* I1_desc,uint8_t* I2_desc,const int16_t &d_prior);
   std::vector<support_pt> computeSupportMatches (uint8_t* I1_desc,uint8_t* I2_desc);
 
   // triangulation & grid
-  std::vector<triangle> computeDelaunayTriangulation (std::vector<support_pt> p_support,int32_t right_image);
-  void computeDisparityPlanes (std::vector<support_pt> p_support,std::vector<triangle> &tri,int32_t right_image);
-  void createGrid (std::vector<support_pt> p_support,int32_t* disparity_grid,int32_t* grid_dims,bool right_image);
-
-  // matching
-  inline void updatePosteriorMinimum (__m128i* I2_block_addr,const int32_t &d,const int32_t &w,
-                                      const __m128i &xmm1,__m128i &xmm2,int32_t &val,int32_t &min_val,int32_t &min_d);
-  inline void updatePosteriorMinimum (__m128i* I2_block_addr,const int32_t &d,
-                                      const __m128i &xmm1,__m128i &xmm2,int32_t &val,int32_t &min_val,int32_t &min_d);
+  std::vector<triangle> computeDelaunayTriangulation (const std::vector<support_pt> &p_support,int32_t right_image);
+  void computeDisparityPlanes (const std::vector<support_pt> &p_support,std::vector<triangle> &tri,int32_t right_image,
+                               const std::vector<int32_t>* subset=0);
+  void createGrid (const std::vector<support_pt> &p_support,int32_t* disparity_grid,int32_t* grid_dims,bool right_image);
+
+  // incremental triangulation kept across frames (incremental_delaunay), the planes
+  // are only recomputed for new triangles and for those whose corners changed
+  void updateDelaunayTriangulation (const std::vector<support_pt> &p_support,int32_t right_image,
+                                    std::vector<triangle> &tri);
+
+  // matching, D_prev = disparity map of the previous frame (temporal prior, 0 = none):
+  // pixels with a previous disparity agreeing with the plane prior are first matched
+  // within +/- prior_radius of it
   inline void findMatch (int32_t &u,int32_t &v,float &plane_a,float &plane_b,float &plane_c,
                          int32_t* disparity_grid,int32_t *grid_dims,uint8_t* I1_desc,uint8_t* I2_desc,
-                         int32_t *P,int32_t &plane_radius,bool &valid,bool &right_image,float* D);
-  void computeDisparity (std::vector<support_pt> p_support,std::vector<triangle> tri,int32_t* disparity_grid,int32_t* grid_dims,
+                         int32_t *P,int32_t &plane_radius,bool &valid,bool &right_image,float* D,
+                         const float* D_prev);
+  void computeDisparity (const std::vector<support_pt> &p_support,const std::vector<triangle> &tri,int32_t* disparity_grid,int32_t* grid_dims,
                          uint8_t* I1_desc,uint8_t* I2_desc,bool right_image,float* D);
 
+  // band matching of refine()
+  void matchInBand (uint8_t* I1_desc,uint8_t* I2_desc,const float* D_prior,const int32_t radius,
+                    const bool right_image,float* D);
+
   // L/R consistency check
   void leftRightConsistencyCheck (float* D1,float* D2);
 
@@ -221,14 +304,90 @@ private:
   void adaptiveMean (float* D);
   void median (float* D);
 
+  // stage timing
+  void startStages ();
+  void stopStage (int32_t s);
+
+  // persistent workspace
+  void setInputImages (uint8_t* I1_,uint8_t* I2_,const int32_t* dims);
+  void allocateWorkspace ();
+  void releaseWorkspace ();
+
+  // buffers are kept across calls to process() and are only
+  // reallocated when image size, disp_max or grid_size change
+  struct workspace {
+    int32_t  width,height,bpl,disp_max,grid_size;
+    int32_t  grid_width,grid_height;
+    uint8_t *I1,*I2;               // aligned copies of the input images (bpl*height)
+    uint8_t *I1_desc,*I2_desc;     // 16*width*height descriptors
+    uint8_t *I_du,*I_dv;           // sobel output (bpl*height), shared by both descriptors
+    int16_t *I_tmp;                // sobel scratch (2*bpl*height)
+    int32_t *disparity_grid_1,*disparity_grid_2;
+    int32_t *grid_temp1[2],*grid_temp2[2];
+    std::vector<int32_t> incon_support;   // support counts of the candidates (OpenMP only)
+    workspace () : width(0),height(0),bpl(0),disp_max(-1),grid_size(0),grid_width(0),grid_height(0),
+                   I1(0),I2(0),I1_desc(0),I2_desc(0),I_du(0),I_dv(0),I_tmp(0),
+                   disparity_grid_1(0),disparity_grid_2(0) {
+      grid_temp1[0] = grid_temp1[1] = 0;
+      grid_temp2[0] = grid_temp2[1] = 0;
+    }
+  };
+
+  // support point candidates and disparity maps of the previous frame (temporal prior)
+  struct temporal {
+    std::vector<int16_t> D_can;   // candidate disparities after the consistency check
+    int32_t width,height,step;    // candidate grid they refer to
+    int32_t frames;               // frames since the last full search
+    int32_t full_num;             // valid candidates found by the last full search
+    std::vector<float> D[2];      // left and right disparity maps (band of findMatch)
+    temporal () : width(0),height(0),step(0),frames(0),full_num(0) {}
+  };
+
+  // triangulation of one image kept across frames, with the disparity
+  // planes of its triangles (by slot of the triangulation)
+  struct plane_cache {
+    uint32_t stamp;               // triangle they belong to (0 = none)
+    int32_t  d[3];                // disparities of its corners
+    float    t1a,t1b,t1c;
+    float    t2a,t2b,t2c;
+    plane_cache () : stamp(0) {}
+  };
+  struct triangulation {
+    IncrementalDelaunay dt;
+    std::vector<plane_cache> planes;
+    std::vector<int32_t> key,x,y,todo;
+  };
+
+  // the workspace owns raw buffers: copying is not allowed
+  Elas (const Elas&);
+  Elas& operator= (const Elas&);
+
 protected:
   // parameter set
   parameters param;
 
 private:
-  // memory aligned input images + dimensions
+  // memory aligned input images (workspace copies or caller buffers) + dimensions
   uint8_t *I1,*I2;
   int32_t width,height,bpl;
+  int32_t copies_saved;
+
+  // SIMD kernels (sobel filter, descriptor SAD)
+  const kernels::table* kern;
+
+  // persistent buffers
+  workspace ws;
+
+  // temporal prior
+  temporal prior;
+  bool prior_used;
+
+  // incremental triangulations of the left and right image
+  triangulation delaunay[2];
+
+  // durations of the stages of the last frame (ms)
+  float  stage_time[NUM_STAGES];
+  double stage_clock;
 
   // profiling timer
 #ifdef PROFILE
@@ -79,6 +79,9 @@ namespace filter {
   
   void sobel3x3( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h );
   
+  // same as above, using caller-owned 16-byte aligned scratch of w*h int16_t each
+  void sobel3x3( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h, int16_t* temp_h, int16_t* temp_v );
+  
   void sobel5x5( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h );
   
   // -1 -1  0  1  1
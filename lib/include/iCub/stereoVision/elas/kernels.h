@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+// SIMD kernels of the libelas hot loops (sobel filter, descriptor SAD).
+// Several variants are compiled in (generic C++, SSE2, AVX2, NEON) and the
+// best one supported by the running CPU is selected once, at first use.
+// All variants must produce bit-identical results, see check().
+
+#ifndef __KERNELS_H__
+#define __KERNELS_H__
+
+#include <stdlib.h>
+
+// define fixed-width datatypes for Visual Studio projects
+#ifndef _MSC_VER
+  #include <stdint.h>
+#else
+  typedef __int8            int8_t;
+  typedef __int16           int16_t;
+  typedef __int32           int32_t;
+  typedef __int64           int64_t;
+  typedef unsigned __int8   uint8_t;
+  typedef unsigned __int16  uint16_t;
+  typedef unsigned __int32  uint32_t;
+  typedef unsigned __int64  uint64_t;
+#endif
+
+// instruction set available at compile time
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+  #define ELAS_SSE2
+  #include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #define ELAS_NEON
+  #include <arm_neon.h>
+#endif
+
+#ifndef ELAS_SSE2
+
+// minimal replacements of the SSE helpers libelas uses outside the kernels,
+// so that the library also builds on non-x86 targets
+inline void* _mm_malloc (size_t size,size_t align) {
+  void* p = 0;
+  if (posix_memalign(&p,align,size)!=0)
+    return 0;
+  return p;
+}
+
+inline void _mm_free (void* p) {
+  free(p);
+}
+
+struct __m128 {
+  float f[4];
+};
+
+inline __m128 _mm_set1_ps (float a) {
+  __m128 r; r.f[0] = r.f[1] = r.f[2] = r.f[3] = a; return r;
+}
+
+inline __m128 _mm_load_ps (const float* p) {
+  __m128 r; for (int i=0; i<4; i++) r.f[i] = p[i]; return r;
+}
+
+inline void _mm_store_ps (float* p,const __m128 &a) {
+  for (int i=0; i<4; i++) p[i] = a.f[i];
+}
+
+inline __m128 _mm_add_ps (const __m128 &a,const __m128 &b) {
+  __m128 r; for (int i=0; i<4; i++) r.f[i] = a.f[i]+b.f[i]; return r;
+}
+
+inline __m128 _mm_sub_ps (const __m128 &a,const __m128 &b) {
+  __m128 r; for (int i=0; i<4; i++) r.f[i] = a.f[i]-b.f[i]; return r;
+}
+
+inline __m128 _mm_mul_ps (const __m128 &a,const __m128 &b) {
+  __m128 r; for (int i=0; i<4; i++) r.f[i] = a.f[i]*b.f[i]; return r;
+}
+
+inline __m128 _mm_max_ps (const __m128 &a,const __m128 &b) {
+  __m128 r; for (int i=0; i<4; i++) r.f[i] = a.f[i]>b.f[i] ? a.f[i] : b.f[i]; return r;
+}
+
+inline __m128 _mm_and_ps (const __m128 &a,const __m128 &b) {
+  union { float f; uint32_t u; } x,y;
+  __m128 r;
+  for (int i=0; i<4; i++) {
+    x.f = a.f[i]; y.f = b.f[i];
+    x.u &= y.u;
+    r.f[i] = x.f;
+  }
+  return r;
+}
+
+#endif
+
+namespace kernels {
+
+  // function table of one kernel variant
+  struct table {
+
+    // name of the variant ("generic", "sse2", "avx2", "neon")
+    const char* name;
+
+    // 3x3 sobel filter of a w x h image (w multiple of 16), see filter::sobel3x3
+    // temp_h and temp_v are 16-byte aligned scratch buffers of w*h int16_t each
+    void (*sobel3x3)( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h,
+                      int16_t* temp_h, int16_t* temp_v );
+
+    // E[i] = SAD between the 16-byte descriptors at I1_block and I2_block+i*step, i<n
+    void (*sadStrided)( const uint8_t* I1_block, const uint8_t* I2_block, int32_t step,
+                        int32_t n, int32_t* E );
+
+    // E[i] = SAD between the 16-byte descriptors at I1_block and I2_blocks[i], i<n
+    void (*sadGather)( const uint8_t* I1_block, const uint8_t* const* I2_blocks,
+                       int32_t n, int32_t* E );
+
+    // E[i] = sum over k<4 of the SADs between the descriptors at
+    // I1_block+offsets[k] and I2_block+i*step+offsets[k], i<n (support matching)
+    void (*sadSupport)( const uint8_t* I1_block, const uint8_t* I2_block, int32_t step,
+                        const int32_t* offsets, int32_t n, int32_t* E );
+  };
+
+  // maximal number of energies the callers compute per kernel call
+  const int32_t max_chunk = 32;
+
+  // variants compiled into this build (0 if not available)
+  const table* generic ();
+  const table* sse2 ();
+  const table* avx2 ();
+  const table* neon ();
+
+  // best variant for the running CPU; it can be forced by setting the
+  // environment variable ELAS_KERNELS to the name of a compiled-in variant
+  const table& get ();
+
+  // compares the kernels of a variant with the ones of a reference on random
+  // inputs: the sobel filter of Descriptor::createDescriptor and the SADs of
+  // the support matching and of updatePosteriorMinimum; true if equal
+  bool check (const table& t,const table& reference);
+
+  // checks the variants compiled into this build and supported by the CPU
+  // against the generic one, printing the outcome; true if all of them agree
+  bool checkAll ();
+}
+
+#endif
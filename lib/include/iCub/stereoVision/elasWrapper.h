@@ -46,16 +46,104 @@ class elasWrapper : public Elas {
 
     double io_scaling_factor;
 
+    // buffers kept across frames (reallocated by OpenCV only on size change)
+    cv::Mat imL_scaled, imR_scaled;
+    cv::Mat imL_gray, imR_gray;
+    cv::Mat dispL_buf, dispR_buf;
+
+    // coarse-to-fine mode: LIBELAS at half resolution, then refined
+    elasWrapper *coarse;
+    int refine_radius;
+    double coarse_time;
+    cv::Mat imL_coarse, imR_coarse;
+    cv::Mat dispL_coarse, dispR_coarse;
+    cv::Mat disp_prior;
+
+    bool match(cv::Mat &imL, cv::Mat &imR);
+
 public:
 
     int64 workBegin();
     double workEnd(int64 work_begin);
 
     elasWrapper();
+    /**
+    * Constructor.
+    * @param scaling_factor the scaling of the input images.
+    * @param elas_setting \e ROBOTICS, \e MIDDLEBURY or \e COARSE_TO_FINE: the ROBOTICS
+    * parameters with the disparity computed at half resolution first, and then refined at
+    * full resolution in a band of +/- refine_radius around the upsampled coarse map
+    * (see Elas::refine()); the support points and the planes are only computed at the
+    * coarse level. Not used with subsampling.
+    */
     elasWrapper(double scaling_factor, string elas_setting);
+    ~elasWrapper();
 
     bool compute_disparity(cv::Mat &imL, cv::Mat &imR, cv::Mat &dispL, int num_disparities);
 
+    /**
+    * Zero-copy variant of compute_disparity(): imL and imR must be grayscale images
+    * laid out as by create_aligned_input(), they are passed to Elas without any copy.
+    * Falls back to compute_disparity() when io scaling is active.
+    */
+    bool compute_disparity_aligned(cv::Mat &imL, cv::Mat &imR, cv::Mat &dispL, int num_disparities);
+
+    /**
+    * Allocates (only if needed) a zero-padded CV_8UC1 image of the given size whose
+    * rows are 16-byte aligned and padded to the ELAS internal stride.
+    * @param im the image to allocate.
+    * @param size the image size.
+    */
+    static void create_aligned_input(cv::Mat &im, cv::Size size);
+
+    /**
+    * Checks whether an image can be passed to compute_disparity_aligned().
+    * @param im the image to check.
+    * @return true if im has the aligned ELAS layout.
+    */
+    static bool is_aligned_input(const cv::Mat &im);
+
+    /**
+    * Returns headers to the persistent aligned input buffers of this object,
+    * so that callers (e.g. rectification) can write straight into them.
+    * @param size the image size.
+    * @param imL the left buffer.
+    * @param imR the right buffer.
+    */
+    void get_aligned_inputs(cv::Size size, cv::Mat &imL, cv::Mat &imR);
+
+    double get_io_scaling_factor();
+
+    /**
+    * With the temporal prior enabled (set_temporal_prior()), the support points of a frame
+    * are searched around the ones of the previous frame, in a range of +/- prior_radius
+    * disparities, and the other candidates over the full range on a sparser grid; each pixel
+    * is first matched within +/- prior_radius of its previous disparity. A full search is
+    * done every prior_refresh frames and whenever less than prior_min_ratio of the support
+    * points of the last full search are confirmed (large motion).
+    * This forgets the previous support points and disparities, e.g. after a change of the
+    * rectification.
+    */
+    void reset_prior();
+
+    /**
+    * Takes the parameters of another instance (io scaling and setting included),
+    * while the state of this one (buffers, prior, triangulations) is kept.
+    * @param other the instance to copy the parameters from.
+    */
+    void copy_settings(const elasWrapper &other);
+
+    /**
+    * @return true in the coarse-to-fine mode.
+    */
+    bool is_coarse_to_fine() { return coarse!=NULL; }
+
+    /**
+    * @return the time spent at the coarse level during the last frame [ms]
+    * (coarse-to-fine mode), the stages of the refinement are given by getStageTime().
+    */
+    double get_coarse_time() { return coarse_time; }
+
     int get_disp_min();
     int get_disp_max();
     float get_support_threshold();
@@ -79,6 +167,13 @@ public:
     bool get_filter_adaptive_mean();
     bool get_postprocess_only_left();
     bool get_subsampling();
+    int get_num_threads();
+    bool get_temporal_prior();
+    int get_prior_radius();
+    int get_prior_refresh();
+    float get_prior_min_ratio();
+    bool get_incremental_delaunay();
+    int get_refine_radius();
 
     void set_disp_min(int param_value);
     void set_disp_max(int param_value);
@@ -103,6 +198,13 @@ public:
     void set_filter_adaptive_mean(bool param_value);
     void set_postprocess_only_left(bool param_value);
     void set_subsampling(bool param_value);
+    void set_num_threads(int param_value);
+    void set_temporal_prior(bool param_value);
+    void set_prior_radius(int param_value);
+    void set_prior_refresh(int param_value);
+    void set_prior_min_ratio(float param_value);
+    void set_incremental_delaunay(bool param_value);
+    void set_refine_radius(int param_value);
 };
 
 #endif /* ELASWRAPPER_H_ */
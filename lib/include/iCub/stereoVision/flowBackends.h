@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#ifndef __FLOW_BACKENDS_H__
+#define __FLOW_BACKENDS_H__
+
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include <yarp/os/all.h>
+
+/**
+* \ingroup StereoVisionLib
+*
+* Interface of the optical flow algorithms used by OpticalFlowThread.
+*/
+class FlowBackend
+{
+public:
+    virtual ~FlowBackend() { }
+
+    /**
+    * @return the name of the backend, as given in the configuration.
+    */
+    virtual std::string getName() const=0;
+
+    /**
+    * Computes the flow between two RGB images of the same size.
+    * @param prev the previous image.
+    * @param next the current image.
+    * @param flow the flow (CV_32FC2, image size), to be allocated by the backend.
+    */
+    virtual void compute(const cv::Mat &prev, const cv::Mat &next, cv::Mat &flow)=0;
+
+    /**
+    * Creates a dense backend:
+    * - \e farneback: OpenCV's Farneback at full resolution;
+    * - \e farneback_pyr: Farneback on images downscaled by \e flowScale;
+    * - \e dis: DIS optical flow with the fast preset (OpenCV 4);
+    * - \e cuda: Farneback on the GPU (OpenCV built with the CUDA optical flow module).
+    * @param name the backend name.
+    * @param rf the configuration.
+    * @return the backend, NULL if unknown or not available in this build.
+    */
+    static FlowBackend* createDense(const std::string &name, yarp::os::ResourceFinder &rf);
+};
+
+
+/**
+* \ingroup StereoVisionLib
+*
+* Sparse optical flow (pyramidal Lucas-Kanade) that persists across frames.
+* The pyramid of the current image becomes the previous one at the next frame
+* and the tracked corners are kept; corners are detected again every
+* \e redetect frames or when less than half of \e maxCorners survive.
+* The flow is (dx,dy) at the tracked corners of the previous image, 0 elsewhere.
+*/
+class SparseFlowTracker : public FlowBackend
+{
+    int maxCorners;
+    int redetect;
+    int winSize;
+    int levels;
+    double maxError;
+    int framesSinceDetection;
+
+    cv::Mat grayPrev,grayNext;
+    std::vector<cv::Mat> pyrPrev,pyrNext;
+    std::vector<cv::Point2f> ptsPrev,ptsNext;
+    std::vector<uchar> status;
+    std::vector<float> err;
+    cv::Mat lastImage;
+
+public:
+
+    SparseFlowTracker(yarp::os::ResourceFinder &rf);
+
+    std::string getName() const { return "sparse"; }
+
+    /**
+    * Computes the flow between two RGB images; if \e prev is the \e next
+    * of the last call its pyramid and corners are reused.
+    */
+    void compute(const cv::Mat &prev, const cv::Mat &next, cv::Mat &flow);
+
+    /**
+    * Forgets the pyramids and the corners.
+    */
+    void reset();
+};
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#ifndef __JOB_HANDLE_H__
+#define __JOB_HANDLE_H__
+
+#include <opencv2/opencv.hpp>
+
+#include <yarp/os/all.h>
+
+/**
+* \ingroup StereoVisionLib
+*
+* Handle of a job submitted to a worker thread (DisparityThread, OpticalFlowThread).
+* Copies of a handle share the same state; the worker calls complete() as soon as
+* the job is done and all the threads blocked in wait() are released; a job
+* superseded by a newer one before it has started is dropped, which releases
+* the waiting threads as well.
+* A default-constructed handle refers to no job and it is already completed.
+*/
+class JobHandle
+{
+    struct State
+    {
+        yarp::os::Mutex mutex;
+        yarp::os::Semaphore finished;
+        bool done;
+        bool dropped;
+        int waiting;
+
+        State() : finished(0), done(false), dropped(false), waiting(0) { }
+    };
+
+    cv::Ptr<State> state;
+
+    void finish(const bool drop)
+    {
+        if (state.empty())
+            return;
+
+        state->mutex.lock();
+        bool wasDone=state->done;
+        int n=state->waiting;
+        state->done=true;
+        if (!wasDone)
+            state->dropped=drop;
+        state->waiting=0;
+        state->mutex.unlock();
+
+        if (!wasDone)
+            for (int i=0; i<n; i++)
+                state->finished.post();
+    }
+
+public:
+
+    JobHandle() { }
+
+    /**
+    * @return a handle of a new job, not completed.
+    */
+    static JobHandle create()
+    {
+        JobHandle h;
+        h.state=cv::Ptr<State>(new State);
+        return h;
+    }
+
+    /**
+    * Marks the job as done and wakes up the waiting threads.
+    */
+    void complete() { finish(false); }
+
+    /**
+    * Marks the job as done without having run it and wakes up the waiting threads.
+    */
+    void drop() { finish(true); }
+
+    /**
+    * Blocks until the job is done.
+    */
+    void wait()
+    {
+        if (state.empty())
+            return;
+
+        state->mutex.lock();
+        if (state->done)
+        {
+            state->mutex.unlock();
+            return;
+        }
+        state->waiting++;
+        state->mutex.unlock();
+
+        state->finished.wait();
+    }
+
+    /**
+    * @return true if the job is done.
+    */
+    bool isDone()
+    {
+        if (state.empty())
+            return true;
+
+        yarp::os::LockGuard lg(state->mutex);
+        return state->done;
+    }
+
+    /**
+    * @return true if the job has been dropped (superseded by a newer one);
+    * the results are then the ones of the newer job, once done.
+    */
+    bool isDropped()
+    {
+        if (state.empty())
+            return false;
+
+        yarp::os::LockGuard lg(state->mutex);
+        return state->dropped;
+    }
+};
+
+#endif
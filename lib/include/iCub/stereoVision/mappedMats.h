@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#ifndef __MAPPED_MATS_H__
+#define __MAPPED_MATS_H__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <opencv2/opencv.hpp>
+
+/**
+* \ingroup StereoVisionLib
+*
+* A versioned binary file holding a list of matrices under a 64 bit key (e.g.
+* the rectification maps of a calibration): a 64 byte header, a table of the
+* matrices and their data, each 64 byte aligned, in the byte order of the
+* machine. Once opened the file is mapped in memory and the matrices are
+* views on the mapped pages, valid until close(). The mapping is private,
+* pages written by the caller are copied on write and the file is never
+* modified.
+*/
+class MappedMatFile
+{
+    unsigned char *data;
+    size_t length;
+#ifdef _WIN32
+    void *file,*mapping;
+#else
+    int fd;
+#endif
+    uint64_t key;
+    std::vector<cv::Mat> mats;
+
+    MappedMatFile(const MappedMatFile&);
+    MappedMatFile& operator=(const MappedMatFile&);
+
+public:
+
+    MappedMatFile();
+    ~MappedMatFile();
+
+    /**
+    * Writes a file, replacing an existing one only once it is complete.
+    * @param path the file.
+    * @param key the key of the matrices.
+    * @param mats the matrices (empty ones are allowed).
+    * @return true on success.
+    */
+    static bool write(const std::string &path, const uint64_t key,
+                      const std::vector<cv::Mat> &mats);
+
+    /**
+    * Maps a file and reads its table.
+    * @param path the file.
+    * @return true if the file is valid and of the current version.
+    */
+    bool open(const std::string &path);
+
+    /**
+    * @return true if a file is mapped.
+    */
+    bool isOpen() const { return (data!=NULL); }
+
+    /**
+    * @return the key the file has been written with.
+    */
+    uint64_t getKey() const { return key; }
+
+    /**
+    * @return the matrices, views on the mapped file.
+    */
+    const std::vector<cv::Mat>& getMats() const { return mats; }
+
+    /**
+    * Unmaps the file.
+    */
+    void close();
+};
+
+#endif
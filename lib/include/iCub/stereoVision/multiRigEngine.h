@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#ifndef __MULTI_RIG_ENGINE_H__
+#define __MULTI_RIG_ENGINE_H__
+
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include <yarp/os/all.h>
+
+#include <iCub/stereoVision/stereoCamera.h>
+#include <iCub/stereoVision/disparityEngine.h>
+#include <iCub/stereoVision/jobHandle.h>
+#include <iCub/stereoVision/stageStats.h>
+#include <iCub/stereoVision/workerPool.h>
+
+/**
+* \ingroup StereoVisionLib
+*
+* How a rig of a MultiRigEngine is processed.
+*/
+struct RigOptions
+{
+    std::string name;
+    int priority;               // in [0,WorkerPool::numPriorities), the higher the sooner
+    double fps;                 // target frame rate, the exceeding frames are dropped (0 = no limit)
+    bool reproject;             // compute the world image
+    bool map8;                  // compute the 8 bit disparity map
+    bool rectified;             // keep a copy of the rectified left image
+    DisparityParams disparity;
+
+    RigOptions();
+};
+
+
+/**
+* \ingroup StereoVisionLib
+*
+* A stereo pair submitted to a rig.
+*/
+struct RigFrame
+{
+    cv::Mat left,right;         // never written by the engine
+    cv::Mat R,T;                // the extrinsics of the pair, empty to keep the current ones
+    cv::Mat H;                  // the world frame of the reprojection, empty for the left camera
+    yarp::os::Stamp stamp;      // given back with the result
+};
+
+
+/**
+* \ingroup StereoVisionLib
+*
+* The outputs of a frame, shared with the engine: they are never written once given.
+*/
+struct RigResult
+{
+    int rig;
+    yarp::os::Stamp stamp;
+    double latency;             // from the submission to the end of the processing [s]
+    cv::Mat disp8,disp16;
+    cv::Mat rectLeft;
+    cv::Mat world;              // CV_32FC3, (0,0,0) where not valid
+};
+
+
+/**
+* \ingroup StereoVisionLib
+*
+* The counters of a rig.
+*/
+struct RigStats
+{
+    int submitted;
+    int processed;
+    int dropped;                // superseded by a newer frame while the rig was busy
+    int throttled;              // in excess of the target frame rate
+    double fps;                 // processed frames per second (moving average)
+};
+
+
+/**
+* \ingroup StereoVisionLib
+*
+* Receives the results of the frames of the rigs.
+*/
+class RigListener
+{
+public:
+    virtual ~RigListener() { }
+
+    /**
+    * Called by the worker that has processed the frame, before the next frame
+    * of the rig is started: the StereoCamera of the rig can be read meanwhile.
+    * It should return quickly, since it holds a worker of the pool.
+    * @param result the result.
+    */
+    virtual void frameDone(const RigResult &result)=0;
+};
+
+
+/**
+* \ingroup StereoVisionLib
+*
+* Hosts several stereo rigs (e.g. the iCub eyes and external cameras), each
+* with its own StereoCamera, in one process and runs their jobs on a shared
+* WorkerPool instead of one thread (and one OpenMP team) per rig.
+*
+* The frames of a rig are processed in order, one at a time, since they go
+* through the same StereoCamera: a frame submitted while the rig is busy waits
+* for it, replacing the one which was waiting already. Each frame is a
+* disparity job (rectification and disparity) followed, on the same worker
+* unless another one is idle, by a reprojection job; the jobs of the rigs with
+* a higher priority are taken first and the frames beyond the target frame
+* rate of a rig are dropped, so the ones of the other rigs get the cores.
+*
+* The OpenMP team of a job (LIBELAS) is the share of the workers of the
+* rigs being processed at the time it starts, so that the threads running
+* never exceed the workers.
+*/
+class MultiRigEngine
+{
+    struct Rig
+    {
+        StereoCamera *stereo;
+        RigOptions options;
+        RigListener *listener;
+
+        StageStats stats;
+        int stageQueue,stageDisparity,stageWorld,stageFrame;
+
+        yarp::os::Mutex mutex;
+        bool busy,hasPending;
+        RigFrame current,pending;
+        double currentSubmitted,pendingSubmitted;
+        double nextDue,lastDone;
+        JobHandle idle;
+        RigStats counters;
+
+        RigResult result;       // of the frame being processed
+        std::vector<cv::Mat> worldPool;
+    };
+
+    class DisparityJob;
+    class WorldJob;
+
+    WorkerPool pool;
+    std::vector<Rig*> rigs;
+    yarp::os::Mutex mutexBusy;
+    int busyRigs;
+    volatile bool running;
+
+    void startFrame(const int rig);
+    void runDisparity(const int rig);
+    void runWorld(const int rig);
+    void finishFrame(const int rig);
+    void setTeamSize();
+
+    MultiRigEngine(const MultiRigEngine&);
+    MultiRigEngine& operator=(const MultiRigEngine&);
+
+public:
+
+    /**
+    * Constructor.
+    * @param threads the workers of the pool, 0 for one per core.
+    */
+    MultiRigEngine(const int threads=0);
+
+    /**
+    * Stops the engine; the cameras are not deleted.
+    */
+    ~MultiRigEngine();
+
+    /**
+    * Adds a rig, before start().
+    * @param stereo the camera of the rig, calibrated and with its disparity
+    * engine; it is not owned by the engine and, while the rig is processing,
+    * it must be accessed only by the listener (see waitIdle()).
+    * @param options the options.
+    * @param listener the receiver of the results, if any.
+    * @return the index of the rig, -1 if the engine is running.
+    */
+    int addRig(StereoCamera *stereo, const RigOptions &options, RigListener *listener=NULL);
+
+    /**
+    * @return the number of rigs.
+    */
+    int getNumRigs() const { return (int)rigs.size(); }
+
+    /**
+    * @param rig the index of the rig.
+    * @return the options of the rig.
+    */
+    const RigOptions& getRigOptions(const int rig) const { return rigs[rig]->options; }
+
+    /**
+    * Starts the workers.
+    * @return true on success.
+    */
+    bool start();
+
+    /**
+    * Waits for the frames being processed and stops the workers; the frames
+    * waiting are dropped.
+    */
+    void stop();
+
+    /**
+    * Submits a frame to a rig.
+    * @param rig the index of the rig.
+    * @param frame the frame.
+    * @return true if the frame is processed or waiting, false if it has been
+    * dropped (target frame rate, engine not running).
+    */
+    bool submit(const int rig, const RigFrame &frame);
+
+    /**
+    * Blocks until a rig has no frame being processed or waiting.
+    * @param rig the index of the rig.
+    */
+    void waitIdle(const int rig);
+
+    /**
+    * @param rig the index of the rig.
+    * @return the counters of the rig.
+    */
+    RigStats getRigStats(const int rig);
+
+    /**
+    * @param rig the index of the rig.
+    * @return the latency statistics of the rig: \e queue (from the submission
+    * to the start of the processing), \e disparity, \e world3d, \e frame
+    * (from the submission to the result) and the stages of
+    * StereoCamera::computeDisparity().
+    */
+    StageStats& getStageStats(const int rig) { return rigs[rig]->stats; }
+
+    /**
+    * @return the pool running the jobs.
+    */
+    WorkerPool& getPool() { return pool; }
+};
+
+#endif
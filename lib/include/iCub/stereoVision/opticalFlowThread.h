@@ -16,10 +16,15 @@
  * Public License for more details
  */
 
+#include <vector>
+
 #include <opencv2/opencv.hpp>
 
 #include <yarp/os/all.h>
 
+#include <iCub/stereoVision/jobHandle.h>
+#include <iCub/stereoVision/flowBackends.h>
+
 #define DENSE    1
 
 using namespace cv;
@@ -29,28 +34,51 @@ using namespace cv;
 *
 * The base class defining the 2D optical flow.
 * It computes the 2D motion field in the image.
+* The thread sleeps until setImages() submits a new pair.
 */
-class OpticalFlowThread : public yarp::os::RateThread
+class OpticalFlowThread : public yarp::os::Thread
 {
 private:
 
     cv::Mat optFlow;
     cv::Mat leftPrev;
     cv::Mat leftNext;
-    bool done;
+    JobHandle job;
     bool work;
+    yarp::os::Mutex mutexJob;
+    yarp::os::Semaphore jobAvailable;
     bool dense;
-    void computeFlowSparse(IplImage* previous, IplImage* current, Mat &optFlow);
+    FlowBackend *denseBackend;
+    SparseFlowTracker sparse;
+
+    // time spent in the backends [s]
+    double timeLast;
+    double timeSum;
+    int timeCount;
 
 public:
 
      OpticalFlowThread(yarp::os::ResourceFinder &rf);
-    ~OpticalFlowThread() {};
+    ~OpticalFlowThread();
 
-    void setImages(cv::Mat &_leftPrev, cv::Mat &_leftNext);
+    JobHandle setImages(cv::Mat &_leftPrev, cv::Mat &_leftNext);
+
+    // the flow is shared with the thread and must not be modified
     void getOptFlow(cv::Mat &_optFlow);
     void setFlow(int flowType);
 
+    /**
+    * @return the name of the backend in use.
+    */
+    std::string getBackendName();
+
+    /**
+    * Returns the time spent computing the flow.
+    * @param last the time of the last frame [s].
+    * @param mean the mean time per frame since the start [s].
+    */
+    void getFlowTime(double &last, double &mean);
+
     bool checkDone();
 
     bool threadInit();
@@ -20,6 +20,9 @@
 #include <yarp/os/all.h>
 #include "iCub/stereoVision/disparityThread.h"
 #include "iCub/stereoVision/opticalFlowThread.h"
+#include "iCub/stereoVision/stereoSync.h"
+#include "iCub/stereoVision/stageStats.h"
+#include "iCub/stereoVision/stereoLog.h"
 #include <yarp/sig/Matrix.h>
 #include <yarp/sig/Image.h>
 #include <yarp/os/Stamp.h>
@@ -48,37 +51,51 @@ private:
     OpticalFlowThread* opt;
     yarp::os::Stamp TSLeft;
     yarp::os::Stamp TSRight;
-    yarp::sig::ImageOf<yarp::sig::PixelRgb>* imageL;
-    yarp::sig::ImageOf<yarp::sig::PixelRgb>* imageR;
-    IplImage* imgLPrev;
-    IplImage* imgRPrev;
-    IplImage* imgLNext;
-    IplImage* imgRNext;
-
-    Mat optFlow;
-    Mat dispOld;
-    Mat dispNew;
-    Mat mapperOld;
-    Mat mapperNew;
-    Mat QOld;
-    Mat QNew;
-    Mat RLOld;
-    Mat RLNew;
-    Mat dispFloatOld;
-    Mat dispFloatNew;
+    StereoSynchronizer* stereoSync;
+    StereoLogPlayer* player;    // replaces the image ports if not NULL
+
+    // frame slots: the newest processed frame, the previous one and the one
+    // being filled by run(); the matrices are shared with the workers and the
+    // port reader (no copies), moving to the next frame is an index swap
+    struct FlowFrame
+    {
+        Mat left,right;
+        Mat disp,dispFloat;
+        Mat mapper,Q,RL;
+        Mat flow;           // optical flow from the previous frame
+    };
+    FlowFrame frames[3];
+    int newest;
+
+    // rays of the left camera in the rectified frame for one mapper/Q generation
+    // (the mapper and Q of a rectification are never modified, their data identify it)
+    struct RayTable
+    {
+        Mat mapper,Q;   // the generation the table is built from
+        size_t dispStep;
+        Mat idx;        // offset of the rectified pixel in the 16 bit disparity (-1 if outside)
+        Mat rayX,rayY;  // numerators of the x and y coordinates
+    };
+    cv::Ptr<RayTable> rayTables[2];
+    int rayTableLast;
+    yarp::os::Mutex mutexRays;
+
     Mat HL_root;
 
+    // stages of run() and of the 3D flow computation
+    StageStats stats;
+    int stageSync,stageWorkers,stageFlow,stageCollect,stageFrame,stageSceneFlow;
+
     int width;
     int height;
-    bool initL,initR;
     bool init;
 
     Semaphore* flowSem;
     yarp::os::BufferedPort<yarp::sig::ImageOf<yarp::sig::PixelRgb> > imagePortInLeft;
     yarp::os::BufferedPort<yarp::sig::ImageOf<yarp::sig::PixelRgb> > imagePortInRight;
-    void triangulate(Point2f &pixel,Point3f &point,Mat &Mapper, Mat &disparity, Mat &Q, Mat &RLrect);
-    void buildRotTras(Mat & R, Mat & T, Mat & A);
     void printMatrix(Mat &matrix);
+    cv::Ptr<RayTable> getRayTable(const Mat &mapper, const Mat &Q, const Mat &disp);
+    bool computeSceneFlow(Mat &flow3D, const Rect &roi, const int step);
 public:
 
     SceneFlow(yarp::os::ResourceFinder &rf);
@@ -98,9 +115,45 @@ public:
     void drawFlowModule(IplImage* imgMotion);
     int getImgWidth();
     int getImgHeight();
+
+    /**
+    * Computes the 3D flow of the whole image, wrt the ROOT reference frame.
+    * @param flow3D the flow (CV_32FC3, image size), (0,0,0) where it is not valid.
+    */
     void getSceneFlow(Mat &flow3D);
+
+    /**
+    * Computes the 3D flow of the pixels in {(U1,V1) (U2,V2)}.
+    * @param flow3D the flow (CV_32FC3, image size), (0,0,0) outside the rectangle
+    * and where it is not valid.
+    */
     void getSceneFlow(Mat &flow3D, int U1, int V1, int U2, int V2);
 
+    /**
+    * Computes a subsampled 3D flow field: the element (i,j) is the flow of
+    * the pixel (roi.x+j*step, roi.y+i*step).
+    * @param flow3D the flow (CV_32FC3, ceil(roi.height/step) x ceil(roi.width/step)),
+    * (0,0,0) where it is not valid.
+    * @param roi the region of the left image (clipped to the image).
+    * @param step the sampling step in pixels.
+    */
+    void getSceneFlow(Mat &flow3D, const Rect &roi, const int step);
+
     void threadRelease();
     void recalibrate();
+
+    /**
+    * Appends the latency statistics (see StageStats::toBottle()) to a bottle:
+    * (sceneFlow (stage ...) ...) with the stages \e sync (reading of the stereo pair),
+    * \e workers (disparity and optical flow, running concurrently), \e optical_flow,
+    * \e collect, \e frame (the whole run()) and \e scene_flow (3D flow computations),
+    * then (disparity (stage ...) ...) with the ones of DisparityThread.
+    * @param b the bottle.
+    */
+    void getStageStats(yarp::os::Bottle &b);
+
+    /**
+    * Clears the latency statistics.
+    */
+    void resetStageStats();
 };
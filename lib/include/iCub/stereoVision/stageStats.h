@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#ifndef __STAGE_STATS_H__
+#define __STAGE_STATS_H__
+
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include <yarp/os/all.h>
+
+/**
+* \ingroup StereoVisionLib
+*
+* Latency statistics of the stages of a pipeline: count, last, mean and max
+* duration plus a histogram (4 bins per octave, from 1 us to about 4 minutes)
+* the percentiles are read from.
+*
+* Any thread can record any stage, e.g. the workers of a pool running the same
+* stage for different jobs: each stage has a lock of its own, held for the few
+* operations of a record() and while a reader copies it, so that the readers
+* always see whole records. The stages are registered with addStage(), up to
+* \e maxStages.
+*/
+class StageStats
+{
+public:
+
+    static const int maxStages=48;
+    static const int numBins=112;
+
+    /**
+    * The summary of a stage, durations in milliseconds.
+    */
+    struct Summary
+    {
+        std::string name;
+        int count;
+        double last,mean,p50,p99,max;
+    };
+
+    StageStats();
+
+    /**
+    * Registers a stage.
+    * @param name the stage name.
+    * @return the stage id (the one of the stage with this name if already
+    * registered), -1 if there are already maxStages stages.
+    */
+    int addStage(const std::string &name);
+
+    /**
+    * Records a duration.
+    * @param stage the stage id (ignored if negative).
+    * @param seconds the duration [s].
+    */
+    void record(const int stage, const double seconds);
+
+    /**
+    * @return a timestamp for record() [s], monotonic and cheap.
+    */
+    static double now()
+    {
+        return (double)cv::getTickCount()/cv::getTickFrequency();
+    }
+
+    /**
+    * Records the time since t0 and returns the current time, so that
+    * consecutive stages are timed with one clock reading each.
+    * @param stage the stage id.
+    * @param t0 the start of the stage (from now()).
+    * @return now().
+    */
+    double stop(const int stage, const double t0)
+    {
+        double t1=now();
+        record(stage,t1-t0);
+        return t1;
+    }
+
+    /**
+    * Clears the statistics.
+    */
+    void reset();
+
+    /**
+    * @param summaries the summaries of the stages that have been recorded at least once.
+    */
+    void getSummaries(std::vector<Summary> &summaries) const;
+
+    /**
+    * Appends the summaries to a bottle, a list (name count last mean p50 p99 max)
+    * per stage, durations in milliseconds.
+    * @param b the bottle.
+    */
+    void toBottle(yarp::os::Bottle &b) const;
+
+private:
+
+    struct Stage
+    {
+        std::string name;
+        unsigned int bins[numBins];
+        int count;
+        double sum,last,max;
+        mutable yarp::os::Mutex mutex;
+    };
+
+    Stage stages[maxStages];
+    volatile int numStages;
+    yarp::os::Mutex mutexAdd;
+
+    // the stages hold their locks
+    StageStats(const StageStats&);
+    StageStats& operator=(const StageStats&);
+};
+
+#endif
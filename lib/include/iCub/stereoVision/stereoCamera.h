@@ -42,7 +42,8 @@
 #include <opencv2/opencv.hpp>
 
 #include <iCub/stereoVision/camera.h>
-#include <iCub/stereoVision/elasWrapper.h>
+#include <iCub/stereoVision/disparityEngine.h>
+#include <iCub/stereoVision/mappedMats.h>
 
 #include <yarp/os/all.h>
 
@@ -91,6 +92,7 @@ private:
     Mat imrightund; // Undistorted Image Right
     Mat Disparity; // Disparity Map Image
     Mat Disparity16; // Disparity 16 Bit Signed
+    Mat DisparityFloat; // Disparity in pixels
     Mat imgLeftRect; // Rectified Left Image
     Mat imgRightRect; // Rectified Right Image
 
@@ -120,6 +122,10 @@ private:
     Mat map12; //Mapping from from rectified to original
     Mat map21; //Mapping from from rectified to original
     Mat map22; //Mapping from from rectified to original
+    Mat rmap11; //Fixed-point version of map11/map12 used by remap
+    Mat rmap12; //Fixed-point version of map11/map12 used by remap
+    Mat rmap21; //Fixed-point version of map21/map22 used by remap
+    Mat rmap22; //Fixed-point version of map21/map22 used by remap
     Mat mapxL; //Mapping from Undistorted to Original Left image for the x coordinates
     Mat mapyL; //Mapping from Undistorted to Original Left image for the y coordinates
     Mat mapxR; //Mapping from Undistorted to Original Right image for the x coordinates
@@ -127,6 +133,7 @@ private:
 
     Mat MapperL; // pixels mapping from original left camera to rectified left camera
     Mat MapperR; // pixels mapping from original right camera to rectified right camera
+    Mat worldDispTmp; // disparity remapped to the original left camera (computeWorldImage)
 
     vector<Point2f> PointsL; // Match Left
     vector<Point2f> PointsR; // Match Right
@@ -136,9 +143,38 @@ private:
     
     double epipolarTh; //threshold for the constraint x'Fx=0 -> x'Fx<epipolarTh
 
+    // rectification built for one set of camera parameters
+    struct RectificationEntry
+    {
+        Mat KL, KR, DistL, DistR, R, T; // parameters the entry was built from
+        Size size;
+        bool rectify;
+        Mat RLrect, RRrect, PLrect, PRrect, Q;
+        Mat map11, map12, map21, map22;
+        Mat rmap11, rmap12, rmap21, rmap22;
+        Mat MapperL, MapperR;
+        unsigned int lastUsed;
+    };
+
+    vector<RectificationEntry> rectCache; // recently used rectifications
+    int rectCurrent; // index of the installed entry (-1 if none)
+    unsigned int rectClock;
+    double rectTolerance; // max abs difference of the parameters to reuse an entry
+    int rectCacheSize;
+
+    // binary file of the rectification maps of the next start (empty = none); the files
+    // mapped are kept until destruction, the installed maps may refer to them
+    string rectFile;
+    vector<cv::Ptr<MappedMatFile> > rectMapped;
+    bool rectFileSaved;
+
     Semaphore* mutex;
     bool cameraChanged;
     bool rectify;
+    bool matchRectification(const RectificationEntry &entry, const Size &size, bool rect) const;
+    void updateRectification(const Size &size, bool rect);
+    bool loadRectification(const Size &size, bool rect, RectificationEntry &entry);
+    bool saveRectification(const RectificationEntry &entry);
     bool readStringList( const string& filename, vector<string>& l );
     void runStereoCalib(const vector<string>& imagelist, Size boardSize,float sqsize);
     double* reprojectionError(Mat& Rot, Mat& Tras);
@@ -158,8 +194,29 @@ private:
     bool loadStereoParameters(yarp::os::ResourceFinder &rf, Mat &KL, Mat &KR, Mat &DistL, Mat &DistR, Mat &Ro, Mat &T);
     void updateExpectedCameraMatrices();
 
-    bool use_elas;
-    elasWrapper*  elaswrap;
+    DisparityEngine* engine;
+    StageStats* stats;
+    int stageRectification,stageDisparityMap;
+    vector<Rect> dispROIs; // regions of the left image the disparity is computed for (empty = all)
+    int dispROIMargin;
+    Rect getRectifiedWindow(const Rect &roi, int numberOfDisparities, int minDisparity) const;
+    bool computeDisparityROIs(const DisparityParams &params, Mat &rectL, Mat &rectR, Mat &disp);
+
+    // feature front-end of findMatch
+    string matchDetector; // sift, orb or akaze
+    int matchMaxFeatures; // keypoints kept per image (0 = all)
+    int matchGridCols, matchGridRows; // cells the kept keypoints are spread over
+    double matchEpipolarBand; // max distance of a match from the epipolar line [pixels] (0 = no band)
+    Ptr<cv::Feature2D> matchFeatures; // detector and descriptor, kept across the calls
+
+    // outputs of computeDisparity, written into buffers reused across the frames
+    bool outputMap8, outputFixed16, outputFloat;
+    vector<Mat> dispPool8, dispPool16, dispPoolFloat;
+    Mat pooledBuffer(vector<Mat> &pool, const Size &size, int type);
+    bool createMatchFeatures();
+    void bucketKeypoints(vector<KeyPoint> &keypoints, const Size &size) const;
+    void epipolarMatching(const Mat &Fm, const vector<KeyPoint> &keypoints1, const Mat &descriptors1, const vector<KeyPoint> &keypoints2, const Mat &descriptors2, double radius, vector<DMatch> &filteredMatches12) const;
+    void lshCrossCheckMatching(const Mat &descriptors1, const Mat &descriptors2, vector<DMatch> &filteredMatches12) const;
 
 public:
 
@@ -169,7 +226,7 @@ public:
     */
     StereoCamera(bool rectify=true);
 
-    ~StereoCamera() { delete mutex;}
+    ~StereoCamera() { delete mutex; delete engine; }
 
     /**
     * Costructor for initialization from file.
@@ -193,6 +250,68 @@ public:
     */
     void initELAS(yarp::os::ResourceFinder &rf);
 
+    /**
+    * It selects the algorithm used by computeDisparity() (OpenCV's SGBM by default).
+    * @param name the engine: \e elas, \e sgbm or \e cuda_sgm (see DisparityEngine::create()).
+    * @param rf the configuration of the engine.
+    * @return false if the engine is unknown or not available in this build, the current one is then kept.
+    */
+    bool setDisparityEngine(const string &name, yarp::os::ResourceFinder &rf);
+
+    /**
+    * @return the name of the algorithm used by computeDisparity().
+    */
+    string getDisparityEngineName() const;
+
+    /**
+    * Sets where the durations of the stages of computeDisparity() are recorded: \e rectification
+    * (update of the maps), the stages of the engine and \e disparity_map (8 bit map).
+    * @param stats the statistics, NULL to stop recording; they are recorded by the thread
+    * calling computeDisparity().
+    */
+    void setStageStats(StageStats *stats);
+
+    /**
+    * It restricts computeDisparity() to regions of the left image. Each region is mapped to the
+    * rectified image and enlarged by the disparity range (on the left) and by the margin, the
+    * rectification and the matching are done only on these windows. The disparity is not valid
+    * outside the windows and the rectified images are black there.
+    * @param rois the regions in the (not rectified) left image, empty for the whole image.
+    * @param margin the margin around each region [pixels].
+    */
+    void setDisparityROIs(const vector<Rect> &rois, int margin=16);
+
+    /**
+    * @return the regions of the left image computeDisparity() is restricted to (empty = whole image).
+    */
+    const vector<Rect>& getDisparityROIs() const;
+
+    /**
+    * It sets the tolerance of the rectification cache. The rectification maps are rebuilt only
+    * when R, T, the intrinsics or the distortion coefficients differ by more than tol (absolute,
+    * element-wise) from the ones of all the cached rectifications.
+    * @param tol the tolerance, 0 rebuilds the maps at every change of the parameters.
+    * @param size the number of rectifications kept in the cache.
+    */
+    void setRectificationTolerance(double tol, int size=4);
+
+    /**
+    * It sets the binary cache of the rectification maps, so that a restart with the same
+    * calibration delivers the first disparity without building them. The file is mapped in
+    * memory and used if its image size and intrinsics are the current ones (it is keyed by
+    * their hash) and its extrinsics match within the tolerance of the rectification cache.
+    * Otherwise the first rectification built afterwards is stored in it.
+    * @param path the file, an empty string disables the cache.
+    */
+    void setRectificationCacheFile(const string &path);
+
+    /**
+    * It stores the installed rectification in the cache file (e.g. when the current
+    * extrinsics are saved as the ones of the next start).
+    * @return true on success.
+    */
+    bool saveRectificationCache();
+
     /**
     * It performs the stereo camera calibration. (see \ref stereoCalibration module)
     * @param imageList is the list containing the paths of the images with the chessboard patterns. even indices refer to
@@ -219,11 +338,23 @@ public:
     void setImages(IplImage* firstImg, IplImage* secondImg);
 
     /**
-    * It finds matches between two images. SIFT detector and descriptor is used.
+    * It selects the features used by findMatch(). The detector is created here and reused by all the calls.
+    * @param detector "sift" (default), "orb" or "akaze" (OpenCV 3 only); binary descriptors are matched with LSH.
+    * @param maxFeatures keypoints kept per image, the strongest ones of each cell of the grid (0 = all).
+    * @param gridCols columns of the grid the keypoints are spread over.
+    * @param gridRows rows of the grid the keypoints are spread over.
+    * @param epipolarBand if positive, a keypoint is matched only with the keypoints closer than epipolarBand
+    * pixels to its epipolar line, given by the expected extrinsics (see setExpectedPosition()) or by the current ones.
+    * @return true if the detector is available.
+    */
+    bool setMatchParameters(const string &detector, int maxFeatures=0, int gridCols=1, int gridRows=1, double epipolarBand=0.0);
+
+    /**
+    * It finds matches between two images, with the features selected by setMatchParameters() (SIFT by default).
     * @note Run setImages and indistortImages methods before using this method.
     * @param visualize true if you want to visualize matches between images
     * @param displacement maximum pixel displacement between first and second camera
-    * @param radius maximum radius between the first candidate match and the second one
+    * @param radius maximum radius between the first candidate match and the second one (SIFT only)
     */
     cv::Mat findMatch(bool visualize=false, double displacement=20.0, double radius=200.0);
 
@@ -380,6 +511,23 @@ public:
     */
     const Mat& getDisparity16() const;
 
+    /**
+    * It returns the disparity in pixels of the rectified left image (CV_32F, negative where not valid).
+    * @return the disparity computed via computeDisparity(), empty unless enabled by setDisparityOutputs().
+    */
+    const Mat& getDisparityFloat() const;
+
+    /**
+    * It selects the outputs of computeDisparity(). They are produced by a single row-parallel pass
+    * over the disparity of the engine, into buffers reused across the frames: a buffer is written
+    * again only when no other Mat refers to it, hence the images returned stay valid as long as they
+    * are referenced. The outputs not selected are empty.
+    * @param map8 the 8 bit map in the (not rectified) left image, see getDisparity().
+    * @param fixed16 the 16 bit disparity scaled by 16, see getDisparity16().
+    * @param floating the disparity in pixels, see getDisparityFloat().
+    */
+    void setDisparityOutputs(bool map8=true, bool fixed16=true, bool floating=false);
+
     /**
     * It returns the 4x4 disparity-to-depth mapping matrix.
     * @return 4x4 disparity-to-depth mapping matrix.
@@ -515,6 +663,16 @@ public:
     */
     Mat computeWorldImage(Mat &H);
 
+    /**
+    * Same as computeWorldImage(Mat &H), but the result is written into a caller-provided image
+    * that is reallocated only if its size or type do not match (CV_32FC3, same size of the disparity).
+    * @param H the transformation from the camera reference system to the H reference system
+    * @param worldImg the output 3-Channels float image with the world coordinates w.r.t H reference system.
+    * @return true if the disparity has already been computed, false otherwise.
+    * @note It uses internal scratch buffers: do not call it concurrently on the same object.
+    */
+    bool computeWorldImage(Mat &H, Mat &worldImg);
+
     /**
     * It returns the 5x1 right distortion coefficients.
     * @return 5x1 right distortion coefficients.
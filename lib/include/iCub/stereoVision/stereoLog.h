@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#ifndef __STEREO_LOG_H__
+#define __STEREO_LOG_H__
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include <yarp/os/all.h>
+#include <yarp/sig/Vector.h>
+#include <yarp/sig/Matrix.h>
+
+/**
+* \ingroup StereoVisionLib
+*
+* A synchronized stereo pair with the state of the head when it was taken.
+*/
+struct StereoLogFrame
+{
+    cv::Mat left,right;
+    yarp::os::Stamp stampL,stampR;
+    yarp::sig::Vector head;     // head encoders [deg], empty if not recorded
+    yarp::sig::Matrix HL,HR;    // poses of the eyes in the root frame, 0x0 if not recorded
+    double time;                // yarp::os::Time::now() when the pair was recorded [s]
+};
+
+
+/**
+* \ingroup StereoVisionLib
+*
+* Appends StereoLogFrame records to a stereo log, a file made of a 64 byte
+* header and of one record per pair: a fixed header, the encoders, the poses
+* and the two images, each 64 byte aligned and with contiguous rows, so that
+* a StereoLogReader maps them in place. Values are in the byte order of the
+* machine. A log whose recording has been interrupted is valid up to its last
+* complete record.
+*/
+class StereoLogWriter
+{
+    FILE *file;
+    int frames;
+    yarp::os::Mutex mutex;
+
+    StereoLogWriter(const StereoLogWriter&);
+    StereoLogWriter& operator=(const StereoLogWriter&);
+
+public:
+
+    StereoLogWriter();
+    ~StereoLogWriter();
+
+    /**
+    * Creates the log, overwriting an existing file.
+    * @param path the file.
+    * @return true on success.
+    */
+    bool open(const std::string &path);
+
+    /**
+    * @return true if a log is open.
+    */
+    bool isOpen() const { return (file!=NULL); }
+
+    /**
+    * Appends a pair.
+    * @param frame the pair, gray or color images of 8 bit depth.
+    * @return true on success.
+    */
+    bool write(const StereoLogFrame &frame);
+
+    /**
+    * @return the pairs written since open().
+    */
+    int getFrames() const { return frames; }
+
+    /**
+    * Flushes and closes the log.
+    */
+    void close();
+};
+
+
+/**
+* \ingroup StereoVisionLib
+*
+* Maps a stereo log in memory; the pairs are read without any copy: the
+* images returned are views on the mapped pages, valid until close(). The
+* mapping is private, pages written by the caller are copied on write and
+* the file is never modified.
+*/
+class StereoLogReader
+{
+    unsigned char *data;
+    size_t length;
+#ifdef _WIN32
+    void *file,*mapping;
+#else
+    int fd;
+#endif
+    std::vector<size_t> index;  // offset of each record
+
+    StereoLogReader(const StereoLogReader&);
+    StereoLogReader& operator=(const StereoLogReader&);
+
+public:
+
+    StereoLogReader();
+    ~StereoLogReader();
+
+    /**
+    * Maps a log and indexes its records.
+    * @param path the file.
+    * @return true if the file is a stereo log.
+    */
+    bool open(const std::string &path);
+
+    /**
+    * @return true if a log is mapped.
+    */
+    bool isOpen() const { return (data!=NULL); }
+
+    /**
+    * @return the number of pairs.
+    */
+    int size() const { return (int)index.size(); }
+
+    /**
+    * Reads a pair; the pages of the next one are prefetched.
+    * @param i the pair index.
+    * @param frame the pair, its images refer to the mapped file.
+    * @return true if the index is valid.
+    */
+    bool get(const int i, StereoLogFrame &frame) const;
+
+    /**
+    * Unmaps the log.
+    */
+    void close();
+};
+
+
+/**
+* \ingroup StereoVisionLib
+*
+* Replays a stereo log as a source of pairs, either paced as recorded
+* (the recorded time between two pairs is kept) or as fast as
+* the consumer reads them. The timestamps of the pairs are the recorded ones.
+*/
+class StereoLogPlayer
+{
+    StereoLogReader reader;
+    bool realTime;
+    bool loop;
+    int next;
+    double originLog,originReplay;
+
+public:
+
+    /**
+    * Constructor.
+    * @param realTime if true the pairs are paced as recorded.
+    * @param loop if true the replay starts again at the end of the log.
+    */
+    StereoLogPlayer(const bool realTime=true, const bool loop=false);
+
+    /**
+    * Opens a log.
+    * @param path the file.
+    * @return true on success.
+    */
+    bool open(const std::string &path);
+
+    /**
+    * Closes the log; the pairs returned so far become invalid.
+    */
+    void close();
+
+    /**
+    * Restarts the replay from the first pair.
+    */
+    void rewind();
+
+    /**
+    * Returns the next pair (zero-copy, see StereoLogReader::get()).
+    * @param frame the pair.
+    * @param wait if true and pacing as recorded it waits for the time of the pair,
+    * otherwise it returns false if the pair is not due yet.
+    * @return true if a pair is returned, false if not due yet or at the end of the log.
+    */
+    bool read(StereoLogFrame &frame, const bool wait=true);
+
+    /**
+    * Peeks at a pair without affecting the replay.
+    * @param i the pair index.
+    * @param frame the pair.
+    * @return true if the index is valid.
+    */
+    bool peek(const int i, StereoLogFrame &frame) const { return reader.get(i,frame); }
+
+    /**
+    * @return the number of pairs of the log.
+    */
+    int size() const { return reader.size(); }
+
+    /**
+    * @return true if all the pairs have been returned (never when looping).
+    */
+    bool isFinished() const { return !loop && (next>=reader.size()); }
+};
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#ifndef __STEREO_SYNC_H__
+#define __STEREO_SYNC_H__
+
+#include <deque>
+
+#include <opencv2/opencv.hpp>
+
+#include <yarp/os/all.h>
+#include <yarp/sig/Image.h>
+
+/**
+* \ingroup StereoVisionLib
+*
+* Counters of a StereoSynchronizer.
+*/
+struct StereoSyncStats
+{
+    int pairs;          // pairs returned
+    int droppedLeft;    // left images discarded (orphans or superseded by a newer pair)
+    int droppedRight;   // right images discarded (orphans or superseded by a newer pair)
+    double lastSkew;    // stamp(left)-stamp(right) of the last pair [s]
+    double meanSkew;    // mean of |skew| over the returned pairs [s]
+    double maxSkew;     // max of |skew| over the returned pairs [s]
+};
+
+
+/**
+* \ingroup StereoVisionLib
+*
+* Pairs the images of two stereo ports by their yarp::os::Stamp.
+* Two images are a pair if their timestamps differ at most by the tolerance;
+* images that cannot be paired anymore (the other side already delivered a
+* newer image) are discarded, as well as older pairs when a newer one is
+* available, so that only the freshest coherent pair is returned.
+* Images sent without envelope are paired in order of arrival.
+*/
+class StereoSynchronizer
+{
+    struct Item
+    {
+        cv::Mat img;
+        yarp::os::Stamp stamp;
+    };
+
+    yarp::os::BufferedPort<yarp::sig::ImageOf<yarp::sig::PixelRgb> > *portL;
+    yarp::os::BufferedPort<yarp::sig::ImageOf<yarp::sig::PixelRgb> > *portR;
+    std::deque<Item> pendingL,pendingR;
+    double tolerance;
+    size_t maxPending;
+
+    StereoSyncStats stats;
+    double skewSum;
+    yarp::os::Mutex mutex;
+
+    bool grab(yarp::os::BufferedPort<yarp::sig::ImageOf<yarp::sig::PixelRgb> > *port, std::deque<Item> &pending, int &dropped, const bool wait);
+    bool match(cv::Mat &left, cv::Mat &right, yarp::os::Stamp &stampL, yarp::os::Stamp &stampR);
+
+public:
+
+    /**
+    * Constructor.
+    * @param portL the left image port.
+    * @param portR the right image port.
+    * @param tolerance maximum difference between the timestamps of a pair [s].
+    * @param maxPending maximum number of images kept per side while waiting for the other one.
+    */
+    StereoSynchronizer(yarp::os::BufferedPort<yarp::sig::ImageOf<yarp::sig::PixelRgb> > *portL,
+                       yarp::os::BufferedPort<yarp::sig::ImageOf<yarp::sig::PixelRgb> > *portR,
+                       const double tolerance=0.02, const int maxPending=4);
+
+    /**
+    * Returns the freshest stereo pair. The images are copies owned by the caller.
+    * @param left the left image (RGB).
+    * @param right the right image (RGB).
+    * @param stampL the timestamp of the left image.
+    * @param stampR the timestamp of the right image.
+    * @param wait if true it blocks until a pair is available.
+    * @return true if a new pair is returned, false if none is available
+    * (wait=false) or if the ports have been interrupted.
+    */
+    bool read(cv::Mat &left, cv::Mat &right, yarp::os::Stamp &stampL, yarp::os::Stamp &stampR, const bool wait=true);
+
+    /**
+    * Sets the maximum difference between the timestamps of a pair.
+    * @param tolerance the tolerance [s].
+    */
+    void setTolerance(const double tolerance);
+
+    /**
+    * @return the maximum difference between the timestamps of a pair [s].
+    */
+    double getTolerance();
+
+    /**
+    * @return the pairing counters since the construction or the last resetStats().
+    */
+    StereoSyncStats getStats();
+
+    /**
+    * Resets the pairing counters.
+    */
+    void resetStats();
+};
+
+#endif
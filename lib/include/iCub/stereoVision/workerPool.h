@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#ifndef __WORKER_POOL_H__
+#define __WORKER_POOL_H__
+
+#include <deque>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include <yarp/os/all.h>
+
+/**
+* \ingroup StereoVisionLib
+*
+* A pool of worker threads with work stealing. Each worker has a queue per
+* priority level: a job submitted by a worker (e.g. the next stage of the
+* frame it has just processed) goes to its own queue and it is taken back
+* last in first out, while its data are still in the cache; a job submitted
+* by any other thread goes to the queues in turn. An idle worker takes the
+* job of the highest priority, from its own queue first, then stealing the
+* oldest one from the queues of the others.
+*
+* The pool counts the jobs queued, so a worker sleeps only when there is
+* nothing to do. The jobs must not wait for other jobs of the pool.
+*/
+class WorkerPool
+{
+public:
+
+    static const int numPriorities=4;
+
+    /**
+    * A job: run() is called once by a worker.
+    */
+    class Job
+    {
+    public:
+        virtual ~Job() { }
+        virtual void run()=0;
+    };
+
+    /**
+    * Constructor.
+    * @param threads the workers, 0 for one per core.
+    */
+    WorkerPool(const int threads=0);
+    ~WorkerPool();
+
+    /**
+    * Starts the workers.
+    * @return true on success.
+    */
+    bool start();
+
+    /**
+    * Stops the workers once they are done with the jobs they are running;
+    * the jobs still queued are discarded.
+    */
+    void stop();
+
+    /**
+    * Queues a job.
+    * @param job the job, released by the pool once run.
+    * @param priority the level in [0,numPriorities), the higher the sooner.
+    */
+    void submit(const cv::Ptr<Job> &job, const int priority=0);
+
+    /**
+    * @return the number of workers.
+    */
+    int getNumThreads() const { return (int)workers.size(); }
+
+    /**
+    * @return the index of the calling worker, -1 if the caller is not a worker
+    * of the pool.
+    */
+    int getCurrentWorker() const;
+
+    /**
+    * @param executed the jobs run so far.
+    * @param stolen those taken from the queue of another worker.
+    */
+    void getCounters(int &executed, int &stolen) const;
+
+private:
+
+    class Worker;
+
+    struct Queue
+    {
+        yarp::os::Mutex mutex;
+        std::deque<cv::Ptr<Job> > jobs[numPriorities];
+        volatile int size[numPriorities];   // read without the lock, as a hint
+        volatile int executed,stolen;       // written by the owner only
+    };
+
+    std::vector<Worker*> workers;
+    std::vector<Queue*> queues;
+    yarp::os::Semaphore available;          // one post per job queued
+    yarp::os::Mutex mutexSubmit;
+    int nextQueue;
+    volatile bool running;
+
+    cv::Ptr<Job> take(const int worker);
+    void work(const int worker);
+
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+};
+
+#endif
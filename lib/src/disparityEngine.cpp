@@ -0,0 +1,569 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#include <iostream>
+
+#include <opencv2/opencv_modules.hpp>
+#if defined(HAVE_OPENCV_CUDASTEREO) && defined(HAVE_OPENCV_CUDAWARPING) && defined(HAVE_OPENCV_CUDAIMGPROC) && \
+    ((CV_MAJOR_VERSION>4) || ((CV_MAJOR_VERSION==4) && (CV_MINOR_VERSION>=2)))
+    #define DISPARITY_ENGINE_CUDA
+    #include <opencv2/cudastereo.hpp>
+    #include <opencv2/cudawarping.hpp>
+    #include <opencv2/cudaimgproc.hpp>
+#endif
+
+#if defined(OPENCV_GREATER_2) && ((CV_MAJOR_VERSION>3) || (CV_MINOR_VERSION>=1))
+    #define SGBM_HAVE_3WAY
+#endif
+
+#include "iCub/stereoVision/disparityEngine.h"
+
+using namespace std;
+using namespace cv;
+using namespace yarp::os;
+
+
+namespace
+{
+    bool sameParams(const DisparityParams &a, const DisparityParams &b)
+    {
+        return (a.best==b.best) && (a.uniquenessRatio==b.uniquenessRatio) &&
+               (a.speckleWindowSize==b.speckleWindowSize) && (a.speckleRange==b.speckleRange) &&
+               (a.numberOfDisparities==b.numberOfDisparities) && (a.SADWindowSize==b.SADWindowSize) &&
+               (a.minDisparity==b.minDisparity) && (a.preFilterCap==b.preFilterCap) &&
+               (a.disp12MaxDiff==b.disp12MaxDiff);
+    }
+
+    // the whole map a window (e.g. a disparity ROI) belongs to, and the place of the window
+    Mat wholeMap(const Mat &map, Rect &window)
+    {
+        Size size;
+        Point ofs;
+        map.locateROI(size,ofs);
+        window=Rect(ofs,map.size());
+
+        Mat whole=map;
+        whole.adjustROI(ofs.y,size.height-ofs.y-map.rows,ofs.x,size.width-ofs.x-map.cols);
+        return whole;
+    }
+
+
+#ifdef DISPARITY_ENGINE_CUDA
+    // semi-global matching on the GPU: the whole rectification maps are uploaded
+    // once per rectification and the images are rectified on the device, the
+    // windows of the maps (disparity ROIs) being windows of the device maps
+    class CudaSgmDisparityEngine : public DisparityEngine
+    {
+        Ptr<cuda::StereoSGM> sgm;
+        int P1,P2;
+        int sgmDisparities,sgmMinDisparity,sgmUniqueness;
+        bool sgmBest;
+        int stageSgm;   // upload, rectification, matching and download
+
+        Mat mapL1,mapR1;    // the whole maps currently on the device
+        cuda::GpuMat d_mapLx,d_mapLy,d_mapRx,d_mapRy;
+        cuda::GpuMat d_left,d_right,d_rectL,d_rectR,d_grayL,d_grayR,d_disp;
+        cuda::Stream stream;
+
+        void uploadMaps(const Mat &mapL1, const Mat &mapL2, const Mat &mapR1, const Mat &mapR2)
+        {
+            // cuda::remap() wants floating point maps
+            Mat x,y;
+            convertMaps(mapL1,mapL2,x,y,CV_32FC1);
+            d_mapLx.upload(x);
+            d_mapLy.upload(y);
+            convertMaps(mapR1,mapR2,x,y,CV_32FC1);
+            d_mapRx.upload(x);
+            d_mapRy.upload(y);
+
+            this->mapL1=mapL1;
+            this->mapR1=mapR1;
+        }
+
+    public:
+        CudaSgmDisparityEngine(const int P1, const int P2) : P1(P1), P2(P2),
+                               sgmDisparities(0), sgmMinDisparity(0), sgmUniqueness(0), sgmBest(false),
+                               stageSgm(-1) { }
+
+        string getName() const { return "cuda_sgm"; }
+
+        void setStageStats(StageStats *stats)
+        {
+            this->stats=stats;
+            if (stats!=NULL)
+                stageSgm=stats->addStage("cuda_sgm");
+        }
+
+        bool compute(const Mat &left, const Mat &right, const Mat &mapL1, const Mat &mapL2,
+                     const Mat &mapR1, const Mat &mapR2, Mat &rectL, Mat &rectR, Mat &disp,
+                     const DisparityParams &params)
+        {
+            double t0=StageStats::now();
+            Rect windowL,windowR;
+            Mat wholeL1=wholeMap(mapL1,windowL);
+            Mat wholeR1=wholeMap(mapR1,windowR);
+            if ((wholeL1.data!=this->mapL1.data) || (wholeR1.data!=this->mapR1.data))
+            {
+                Rect window;
+                uploadMaps(wholeL1,wholeMap(mapL2,window),wholeR1,wholeMap(mapR2,window));
+            }
+
+            // the GPU implementation supports 64, 128 and 256 disparities only
+            int nd=(params.numberOfDisparities<=64)?64:((params.numberOfDisparities<=128)?128:256);
+            if (sgm.empty() || (nd!=sgmDisparities) || (params.minDisparity!=sgmMinDisparity) ||
+                (params.uniquenessRatio!=sgmUniqueness) || (params.best!=sgmBest))
+            {
+                sgm=cuda::createStereoSGM(params.minDisparity,nd,P1,P2,params.uniquenessRatio,
+                                          params.best?cuda::StereoSGM::MODE_HH:cuda::StereoSGM::MODE_HH4);
+                sgmDisparities=nd;
+                sgmMinDisparity=params.minDisparity;
+                sgmUniqueness=params.uniquenessRatio;
+                sgmBest=params.best;
+            }
+
+            d_left.upload(left,stream);
+            d_right.upload(right,stream);
+            cuda::remap(d_left,d_rectL,d_mapLx(windowL),d_mapLy(windowL),INTER_LINEAR,BORDER_CONSTANT,Scalar(),stream);
+            cuda::remap(d_right,d_rectR,d_mapRx(windowR),d_mapRy(windowR),INTER_LINEAR,BORDER_CONSTANT,Scalar(),stream);
+
+            if (left.channels()==3)
+            {
+                cuda::cvtColor(d_rectL,d_grayL,COLOR_RGB2GRAY,1,stream);
+                cuda::cvtColor(d_rectR,d_grayR,COLOR_RGB2GRAY,1,stream);
+                sgm->compute(d_grayL,d_grayR,d_disp,stream);
+            }
+            else
+                sgm->compute(d_rectL,d_rectR,d_disp,stream);
+
+            d_rectL.download(rectL,stream);
+            d_rectR.download(rectR,stream);
+            d_disp.download(disp,stream);
+            stream.waitForCompletion();
+
+            if (stats!=NULL)
+                stats->stop(stageSgm,t0);
+
+            return true;
+        }
+    };
+#endif
+}
+
+
+/******************************************************************************/
+DisparityEngine* DisparityEngine::create(const string &name, ResourceFinder &rf)
+{
+    if (name=="elas")
+        return new ElasDisparityEngine(rf);
+
+    if (name=="sgbm")
+        return new SgbmDisparityEngine(rf.check("sgbm_3way"));
+
+#ifdef DISPARITY_ENGINE_CUDA
+    if (name=="cuda_sgm")
+        return new CudaSgmDisparityEngine(rf.check("cuda_sgm_P1",Value(10)).asInt(),
+                                          rf.check("cuda_sgm_P2",Value(120)).asInt());
+#endif
+
+    return NULL;
+}
+
+
+/******************************************************************************/
+ElasDisparityEngine::ElasDisparityEngine(ResourceFinder &rf)
+{
+    string elas_string = rf.check("elas_setting",Value("ROBOTICS")).asString().c_str();
+
+    double disp_scaling_factor = rf.check("disp_scaling_factor",Value(1.0)).asDouble();
+
+    elaswrap = new elasWrapper(disp_scaling_factor, elas_string);
+
+    Window first;
+    first.elas=elaswrap;
+    first.lastUsed=0;
+    windows.push_back(first);
+    clock=0;
+
+    stageRectify=stageCoarse=-1;
+    for (int i=0; i<Elas::NUM_STAGES; i++)
+        stageElas[i]=-1;
+
+
+    if (rf.check("elas_subsampling"))
+        elaswrap->set_subsampling(true);
+
+    if (rf.check("elas_add_corners"))
+        elaswrap->set_add_corners(true);
+
+
+    elaswrap->set_ipol_gap_width(40);
+    if (rf.check("elas_ipol_gap_width"))
+        elaswrap->set_ipol_gap_width(rf.find("elas_ipol_gap_width").asInt());
+
+
+    if (rf.check("elas_support_threshold"))
+        elaswrap->set_support_threshold(rf.find("elas_support_threshold").asDouble());
+
+    if(rf.check("elas_gamma"))
+        elaswrap->set_gamma(rf.find("elas_gamma").asDouble());
+
+    if (rf.check("elas_sradius"))
+        elaswrap->set_sradius(rf.find("elas_sradius").asDouble());
+
+    if (rf.check("elas_match_texture"))
+        elaswrap->set_match_texture(rf.find("elas_match_texture").asInt());
+
+    if (rf.check("elas_filter_median"))
+        elaswrap->set_filter_median(rf.find("elas_filter_median").asBool());
+
+    if (rf.check("elas_filter_adaptive_mean"))
+        elaswrap->set_filter_adaptive_mean(rf.find("elas_filter_adaptive_mean").asBool());
+
+    if (rf.check("elas_num_threads"))
+        elaswrap->set_num_threads(rf.find("elas_num_threads").asInt());
+
+    if (rf.check("elas_temporal_prior"))
+        elaswrap->set_temporal_prior(true);
+
+    if (rf.check("elas_prior_radius"))
+        elaswrap->set_prior_radius(rf.find("elas_prior_radius").asInt());
+
+    if (rf.check("elas_prior_refresh"))
+        elaswrap->set_prior_refresh(rf.find("elas_prior_refresh").asInt());
+
+    if (rf.check("elas_prior_min_ratio"))
+        elaswrap->set_prior_min_ratio(rf.find("elas_prior_min_ratio").asDouble());
+
+    if (rf.check("elas_incremental_delaunay"))
+        elaswrap->set_incremental_delaunay(true);
+
+    if (rf.check("elas_refine_radius"))
+        elaswrap->set_refine_radius(rf.find("elas_refine_radius").asInt());
+
+    cout << endl << "ELAS parameters:" << endl << endl;
+
+    cout << "disp_scaling_factor: " << disp_scaling_factor << endl;
+
+    cout << "setting: " << elas_string << endl;
+
+    cout << "postprocess_only_left: " << elaswrap->get_postprocess_only_left() << endl;
+    cout << "subsampling: " << elaswrap->get_subsampling() << endl;
+
+    cout << "add_corners: " << elaswrap->get_add_corners() << endl;
+
+    cout << "ipol_gap_width: " << elaswrap->get_ipol_gap_width() << endl;
+
+    cout << "support_threshold: " << elaswrap->get_support_threshold() << endl;
+    cout << "gamma: " << elaswrap->get_gamma() << endl;
+    cout << "sradius: " << elaswrap->get_sradius() << endl;
+
+    cout << "match_texture: " << elaswrap->get_match_texture() << endl;
+
+    cout << "filter_median: " << elaswrap->get_filter_median() << endl;
+    cout << "filter_adaptive_mean: " << elaswrap->get_filter_adaptive_mean() << endl;
+
+    cout << "num_threads: " << elaswrap->get_num_threads() << endl;
+
+    cout << "temporal_prior: " << elaswrap->get_temporal_prior() << endl;
+    if (elaswrap->get_temporal_prior())
+    {
+        cout << "prior_radius: " << elaswrap->get_prior_radius() << endl;
+        cout << "prior_refresh: " << elaswrap->get_prior_refresh() << endl;
+        cout << "prior_min_ratio: " << elaswrap->get_prior_min_ratio() << endl;
+    }
+
+    cout << "incremental_delaunay: " << elaswrap->get_incremental_delaunay() << endl;
+
+    if (elaswrap->is_coarse_to_fine())
+        cout << "refine_radius: " << elaswrap->get_refine_radius() << endl;
+
+    cout << "kernels: " << elaswrap->getKernelsName() << endl;
+
+    cout << endl;
+}
+
+
+/******************************************************************************/
+ElasDisparityEngine::~ElasDisparityEngine()
+{
+    for (size_t i=0; i<windows.size(); i++)
+        if (windows[i].elas!=elaswrap)
+            delete windows[i].elas;
+    delete elaswrap;
+}
+
+
+/******************************************************************************/
+void ElasDisparityEngine::setStageStats(StageStats *stats)
+{
+    this->stats=stats;
+    if (stats==NULL)
+        return;
+
+    stageRectify=stats->addStage("rectify");
+    if (elaswrap->is_coarse_to_fine())
+        stageCoarse=stats->addStage("elas_coarse");
+    for (int i=0; i<Elas::NUM_STAGES; i++)
+        stageElas[i]=stats->addStage(string("elas_")+Elas::getStageName(i));
+}
+
+
+/******************************************************************************/
+elasWrapper* ElasDisparityEngine::getWindow(const Mat &mapL1)
+{
+    Rect window;
+    Mat whole=wholeMap(mapL1,window);
+
+    // the same place of the same rectification, else the window of this
+    // rectification overlapping the most (a ROI which has moved)
+    int best=-1, bestArea=0;
+    for (size_t i=0; i<windows.size(); i++)
+    {
+        Window &w=windows[i];
+        if (w.mapL1.empty())
+            continue;
+
+        if ((w.mapL1.data==mapL1.data) && (w.mapL1.size()==mapL1.size()))
+        {
+            best=(int)i;
+            break;
+        }
+
+        Rect previous;
+        if (wholeMap(w.mapL1,previous).data!=whole.data)
+            continue;
+
+        int area=(previous & window).area();
+        if (area>bestArea)
+        {
+            best=(int)i;
+            bestArea=area;
+        }
+    }
+
+    // else a new window while there is room, or the least recently used one
+    if (best<0)
+    {
+        if (windows[0].mapL1.empty())
+            best=0;
+        else if ((int)windows.size()<maxWindows)
+        {
+            Window w;
+            w.elas=new elasWrapper();
+            w.lastUsed=0;
+            windows.push_back(w);
+            best=(int)windows.size()-1;
+        }
+        else
+        {
+            best=0;
+            for (size_t i=1; i<windows.size(); i++)
+                if (windows[i].lastUsed<windows[best].lastUsed)
+                    best=(int)i;
+        }
+    }
+
+    // the support points of another rectification, or of another place, are no prior;
+    // the maps are referenced, so that their buffers cannot be taken by new ones
+    Window &w=windows[best];
+    if ((w.mapL1.data!=mapL1.data) || (w.mapL1.size()!=mapL1.size()))
+    {
+        w.elas->reset_prior();
+        w.mapL1=mapL1;
+    }
+
+    if (w.elas!=elaswrap)
+        w.elas->copy_settings(*elaswrap);
+    w.lastUsed=++clock;
+    return w.elas;
+}
+
+
+/******************************************************************************/
+bool ElasDisparityEngine::compute(const Mat &left, const Mat &right, const Mat &mapL1,
+                                  const Mat &mapL2, const Mat &mapR1, const Mat &mapR2,
+                                  Mat &rectL, Mat &rectR, Mat &disp, const DisparityParams &params)
+{
+    // the rectified images are as large as the maps, a window of the images with ROIs
+    Size img_size=mapL1.size();
+    double t0=StageStats::now();
+    elasWrapper *elas=getWindow(mapL1);
+
+    // without io scaling, ELAS is fed through its aligned input buffers:
+    // the rectification (gray cameras) or the color conversion writes
+    // straight into them and no further copy is done
+    Mat img1r, img2r, elasL, elasR;
+    bool elas_aligned=elas->get_io_scaling_factor()==1.0;
+    if (elas_aligned)
+    {
+        elas->get_aligned_inputs(img_size, elasL, elasR);
+        if (left.channels()==1)
+        {
+            img1r=elasL;
+            img2r=elasR;
+        }
+    }
+
+    remap(left, img1r, mapL1, mapL2, cv::INTER_LINEAR);
+    remap(right, img2r, mapR1, mapR2, cv::INTER_LINEAR);
+
+    // the aligned buffers have the size of the maps, so they are not reallocated here
+    if (elas_aligned && img1r.channels()==3)
+    {
+        cvtColor(img1r, elasL, CV_BGR2GRAY);
+        cvtColor(img2r, elasR, CV_BGR2GRAY);
+    }
+
+    rectL=img1r;
+    rectR=img2r;
+
+    if (stats!=NULL)
+        stats->stop(stageRectify,t0);
+
+    Mat dispFloat;
+    bool success;
+    if (elas_aligned)
+        success=elas->compute_disparity_aligned(elasL, elasR, dispFloat, params.numberOfDisparities);
+    else
+        success=elas->compute_disparity(img1r, img2r, dispFloat, params.numberOfDisparities);
+
+    // StereoCamera converts the float disparity together with its other outputs
+    if (success)
+    {
+        disp=dispFloat;
+
+        if (stats!=NULL)
+        {
+            if (elas->is_coarse_to_fine())
+                stats->record(stageCoarse, 1e-3*elas->get_coarse_time());
+            for (int i=0; i<Elas::NUM_STAGES; i++)
+                if (elas->getStageTime(i)>0.0f)
+                    stats->record(stageElas[i], 1e-3*elas->getStageTime(i));
+        }
+    }
+
+    return success;
+}
+
+
+/******************************************************************************/
+SgbmDisparityEngine::SgbmDisparityEngine(const bool threeWay) : threeWay(threeWay), channels(0),
+                                                                  stageRectify(-1), stageMatch(-1)
+{
+#ifndef SGBM_HAVE_3WAY
+    if (threeWay)
+        cout << "SGBM 3-way is not available in this OpenCV version" << endl;
+#endif
+}
+
+
+/******************************************************************************/
+void SgbmDisparityEngine::setStageStats(StageStats *stats)
+{
+    this->stats=stats;
+    if (stats!=NULL)
+    {
+        stageRectify=stats->addStage("rectify");
+        stageMatch=stats->addStage("sgbm");
+    }
+}
+
+
+/******************************************************************************/
+void SgbmDisparityEngine::configure(const DisparityParams &params, const int cn)
+{
+    if (!sgbm.empty() && (cn==channels) && sameParams(params,current))
+        return;
+
+    int SADWindowSize=params.SADWindowSize;
+    int P1=8*cn*SADWindowSize*SADWindowSize;
+    int P2=32*cn*SADWindowSize*SADWindowSize;
+
+#ifdef OPENCV_GREATER_2
+    int mode=params.best?StereoSGBM::MODE_HH:StereoSGBM::MODE_SGBM;
+#ifdef SGBM_HAVE_3WAY
+    if (threeWay)
+        mode=StereoSGBM::MODE_SGBM_3WAY;
+#endif
+
+    if (sgbm.empty())
+        sgbm=cv::StereoSGBM::create(params.minDisparity,params.numberOfDisparities,SADWindowSize,
+                                    P1,P2,params.disp12MaxDiff,params.preFilterCap,params.uniquenessRatio,
+                                    params.speckleWindowSize,params.speckleRange,mode);
+    else
+    {
+        sgbm->setMinDisparity(params.minDisparity);
+        sgbm->setNumDisparities(params.numberOfDisparities);
+        sgbm->setBlockSize(SADWindowSize);
+        sgbm->setP1(P1);
+        sgbm->setP2(P2);
+        sgbm->setDisp12MaxDiff(params.disp12MaxDiff);
+        sgbm->setPreFilterCap(params.preFilterCap);
+        sgbm->setUniquenessRatio(params.uniquenessRatio);
+        sgbm->setSpeckleWindowSize(params.speckleWindowSize);
+        sgbm->setSpeckleRange(params.speckleRange);
+        sgbm->setMode(mode);
+    }
+#else
+    if (sgbm.empty())
+        sgbm=Ptr<StereoSGBM>(new StereoSGBM());
+
+    sgbm->preFilterCap =         params.preFilterCap; //63
+    sgbm->SADWindowSize =        SADWindowSize;
+    sgbm->P1 =                   P1;
+    sgbm->P2 =                   P2;
+    sgbm->minDisparity =         params.minDisparity; //-15
+    sgbm->numberOfDisparities =  params.numberOfDisparities;
+    sgbm->uniquenessRatio =      params.uniquenessRatio; //22
+    sgbm->speckleWindowSize =    params.speckleWindowSize; //100
+    sgbm->speckleRange =         params.speckleRange; //32
+    sgbm->disp12MaxDiff =        params.disp12MaxDiff;
+    sgbm->fullDP =               params.best; // alg == STEREO_HH
+#endif
+
+    current=params;
+    channels=cn;
+}
+
+
+/******************************************************************************/
+bool SgbmDisparityEngine::compute(const Mat &left, const Mat &right, const Mat &mapL1,
+                                  const Mat &mapL2, const Mat &mapR1, const Mat &mapR2,
+                                  Mat &rectL, Mat &rectR, Mat &disp, const DisparityParams &params)
+{
+    double t0=StageStats::now();
+
+    Mat img1r, img2r;
+    remap(left, img1r, mapL1, mapL2, cv::INTER_LINEAR);
+    remap(right, img2r, mapR1, mapR2, cv::INTER_LINEAR);
+    rectL=img1r;
+    rectR=img2r;
+
+    if (stats!=NULL)
+        t0=stats->stop(stageRectify,t0);
+
+    configure(params, left.channels());
+
+#ifdef OPENCV_GREATER_2
+    sgbm->compute(img1r, img2r, disp);
+#else
+    (*sgbm)(img1r, img2r, disp);
+#endif
+
+    if (stats!=NULL)
+        stats->stop(stageMatch,t0);
+
+    return true;
+}
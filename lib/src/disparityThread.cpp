@@ -52,7 +52,7 @@ bool DisparityThread::loadExtrinsics(yarp::os::ResourceFinder& rf, Mat& Ro, Mat&
 
 
 DisparityThread::DisparityThread(const string &name, yarp::os::ResourceFinder &rf,
-                                 bool useHorn, bool updateCamera, bool rectify) : RateThread(10)
+                                 bool useHorn, bool updateCamera, bool rectify) : jobAvailable(0)
 {
     moduleName=name;
     Bottle pars=rf.findGroup("STEREO_DISPARITY");    
@@ -88,6 +88,16 @@ DisparityThread::DisparityThread(const string &name, yarp::os::ResourceFinder &r
     eyes.resize(eyes0.length(),0.0);
 
     this->stereo=new StereoCamera(rectify);
+
+    // rectification maps of the last start, none by default
+    string mapsFile=rf.check("rectMapsFile",Value("")).asString().c_str();
+    if (!mapsFile.empty())
+        stereo->setRectificationCacheFile(localCalibration.getHomeContextPath().c_str()+string("/")+mapsFile);
+
+    stageJob=stats.addStage("job");
+    stageCalibration=stats.addStage("calibration");
+    stageDisparity=stats.addStage("disparity");
+    stereo->setStageStats(&stats);
     if (success)
     {
         stereo->setIntrinsics(KL,KR,DistL,DistR);
@@ -126,7 +136,6 @@ DisparityThread::DisparityThread(const string &name, yarp::os::ResourceFinder &r
 
     this->init=true;
     this->work=false;
-    this->done=false;
     this->updateOnce=false;
     this->updateCamera=updateCamera;
 
@@ -206,14 +215,34 @@ void DisparityThread::updateViaGazeCtrl(const bool update)
 
 void DisparityThread::run() 
 {
-    if (!success)
+    while (!isStopping())
     {
-        printf("Error. Cannot load camera parameters... Check your config file \n");
-        return;
-    }
+        // sleep until setImages() submits a pair (or the thread is stopped)
+        jobAvailable.wait();
+        if (isStopping())
+            break;
+
+        mutexJob.lock();
+        JobHandle running=job;
+        bool todo=work;
+        work=false;
+        Mat left=pendingLeft;
+        Mat right=pendingRight;
+        pendingLeft=pendingRight=Mat();
+        mutexJob.unlock();
+
+        if (!todo)
+            continue;
+
+        if (!success)
+        {
+            printf("Error. Cannot load camera parameters... Check your config file \n");
+            running.complete();
+            continue;
+        }
+
+        double tJob=StageStats::now();
 
-    if (work)
-    {
         // read encoders
         posHead->getEncoder(nHeadAxis-3,&eyes[0]);
         posHead->getEncoder(nHeadAxis-2,&eyes[1]);
@@ -223,6 +252,8 @@ void DisparityThread::run()
         updateViaGazeCtrl(false);
         
         mutexDisp.lock();
+        double t0=StageStats::now();
+        installImages(left,right);
         if (updateCamera || updateOnce)
         {
         #ifdef USING_GPU
@@ -249,21 +280,31 @@ void DisparityThread::run()
                 if (updateOnce)
                     updateOnce=false;
             }
+
+            t0=stats.stop(stageCalibration,t0);
         }
 
         // Compute Disparity
         this->stereo->computeDisparity(this->useBestDisp, this->uniquenessRatio, this->speckleWindowSize,
                                        this->speckleRange, this->numberOfDisparities, this->SADWindowSize,
                                        this->minDisparity, this->preFilterCap, this->disp12MaxDiff);
+        stats.stop(stageDisparity,t0);
         mutexDisp.unlock();
-        work=false;
-        done=true;
-        this->suspend();
+
+        stats.stop(stageJob,tJob);
+        running.complete();
     }
+
+    // nobody must wait for a job that will never run
+    mutexJob.lock();
+    if (work)
+        job.drop();
+    work=false;
+    mutexJob.unlock();
 }
 
 
-void DisparityThread::setImages(Mat &left, Mat &right) 
+void DisparityThread::installImages(Mat &left, Mat &right)
 {
     IplImage l=left;
     IplImage r=right;
@@ -275,18 +316,42 @@ void DisparityThread::setImages(Mat &left, Mat &right)
         this->numberOfDisparities=(l.width<=320)?96:128;
         widthInit=l.width;
     }
+}
+
 
-    this->done=false;
-    this->work=true;
-    this->resume();
+JobHandle DisparityThread::setImages(Mat &left, Mat &right) 
+{
+    // the pair is given to the camera by run(), under mutexDisp; a job
+    // not started yet is superseded by this one
+    mutexJob.lock();
+    if (work)
+        job.drop();
+    job=JobHandle::create();
+    JobHandle handle=job;
+    if (isRunning())
+    {
+        pendingLeft=left;
+        pendingRight=right;
+        work=true;
+    }
+    else
+    {
+        mutexDisp.lock();
+        installImages(left,right);
+        mutexDisp.unlock();
+        job.complete();
+    }
+    mutexJob.unlock();
+
+    jobAvailable.post();
+    return handle;
 }
 
 
 void DisparityThread::getDisparity(Mat &Disp)
 {
     mutexDisp.lock();
-    Mat tmp=stereo->getDisparity();
-    Disp=tmp.clone();
+    Disp=stereo->getDisparity();
     mutexDisp.unlock();
 }
 
@@ -294,8 +359,7 @@ void DisparityThread::getDisparity(Mat &Disp)
 void DisparityThread::getDisparityFloat(Mat &Disp) 
 {
     mutexDisp.lock();
-    Mat tmp=stereo->getDisparity16();
-    Disp= tmp.clone();
+    Disp=stereo->getDisparity16();
     mutexDisp.unlock();
 }
 
@@ -303,8 +367,7 @@ void DisparityThread::getDisparityFloat(Mat &Disp)
 void DisparityThread::getQMat(Mat &Q) 
 {
     mutexDisp.lock();
-    Mat tmp=stereo->getQ();
-    Q= tmp.clone();
+    Q=stereo->getQ();
     mutexDisp.unlock();
 }
 
@@ -312,8 +375,7 @@ void DisparityThread::getQMat(Mat &Q)
 void DisparityThread::getMapper(Mat &Mapper) 
 {
     mutexDisp.lock();
-    Mat tmp=stereo->getMapperL();
-    Mapper= tmp.clone();
+    Mapper=stereo->getMapperL();
     mutexDisp.unlock();
 }
 
@@ -321,8 +383,7 @@ void DisparityThread::getMapper(Mat &Mapper)
 void DisparityThread::getRectMatrix(Mat &RL) 
 {
     mutexDisp.lock();
-    Mat tmp=stereo->getRLrect();
-    RL= tmp.clone();
+    RL=stereo->getRLrect();
     mutexDisp.unlock();
 }
 
@@ -431,7 +492,8 @@ void DisparityThread::threadRelease()
 
 bool DisparityThread::checkDone() 
 {
-    return done;
+    LockGuard lg(mutexJob);
+    return job.isDone();
 }
 
 
@@ -756,8 +818,8 @@ Matrix DisparityThread::getCameraHGazeCtrl(int camera)
 
 void DisparityThread::onStop()
 {
-    this->work=false;
-    this->done=true;
+    // wake up run() so that it can see the stop request
+    jobAvailable.post();
 }
 
 
@@ -782,6 +844,13 @@ void DisparityThread::setDispParameters(bool _useBestDisp, int _uniquenessRatio,
 }
 
 
+bool DisparityThread::setDisparityEngine(const string &name, yarp::os::ResourceFinder &rf)
+{
+    LockGuard lg(mutexDisp);
+    return this->stereo->setDisparityEngine(name,rf);
+}
+
+
 Point3f DisparityThread::get3DPointMatch(double u1, double v1, double u2, double v2, string drive)
 {
     Point3f point;
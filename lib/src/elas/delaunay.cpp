@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#include "delaunay.h"
+
+using namespace std;
+
+namespace {
+
+  // corners of the enclosing triangle, it contains the square of side max_coord
+  const int32_t super_coord = 4*IncrementalDelaunay::max_coord;
+
+  // > 0 if a,b,c are counter-clockwise
+  inline int64_t orient (int32_t ax,int32_t ay,int32_t bx,int32_t by,int32_t cx,int32_t cy) {
+    return (int64_t)(bx-ax)*(cy-ay)-(int64_t)(by-ay)*(cx-ax);
+  }
+
+  // > 0 if d is inside the circumcircle of the counter-clockwise a,b,c
+  // (all terms stay below 2^63 for coordinates up to super_coord)
+  inline int64_t incircle (int32_t ax,int32_t ay,int32_t bx,int32_t by,int32_t cx,int32_t cy,
+                           int32_t dx,int32_t dy) {
+    int64_t adx = ax-dx, ady = ay-dy;
+    int64_t bdx = bx-dx, bdy = by-dy;
+    int64_t cdx = cx-dx, cdy = cy-dy;
+    int64_t alift = adx*adx+ady*ady;
+    int64_t blift = bdx*bdx+bdy*bdy;
+    int64_t clift = cdx*cdx+cdy*cdy;
+    return alift*(bdx*cdy-cdx*bdy)+blift*(cdx*ady-adx*cdy)+clift*(adx*bdy-bdx*ady);
+  }
+}
+
+IncrementalDelaunay::IncrementalDelaunay () : last(-1),next_stamp(1),rand_state(12345) {
+}
+
+void IncrementalDelaunay::reset () {
+  verts.clear();
+  tris.clear();
+  free_verts.clear();
+  free_tris.clear();
+  key_vertex.clear();
+  out_corners.clear();
+  out_slot.clear();
+  last = -1;
+}
+
+int32_t IncrementalDelaunay::newVertex (int32_t key,int32_t x,int32_t y) {
+  int32_t v;
+  if (!free_verts.empty()) {
+    v = free_verts.back();
+    free_verts.pop_back();
+  } else {
+    v = (int32_t)verts.size();
+    verts.push_back(vertex());
+  }
+  vertex &p = verts[v];
+  p.x = x; p.y = y;
+  p.tri = -1; p.index = -1; p.key = key;
+  p.used = true; p.inserted = false;
+  return v;
+}
+
+void IncrementalDelaunay::freeVertex (int32_t v) {
+  verts[v].used = false;
+  free_verts.push_back(v);
+}
+
+int32_t IncrementalDelaunay::newTriangle (int32_t a,int32_t b,int32_t c) {
+  int32_t t;
+  if (!free_tris.empty()) {
+    t = free_tris.back();
+    free_tris.pop_back();
+  } else {
+    t = (int32_t)tris.size();
+    tris.push_back(tri());
+  }
+  tri &T = tris[t];
+  T.v[0] = a; T.v[1] = b; T.v[2] = c;
+  T.n[0] = T.n[1] = T.n[2] = -1;
+  T.stamp = next_stamp++;
+  if (next_stamp==0)
+    next_stamp = 1;
+  verts[a].tri = verts[b].tri = verts[c].tri = t;
+  return t;
+}
+
+void IncrementalDelaunay::freeTriangle (int32_t t) {
+  tris[t].stamp = 0;
+  free_tris.push_back(t);
+}
+
+void IncrementalDelaunay::link (int32_t t,int32_t side,int32_t t_nb,int32_t side_nb) {
+  tris[t].n[side] = t_nb;
+  if (t_nb>=0)
+    tris[t_nb].n[side_nb] = t;
+}
+
+int32_t IncrementalDelaunay::side (int32_t t,int32_t t_nb) const {
+  if (t<0)
+    return -1;
+  const tri &T = tris[t];
+  return T.n[0]==t_nb ? 0 : (T.n[1]==t_nb ? 1 : 2);
+}
+
+int32_t IncrementalDelaunay::locate (int32_t x,int32_t y) {
+
+  // visibility walk, the first edge tested is random so that it cannot cycle
+  int32_t t = last;
+  if (t<0 || tris[t].stamp==0)
+    for (t=0; tris[t].stamp==0; t++);
+
+  int32_t max_steps = 4*(int32_t)tris.size()+16;
+  for (int32_t step=0; step<max_steps; step++) {
+    const tri &T = tris[t];
+    rand_state = rand_state*1103515245+12345;
+    int32_t r = (rand_state>>16)%3;
+    int32_t next = -1;
+    for (int32_t k=0; k<3; k++) {
+      int32_t i = (r+k)%3;
+      const vertex &a = verts[T.v[(i+1)%3]];
+      const vertex &b = verts[T.v[(i+2)%3]];
+      if (orient(a.x,a.y,b.x,b.y,x,y)<0) {
+        next = T.n[i];
+        break;
+      }
+    }
+    if (next<0)
+      return t;
+    t = next;
+  }
+
+  // not expected with exact predicates: linear search
+  for (t=0; t<(int32_t)tris.size(); t++) {
+    const tri &T = tris[t];
+    if (T.stamp==0)
+      continue;
+    bool inside = true;
+    for (int32_t i=0; i<3 && inside; i++) {
+      const vertex &a = verts[T.v[(i+1)%3]];
+      const vertex &b = verts[T.v[(i+2)%3]];
+      inside = orient(a.x,a.y,b.x,b.y,x,y)>=0;
+    }
+    if (inside)
+      return t;
+  }
+  return -1;
+}
+
+bool IncrementalDelaunay::insert (int32_t v) {
+
+  const vertex &p = verts[v];
+  int32_t t = locate(p.x,p.y);
+  if (t<0)
+    return false;
+
+  // duplicate position
+  for (int32_t i=0; i<3; i++) {
+    const vertex &c = verts[tris[t].v[i]];
+    if (c.x==p.x && c.y==p.y)
+      return false;
+  }
+
+  // cavity: the connected triangles whose circumcircle contains p
+  if (marks.size()<tris.size())
+    marks.resize(tris.size(),0);
+  cavity.clear();
+  cavity.push_back(t);
+  marks[t] = 1;
+  for (int32_t k=0; k<(int32_t)cavity.size(); k++) {
+    const tri &T = tris[cavity[k]];
+    for (int32_t i=0; i<3; i++) {
+      int32_t nb = T.n[i];
+      if (nb<0 || marks[nb])
+        continue;
+      const tri &N = tris[nb];
+      const vertex &a = verts[N.v[0]];
+      const vertex &b = verts[N.v[1]];
+      const vertex &c = verts[N.v[2]];
+      if (incircle(a.x,a.y,b.x,b.y,c.x,c.y,p.x,p.y)>0) {
+        marks[nb] = 1;
+        cavity.push_back(nb);
+      }
+    }
+  }
+
+  // boundary edges (a,b, outer neighbor and its side), counter-clockwise
+  edges.clear();
+  for (int32_t k=0; k<(int32_t)cavity.size(); k++) {
+    const tri &T = tris[cavity[k]];
+    for (int32_t i=0; i<3; i++) {
+      int32_t nb = T.n[i];
+      if (nb>=0 && marks[nb])
+        continue;
+      edges.push_back(T.v[(i+1)%3]);
+      edges.push_back(T.v[(i+2)%3]);
+      edges.push_back(nb);
+      edges.push_back(side(nb,cavity[k]));
+    }
+  }
+  for (int32_t k=0; k<(int32_t)cavity.size(); k++) {
+    marks[cavity[k]] = 0;
+    freeTriangle(cavity[k]);
+  }
+
+  // fan of new triangles (a,b,p) around p
+  int32_t num = (int32_t)edges.size()/4;
+  int32_t first = (int32_t)cavity.size();
+  for (int32_t j=0; j<num; j++) {
+    int32_t tn = newTriangle(edges[4*j],edges[4*j+1],v);
+    link(tn,2,edges[4*j+2],edges[4*j+3]);
+    cavity.push_back(tn);
+  }
+  for (int32_t j=0; j<num; j++) {
+    int32_t tj = cavity[first+j];
+    int32_t b  = edges[4*j+1];
+    for (int32_t k=0; k<num; k++) {
+      if (edges[4*k]==b) {
+        link(tj,0,cavity[first+k],1);
+        break;
+      }
+    }
+  }
+
+  if (marks.size()<tris.size())
+    marks.resize(tris.size(),0);
+  verts[v].inserted = true;
+  last = cavity[first];
+  return true;
+}
+
+bool IncrementalDelaunay::remove (int32_t v) {
+
+  // star of v: ring of neighbors (counter-clockwise) with the triangle
+  // across each ring edge (and its side)
+  ring.clear();
+  cavity.clear();
+  int32_t t0 = verts[v].tri, t = t0;
+  do {
+    const tri &T = tris[t];
+    int32_t i = T.v[0]==v ? 0 : (T.v[1]==v ? 1 : 2);
+    ring.push_back(T.v[(i+1)%3]);
+    ring.push_back(T.n[i]);
+    ring.push_back(side(T.n[i],t));
+    cavity.push_back(t);
+    t = T.n[(i+1)%3];
+    if (t<0 || (int32_t)cavity.size()>(int32_t)tris.size())
+      return false;
+  } while (t!=t0);
+
+  // plan the ear clipping of the hole: an ear is convex, it contains no other
+  // vertex of the ring and its circumcircle contains none (Delaunay)
+  edges.clear();
+  int32_t num = (int32_t)ring.size()/3;
+  for (int32_t j=0; j<num; j++)
+    edges.push_back(ring[3*j]);
+  ears.clear();
+  while (edges.size()>3) {
+    int32_t m = (int32_t)edges.size(), found = -1;
+    for (int32_t j=0; j<m && found<0; j++) {
+      const vertex &a = verts[edges[(j+m-1)%m]];
+      const vertex &b = verts[edges[j]];
+      const vertex &c = verts[edges[(j+1)%m]];
+      if (orient(a.x,a.y,b.x,b.y,c.x,c.y)<=0)
+        continue;
+      bool ear = true;
+      for (int32_t k=0; k<m && ear; k++) {
+        if (k==j || k==(j+m-1)%m || k==(j+1)%m)
+          continue;
+        const vertex &d = verts[edges[k]];
+        if (incircle(a.x,a.y,b.x,b.y,c.x,c.y,d.x,d.y)>0)
+          ear = false;
+        else if (orient(a.x,a.y,b.x,b.y,d.x,d.y)>=0 &&
+                 orient(b.x,b.y,c.x,c.y,d.x,d.y)>=0 &&
+                 orient(c.x,c.y,a.x,a.y,d.x,d.y)>=0)
+          ear = false;
+      }
+      if (ear)
+        found = j;
+    }
+    if (found<0)
+      return false;
+    ears.push_back(found);
+    edges.erase(edges.begin()+found);
+  }
+
+  // apply it: edges[] now holds the owner (triangle,side) of each hole edge
+  for (int32_t k=0; k<(int32_t)cavity.size(); k++)
+    freeTriangle(cavity[k]);
+  verts[v].inserted = false;
+  verts[v].tri = -1;
+
+  vector<int32_t> &poly = cavity;
+  poly.clear();
+  edges.clear();
+  for (int32_t j=0; j<num; j++) {
+    poly.push_back(ring[3*j]);
+    edges.push_back(ring[3*j+1]);
+    edges.push_back(ring[3*j+2]);
+  }
+  for (int32_t e=0; e<(int32_t)ears.size(); e++) {
+    int32_t m = (int32_t)poly.size(), j = ears[e], p = (j+m-1)%m;
+    int32_t tn = newTriangle(poly[p],poly[j],poly[(j+1)%m]);
+    link(tn,0,edges[2*j],edges[2*j+1]);
+    link(tn,2,edges[2*p],edges[2*p+1]);
+    edges[2*p] = tn; edges[2*p+1] = 1;
+    poly.erase(poly.begin()+j);
+    edges.erase(edges.begin()+2*j,edges.begin()+2*j+2);
+    last = tn;
+  }
+  int32_t tn = newTriangle(poly[0],poly[1],poly[2]);
+  link(tn,0,edges[2],edges[3]);
+  link(tn,1,edges[4],edges[5]);
+  link(tn,2,edges[0],edges[1]);
+  last = tn;
+  return true;
+}
+
+void IncrementalDelaunay::rebuild (const vector<int32_t> &key,const vector<int32_t> &x,
+                                   const vector<int32_t> &y) {
+  reset();
+  newVertex(-1,-super_coord,-super_coord);
+  newVertex(-1, super_coord,-super_coord);
+  newVertex(-1, 0, super_coord);
+  last = newTriangle(0,1,2);
+
+  // the points come in scan order, each one is located next to the previous one
+  for (int32_t i=0; i<(int32_t)key.size(); i++) {
+    int32_t v = newVertex(key[i],x[i],y[i]);
+    verts[v].index = i;
+    key_vertex[key[i]] = v;
+    insert(v);
+  }
+}
+
+bool IncrementalDelaunay::update (const vector<int32_t> &key,const vector<int32_t> &x,
+                                  const vector<int32_t> &y,float rebuild_ratio) {
+
+  int32_t n = (int32_t)key.size();
+  bool rebuilt = false;
+
+  if (tris.empty()) {
+    rebuild(key,x,y);
+    rebuilt = true;
+  } else {
+
+    // known points (moved or not), new points (-1-i) and the points that disappeared
+    seen.assign(verts.size(),0);
+    changed.clear();
+    for (int32_t i=0; i<n; i++) {
+      map<int32_t,int32_t>::const_iterator it = key_vertex.find(key[i]);
+      if (it==key_vertex.end()) {
+        changed.push_back(-1-i);
+        continue;
+      }
+      int32_t v = it->second;
+      seen[v] = 1;
+      verts[v].index = i;
+      if (verts[v].x!=x[i] || verts[v].y!=y[i])
+        changed.push_back(v);
+    }
+    for (int32_t v=3; v<(int32_t)verts.size(); v++)
+      if (verts[v].used && !seen[v])
+        changed.push_back(v);
+
+    if ((float)changed.size()>rebuild_ratio*n) {
+      rebuild(key,x,y);
+      rebuilt = true;
+    } else {
+
+      // removals first (moved and disappeared points), then insertions
+      for (int32_t k=0; k<(int32_t)changed.size(); k++) {
+        int32_t v = changed[k];
+        if (v<0)
+          continue;
+        if (verts[v].inserted && !remove(v)) {
+          rebuild(key,x,y);
+          rebuilt = true;
+          break;
+        }
+        if (seen[v]) {
+          verts[v].x = x[verts[v].index];
+          verts[v].y = y[verts[v].index];
+        } else {
+          key_vertex.erase(verts[v].key);
+          freeVertex(v);
+        }
+      }
+
+      if (!rebuilt) {
+        for (int32_t k=0; k<(int32_t)changed.size(); k++) {
+          int32_t i = changed[k];
+          if (i>=0)
+            continue;
+          i = -1-i;
+          int32_t v = newVertex(key[i],x[i],y[i]);
+          verts[v].index = i;
+          key_vertex[key[i]] = v;
+        }
+
+        // moved, new and previously left out points
+        for (int32_t v=3; v<(int32_t)verts.size(); v++)
+          if (verts[v].used && !verts[v].inserted)
+            insert(v);
+      }
+    }
+  }
+
+  // triangles not touching the enclosing triangle
+  out_corners.clear();
+  out_slot.clear();
+  for (int32_t t=0; t<(int32_t)tris.size(); t++) {
+    const tri &T = tris[t];
+    if (T.stamp==0 || T.v[0]<3 || T.v[1]<3 || T.v[2]<3)
+      continue;
+    out_corners.push_back(verts[T.v[0]].index);
+    out_corners.push_back(verts[T.v[1]].index);
+    out_corners.push_back(verts[T.v[2]].index);
+    out_slot.push_back(t);
+  }
+  return rebuilt;
+}
@@ -20,23 +20,34 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
 */
 
 #include "descriptor.h"
-#include "filter.h"
-#include <emmintrin.h>
+#include "kernels.h"
 
 using namespace std;
 
 Descriptor::Descriptor(uint8_t* I,int32_t width,int32_t height,int32_t bpl,bool half_resolution) {
   I_desc        = (uint8_t*)_mm_malloc(16*width*height*sizeof(uint8_t),16);
+  owns_desc     = true;
   uint8_t* I_du = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
   uint8_t* I_dv = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
-  filter::sobel3x3(I,I_du,I_dv,bpl,height);
+  int16_t* I_tmp = (int16_t*)_mm_malloc(2*bpl*height*sizeof(int16_t),16);
+  kernels::get().sobel3x3(I,I_du,I_dv,bpl,height,I_tmp,I_tmp+bpl*height);
   createDescriptor(I_du,I_dv,width,height,bpl,half_resolution);
   _mm_free(I_du);
   _mm_free(I_dv);
+  _mm_free(I_tmp);
+}
+
+Descriptor::Descriptor(uint8_t* I,int32_t width,int32_t height,int32_t bpl,bool half_resolution,
+                       uint8_t* I_desc_,uint8_t* I_du,uint8_t* I_dv,int16_t* I_tmp) {
+  I_desc    = I_desc_;
+  owns_desc = false;
+  kernels::get().sobel3x3(I,I_du,I_dv,bpl,height,I_tmp,I_tmp+bpl*height);
+  createDescriptor(I_du,I_dv,width,height,bpl,half_resolution);
 }
 
 Descriptor::~Descriptor() {
-  _mm_free(I_desc);
+  if (owns_desc)
+    _mm_free(I_desc);
 }
 
 void Descriptor::createDescriptor (uint8_t* I_du,uint8_t* I_dv,int32_t width,int32_t height,int32_t bpl,bool half_resolution) {
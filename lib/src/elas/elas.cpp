@@ -23,40 +23,40 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
 
 #include <algorithm>
 #include <math.h>
+#include <time.h>
+#ifndef _MSC_VER
+#include <sys/time.h>
+#endif
 #include "descriptor.h"
 #include "triangle.h"
 #include "matrix.h"
 
 using namespace std;
 
+// wall clock of the stage timing (ms)
+static inline double getStageClock () {
+#ifndef _MSC_VER
+    timeval t;
+    gettimeofday(&t,0);
+    return 1e3*t.tv_sec+1e-3*t.tv_usec;
+#else
+    return 1e3*(double)clock()/CLOCKS_PER_SEC;
+#endif
+}
+
 bool Elas::process (uint8_t* I1_,uint8_t* I2_,float* D1,float* D2,const int32_t* dims){
 
-    // get width, height and bytes per line
-    width  = dims[0];
-    height = dims[1];
-    bpl    = width + 15-(width-1)%16;
-
-    // copy images to byte aligned memory
-    I1 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
-    I2 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
-    memset (I1,0,bpl*height*sizeof(uint8_t));
-    memset (I2,0,bpl*height*sizeof(uint8_t));
-    if (bpl==dims[2]) {
-        memcpy(I1,I1_,bpl*height*sizeof(uint8_t));
-        memcpy(I2,I2_,bpl*height*sizeof(uint8_t));
-    } else {
-        for (int32_t v=0; v<height; v++) {
-            memcpy(I1+v*bpl,I1_+v*dims[2],width*sizeof(uint8_t));
-            memcpy(I2+v*bpl,I2_+v*dims[2],width*sizeof(uint8_t));
-        }
-    }
+    // set dimensions, workspace and aligned input images
+    setInputImages(I1_,I2_,dims);
+    startStages();
 
 #ifdef PROFILE
     timer.start("Descriptor");
 #endif
-    Descriptor desc1(I1,width,height,bpl,param.subsampling);
-    Descriptor desc2(I2,width,height,bpl,param.subsampling);
+    Descriptor desc1(I1,width,height,bpl,param.subsampling,ws.I1_desc,ws.I_du,ws.I_dv,ws.I_tmp);
+    Descriptor desc2(I2,width,height,bpl,param.subsampling,ws.I2_desc,ws.I_du,ws.I_dv,ws.I_tmp);
 
+    stopStage(STAGE_DESCRIPTOR);
 #ifdef PROFILE
     timer.start("Support Matches");
 #endif
@@ -75,43 +75,51 @@ bool Elas::process (uint8_t* I1_,uint8_t* I2_,float* D1,float* D2,const int32_t*
         //		  return;
         //	  }
 
+        stopStage(STAGE_SUPPORT);
 #ifdef PROFILE
         timer.start("Delaunay Triangulation");
 #endif
-        vector<triangle> tri_1 = computeDelaunayTriangulation(p_support,0);
-        vector<triangle> tri_2 = computeDelaunayTriangulation(p_support,1);
+        vector<triangle> tri_1,tri_2;
+        if (param.incremental_delaunay && width<=IncrementalDelaunay::max_coord) {
+            updateDelaunayTriangulation(p_support,0,tri_1);
+            updateDelaunayTriangulation(p_support,1,tri_2);
+        } else {
+            tri_1 = computeDelaunayTriangulation(p_support,0);
+            tri_2 = computeDelaunayTriangulation(p_support,1);
 
 #ifdef PROFILE
-        timer.start("Disparity Planes");
+            timer.start("Disparity Planes");
 #endif
-        computeDisparityPlanes(p_support,tri_1,0);
-        computeDisparityPlanes(p_support,tri_2,1);
+            computeDisparityPlanes(p_support,tri_1,0);
+            computeDisparityPlanes(p_support,tri_2,1);
+        }
 
 #ifdef PROFILE
         timer.start("Grid");
 #endif
 
-        // allocate memory for disparity grid
-        int32_t grid_width   = (int32_t)ceil((float)width/(float)param.grid_size);
-        int32_t grid_height  = (int32_t)ceil((float)height/(float)param.grid_size);
-        int32_t grid_dims[3] = {param.disp_max+2,grid_width,grid_height};
-        int32_t* disparity_grid_1 = (int32_t*)calloc((param.disp_max+2)*grid_height*grid_width,sizeof(int32_t));
-        int32_t* disparity_grid_2 = (int32_t*)calloc((param.disp_max+2)*grid_height*grid_width,sizeof(int32_t));
+        // disparity grids of the workspace
+        int32_t grid_dims[3] = {param.disp_max+2,ws.grid_width,ws.grid_height};
+        int32_t* disparity_grid_1 = ws.disparity_grid_1;
+        int32_t* disparity_grid_2 = ws.disparity_grid_2;
 
         createGrid(p_support,disparity_grid_1,grid_dims,0);
         createGrid(p_support,disparity_grid_2,grid_dims,1);
 
+        stopStage(STAGE_TRIANGULATION);
 #ifdef PROFILE
         timer.start("Matching");
 #endif
         computeDisparity(p_support,tri_1,disparity_grid_1,grid_dims,desc1.I_desc,desc2.I_desc,0,D1);
         computeDisparity(p_support,tri_2,disparity_grid_2,grid_dims,desc1.I_desc,desc2.I_desc,1,D2);
 
+        stopStage(STAGE_MATCHING);
 #ifdef PROFILE
         timer.start("L/R Consistency Check");
 #endif
         leftRightConsistencyCheck(D1,D2);
 
+        stopStage(STAGE_LR_CHECK);
 #ifdef PROFILE
         timer.start("Remove Small Segments");
 #endif
@@ -144,27 +152,299 @@ bool Elas::process (uint8_t* I1_,uint8_t* I2_,float* D1,float* D2,const int32_t*
                 median(D2);
         }
 
+        stopStage(STAGE_POSTPROCESS);
 #ifdef PROFILE
         timer.plot();
+        cout << "Input copies saved: " << copies_saved << "/2" << endl;
 #endif
 
-        free(disparity_grid_1);
-        free(disparity_grid_2);
+        // disparity maps of the temporal prior
+        if (param.temporal_prior) {
+            int32_t D_size = param.subsampling ? (width/2)*(height/2) : width*height;
+            prior.D[0].assign(D1,D1+D_size);
+            prior.D[1].assign(D2,D2+D_size);
+        }
 
         success = true;
 
     } else
     {
+        prior.D[0].clear();
+        prior.D[1].clear();
         success = false;
     }
 
-    // release memory
-    _mm_free(I1);
-    _mm_free(I2);
-
     return success;
 }
 
+void Elas::startStages () {
+    for (int32_t i=0; i<NUM_STAGES; i++)
+        stage_time[i] = 0;
+    stage_clock = getStageClock();
+}
+
+void Elas::stopStage (int32_t s) {
+    double t = getStageClock();
+    stage_time[s] += (float)(t-stage_clock);
+    stage_clock = t;
+}
+
+void Elas::setInputImages (uint8_t* I1_,uint8_t* I2_,const int32_t* dims) {
+
+    // get width, height and bytes per line
+    width  = dims[0];
+    height = dims[1];
+    bpl    = getAlignedBytesPerLine(width);
+
+    // (re)allocate the persistent workspace only if the geometry changed
+    if (ws.width!=width || ws.height!=height || ws.disp_max!=param.disp_max || ws.grid_size!=param.grid_size)
+        allocateWorkspace();
+
+    // use the input images in place if they already have the aligned layout,
+    // otherwise copy them to byte aligned memory
+    copies_saved = 0;
+    if (bpl==dims[2] && ((uintptr_t)I1_)%16==0 && ((uintptr_t)I2_)%16==0) {
+        I1 = I1_;
+        I2 = I2_;
+        copies_saved = 2;
+    } else if (bpl==dims[2]) {
+        I1 = ws.I1;
+        I2 = ws.I2;
+        memcpy(I1,I1_,bpl*height*sizeof(uint8_t));
+        memcpy(I2,I2_,bpl*height*sizeof(uint8_t));
+    } else {
+        I1 = ws.I1;
+        I2 = ws.I2;
+        for (int32_t v=0; v<height; v++) {
+            memcpy(I1+v*bpl,I1_+v*dims[2],width*sizeof(uint8_t));
+            memcpy(I2+v*bpl,I2_+v*dims[2],width*sizeof(uint8_t));
+            memset(I1+v*bpl+width,0,(bpl-width)*sizeof(uint8_t));
+            memset(I2+v*bpl+width,0,(bpl-width)*sizeof(uint8_t));
+        }
+    }
+}
+
+bool Elas::refine (uint8_t* I1_,uint8_t* I2_,const float* D_prior,const int32_t radius,float* D1,float* D2,const int32_t* dims) {
+
+    // the prior is given at full resolution
+    if (param.subsampling)
+        return false;
+
+    // set dimensions, workspace and aligned input images
+    setInputImages(I1_,I2_,dims);
+    startStages();
+
+#ifdef PROFILE
+    timer.start("Descriptor");
+#endif
+    Descriptor desc1(I1,width,height,bpl,false,ws.I1_desc,ws.I_du,ws.I_dv,ws.I_tmp);
+    Descriptor desc2(I2,width,height,bpl,false,ws.I2_desc,ws.I_du,ws.I_dv,ws.I_tmp);
+
+    stopStage(STAGE_DESCRIPTOR);
+#ifdef PROFILE
+    timer.start("Band Matching");
+#endif
+    // prior of the right image: the left one warped to the right view,
+    // where two pixels project on the same one the closest surface wins
+    for (int32_t i=0; i<width*height; i++)
+        D2[i] = -1;
+    for (int32_t v=0; v<height; v++) {
+        for (int32_t u=0; u<width; u++) {
+            float d = D_prior[getAddressOffsetImage(u,v,width)];
+            if (d<0)
+                continue;
+            int32_t u_warp = u-(int32_t)(d+0.5f);
+            if (u_warp>=0 && D2[getAddressOffsetImage(u_warp,v,width)]<d)
+                D2[getAddressOffsetImage(u_warp,v,width)] = d;
+        }
+    }
+
+    // D2 is its own prior: every pixel reads its prior before writing it
+    matchInBand(desc1.I_desc,desc2.I_desc,D_prior,radius,false,D1);
+    matchInBand(desc1.I_desc,desc2.I_desc,D2,radius,true,D2);
+
+    stopStage(STAGE_MATCHING);
+#ifdef PROFILE
+    timer.start("L/R Consistency Check");
+#endif
+    leftRightConsistencyCheck(D1,D2);
+
+    stopStage(STAGE_LR_CHECK);
+#ifdef PROFILE
+    timer.start("Remove Small Segments");
+#endif
+    removeSmallSegments(D1);
+    if (!param.postprocess_only_left)
+        removeSmallSegments(D2);
+
+#ifdef PROFILE
+    timer.start("Gap Interpolation");
+#endif
+    gapInterpolation(D1);
+    if (!param.postprocess_only_left)
+        gapInterpolation(D2);
+
+    if (param.filter_adaptive_mean) {
+#ifdef PROFILE
+        timer.start("Adaptive Mean");
+#endif
+        adaptiveMean(D1);
+        if (!param.postprocess_only_left)
+            adaptiveMean(D2);
+    }
+
+    if (param.filter_median) {
+#ifdef PROFILE
+        timer.start("Median");
+#endif
+        median(D1);
+        if (!param.postprocess_only_left)
+            median(D2);
+    }
+
+    stopStage(STAGE_POSTPROCESS);
+#ifdef PROFILE
+    timer.plot();
+#endif
+
+    return true;
+}
+
+void Elas::matchInBand (uint8_t* I1_desc,uint8_t* I2_desc,const float* D_prior,const int32_t radius,
+                        const bool right_image,float* D) {
+
+    const int32_t window_size = 2;
+
+    // warp direction: u-d for the left image, u+d for the right image
+    const int32_t dir = right_image ? +1 : -1;
+
+    for (int32_t v=0; v<height; v++) {
+
+        // compute line start address
+        int32_t  line_offset = 16*width*max(min(v,height-3),2);
+        uint8_t *I1_line_addr,*I2_line_addr;
+        if (!right_image) {
+            I1_line_addr = I1_desc+line_offset;
+            I2_line_addr = I2_desc+line_offset;
+        } else {
+            I1_line_addr = I2_desc+line_offset;
+            I2_line_addr = I1_desc+line_offset;
+        }
+
+        int32_t E[kernels::max_chunk];
+
+        for (int32_t u=0; u<width; u++) {
+
+            uint32_t addr = getAddressOffsetImage(u,v,width);
+            float d_prior = D_prior[addr];
+            D[addr] = -1;
+
+            // no prior or border pixel
+            if (d_prior<0 || u<window_size || u>=width-window_size)
+                continue;
+
+            // does this patch have enough texture?
+            uint8_t* I1_block_addr = I1_line_addr+16*u;
+            int32_t sum = 0;
+            for (int32_t i=0; i<16; i++)
+                sum += abs((int32_t)(*(I1_block_addr+i))-128);
+            if (sum<param.match_texture)
+                continue;
+
+            // search band around the prior, restricted to warps inside the image
+            int32_t d_center = (int32_t)(d_prior+0.5f);
+            int32_t d_lo     = max(d_center-radius,param.disp_min);
+            int32_t d_hi     = min(d_center+radius,param.disp_max);
+            int32_t d_range_min,d_range_max;
+            if (!right_image) {
+                d_range_min = max(d_lo,u-width+window_size+1);
+                d_range_max = min(d_hi,u-window_size);
+            } else {
+                d_range_min = max(d_lo,window_size-u);
+                d_range_max = min(d_hi,width-window_size-1-u);
+            }
+
+            int32_t min_val = 10000;
+            int32_t min_d   = -1;
+            for (int32_t d0=d_range_min; d0<=d_range_max; d0+=kernels::max_chunk) {
+                int32_t n = min(kernels::max_chunk,d_range_max-d0+1);
+                kern->sadStrided(I1_block_addr,I2_line_addr+16*(u+dir*d0),16*dir,n,E);
+                for (int32_t k=0; k<n; k++) {
+                    if (E[k]<min_val) {
+                        min_val = E[k];
+                        min_d   = d0+k;
+                    }
+                }
+            }
+
+            // a minimum on a border of the band which is not a border of the
+            // disparity range is no minimum: the prior is wrong there
+            if ((min_d==d_lo && d_lo>param.disp_min) || (min_d==d_hi && d_hi<param.disp_max))
+                continue;
+
+            D[addr] = min_d;
+        }
+    }
+}
+
+void Elas::allocateWorkspace () {
+
+    // release buffers allocated for a previous geometry
+    releaseWorkspace();
+
+    // remember the geometry the buffers are allocated for
+    ws.width       = width;
+    ws.height      = height;
+    ws.bpl         = bpl;
+    ws.disp_max    = param.disp_max;
+    ws.grid_size   = param.grid_size;
+    ws.grid_width  = (int32_t)ceil((float)width/(float)param.grid_size);
+    ws.grid_height = (int32_t)ceil((float)height/(float)param.grid_size);
+
+    // byte aligned input images
+    ws.I1 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+    ws.I2 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+    memset (ws.I1,0,bpl*height*sizeof(uint8_t));
+    memset (ws.I2,0,bpl*height*sizeof(uint8_t));
+
+    // descriptors and sobel scratch
+    ws.I1_desc = (uint8_t*)_mm_malloc(16*width*height*sizeof(uint8_t),16);
+    ws.I2_desc = (uint8_t*)_mm_malloc(16*width*height*sizeof(uint8_t),16);
+    memset (ws.I1_desc,0,16*width*height*sizeof(uint8_t));
+    memset (ws.I2_desc,0,16*width*height*sizeof(uint8_t));
+    ws.I_du  = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+    ws.I_dv  = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+    ws.I_tmp = (int16_t*)_mm_malloc(2*bpl*height*sizeof(int16_t),16);
+
+    // disparity grids and their temporary diffusion grids
+    // (borders of grid_temp2 are never written by createGrid and stay zero)
+    int32_t grid_num = ws.grid_width*ws.grid_height;
+    ws.disparity_grid_1 = (int32_t*)calloc((param.disp_max+2)*grid_num,sizeof(int32_t));
+    ws.disparity_grid_2 = (int32_t*)calloc((param.disp_max+2)*grid_num,sizeof(int32_t));
+    for (int32_t i=0; i<2; i++) {
+        ws.grid_temp1[i] = (int32_t*)calloc((param.disp_max+1)*grid_num,sizeof(int32_t));
+        ws.grid_temp2[i] = (int32_t*)calloc((param.disp_max+1)*grid_num,sizeof(int32_t));
+    }
+}
+
+void Elas::releaseWorkspace () {
+    _mm_free(ws.I1);
+    _mm_free(ws.I2);
+    _mm_free(ws.I1_desc);
+    _mm_free(ws.I2_desc);
+    _mm_free(ws.I_du);
+    _mm_free(ws.I_dv);
+    _mm_free(ws.I_tmp);
+    free(ws.disparity_grid_1);
+    free(ws.disparity_grid_2);
+    for (int32_t i=0; i<2; i++) {
+        free(ws.grid_temp1[i]);
+        free(ws.grid_temp2[i]);
+    }
+    I1 = I2 = 0;
+    ws = workspace();
+}
+
 void Elas::removeInconsistentSupportPoints (int16_t* D_can,int32_t D_can_width,int32_t D_can_height) {
 
     // for all valid support points do
@@ -281,7 +561,8 @@ void Elas::addCornerSupportPoints(vector<support_pt> &p_support) {
         p_support.push_back(p_border[i]);
 }
 
-inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v,uint8_t* I1_desc,uint8_t* I2_desc,const bool &right_image) {
+inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v,uint8_t* I1_desc,uint8_t* I2_desc,const bool &right_image,
+                                               const int32_t &d_lo,const int32_t &d_hi) {
 
     const int32_t u_step      = 2;
     const int32_t v_step      = 2;
@@ -292,7 +573,7 @@ inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v
     int32_t desc_offset_3 = -16*u_step+16*width*v_step;
     int32_t desc_offset_4 = +16*u_step+16*width*v_step;
 
-    __m128i xmm1,xmm2,xmm3,xmm4,xmm5,xmm6;
+    const int32_t desc_offsets[4] = {desc_offset_1,desc_offset_2,desc_offset_3,desc_offset_4};
 
     // check if we are inside the image region
     if (u>=window_size+u_step && u<=width-window_size-1-u_step && v>=window_size+v_step && v<=height-window_size-1-v_step) {
@@ -319,13 +600,8 @@ inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v
         if (sum<param.support_texture)
             return -1;
 
-        // load first blocks to xmm registers
-        xmm1 = _mm_load_si128((__m128i*)(I1_block_addr+desc_offset_1));
-        xmm2 = _mm_load_si128((__m128i*)(I1_block_addr+desc_offset_2));
-        xmm3 = _mm_load_si128((__m128i*)(I1_block_addr+desc_offset_3));
-        xmm4 = _mm_load_si128((__m128i*)(I1_block_addr+desc_offset_4));
-
-        // declare match energy for each disparity
+        // match energies of a chunk of disparities
+        int32_t E[kernels::max_chunk];
         int32_t u_warp;
 
         // best match
@@ -344,39 +620,47 @@ inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v
         if (disp_max_valid-disp_min_valid<10)
             return -1;
 
-        // for all disparities do
-        for (int16_t d=disp_min_valid; d<=disp_max_valid; d++) {
+        // restrict the search to the requested range
+        int32_t d_first = max(disp_min_valid,d_lo);
+        int32_t d_last  = min(disp_max_valid,d_hi);
+        if (d_first>d_last)
+            return -1;
+
+        // for all disparities do (in chunks)
+        for (int32_t d0=d_first; d0<=d_last; d0+=kernels::max_chunk) {
 
-            // warp u coordinate
-            if (!right_image) u_warp = u-d;
-            else              u_warp = u+d;
+            // warp u coordinate of the first disparity of the chunk
+            if (!right_image) u_warp = u-d0;
+            else              u_warp = u+d0;
 
-            // compute I2 block start addresses
+            // compute I2 block start address
             I2_block_addr = I2_line_addr+16*u_warp;
 
-            // compute match energy at this disparity
-            xmm6 = _mm_load_si128((__m128i*)(I2_block_addr+desc_offset_1));
-            xmm6 = _mm_sad_epu8(xmm1,xmm6);
-            xmm5 = _mm_load_si128((__m128i*)(I2_block_addr+desc_offset_2));
-            xmm6 = _mm_add_epi16(_mm_sad_epu8(xmm2,xmm5),xmm6);
-            xmm5 = _mm_load_si128((__m128i*)(I2_block_addr+desc_offset_3));
-            xmm6 = _mm_add_epi16(_mm_sad_epu8(xmm3,xmm5),xmm6);
-            xmm5 = _mm_load_si128((__m128i*)(I2_block_addr+desc_offset_4));
-            xmm6 = _mm_add_epi16(_mm_sad_epu8(xmm4,xmm5),xmm6);
-            sum  = _mm_extract_epi16(xmm6,0)+_mm_extract_epi16(xmm6,4);
-
-            // best + second best match
-            if (sum<min_1_E) {
-                min_2_E = min_1_E;
-                min_2_d = min_1_d;
-                min_1_E = sum;
-                min_1_d = d;
-            } else if (sum<min_2_E) {
-                min_2_E = sum;
-                min_2_d = d;
+            // compute match energies of this chunk
+            int32_t n = min(kernels::max_chunk,d_last-d0+1);
+            kern->sadSupport(I1_block_addr,I2_block_addr,right_image?16:-16,desc_offsets,n,E);
+
+            for (int32_t i=0; i<n; i++) {
+                int16_t d = d0+i;
+                sum = E[i];
+
+                // best + second best match
+                if (sum<min_1_E) {
+                    min_2_E = min_1_E;
+                    min_2_d = min_1_d;
+                    min_1_E = sum;
+                    min_1_d = d;
+                } else if (sum<min_2_E) {
+                    min_2_E = sum;
+                    min_2_d = d;
+                }
             }
         }
 
+        // a minimum on the border of a restricted range may not be the true one
+        if ((min_1_d==d_first && d_first>disp_min_valid) || (min_1_d==d_last && d_last<disp_max_valid))
+            return -1;
+
         // check if best and second best match are available and if matching ratio is sufficient
         if (min_1_d>=0 && min_2_d>=0 && (float)min_1_E<param.support_threshold*(float)min_2_E)
             return min_1_d;
@@ -387,6 +671,33 @@ inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v
         return -1;
 }
 
+inline int16_t Elas::computeSupportCandidate (const int32_t &u,const int32_t &v,uint8_t* I1_desc,uint8_t* I2_desc,const int16_t &d_prior) {
+
+    // full range, or a narrow one around the previous disparity
+    int32_t d_lo = 0;
+    int32_t d_hi = param.disp_max;
+    if (d_prior>=0) {
+        d_lo = d_prior-param.prior_radius;
+        d_hi = d_prior+param.prior_radius;
+    }
+
+    // find forwards
+    int16_t d = computeMatchingDisparity(u,v,I1_desc,I2_desc,false,d_lo,d_hi);
+    if (d<0)
+        return -1;
+
+    // find backwards
+    if (d_prior>=0) {
+        d_lo = d-param.prior_radius;
+        d_hi = d+param.prior_radius;
+    }
+    int16_t d2 = computeMatchingDisparity(u-d,v,I1_desc,I2_desc,true,d_lo,d_hi);
+    if (d2>=0 && abs(d-d2)<=param.lr_threshold)
+        return d;
+    else
+        return -1;
+}
+
 vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t* I2_desc) {
 
     // be sure that at half resolution we only need data
@@ -402,27 +713,48 @@ vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t*
     for (int32_t v=0; v<height; v+=D_candidate_stepsize) D_can_height++;
     int16_t* D_can = (int16_t*)calloc(D_can_width*D_can_height,sizeof(int16_t));
 
+    // temporal prior: until the next full search the candidates of the
+    // previous frame are searched again around their disparity, the others
+    // over the full range on a 2x2 subgrid rotating from frame to frame
+    // (e.g. surfaces entering the view)
+    bool use_prior = param.temporal_prior && prior.frames>0 && prior.frames<param.prior_refresh &&
+                     prior.width==D_can_width && prior.height==D_can_height && prior.step==D_candidate_stepsize;
+    bool full_search = true;
+
     // loop variables
     int32_t u,v;
-    int16_t d,d2;
+
+    if (use_prior) {
+        int32_t phase      = prior.frames%4;
+        int32_t prior_hits = 0;
+        for (int32_t u_can=1; u_can<D_can_width; u_can++) {
+            u = u_can*D_candidate_stepsize;
+            for (int32_t v_can=1; v_can<D_can_height; v_can++) {
+                v = v_can*D_candidate_stepsize;
+                int16_t d_prior = prior.D_can[getAddressOffsetImage(u_can,v_can,D_can_width)];
+                int16_t d = -1;
+                if (d_prior>=0) {
+                    d = computeSupportCandidate(u,v,I1_desc,I2_desc,d_prior);
+                    if (d>=0)
+                        prior_hits++;
+                } else if ((u_can&1)==(phase&1) && (v_can&1)==(phase>>1))
+                    d = computeSupportCandidate(u,v,I1_desc,I2_desc,-1);
+                *(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = d;
+            }
+        }
+
+        // large motion: too few of the support points of the last full search
+        // confirmed, search them all
+        full_search = prior.full_num==0 || prior_hits<param.prior_min_ratio*prior.full_num;
+    }
 
     // for all point candidates in image 1 do
-    for (int32_t u_can=1; u_can<D_can_width; u_can++) {
-        u = u_can*D_candidate_stepsize;
-        for (int32_t v_can=1; v_can<D_can_height; v_can++) {
-            v = v_can*D_candidate_stepsize;
-
-            // initialize disparity candidate to invalid
-            *(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = -1;
-
-            // find forwards
-            d = computeMatchingDisparity(u,v,I1_desc,I2_desc,false);
-            if (d>=0) {
-
-                // find backwards
-                d2 = computeMatchingDisparity(u-d,v,I1_desc,I2_desc,true);
-                if (d2>=0 && abs(d-d2)<=param.lr_threshold)
-                    *(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = d;
+    if (full_search) {
+        for (int32_t u_can=1; u_can<D_can_width; u_can++) {
+            u = u_can*D_candidate_stepsize;
+            for (int32_t v_can=1; v_can<D_can_height; v_can++) {
+                v = v_can*D_candidate_stepsize;
+                *(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = computeSupportCandidate(u,v,I1_desc,I2_desc,-1);
             }
         }
     }
@@ -430,6 +762,23 @@ vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t*
     // remove inconsistent support points
     removeInconsistentSupportPoints(D_can,D_can_width,D_can_height);
 
+    // the consistent candidates seed the next frame
+    if (param.temporal_prior) {
+        prior.D_can.assign(D_can,D_can+D_can_width*D_can_height);
+        prior.width  = D_can_width;
+        prior.height = D_can_height;
+        prior.step   = D_candidate_stepsize;
+        prior.frames = full_search ? 1 : prior.frames+1;
+        if (full_search) {
+            prior.full_num = 0;
+            for (int32_t u_can=1; u_can<D_can_width; u_can++)
+                for (int32_t v_can=1; v_can<D_can_height; v_can++)
+                    if (*(D_can+getAddressOffsetImage(u_can,v_can,D_can_width))>=0)
+                        prior.full_num++;
+        }
+    }
+    prior_used = !full_search;
+
     // remove support points on straight lines, since they are redundant
     // this reduces the number of triangles a little bit and hence speeds up
     // the triangulation process
@@ -457,7 +806,7 @@ vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t*
     return p_support;
 }
 
-vector<Elas::triangle> Elas::computeDelaunayTriangulation (vector<support_pt> p_support,int32_t right_image) {
+vector<Elas::triangle> Elas::computeDelaunayTriangulation (const vector<support_pt> &p_support,int32_t right_image) {
 
     // input/output structure for triangulation
     struct triangulateio in, out;
@@ -519,14 +868,17 @@ vector<Elas::triangle> Elas::computeDelaunayTriangulation (vector<support_pt> p_
     return tri;
 }
 
-void Elas::computeDisparityPlanes (vector<support_pt> p_support,vector<triangle> &tri,int32_t right_image) {
+void Elas::computeDisparityPlanes (const vector<support_pt> &p_support,vector<triangle> &tri,int32_t right_image,
+                                    const vector<int32_t>* subset) {
 
     // init matrices
     Matrix A(3,3);
     Matrix b(3,1);
 
-    // for all triangles do
-    for (int32_t i=0; i<tri.size(); i++) {
+    // for all triangles (or the given subset) do
+    int32_t num = subset ? subset->size() : tri.size();
+    for (int32_t k=0; k<num; k++) {
+        int32_t i = subset ? (*subset)[k] : k;
 
         // get triangle corner indices
         int32_t c1 = tri[i].c1;
@@ -591,15 +943,65 @@ void Elas::computeDisparityPlanes (vector<support_pt> p_support,vector<triangle>
     }
 }
 
-void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32_t* grid_dims,bool right_image) {
+void Elas::updateDelaunayTriangulation (const vector<support_pt> &p_support,int32_t right_image,vector<triangle> &tri) {
+
+    triangulation &T = delaunay[right_image ? 1 : 0];
+
+    // support points are identified across frames by their position in the left image
+    int32_t n = p_support.size();
+    T.key.resize(n);
+    T.x.resize(n);
+    T.y.resize(n);
+    for (int32_t i=0; i<n; i++) {
+        T.key[i] = (p_support[i].v<<16)+p_support[i].u;
+        T.x[i]   = right_image ? p_support[i].u-p_support[i].d : p_support[i].u;
+        T.y[i]   = p_support[i].v;
+    }
+
+    // rebuild when more than a quarter of the support points changed
+    T.dt.update(T.key,T.x,T.y,0.25f);
+    if (T.planes.size()<T.dt.numSlots())
+        T.planes.resize(T.dt.numSlots());
+
+    // planes of the triangles that kept their corners and disparities are reused
+    tri.clear();
+    T.todo.clear();
+    for (int32_t i=0; i<T.dt.numTriangles(); i++) {
+        const int32_t* c = T.dt.corners(i);
+        triangle t(c[0],c[1],c[2]);
+        const plane_cache &p = T.planes[T.dt.slot(i)];
+        if (p.stamp==T.dt.stamp(i) && p.d[0]==p_support[c[0]].d &&
+            p.d[1]==p_support[c[1]].d && p.d[2]==p_support[c[2]].d) {
+            t.t1a = p.t1a; t.t1b = p.t1b; t.t1c = p.t1c;
+            t.t2a = p.t2a; t.t2b = p.t2b; t.t2c = p.t2c;
+        } else
+            T.todo.push_back(i);
+        tri.push_back(t);
+    }
+
+    computeDisparityPlanes(p_support,tri,right_image,&T.todo);
+    for (int32_t k=0; k<T.todo.size(); k++) {
+        int32_t i = T.todo[k];
+        plane_cache &p = T.planes[T.dt.slot(i)];
+        p.stamp = T.dt.stamp(i);
+        p.d[0] = p_support[tri[i].c1].d;
+        p.d[1] = p_support[tri[i].c2].d;
+        p.d[2] = p_support[tri[i].c3].d;
+        p.t1a = tri[i].t1a; p.t1b = tri[i].t1b; p.t1c = tri[i].t1c;
+        p.t2a = tri[i].t2a; p.t2b = tri[i].t2b; p.t2c = tri[i].t2c;
+    }
+}
+
+void Elas::createGrid(const vector<support_pt> &p_support,int32_t* disparity_grid,int32_t* grid_dims,bool right_image) {
 
     // get grid dimensions
     int32_t grid_width  = grid_dims[1];
     int32_t grid_height = grid_dims[2];
 
     // allocate temporary memory
-    int32_t* temp1 = (int32_t*)calloc((param.disp_max+1)*grid_height*grid_width,sizeof(int32_t));
-    int32_t* temp2 = (int32_t*)calloc((param.disp_max+1)*grid_height*grid_width,sizeof(int32_t));
+    int32_t* temp1 = ws.grid_temp1[right_image ? 1 : 0];
+    int32_t* temp2 = ws.grid_temp2[right_image ? 1 : 0];
+    memset(temp1,0,(param.disp_max+1)*grid_height*grid_width*sizeof(int32_t));
 
     // for all support points do
     for (int32_t i=0; i<p_support.size(); i++) {
@@ -668,36 +1070,12 @@ void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32
         }
     }
 
-    // release temporary memory
-    free(temp1);
-    free(temp2);
-}
-
-inline void Elas::updatePosteriorMinimum(__m128i* I2_block_addr,const int32_t &d,const int32_t &w,
-        const __m128i &xmm1,__m128i &xmm2,int32_t &val,int32_t &min_val,int32_t &min_d) {
-    xmm2 = _mm_load_si128(I2_block_addr);
-    xmm2 = _mm_sad_epu8(xmm1,xmm2);
-    val  = _mm_extract_epi16(xmm2,0)+_mm_extract_epi16(xmm2,4)+w;
-    if (val<min_val) {
-        min_val = val;
-        min_d   = d;
-    }
-}
-
-inline void Elas::updatePosteriorMinimum(__m128i* I2_block_addr,const int32_t &d,
-        const __m128i &xmm1,__m128i &xmm2,int32_t &val,int32_t &min_val,int32_t &min_d) {
-    xmm2 = _mm_load_si128(I2_block_addr);
-    xmm2 = _mm_sad_epu8(xmm1,xmm2);
-    val  = _mm_extract_epi16(xmm2,0)+_mm_extract_epi16(xmm2,4);
-    if (val<min_val) {
-        min_val = val;
-        min_d   = d;
-    }
 }
 
 inline void Elas::findMatch(int32_t &u,int32_t &v,float &plane_a,float &plane_b,float &plane_c,
         int32_t* disparity_grid,int32_t *grid_dims,uint8_t* I1_desc,uint8_t* I2_desc,
-        int32_t *P,int32_t &plane_radius,bool &valid,bool &right_image,float* D){
+        int32_t *P,int32_t &plane_radius,bool &valid,bool &right_image,float* D,
+        const float* D_prev){
 
     // get image width and height
     const int32_t disp_num    = grid_dims[0]-1;
@@ -745,48 +1123,85 @@ inline void Elas::findMatch(int32_t &u,int32_t &v,float &plane_a,float &plane_b,
     int32_t  num_grid  = *(disparity_grid+grid_addr);
     int32_t* d_grid    = disparity_grid+grid_addr+1;
 
+    // temporal prior: band around the disparity of the previous frame, if
+    // it agrees with the plane prior (else the surface has moved)
+    int32_t d_band_min = 0;
+    int32_t d_band_max = disp_num-1;
+    bool    banded     = false;
+    if (D_prev!=0 && *(D_prev+d_addr)>=0) {
+        int32_t d_prev = (int32_t)(*(D_prev+d_addr)+0.5f);
+        if (d_prev+param.prior_radius>=d_plane_min && d_prev-param.prior_radius<=d_plane_max) {
+            d_band_min = max(d_prev-param.prior_radius,0);
+            d_band_max = min(d_prev+param.prior_radius,disp_num-1);
+            banded     = true;
+        }
+    }
+
     // loop variables
     int32_t d_curr, u_warp, val;
     int32_t min_val = 10000;
     int32_t min_d   = -1;
-    __m128i xmm1    = _mm_load_si128((__m128i*)I1_block_addr);
-    __m128i xmm2;
 
-    // left image
-    if (!right_image) {
-        for (int32_t i=0; i<num_grid; i++) {
+    // match energies of a chunk of disparities
+    int32_t        E[kernels::max_chunk];
+    int32_t        d_chunk[kernels::max_chunk];
+    const uint8_t* I2_blocks[kernels::max_chunk];
+
+    // warp direction: u-d for the left image, u+d for the right image
+    const int32_t dir = right_image ? +1 : -1;
+
+    // grid disparities outside of the plane prior range
+    for (int32_t i=0; i<num_grid; ) {
+        int32_t n = 0;
+        for (; i<num_grid && n<kernels::max_chunk; i++) {
             d_curr = d_grid[i];
-            if (d_curr<d_plane_min || d_curr>d_plane_max) {
-                u_warp = u-d_curr;
-                if (u_warp<window_size || u_warp>=width-window_size)
-                    continue;
-                updatePosteriorMinimum((__m128i*)(I2_line_addr+16*u_warp),d_curr,xmm1,xmm2,val,min_val,min_d);
-            }
-        }
-        for (d_curr=d_plane_min; d_curr<=d_plane_max; d_curr++) {
-            u_warp = u-d_curr;
+            if ((d_curr>=d_plane_min && d_curr<=d_plane_max) || d_curr<d_band_min || d_curr>d_band_max)
+                continue;
+            u_warp = u+dir*d_curr;
             if (u_warp<window_size || u_warp>=width-window_size)
                 continue;
-            updatePosteriorMinimum((__m128i*)(I2_line_addr+16*u_warp),d_curr,valid?*(P+abs(d_curr-d_plane)):0,xmm1,xmm2,val,min_val,min_d);
+            d_chunk[n]   = d_curr;
+            I2_blocks[n] = I2_line_addr+16*u_warp;
+            n++;
         }
+        kern->sadGather(I1_block_addr,I2_blocks,n,E);
+        for (int32_t k=0; k<n; k++) {
+            if (E[k]<min_val) {
+                min_val = E[k];
+                min_d   = d_chunk[k];
+            }
+        }
+    }
 
-        // right image
+    // plane prior range, restricted to warps inside the image
+    int32_t d_range_min,d_range_max;
+    if (!right_image) {
+        d_range_min = max(d_plane_min,u-width+window_size+1);
+        d_range_max = min(d_plane_max,u-window_size);
     } else {
-        for (int32_t i=0; i<num_grid; i++) {
-            d_curr = d_grid[i];
-            if (d_curr<d_plane_min || d_curr>d_plane_max) {
-                u_warp = u+d_curr;
-                if (u_warp<window_size || u_warp>=width-window_size)
-                    continue;
-                updatePosteriorMinimum((__m128i*)(I2_line_addr+16*u_warp),d_curr,xmm1,xmm2,val,min_val,min_d);
+        d_range_min = max(d_plane_min,window_size-u);
+        d_range_max = min(d_plane_max,width-window_size-1-u);
+    }
+    d_range_min = max(d_range_min,d_band_min);
+    d_range_max = min(d_range_max,d_band_max);
+    for (int32_t d0=d_range_min; d0<=d_range_max; d0+=kernels::max_chunk) {
+        int32_t n = min(kernels::max_chunk,d_range_max-d0+1);
+        kern->sadStrided(I1_block_addr,I2_line_addr+16*(u+dir*d0),16*dir,n,E);
+        for (int32_t k=0; k<n; k++) {
+            d_curr = d0+k;
+            val    = E[k]+(valid?*(P+abs(d_curr-d_plane)):0);
+            if (val<min_val) {
+                min_val = val;
+                min_d   = d_curr;
             }
         }
-        for (d_curr=d_plane_min; d_curr<=d_plane_max; d_curr++) {
-            u_warp = u+d_curr;
-            if (u_warp<window_size || u_warp>=width-window_size)
-                continue;
-            updatePosteriorMinimum((__m128i*)(I2_line_addr+16*u_warp),d_curr,valid?*(P+abs(d_curr-d_plane)):0,xmm1,xmm2,val,min_val,min_d);
-        }
+    }
+
+    // nothing in the band (e.g. occlusion or large motion): search without it
+    if (min_d<0 && banded) {
+        findMatch(u,v,plane_a,plane_b,plane_c,disparity_grid,grid_dims,I1_desc,I2_desc,
+                  P,plane_radius,valid,right_image,D,0);
+        return;
     }
 
     // set disparity value
@@ -795,7 +1210,7 @@ inline void Elas::findMatch(int32_t &u,int32_t &v,float &plane_a,float &plane_b,
 }
 
 // TODO: %2 => more elegantly
-void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,int32_t* disparity_grid,int32_t *grid_dims,
+void Elas::computeDisparity(const vector<support_pt> &p_support,const vector<triangle> &tri,int32_t* disparity_grid,int32_t *grid_dims,
         uint8_t* I1_desc,uint8_t* I2_desc,bool right_image,float* D) {
 
     // number of disparities
@@ -805,13 +1220,14 @@ void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,in
     int32_t window_size = 2;
 
     // init disparity image to -10
-    if (param.subsampling) {
-        for (int32_t i=0; i<(width/2)*(height/2); i++)
-            *(D+i) = -10;
-    } else {
-        for (int32_t i=0; i<width*height; i++)
-            *(D+i) = -10;
-    }
+    int32_t D_size = param.subsampling ? (width/2)*(height/2) : width*height;
+    for (int32_t i=0; i<D_size; i++)
+        *(D+i) = -10;
+
+    // disparity map of the previous frame if the support points were seeded by it
+    const float* D_prev = 0;
+    if (prior_used && prior.D[right_image].size()==(size_t)D_size)
+        D_prev = &prior.D[right_image][0];
 
     // pre-compute prior
     float two_sigma_squared = 2*param.sigma*param.sigma;
@@ -895,7 +1311,7 @@ void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,in
                     for (int32_t v=min(v_1,v_2); v<max(v_1,v_2); v++)
                         if (!param.subsampling || v%2==0) {
                             findMatch(u,v,plane_a,plane_b,plane_c,disparity_grid,grid_dims,
-                                    I1_desc,I2_desc,P,plane_radius,valid,right_image,D);
+                                    I1_desc,I2_desc,P,plane_radius,valid,right_image,D,D_prev);
                         }
                 }
             }
@@ -910,7 +1326,7 @@ void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,in
                     for (int32_t v=min(v_1,v_2); v<max(v_1,v_2); v++)
                         if (!param.subsampling || v%2==0) {
                             findMatch(u,v,plane_a,plane_b,plane_c,disparity_grid,grid_dims,
-                                    I1_desc,I2_desc,P,plane_radius,valid,right_image,D);
+                                    I1_desc,I2_desc,P,plane_radius,valid,right_image,D,D_prev);
                         }
                 }
             }
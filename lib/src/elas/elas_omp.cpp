@@ -30,41 +30,34 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
 
 using namespace std;
 
+// number of threads used by the parallel regions
+static inline int32_t getNumThreads (int32_t num_threads) {
+    return num_threads>0 ? num_threads : omp_get_max_threads();
+}
+
+// wall clock of the stage timing (ms)
+static inline double getStageClock () {
+    return 1e3*omp_get_wtime();
+}
+
 bool Elas::process (uint8_t* I1_,uint8_t* I2_,float* D1,float* D2,const int32_t* dims){
 
-    // get width, height and bytes per line
-    width  = dims[0];
-    height = dims[1];
-    bpl    = width + 15-(width-1)%16;
-
-    // copy images to byte aligned memory
-    I1 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
-    I2 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
-    memset (I1,0,bpl*height*sizeof(uint8_t));
-    memset (I2,0,bpl*height*sizeof(uint8_t));
-    if (bpl==dims[2]) {
-        memcpy(I1,I1_,bpl*height*sizeof(uint8_t));
-        memcpy(I2,I2_,bpl*height*sizeof(uint8_t));
-    } else {
-        for (int32_t v=0; v<height; v++) {
-            memcpy(I1+v*bpl,I1_+v*dims[2],width*sizeof(uint8_t));
-            memcpy(I2+v*bpl,I2_+v*dims[2],width*sizeof(uint8_t));
-        }
-    }
+    // set dimensions, workspace and aligned input images
+    setInputImages(I1_,I2_,dims);
+    startStages();
 
-    // allocate memory for disparity grid
-    int32_t grid_width   = (int32_t)ceil((float)width/(float)param.grid_size);
-    int32_t grid_height  = (int32_t)ceil((float)height/(float)param.grid_size);
-    int32_t grid_dims[3] = {param.disp_max+2,grid_width,grid_height};
-    int32_t* disparity_grid_1 = (int32_t*)calloc((param.disp_max+2)*grid_height*grid_width,sizeof(int32_t));
-    int32_t* disparity_grid_2 = (int32_t*)calloc((param.disp_max+2)*grid_height*grid_width,sizeof(int32_t));
+    // disparity grids of the workspace
+    int32_t grid_dims[3] = {param.disp_max+2,ws.grid_width,ws.grid_height};
+    int32_t* disparity_grid_1 = ws.disparity_grid_1;
+    int32_t* disparity_grid_2 = ws.disparity_grid_2;
 
 #ifdef PROFILE
     timer.start("Descriptor");
 #endif
-    Descriptor desc1(I1,width,height,bpl,param.subsampling);
-    Descriptor desc2(I2,width,height,bpl,param.subsampling);
+    Descriptor desc1(I1,width,height,bpl,param.subsampling,ws.I1_desc,ws.I_du,ws.I_dv,ws.I_tmp);
+    Descriptor desc2(I2,width,height,bpl,param.subsampling,ws.I2_desc,ws.I_du,ws.I_dv,ws.I_tmp);
 
+    stopStage(STAGE_DESCRIPTOR);
 #ifdef PROFILE
     timer.start("Support Matches");
 #endif
@@ -75,26 +68,36 @@ bool Elas::process (uint8_t* I1_,uint8_t* I2_,float* D1,float* D2,const int32_t*
     if (p_support.size()>=3)
     {
 
+        stopStage(STAGE_SUPPORT);
 #ifdef PROFILE
         timer.start("Parallel Region #1 = {Delaunay Triangulation, Disparity Planes, Grid}");
 #endif
 
         vector<triangle> tri_1, tri_2;
+        bool incremental = param.incremental_delaunay && width<=IncrementalDelaunay::max_coord;
 #pragma omp parallel num_threads(2)
         {
 #pragma omp sections
             {
 #pragma omp section
                 {
-                    tri_1 = computeDelaunayTriangulation(p_support,0);
-                    computeDisparityPlanes(p_support,tri_1,0);
+                    if (incremental)
+                        updateDelaunayTriangulation(p_support,0,tri_1);
+                    else {
+                        tri_1 = computeDelaunayTriangulation(p_support,0);
+                        computeDisparityPlanes(p_support,tri_1,0);
+                    }
                     createGrid(p_support,disparity_grid_1,grid_dims,0);
                     //computeDisparity(p_support,tri_1,disparity_grid_1,grid_dims,desc1.I_desc,desc2.I_desc,0,D1);
                 }
 #pragma omp section
                 {
-                    tri_2 = computeDelaunayTriangulation(p_support,1);
-                    computeDisparityPlanes(p_support,tri_2,1);
+                    if (incremental)
+                        updateDelaunayTriangulation(p_support,1,tri_2);
+                    else {
+                        tri_2 = computeDelaunayTriangulation(p_support,1);
+                        computeDisparityPlanes(p_support,tri_2,1);
+                    }
                     createGrid(p_support,disparity_grid_2,grid_dims,1);
                     //computeDisparity(p_support,tri_2,disparity_grid_2,grid_dims,desc1.I_desc,desc2.I_desc,1,D2);
 
@@ -103,23 +106,22 @@ bool Elas::process (uint8_t* I1_,uint8_t* I2_,float* D1,float* D2,const int32_t*
             }
         }
 
+        stopStage(STAGE_TRIANGULATION);
 #ifdef PROFILE
         timer.start("Matching");
 #endif
 
-#pragma omp sections
-        {
-#pragma omp section
-            computeDisparity(p_support,tri_1,disparity_grid_1,grid_dims,desc1.I_desc,desc2.I_desc,0,D1);
-#pragma omp section
-            computeDisparity(p_support,tri_2,disparity_grid_2,grid_dims,desc1.I_desc,desc2.I_desc,1,D2);
-        }
+        // each call is parallelized over row bands
+        computeDisparity(p_support,tri_1,disparity_grid_1,grid_dims,desc1.I_desc,desc2.I_desc,0,D1);
+        computeDisparity(p_support,tri_2,disparity_grid_2,grid_dims,desc1.I_desc,desc2.I_desc,1,D2);
 
+        stopStage(STAGE_MATCHING);
 #ifdef PROFILE
         timer.start("L/R Consistency Check");
 #endif
         leftRightConsistencyCheck(D1,D2);
 
+        stopStage(STAGE_LR_CHECK);
 #ifdef PROFILE
         timer.start("Remove Small Segments");
 #endif
@@ -152,49 +154,348 @@ bool Elas::process (uint8_t* I1_,uint8_t* I2_,float* D1,float* D2,const int32_t*
                 median(D2);
         }
 
+        stopStage(STAGE_POSTPROCESS);
 #ifdef PROFILE
         timer.plot();
+        cout << "Input copies saved: " << copies_saved << "/2" << endl;
 #endif
 
+        // disparity maps of the temporal prior
+        if (param.temporal_prior) {
+            int32_t D_size = param.subsampling ? (width/2)*(height/2) : width*height;
+            prior.D[0].assign(D1,D1+D_size);
+            prior.D[1].assign(D2,D2+D_size);
+        }
+
         success = true;
     } else
     {
+        prior.D[0].clear();
+        prior.D[1].clear();
         success = false;
     }
 
-    // release memory
-    free(disparity_grid_1);
-    free(disparity_grid_2);
-    _mm_free(I1);
-    _mm_free(I2);
-
     return success;
 }
 
+void Elas::startStages () {
+    for (int32_t i=0; i<NUM_STAGES; i++)
+        stage_time[i] = 0;
+    stage_clock = getStageClock();
+}
+
+void Elas::stopStage (int32_t s) {
+    double t = getStageClock();
+    stage_time[s] += (float)(t-stage_clock);
+    stage_clock = t;
+}
+
+void Elas::setInputImages (uint8_t* I1_,uint8_t* I2_,const int32_t* dims) {
+
+    // get width, height and bytes per line
+    width  = dims[0];
+    height = dims[1];
+    bpl    = getAlignedBytesPerLine(width);
+
+    // (re)allocate the persistent workspace only if the geometry changed
+    if (ws.width!=width || ws.height!=height || ws.disp_max!=param.disp_max || ws.grid_size!=param.grid_size)
+        allocateWorkspace();
+
+    // use the input images in place if they already have the aligned layout,
+    // otherwise copy them to byte aligned memory
+    copies_saved = 0;
+    if (bpl==dims[2] && ((uintptr_t)I1_)%16==0 && ((uintptr_t)I2_)%16==0) {
+        I1 = I1_;
+        I2 = I2_;
+        copies_saved = 2;
+    } else if (bpl==dims[2]) {
+        I1 = ws.I1;
+        I2 = ws.I2;
+        memcpy(I1,I1_,bpl*height*sizeof(uint8_t));
+        memcpy(I2,I2_,bpl*height*sizeof(uint8_t));
+    } else {
+        I1 = ws.I1;
+        I2 = ws.I2;
+        for (int32_t v=0; v<height; v++) {
+            memcpy(I1+v*bpl,I1_+v*dims[2],width*sizeof(uint8_t));
+            memcpy(I2+v*bpl,I2_+v*dims[2],width*sizeof(uint8_t));
+            memset(I1+v*bpl+width,0,(bpl-width)*sizeof(uint8_t));
+            memset(I2+v*bpl+width,0,(bpl-width)*sizeof(uint8_t));
+        }
+    }
+}
+
+bool Elas::refine (uint8_t* I1_,uint8_t* I2_,const float* D_prior,const int32_t radius,float* D1,float* D2,const int32_t* dims) {
+
+    // the prior is given at full resolution
+    if (param.subsampling)
+        return false;
+
+    // set dimensions, workspace and aligned input images
+    setInputImages(I1_,I2_,dims);
+    startStages();
+
+#ifdef PROFILE
+    timer.start("Descriptor");
+#endif
+    Descriptor desc1(I1,width,height,bpl,false,ws.I1_desc,ws.I_du,ws.I_dv,ws.I_tmp);
+    Descriptor desc2(I2,width,height,bpl,false,ws.I2_desc,ws.I_du,ws.I_dv,ws.I_tmp);
+
+    stopStage(STAGE_DESCRIPTOR);
+#ifdef PROFILE
+    timer.start("Band Matching");
+#endif
+    // prior of the right image: the left one warped to the right view,
+    // where two pixels project on the same one the closest surface wins
+    for (int32_t i=0; i<width*height; i++)
+        D2[i] = -1;
+    for (int32_t v=0; v<height; v++) {
+        for (int32_t u=0; u<width; u++) {
+            float d = D_prior[getAddressOffsetImage(u,v,width)];
+            if (d<0)
+                continue;
+            int32_t u_warp = u-(int32_t)(d+0.5f);
+            if (u_warp>=0 && D2[getAddressOffsetImage(u_warp,v,width)]<d)
+                D2[getAddressOffsetImage(u_warp,v,width)] = d;
+        }
+    }
+
+    // D2 is its own prior: every pixel reads its prior before writing it
+    matchInBand(desc1.I_desc,desc2.I_desc,D_prior,radius,false,D1);
+    matchInBand(desc1.I_desc,desc2.I_desc,D2,radius,true,D2);
+
+    stopStage(STAGE_MATCHING);
+#ifdef PROFILE
+    timer.start("L/R Consistency Check");
+#endif
+    leftRightConsistencyCheck(D1,D2);
+
+    stopStage(STAGE_LR_CHECK);
+#ifdef PROFILE
+    timer.start("Remove Small Segments");
+#endif
+    removeSmallSegments(D1);
+    if (!param.postprocess_only_left)
+        removeSmallSegments(D2);
+
+#ifdef PROFILE
+    timer.start("Gap Interpolation");
+#endif
+    gapInterpolation(D1);
+    if (!param.postprocess_only_left)
+        gapInterpolation(D2);
+
+    if (param.filter_adaptive_mean) {
+#ifdef PROFILE
+        timer.start("Adaptive Mean");
+#endif
+        adaptiveMean(D1);
+        if (!param.postprocess_only_left)
+            adaptiveMean(D2);
+    }
+
+    if (param.filter_median) {
+#ifdef PROFILE
+        timer.start("Median");
+#endif
+        median(D1);
+        if (!param.postprocess_only_left)
+            median(D2);
+    }
+
+    stopStage(STAGE_POSTPROCESS);
+#ifdef PROFILE
+    timer.plot();
+#endif
+
+    return true;
+}
+
+void Elas::matchInBand (uint8_t* I1_desc,uint8_t* I2_desc,const float* D_prior,const int32_t radius,
+                        const bool right_image,float* D) {
+
+    const int32_t window_size = 2;
+
+    // warp direction: u-d for the left image, u+d for the right image
+    const int32_t dir = right_image ? +1 : -1;
+
+#pragma omp parallel for num_threads(getNumThreads(param.num_threads))
+    for (int32_t v=0; v<height; v++) {
+
+        // compute line start address
+        int32_t  line_offset = 16*width*max(min(v,height-3),2);
+        uint8_t *I1_line_addr,*I2_line_addr;
+        if (!right_image) {
+            I1_line_addr = I1_desc+line_offset;
+            I2_line_addr = I2_desc+line_offset;
+        } else {
+            I1_line_addr = I2_desc+line_offset;
+            I2_line_addr = I1_desc+line_offset;
+        }
+
+        int32_t E[kernels::max_chunk];
+
+        for (int32_t u=0; u<width; u++) {
+
+            uint32_t addr = getAddressOffsetImage(u,v,width);
+            float d_prior = D_prior[addr];
+            D[addr] = -1;
+
+            // no prior or border pixel
+            if (d_prior<0 || u<window_size || u>=width-window_size)
+                continue;
+
+            // does this patch have enough texture?
+            uint8_t* I1_block_addr = I1_line_addr+16*u;
+            int32_t sum = 0;
+            for (int32_t i=0; i<16; i++)
+                sum += abs((int32_t)(*(I1_block_addr+i))-128);
+            if (sum<param.match_texture)
+                continue;
+
+            // search band around the prior, restricted to warps inside the image
+            int32_t d_center = (int32_t)(d_prior+0.5f);
+            int32_t d_lo     = max(d_center-radius,param.disp_min);
+            int32_t d_hi     = min(d_center+radius,param.disp_max);
+            int32_t d_range_min,d_range_max;
+            if (!right_image) {
+                d_range_min = max(d_lo,u-width+window_size+1);
+                d_range_max = min(d_hi,u-window_size);
+            } else {
+                d_range_min = max(d_lo,window_size-u);
+                d_range_max = min(d_hi,width-window_size-1-u);
+            }
+
+            int32_t min_val = 10000;
+            int32_t min_d   = -1;
+            for (int32_t d0=d_range_min; d0<=d_range_max; d0+=kernels::max_chunk) {
+                int32_t n = min(kernels::max_chunk,d_range_max-d0+1);
+                kern->sadStrided(I1_block_addr,I2_line_addr+16*(u+dir*d0),16*dir,n,E);
+                for (int32_t k=0; k<n; k++) {
+                    if (E[k]<min_val) {
+                        min_val = E[k];
+                        min_d   = d0+k;
+                    }
+                }
+            }
+
+            // a minimum on a border of the band which is not a border of the
+            // disparity range is no minimum: the prior is wrong there
+            if ((min_d==d_lo && d_lo>param.disp_min) || (min_d==d_hi && d_hi<param.disp_max))
+                continue;
+
+            D[addr] = min_d;
+        }
+    }
+}
+
+void Elas::allocateWorkspace () {
+
+    // release buffers allocated for a previous geometry
+    releaseWorkspace();
+
+    // remember the geometry the buffers are allocated for
+    ws.width       = width;
+    ws.height      = height;
+    ws.bpl         = bpl;
+    ws.disp_max    = param.disp_max;
+    ws.grid_size   = param.grid_size;
+    ws.grid_width  = (int32_t)ceil((float)width/(float)param.grid_size);
+    ws.grid_height = (int32_t)ceil((float)height/(float)param.grid_size);
+
+    // byte aligned input images
+    ws.I1 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+    ws.I2 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+    memset (ws.I1,0,bpl*height*sizeof(uint8_t));
+    memset (ws.I2,0,bpl*height*sizeof(uint8_t));
+
+    // descriptors and sobel scratch
+    ws.I1_desc = (uint8_t*)_mm_malloc(16*width*height*sizeof(uint8_t),16);
+    ws.I2_desc = (uint8_t*)_mm_malloc(16*width*height*sizeof(uint8_t),16);
+    memset (ws.I1_desc,0,16*width*height*sizeof(uint8_t));
+    memset (ws.I2_desc,0,16*width*height*sizeof(uint8_t));
+    ws.I_du  = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+    ws.I_dv  = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+    ws.I_tmp = (int16_t*)_mm_malloc(2*bpl*height*sizeof(int16_t),16);
+
+    // disparity grids and their temporary diffusion grids
+    // (borders of grid_temp2 are never written by createGrid and stay zero)
+    int32_t grid_num = ws.grid_width*ws.grid_height;
+    ws.disparity_grid_1 = (int32_t*)calloc((param.disp_max+2)*grid_num,sizeof(int32_t));
+    ws.disparity_grid_2 = (int32_t*)calloc((param.disp_max+2)*grid_num,sizeof(int32_t));
+    for (int32_t i=0; i<2; i++) {
+        ws.grid_temp1[i] = (int32_t*)calloc((param.disp_max+1)*grid_num,sizeof(int32_t));
+        ws.grid_temp2[i] = (int32_t*)calloc((param.disp_max+1)*grid_num,sizeof(int32_t));
+    }
+}
+
+void Elas::releaseWorkspace () {
+    _mm_free(ws.I1);
+    _mm_free(ws.I2);
+    _mm_free(ws.I1_desc);
+    _mm_free(ws.I2_desc);
+    _mm_free(ws.I_du);
+    _mm_free(ws.I_dv);
+    _mm_free(ws.I_tmp);
+    free(ws.disparity_grid_1);
+    free(ws.disparity_grid_2);
+    for (int32_t i=0; i<2; i++) {
+        free(ws.grid_temp1[i]);
+        free(ws.grid_temp2[i]);
+    }
+    I1 = I2 = 0;
+    ws = workspace();
+}
+
+// must be called from within a parallel region; the candidates are invalidated
+// in the order of the serial in-place version (column by column)
 void Elas::removeInconsistentSupportPoints (int16_t* D_can,int32_t D_can_width,int32_t D_can_height) {
 
-    // for all valid support points do
-#pragma omp for
+    int32_t* support = &ws.incon_support[0];
+
+    // 1. count in parallel the supporting points of all valid candidates
+    // (the support of a candidate can only decrease during step 2)
+#pragma omp for schedule(dynamic)
     for (int32_t u_can=0; u_can<D_can_width; u_can++) {
         for (int32_t v_can=0; v_can<D_can_height; v_can++) {
             int16_t d_can = *(D_can+getAddressOffsetImage(u_can,v_can,D_can_width));
+            int32_t count = 0;
             if (d_can>=0) {
-
-                // compute number of other points supporting the current point
-                int32_t support = 0;
                 for (int32_t u_can_2=u_can-param.incon_window_size; u_can_2<=u_can+param.incon_window_size; u_can_2++) {
                     for (int32_t v_can_2=v_can-param.incon_window_size; v_can_2<=v_can+param.incon_window_size; v_can_2++) {
                         if (u_can_2>=0 && v_can_2>=0 && u_can_2<D_can_width && v_can_2<D_can_height) {
                             int16_t d_can_2 = *(D_can+getAddressOffsetImage(u_can_2,v_can_2,D_can_width));
                             if (d_can_2>=0 && abs(d_can-d_can_2)<=param.incon_threshold)
-                                support++;
+                                count++;
                         }
                     }
                 }
+            }
+            *(support+getAddressOffsetImage(u_can,v_can,D_can_width)) = count;
+        }
+    }
 
-                // invalidate support point if number of supporting points is too low
-                if (support<param.incon_min_support)
+    // 2. invalidate candidates in the serial order; when a candidate is removed
+    // the support of the ones still to be visited in its window is decreased
+#pragma omp single
+    {
+        for (int32_t u_can=0; u_can<D_can_width; u_can++) {
+            for (int32_t v_can=0; v_can<D_can_height; v_can++) {
+                int16_t d_can = *(D_can+getAddressOffsetImage(u_can,v_can,D_can_width));
+                if (d_can>=0 && *(support+getAddressOffsetImage(u_can,v_can,D_can_width))<param.incon_min_support) {
                     *(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = -1;
+                    for (int32_t u_can_2=u_can; u_can_2<=u_can+param.incon_window_size; u_can_2++) {
+                        for (int32_t v_can_2=v_can-param.incon_window_size; v_can_2<=v_can+param.incon_window_size; v_can_2++) {
+                            if (u_can_2==u_can && v_can_2<=v_can)
+                                continue;
+                            if (u_can_2<D_can_width && v_can_2>=0 && v_can_2<D_can_height) {
+                                int16_t d_can_2 = *(D_can+getAddressOffsetImage(u_can_2,v_can_2,D_can_width));
+                                if (d_can_2>=0 && abs(d_can-d_can_2)<=param.incon_threshold)
+                                    (*(support+getAddressOffsetImage(u_can_2,v_can_2,D_can_width)))--;
+                            }
+                        }
+                    }
+                }
             }
         }
     }
@@ -214,10 +515,18 @@ void Elas::removeRedundantSupportPoints(int16_t* D_can,int32_t D_can_width,int32
         redun_dir_u[1] = +1;
     }
 
+    // redundancy only depends on the candidates of the same column (vertical)
+    // or row (horizontal): lines are independent and processed in parallel,
+    // each one in the serial order
+    int32_t num_lines = vertical ? D_can_width  : D_can_height;
+    int32_t line_len  = vertical ? D_can_height : D_can_width;
+
     // for all valid support points do
-#pragma omp for
-    for (int32_t u_can=0; u_can<D_can_width; u_can++) {
-        for (int32_t v_can=0; v_can<D_can_height; v_can++) {
+#pragma omp for schedule(dynamic)
+    for (int32_t l=0; l<num_lines; l++) {
+        for (int32_t k=0; k<line_len; k++) {
+            int32_t u_can = vertical ? l : k;
+            int32_t v_can = vertical ? k : l;
             int16_t d_can = *(D_can+getAddressOffsetImage(u_can,v_can,D_can_width));
             if (d_can>=0) {
 
@@ -289,7 +598,8 @@ void Elas::addCornerSupportPoints(vector<support_pt> &p_support) {
         p_support.push_back(p_border[i]);
 }
 
-inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v,uint8_t* I1_desc,uint8_t* I2_desc,const bool &right_image) {
+inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v,uint8_t* I1_desc,uint8_t* I2_desc,const bool &right_image,
+                                               const int32_t &d_lo,const int32_t &d_hi) {
 
     const int32_t u_step      = 2;
     const int32_t v_step      = 2;
@@ -300,7 +610,7 @@ inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v
     int32_t desc_offset_3 = -16*u_step+16*width*v_step;
     int32_t desc_offset_4 = +16*u_step+16*width*v_step;
 
-    __m128i xmm1,xmm2,xmm3,xmm4,xmm5,xmm6;
+    const int32_t desc_offsets[4] = {desc_offset_1,desc_offset_2,desc_offset_3,desc_offset_4};
 
     // check if we are inside the image region
     if (u>=window_size+u_step && u<=width-window_size-1-u_step && v>=window_size+v_step && v<=height-window_size-1-v_step) {
@@ -327,13 +637,8 @@ inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v
         if (sum<param.support_texture)
             return -1;
 
-        // load first blocks to xmm registers
-        xmm1 = _mm_load_si128((__m128i*)(I1_block_addr+desc_offset_1));
-        xmm2 = _mm_load_si128((__m128i*)(I1_block_addr+desc_offset_2));
-        xmm3 = _mm_load_si128((__m128i*)(I1_block_addr+desc_offset_3));
-        xmm4 = _mm_load_si128((__m128i*)(I1_block_addr+desc_offset_4));
-
-        // declare match energy for each disparity
+        // match energies of a chunk of disparities
+        int32_t E[kernels::max_chunk];
         int32_t u_warp;
 
         // best match
@@ -352,37 +657,45 @@ inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v
         if (disp_max_valid-disp_min_valid<10)
             return -1;
 
-        // for all disparities do
-        for (int16_t d=disp_min_valid; d<=disp_max_valid; d++) {
+        // restrict the search to the requested range
+        int32_t d_first = max(disp_min_valid,d_lo);
+        int32_t d_last  = min(disp_max_valid,d_hi);
+        if (d_first>d_last)
+            return -1;
+
+        // for all disparities do (in chunks)
+        for (int32_t d0=d_first; d0<=d_last; d0+=kernels::max_chunk) {
 
-            // warp u coordinate
-            if (!right_image) u_warp = u-d;
-            else              u_warp = u+d;
+            // warp u coordinate of the first disparity of the chunk
+            if (!right_image) u_warp = u-d0;
+            else              u_warp = u+d0;
 
-            // compute I2 block start addresses
+            // compute I2 block start address
             I2_block_addr = I2_line_addr+16*u_warp;
 
-            // compute match energy at this disparity
-            xmm6 = _mm_load_si128((__m128i*)(I2_block_addr+desc_offset_1));
-            xmm6 = _mm_sad_epu8(xmm1,xmm6);
-            xmm5 = _mm_load_si128((__m128i*)(I2_block_addr+desc_offset_2));
-            xmm6 = _mm_add_epi16(_mm_sad_epu8(xmm2,xmm5),xmm6);
-            xmm5 = _mm_load_si128((__m128i*)(I2_block_addr+desc_offset_3));
-            xmm6 = _mm_add_epi16(_mm_sad_epu8(xmm3,xmm5),xmm6);
-            xmm5 = _mm_load_si128((__m128i*)(I2_block_addr+desc_offset_4));
-            xmm6 = _mm_add_epi16(_mm_sad_epu8(xmm4,xmm5),xmm6);
-            sum  = _mm_extract_epi16(xmm6,0)+_mm_extract_epi16(xmm6,4);
-
-            // best + second best match
-            if (sum<min_1_E) {
-                min_1_E = sum;
-                min_1_d = d;
-            } else if (sum<min_2_E) {
-                min_2_E = sum;
-                min_2_d = d;
+            // compute match energies of this chunk
+            int32_t n = min(kernels::max_chunk,d_last-d0+1);
+            kern->sadSupport(I1_block_addr,I2_block_addr,right_image?16:-16,desc_offsets,n,E);
+
+            for (int32_t i=0; i<n; i++) {
+                int16_t d = d0+i;
+                sum = E[i];
+
+                // best + second best match
+                if (sum<min_1_E) {
+                    min_1_E = sum;
+                    min_1_d = d;
+                } else if (sum<min_2_E) {
+                    min_2_E = sum;
+                    min_2_d = d;
+                }
             }
         }
 
+        // a minimum on the border of a restricted range may not be the true one
+        if ((min_1_d==d_first && d_first>disp_min_valid) || (min_1_d==d_last && d_last<disp_max_valid))
+            return -1;
+
         // check if best and second best match are available and if matching ratio is sufficient
         if (min_1_d>=0 && min_2_d>=0 && (float)min_1_E<param.support_threshold*(float)min_2_E)
             return min_1_d;
@@ -393,6 +706,33 @@ inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v
         return -1;
 }
 
+inline int16_t Elas::computeSupportCandidate (const int32_t &u,const int32_t &v,uint8_t* I1_desc,uint8_t* I2_desc,const int16_t &d_prior) {
+
+    // full range, or a narrow one around the previous disparity
+    int32_t d_lo = 0;
+    int32_t d_hi = param.disp_max;
+    if (d_prior>=0) {
+        d_lo = d_prior-param.prior_radius;
+        d_hi = d_prior+param.prior_radius;
+    }
+
+    // find forwards
+    int16_t d = computeMatchingDisparity(u,v,I1_desc,I2_desc,false,d_lo,d_hi);
+    if (d<0)
+        return -1;
+
+    // find backwards
+    if (d_prior>=0) {
+        d_lo = d-param.prior_radius;
+        d_hi = d+param.prior_radius;
+    }
+    int16_t d2 = computeMatchingDisparity(u-d,v,I1_desc,I2_desc,true,d_lo,d_hi);
+    if (d2>=0 && abs(d-d2)<=param.lr_threshold)
+        return d;
+    else
+        return -1;
+}
+
 vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t* I2_desc) {
 
     // be sure that at half resolution we only need data
@@ -407,35 +747,58 @@ vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t*
     for (int32_t u=0; u<width;  u+=D_candidate_stepsize) D_can_width++;
     for (int32_t v=0; v<height; v+=D_candidate_stepsize) D_can_height++;
     int16_t* D_can = (int16_t*)calloc(D_can_width*D_can_height,sizeof(int16_t));
+    ws.incon_support.resize(D_can_width*D_can_height);
+
+    // temporal prior: until the next full search the candidates of the
+    // previous frame are searched again around their disparity, the others
+    // over the full range on a 2x2 subgrid rotating from frame to frame
+    // (e.g. surfaces entering the view)
+    bool use_prior = param.temporal_prior && prior.frames>0 && prior.frames<param.prior_refresh &&
+                     prior.width==D_can_width && prior.height==D_can_height && prior.step==D_candidate_stepsize;
+    int16_t* D_prior = use_prior ? &prior.D_can[0] : 0;
+    int32_t phase      = prior.frames%4;
+    int32_t prior_hits = 0;
+    bool full_search = !use_prior;
 
     // loop variables
     int32_t u,v;
-    int16_t d,d2;
     int32_t u_can, v_can;
-    int32_t lr_threshold = param.lr_threshold;
     vector<support_pt> p_support;
-    vector<support_pt> partial_p_support[2];
-    // for all point candidates in image 1 do
-#pragma omp parallel default(none) num_threads(2) private(u_can, v_can, u, d, v, d2) shared(partial_p_support,lr_threshold, D_can, D_can_width, D_can_height, D_candidate_stepsize, I1_desc, I2_desc)
+
+    // for all point candidates in image 1 do (in row bands)
+#pragma omp parallel num_threads(getNumThreads(param.num_threads)) private(u_can, v_can, u, v)
     {
-        int tid = omp_get_thread_num();
-#pragma omp for
-        for (v_can=1; v_can<D_can_height; v_can++) {
-            v = v_can*D_candidate_stepsize;
-            for (u_can=1; u_can<D_can_width; u_can++) {
-                u = u_can*D_candidate_stepsize;
-
-                // initialize disparity candidate to invalid
-                *(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = -1;
-
-                // find forwards
-                d = computeMatchingDisparity(u,v,I1_desc,I2_desc,false);
-                if (d>=0) {
-
-                    // find backwards
-                    d2 = computeMatchingDisparity(u-d,v,I1_desc,I2_desc,true);
-                    if (d2>=0 && abs(d-d2)<=lr_threshold)
-                        *(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = d;
+        if (use_prior) {
+#pragma omp for schedule(dynamic) reduction(+:prior_hits)
+            for (v_can=1; v_can<D_can_height; v_can++) {
+                v = v_can*D_candidate_stepsize;
+                for (u_can=1; u_can<D_can_width; u_can++) {
+                    u = u_can*D_candidate_stepsize;
+                    int16_t d_prior = *(D_prior+getAddressOffsetImage(u_can,v_can,D_can_width));
+                    int16_t d = -1;
+                    if (d_prior>=0) {
+                        d = computeSupportCandidate(u,v,I1_desc,I2_desc,d_prior);
+                        if (d>=0)
+                            prior_hits++;
+                    } else if ((u_can&1)==(phase&1) && (v_can&1)==(phase>>1))
+                        d = computeSupportCandidate(u,v,I1_desc,I2_desc,-1);
+                    *(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = d;
+                }
+            }
+
+            // large motion: too few of the support points of the last full search
+            // confirmed, search them all
+#pragma omp single
+            full_search = prior.full_num==0 || prior_hits<param.prior_min_ratio*prior.full_num;
+        }
+
+        if (full_search) {
+#pragma omp for schedule(dynamic)
+            for (v_can=1; v_can<D_can_height; v_can++) {
+                v = v_can*D_candidate_stepsize;
+                for (u_can=1; u_can<D_can_width; u_can++) {
+                    u = u_can*D_candidate_stepsize;
+                    *(D_can+getAddressOffsetImage(u_can,v_can,D_can_width)) = computeSupportCandidate(u,v,I1_desc,I2_desc,-1);
                 }
             }
         }
@@ -446,6 +809,21 @@ vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t*
         //timer.start("removeInconsistentSupportPoints");
         removeInconsistentSupportPoints(D_can,D_can_width,D_can_height);
 
+        // the consistent candidates seed the next frame
+        if (param.temporal_prior) {
+#pragma omp single
+            {
+                prior.D_can.assign(D_can,D_can+D_can_width*D_can_height);
+                if (full_search) {
+                    prior.full_num = 0;
+                    for (v_can=1; v_can<D_can_height; v_can++)
+                        for (u_can=1; u_can<D_can_width; u_can++)
+                            if (*(D_can+getAddressOffsetImage(u_can,v_can,D_can_width))>=0)
+                                prior.full_num++;
+                }
+            }
+        }
+
         // remove support points on straight lines, since they are redundant
         // this reduces the number of triangles a little bit and hence speeds up
         // the triangulation process
@@ -453,22 +831,23 @@ vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t*
         removeRedundantSupportPoints(D_can,D_can_width,D_can_height,5,1,true);
         removeRedundantSupportPoints(D_can,D_can_width,D_can_height,5,1,false);
 
-        //}
-        // move support points from image representation into a vector representation
-        //timer.start("segundo for");
-
-
+    }
 
-#pragma omp for
-        for (int32_t v_can=1; v_can<D_can_height; v_can++)
-            for (int32_t u_can=1; u_can<D_can_width; u_can++)
-                if (*(D_can+getAddressOffsetImage(u_can,v_can,D_can_width))>=0)
-                    partial_p_support[tid].push_back(support_pt(u_can*D_candidate_stepsize,
-                            v_can*D_candidate_stepsize,
-                            *(D_can+getAddressOffsetImage(u_can,v_can,D_can_width))));
+    if (param.temporal_prior) {
+        prior.width  = D_can_width;
+        prior.height = D_can_height;
+        prior.step   = D_candidate_stepsize;
+        prior.frames = full_search ? 1 : prior.frames+1;
     }
-    p_support = partial_p_support[0];
-    p_support.insert(p_support.end(),partial_p_support[1].begin(),partial_p_support[1].end());
+    prior_used = !full_search;
+
+    // move support points from image representation into a vector representation
+    for (int32_t v_can=1; v_can<D_can_height; v_can++)
+        for (int32_t u_can=1; u_can<D_can_width; u_can++)
+            if (*(D_can+getAddressOffsetImage(u_can,v_can,D_can_width))>=0)
+                p_support.push_back(support_pt(u_can*D_candidate_stepsize,
+                        v_can*D_candidate_stepsize,
+                        *(D_can+getAddressOffsetImage(u_can,v_can,D_can_width))));
 
     // if flag is set, add support points in image corners
     // with the same disparity as the nearest neighbor support point
@@ -483,7 +862,7 @@ vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t*
     return p_support;
 }
 
-vector<Elas::triangle> Elas::computeDelaunayTriangulation (vector<support_pt> p_support,int32_t right_image) {
+vector<Elas::triangle> Elas::computeDelaunayTriangulation (const vector<support_pt> &p_support,int32_t right_image) {
 
     // input/output structure for triangulation
     struct triangulateio in, out;
@@ -545,14 +924,17 @@ vector<Elas::triangle> Elas::computeDelaunayTriangulation (vector<support_pt> p_
     return tri;
 }
 
-void Elas::computeDisparityPlanes (vector<support_pt> p_support,vector<triangle> &tri,int32_t right_image) {
+void Elas::computeDisparityPlanes (const vector<support_pt> &p_support,vector<triangle> &tri,int32_t right_image,
+                                    const vector<int32_t>* subset) {
 
     // init matrices
     Matrix A(3,3);
     Matrix b(3,1);
 
-    // for all triangles do
-    for (int32_t i=0; i<tri.size(); i++) {
+    // for all triangles (or the given subset) do
+    int32_t num = subset ? subset->size() : tri.size();
+    for (int32_t k=0; k<num; k++) {
+        int32_t i = subset ? (*subset)[k] : k;
 
         // get triangle corner indices
         int32_t c1 = tri[i].c1;
@@ -617,15 +999,65 @@ void Elas::computeDisparityPlanes (vector<support_pt> p_support,vector<triangle>
     }
 }
 
-void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32_t* grid_dims,bool right_image) {
+void Elas::updateDelaunayTriangulation (const vector<support_pt> &p_support,int32_t right_image,vector<triangle> &tri) {
+
+    triangulation &T = delaunay[right_image ? 1 : 0];
+
+    // support points are identified across frames by their position in the left image
+    int32_t n = p_support.size();
+    T.key.resize(n);
+    T.x.resize(n);
+    T.y.resize(n);
+    for (int32_t i=0; i<n; i++) {
+        T.key[i] = (p_support[i].v<<16)+p_support[i].u;
+        T.x[i]   = right_image ? p_support[i].u-p_support[i].d : p_support[i].u;
+        T.y[i]   = p_support[i].v;
+    }
+
+    // rebuild when more than a quarter of the support points changed
+    T.dt.update(T.key,T.x,T.y,0.25f);
+    if (T.planes.size()<T.dt.numSlots())
+        T.planes.resize(T.dt.numSlots());
+
+    // planes of the triangles that kept their corners and disparities are reused
+    tri.clear();
+    T.todo.clear();
+    for (int32_t i=0; i<T.dt.numTriangles(); i++) {
+        const int32_t* c = T.dt.corners(i);
+        triangle t(c[0],c[1],c[2]);
+        const plane_cache &p = T.planes[T.dt.slot(i)];
+        if (p.stamp==T.dt.stamp(i) && p.d[0]==p_support[c[0]].d &&
+            p.d[1]==p_support[c[1]].d && p.d[2]==p_support[c[2]].d) {
+            t.t1a = p.t1a; t.t1b = p.t1b; t.t1c = p.t1c;
+            t.t2a = p.t2a; t.t2b = p.t2b; t.t2c = p.t2c;
+        } else
+            T.todo.push_back(i);
+        tri.push_back(t);
+    }
+
+    computeDisparityPlanes(p_support,tri,right_image,&T.todo);
+    for (int32_t k=0; k<T.todo.size(); k++) {
+        int32_t i = T.todo[k];
+        plane_cache &p = T.planes[T.dt.slot(i)];
+        p.stamp = T.dt.stamp(i);
+        p.d[0] = p_support[tri[i].c1].d;
+        p.d[1] = p_support[tri[i].c2].d;
+        p.d[2] = p_support[tri[i].c3].d;
+        p.t1a = tri[i].t1a; p.t1b = tri[i].t1b; p.t1c = tri[i].t1c;
+        p.t2a = tri[i].t2a; p.t2b = tri[i].t2b; p.t2c = tri[i].t2c;
+    }
+}
+
+void Elas::createGrid(const vector<support_pt> &p_support,int32_t* disparity_grid,int32_t* grid_dims,bool right_image) {
 
     // get grid dimensions
     int32_t grid_width  = grid_dims[1];
     int32_t grid_height = grid_dims[2];
 
     // allocate temporary memory
-    int32_t* temp1 = (int32_t*)calloc((param.disp_max+1)*grid_height*grid_width,sizeof(int32_t));
-    int32_t* temp2 = (int32_t*)calloc((param.disp_max+1)*grid_height*grid_width,sizeof(int32_t));
+    int32_t* temp1 = ws.grid_temp1[right_image ? 1 : 0];
+    int32_t* temp2 = ws.grid_temp2[right_image ? 1 : 0];
+    memset(temp1,0,(param.disp_max+1)*grid_height*grid_width*sizeof(int32_t));
 
     // for all support points do
     for (int32_t i=0; i<p_support.size(); i++) {
@@ -694,36 +1126,12 @@ void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32
         }
     }
 
-    // release temporary memory
-    free(temp1);
-    free(temp2);
-}
-
-inline void Elas::updatePosteriorMinimum(__m128i* I2_block_addr,const int32_t &d,const int32_t &w,
-        const __m128i &xmm1,__m128i &xmm2,int32_t &val,int32_t &min_val,int32_t &min_d) {
-    xmm2 = _mm_load_si128(I2_block_addr);
-    xmm2 = _mm_sad_epu8(xmm1,xmm2);
-    val  = _mm_extract_epi16(xmm2,0)+_mm_extract_epi16(xmm2,4)+w;
-    if (val<min_val) {
-        min_val = val;
-        min_d   = d;
-    }
-}
-
-inline void Elas::updatePosteriorMinimum(__m128i* I2_block_addr,const int32_t &d,
-        const __m128i &xmm1,__m128i &xmm2,int32_t &val,int32_t &min_val,int32_t &min_d) {
-    xmm2 = _mm_load_si128(I2_block_addr);
-    xmm2 = _mm_sad_epu8(xmm1,xmm2);
-    val  = _mm_extract_epi16(xmm2,0)+_mm_extract_epi16(xmm2,4);
-    if (val<min_val) {
-        min_val = val;
-        min_d   = d;
-    }
 }
 
 inline void Elas::findMatch(int32_t &u,int32_t &v,float &plane_a,float &plane_b,float &plane_c,
         int32_t* disparity_grid,int32_t *grid_dims,uint8_t* I1_desc,uint8_t* I2_desc,
-        int32_t *P,int32_t &plane_radius,bool &valid,bool &right_image,float* D){
+        int32_t *P,int32_t &plane_radius,bool &valid,bool &right_image,float* D,
+        const float* D_prev){
 
     // get image width and height
     const int32_t disp_num    = grid_dims[0]-1;
@@ -771,48 +1179,85 @@ inline void Elas::findMatch(int32_t &u,int32_t &v,float &plane_a,float &plane_b,
     int32_t  num_grid  = *(disparity_grid+grid_addr);
     int32_t* d_grid    = disparity_grid+grid_addr+1;
 
+    // temporal prior: band around the disparity of the previous frame, if
+    // it agrees with the plane prior (else the surface has moved)
+    int32_t d_band_min = 0;
+    int32_t d_band_max = disp_num-1;
+    bool    banded     = false;
+    if (D_prev!=0 && *(D_prev+d_addr)>=0) {
+        int32_t d_prev = (int32_t)(*(D_prev+d_addr)+0.5f);
+        if (d_prev+param.prior_radius>=d_plane_min && d_prev-param.prior_radius<=d_plane_max) {
+            d_band_min = max(d_prev-param.prior_radius,0);
+            d_band_max = min(d_prev+param.prior_radius,disp_num-1);
+            banded     = true;
+        }
+    }
+
     // loop variables
     int32_t d_curr, u_warp, val;
     int32_t min_val = 10000;
     int32_t min_d   = -1;
-    __m128i xmm1    = _mm_load_si128((__m128i*)I1_block_addr);
-    __m128i xmm2;
 
-    // left image
-    if (!right_image) {
-        for (int32_t i=0; i<num_grid; i++) {
+    // match energies of a chunk of disparities
+    int32_t        E[kernels::max_chunk];
+    int32_t        d_chunk[kernels::max_chunk];
+    const uint8_t* I2_blocks[kernels::max_chunk];
+
+    // warp direction: u-d for the left image, u+d for the right image
+    const int32_t dir = right_image ? +1 : -1;
+
+    // grid disparities outside of the plane prior range
+    for (int32_t i=0; i<num_grid; ) {
+        int32_t n = 0;
+        for (; i<num_grid && n<kernels::max_chunk; i++) {
             d_curr = d_grid[i];
-            if (d_curr<d_plane_min || d_curr>d_plane_max) {
-                u_warp = u-d_curr;
-                if (u_warp<window_size || u_warp>=width-window_size)
-                    continue;
-                updatePosteriorMinimum((__m128i*)(I2_line_addr+16*u_warp),d_curr,xmm1,xmm2,val,min_val,min_d);
-            }
-        }
-        for (d_curr=d_plane_min; d_curr<=d_plane_max; d_curr++) {
-            u_warp = u-d_curr;
+            if ((d_curr>=d_plane_min && d_curr<=d_plane_max) || d_curr<d_band_min || d_curr>d_band_max)
+                continue;
+            u_warp = u+dir*d_curr;
             if (u_warp<window_size || u_warp>=width-window_size)
                 continue;
-            updatePosteriorMinimum((__m128i*)(I2_line_addr+16*u_warp),d_curr,valid?*(P+abs(d_curr-d_plane)):0,xmm1,xmm2,val,min_val,min_d);
+            d_chunk[n]   = d_curr;
+            I2_blocks[n] = I2_line_addr+16*u_warp;
+            n++;
+        }
+        kern->sadGather(I1_block_addr,I2_blocks,n,E);
+        for (int32_t k=0; k<n; k++) {
+            if (E[k]<min_val) {
+                min_val = E[k];
+                min_d   = d_chunk[k];
+            }
         }
+    }
 
-        // right image
+    // plane prior range, restricted to warps inside the image
+    int32_t d_range_min,d_range_max;
+    if (!right_image) {
+        d_range_min = max(d_plane_min,u-width+window_size+1);
+        d_range_max = min(d_plane_max,u-window_size);
     } else {
-        for (int32_t i=0; i<num_grid; i++) {
-            d_curr = d_grid[i];
-            if (d_curr<d_plane_min || d_curr>d_plane_max) {
-                u_warp = u+d_curr;
-                if (u_warp<window_size || u_warp>=width-window_size)
-                    continue;
-                updatePosteriorMinimum((__m128i*)(I2_line_addr+16*u_warp),d_curr,xmm1,xmm2,val,min_val,min_d);
+        d_range_min = max(d_plane_min,window_size-u);
+        d_range_max = min(d_plane_max,width-window_size-1-u);
+    }
+    d_range_min = max(d_range_min,d_band_min);
+    d_range_max = min(d_range_max,d_band_max);
+    for (int32_t d0=d_range_min; d0<=d_range_max; d0+=kernels::max_chunk) {
+        int32_t n = min(kernels::max_chunk,d_range_max-d0+1);
+        kern->sadStrided(I1_block_addr,I2_line_addr+16*(u+dir*d0),16*dir,n,E);
+        for (int32_t k=0; k<n; k++) {
+            d_curr = d0+k;
+            val    = E[k]+(valid?*(P+abs(d_curr-d_plane)):0);
+            if (val<min_val) {
+                min_val = val;
+                min_d   = d_curr;
             }
         }
-        for (d_curr=d_plane_min; d_curr<=d_plane_max; d_curr++) {
-            u_warp = u+d_curr;
-            if (u_warp<window_size || u_warp>=width-window_size)
-                continue;
-            updatePosteriorMinimum((__m128i*)(I2_line_addr+16*u_warp),d_curr,valid?*(P+abs(d_curr-d_plane)):0,xmm1,xmm2,val,min_val,min_d);
-        }
+    }
+
+    // nothing in the band (e.g. occlusion or large motion): search without it
+    if (min_d<0 && banded) {
+        findMatch(u,v,plane_a,plane_b,plane_c,disparity_grid,grid_dims,I1_desc,I2_desc,
+                  P,plane_radius,valid,right_image,D,0);
+        return;
     }
 
     // set disparity value
@@ -821,7 +1266,7 @@ inline void Elas::findMatch(int32_t &u,int32_t &v,float &plane_a,float &plane_b,
 }
 
 // TODO: %2 => more elegantly
-void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,int32_t* disparity_grid,int32_t *grid_dims,
+void Elas::computeDisparity(const vector<support_pt> &p_support,const vector<triangle> &tri,int32_t* disparity_grid,int32_t *grid_dims,
         uint8_t* I1_desc,uint8_t* I2_desc,bool right_image,float* D) {
 
     // number of disparities
@@ -831,14 +1276,19 @@ void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,in
     // descriptor window_size
     int32_t window_size = 2;
 
+    // number of threads
+    int32_t num_threads = getNumThreads(param.num_threads);
+
     // init disparity image to -10
-    if (param.subsampling) {
-        for (int32_t i=0; i<(width/2)*(height/2); i++)
-            *(D+i) = -10;
-    } else {
-        for (int32_t i=0; i<width*height; i++)
-            *(D+i) = -10;
-    }
+    int32_t D_size = param.subsampling ? (width/2)*(height/2) : width*height;
+#pragma omp parallel for num_threads(num_threads)
+    for (int32_t i=0; i<D_size; i++)
+        *(D+i) = -10;
+
+    // disparity map of the previous frame if the support points were seeded by it
+    const float* D_prev = 0;
+    if (prior_used && prior.D[right_image].size()==(size_t)D_size)
+        D_prev = &prior.D[right_image][0];
 
     // pre-compute prior
     float two_sigma_squared = 2*param.sigma*param.sigma;
@@ -847,107 +1297,126 @@ void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,in
         P[delta_d] = (int32_t)((-log(param.gamma+exp(-delta_d*delta_d/two_sigma_squared))+log(param.gamma))/param.beta);
     int32_t plane_radius = (int32_t)max((float)ceil(param.sigma*param.sradius),(float)2.0);
 
-    // loop variables
-    int32_t c1, c2, c3;
-    float plane_a,plane_b,plane_c,plane_d;
-    uint32_t i;
-
-    // for all triangles do
-#pragma omp parallel for num_threads(3) default(none)\
-        private(i, plane_a, plane_b, plane_c, plane_d, c1, c2, c3)\
-        shared(P, plane_radius, two_sigma_squared, disp_num, window_size, p_support, tri, disparity_grid, grid_dims, I1_desc, I2_desc, right_image, D)
-    for (i=0; i<tri.size(); i++) {
-
-        //printf("Matching thread %d\n", omp_get_thread_num());
-        // get plane parameters
-        uint32_t p_i = i*3;
-        if (!right_image) {
-            plane_a = tri[i].t1a;
-            plane_b = tri[i].t1b;
-            plane_c = tri[i].t1c;
-            plane_d = tri[i].t2a;
-        } else {
-            plane_a = tri[i].t2a;
-            plane_b = tri[i].t2b;
-            plane_c = tri[i].t2c;
-            plane_d = tri[i].t1a;
-        }
+    // split the image into row bands (a few per thread for load balancing)
+    // and assign to each band the triangles overlapping it, in their
+    // original order: every pixel is then written by one thread only, by
+    // the triangles in the serial order, whatever the number of threads
+    int32_t band_height = max((height+4*num_threads-1)/(4*num_threads),1);
+    int32_t num_bands   = (height+band_height-1)/band_height;
+    vector< vector<uint32_t> > band_tri(num_bands);
+    for (uint32_t i=0; i<tri.size(); i++) {
+        int32_t v_min = min(p_support[tri[i].c1].v,min(p_support[tri[i].c2].v,p_support[tri[i].c3].v));
+        int32_t v_max = max(p_support[tri[i].c1].v,max(p_support[tri[i].c2].v,p_support[tri[i].c3].v));
+        int32_t b_min = max((v_min-1)/band_height,0);
+        int32_t b_max = min((v_max+1)/band_height,num_bands-1);
+        for (int32_t b=b_min; b<=b_max; b++)
+            band_tri[b].push_back(i);
+    }
 
-        // triangle corners
-        c1 = tri[i].c1;
-        c2 = tri[i].c2;
-        c3 = tri[i].c3;
+    // for all bands do
+#pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+    for (int32_t b=0; b<num_bands; b++) {
 
-        // sort triangle corners wrt. u (ascending)
-        float tri_u[3];
-        if (!right_image) {
-            tri_u[0] = p_support[c1].u;
-            tri_u[1] = p_support[c2].u;
-            tri_u[2] = p_support[c3].u;
-        } else {
-            tri_u[0] = p_support[c1].u-p_support[c1].d;
-            tri_u[1] = p_support[c2].u-p_support[c2].d;
-            tri_u[2] = p_support[c3].u-p_support[c3].d;
-        }
-        float tri_v[3] = {p_support[c1].v,p_support[c2].v,p_support[c3].v};
+        // rows of this band
+        int32_t band_v_min = b*band_height;
+        int32_t band_v_max = min((b+1)*band_height,height);
+
+        // loop variables
+        int32_t c1, c2, c3;
+        float plane_a,plane_b,plane_c,plane_d;
+
+        // for all triangles of this band do
+        for (uint32_t t=0; t<band_tri[b].size(); t++) {
+            uint32_t i = band_tri[b][t];
+
+            // get plane parameters
+            if (!right_image) {
+                plane_a = tri[i].t1a;
+                plane_b = tri[i].t1b;
+                plane_c = tri[i].t1c;
+                plane_d = tri[i].t2a;
+            } else {
+                plane_a = tri[i].t2a;
+                plane_b = tri[i].t2b;
+                plane_c = tri[i].t2c;
+                plane_d = tri[i].t1a;
+            }
+
+            // triangle corners
+            c1 = tri[i].c1;
+            c2 = tri[i].c2;
+            c3 = tri[i].c3;
+
+            // sort triangle corners wrt. u (ascending)
+            float tri_u[3];
+            if (!right_image) {
+                tri_u[0] = p_support[c1].u;
+                tri_u[1] = p_support[c2].u;
+                tri_u[2] = p_support[c3].u;
+            } else {
+                tri_u[0] = p_support[c1].u-p_support[c1].d;
+                tri_u[1] = p_support[c2].u-p_support[c2].d;
+                tri_u[2] = p_support[c3].u-p_support[c3].d;
+            }
+            float tri_v[3] = {(float)p_support[c1].v,(float)p_support[c2].v,(float)p_support[c3].v};
 
-        for (uint32_t j=0; j<3; j++) {
-            for (uint32_t k=0; k<j; k++) {
-                if (tri_u[k]>tri_u[j]) {
-                    float tri_u_temp = tri_u[j]; tri_u[j] = tri_u[k]; tri_u[k] = tri_u_temp;
-                    float tri_v_temp = tri_v[j]; tri_v[j] = tri_v[k]; tri_v[k] = tri_v_temp;
+            for (uint32_t j=0; j<3; j++) {
+                for (uint32_t k=0; k<j; k++) {
+                    if (tri_u[k]>tri_u[j]) {
+                        float tri_u_temp = tri_u[j]; tri_u[j] = tri_u[k]; tri_u[k] = tri_u_temp;
+                        float tri_v_temp = tri_v[j]; tri_v[j] = tri_v[k]; tri_v[k] = tri_v_temp;
+                    }
                 }
             }
-        }
 
-        // rename corners
-        float A_u = tri_u[0]; float A_v = tri_v[0];
-        float B_u = tri_u[1]; float B_v = tri_v[1];
-        float C_u = tri_u[2]; float C_v = tri_v[2];
-
-        // compute straight lines connecting triangle corners
-        float AB_a = 0; float AC_a = 0; float BC_a = 0;
-        if ((int32_t)(A_u)!=(int32_t)(B_u)) AB_a = (A_v-B_v)/(A_u-B_u);
-        if ((int32_t)(A_u)!=(int32_t)(C_u)) AC_a = (A_v-C_v)/(A_u-C_u);
-        if ((int32_t)(B_u)!=(int32_t)(C_u)) BC_a = (B_v-C_v)/(B_u-C_u);
-        float AB_b = A_v-AB_a*A_u;
-        float AC_b = A_v-AC_a*A_u;
-        float BC_b = B_v-BC_a*B_u;
-
-        // a plane is only valid if itself and its projection
-        // into the other image is not too much slanted
-        bool valid = fabs(plane_a)<0.7 && fabs(plane_d)<0.7;
-
-        // first part (triangle corner A->B)
-        if ((int32_t)(A_u)!=(int32_t)(B_u)) {
-            for (int32_t u=max((int32_t)A_u,0); u<min((int32_t)B_u,width); u++){
-                if (!param.subsampling || u%2==0) {
-                    int32_t v_1 = (uint32_t)(AC_a*(float)u+AC_b);
-                    int32_t v_2 = (uint32_t)(AB_a*(float)u+AB_b);
-                    for (int32_t v=min(v_1,v_2); v<max(v_1,v_2); v++)
-                        if (!param.subsampling || v%2==0) {
-                            findMatch(u,v,plane_a,plane_b,plane_c,disparity_grid,grid_dims,
-                                    I1_desc,I2_desc,P,plane_radius,valid,right_image,D);
-                        }
+            // rename corners
+            float A_u = tri_u[0]; float A_v = tri_v[0];
+            float B_u = tri_u[1]; float B_v = tri_v[1];
+            float C_u = tri_u[2]; float C_v = tri_v[2];
+
+            // compute straight lines connecting triangle corners
+            float AB_a = 0; float AC_a = 0; float BC_a = 0;
+            if ((int32_t)(A_u)!=(int32_t)(B_u)) AB_a = (A_v-B_v)/(A_u-B_u);
+            if ((int32_t)(A_u)!=(int32_t)(C_u)) AC_a = (A_v-C_v)/(A_u-C_u);
+            if ((int32_t)(B_u)!=(int32_t)(C_u)) BC_a = (B_v-C_v)/(B_u-C_u);
+            float AB_b = A_v-AB_a*A_u;
+            float AC_b = A_v-AC_a*A_u;
+            float BC_b = B_v-BC_a*B_u;
+
+            // a plane is only valid if itself and its projection
+            // into the other image is not too much slanted
+            bool valid = fabs(plane_a)<0.7 && fabs(plane_d)<0.7;
+
+            // first part (triangle corner A->B)
+            if ((int32_t)(A_u)!=(int32_t)(B_u)) {
+                for (int32_t u=max((int32_t)A_u,0); u<min((int32_t)B_u,width); u++){
+                    if (!param.subsampling || u%2==0) {
+                        int32_t v_1 = (uint32_t)(AC_a*(float)u+AC_b);
+                        int32_t v_2 = (uint32_t)(AB_a*(float)u+AB_b);
+                        for (int32_t v=max(min(v_1,v_2),band_v_min); v<min(max(v_1,v_2),band_v_max); v++)
+                            if (!param.subsampling || v%2==0) {
+                                findMatch(u,v,plane_a,plane_b,plane_c,disparity_grid,grid_dims,
+                                        I1_desc,I2_desc,P,plane_radius,valid,right_image,D,D_prev);
+                            }
+                    }
                 }
             }
-        }
 
-        // second part (triangle corner B->C)
-        if ((int32_t)(B_u)!=(int32_t)(C_u)) {
-            for (int32_t u=max((int32_t)B_u,0); u<min((int32_t)C_u,width); u++){
-                if (!param.subsampling || u%2==0) {
-                    int32_t v_1 = (uint32_t)(AC_a*(float)u+AC_b);
-                    int32_t v_2 = (uint32_t)(BC_a*(float)u+BC_b);
-                    for (int32_t v=min(v_1,v_2); v<max(v_1,v_2); v++)
-                        if (!param.subsampling || v%2==0) {
-                            findMatch(u,v,plane_a,plane_b,plane_c,disparity_grid,grid_dims,
-                                    I1_desc,I2_desc,P,plane_radius,valid,right_image,D);
-                        }
+            // second part (triangle corner B->C)
+            if ((int32_t)(B_u)!=(int32_t)(C_u)) {
+                for (int32_t u=max((int32_t)B_u,0); u<min((int32_t)C_u,width); u++){
+                    if (!param.subsampling || u%2==0) {
+                        int32_t v_1 = (uint32_t)(AC_a*(float)u+AC_b);
+                        int32_t v_2 = (uint32_t)(BC_a*(float)u+BC_b);
+                        for (int32_t v=max(min(v_1,v_2),band_v_min); v<min(max(v_1,v_2),band_v_max); v++)
+                            if (!param.subsampling || v%2==0) {
+                                findMatch(u,v,plane_a,plane_b,plane_c,disparity_grid,grid_dims,
+                                        I1_desc,I2_desc,P,plane_radius,valid,right_image,D,D_prev);
+                            }
+                    }
                 }
             }
         }
-
     }
 
     delete[] P;
@@ -974,6 +1443,7 @@ void Elas::leftRightConsistencyCheck(float* D1,float* D2) {
     float    u_warp_1,u_warp_2,d1,d2;
 
     // for all image points do
+#pragma omp parallel for num_threads(getNumThreads(param.num_threads)) private(addr,addr_warp,u_warp_1,u_warp_2,d1,d2)
     for (int32_t u=0; u<D_width; u++) {
         for (int32_t v=0; v<D_height; v++) {
 
@@ -1025,6 +1495,22 @@ void Elas::leftRightConsistencyCheck(float* D1,float* D2) {
     free(D2_copy);
 }
 
+// union-find helpers of removeSmallSegments (path halving, smallest index as root)
+static inline int32_t findSegmentRoot (int32_t* parent,int32_t i) {
+    while (parent[i]!=i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+static inline void uniteSegments (int32_t* parent,int32_t i,int32_t j) {
+    i = findSegmentRoot(parent,i);
+    j = findSegmentRoot(parent,j);
+    if (i<j)      parent[j] = i;
+    else if (j<i) parent[i] = j;
+}
+
 void Elas::removeSmallSegments (float* D) {
 
     // get disparity image dimensions
@@ -1037,112 +1523,70 @@ void Elas::removeSmallSegments (float* D) {
         D_speckle_size = sqrt((float)param.speckle_size)*2;
     }
 
-    // allocate memory on heap for dynamic programming arrays
-    int32_t *D_done     = (int32_t*)calloc(D_width*D_height,sizeof(int32_t));
-    int32_t *seg_list_u = (int32_t*)calloc(D_width*D_height,sizeof(int32_t));
-    int32_t *seg_list_v = (int32_t*)calloc(D_width*D_height,sizeof(int32_t));
-    int32_t seg_list_count;
-    int32_t seg_list_curr;
-    int32_t u_neighbor[4];
-    int32_t v_neighbor[4];
-    int32_t u_seg_curr;
-    int32_t v_seg_curr;
-
-    // declare loop variables
-    int32_t addr_start, addr_curr, addr_neighbor;
-
-    // for all pixels do
-    for (int32_t u=0; u<D_width; u++) {
-        for (int32_t v=0; v<D_height; v++) {
-
-            // get address of first pixel in this segment
-            addr_start = getAddressOffsetImage(u,v,D_width);
-
-            // if this pixel has not already been processed
-            if (*(D_done+addr_start)==0) {
-
-                // init segment list (add first element
-                // and set it to be the next element to check)
-                *(seg_list_u+0) = u;
-                *(seg_list_v+0) = v;
-                seg_list_count  = 1;
-                seg_list_curr   = 0;
-
-                // add neighboring segments as long as there
-                // are none-processed pixels in the seg_list;
-                // none-processed means: seg_list_curr<seg_list_count
-                while (seg_list_curr<seg_list_count) {
-
-                    // get current position from seg_list
-                    u_seg_curr = *(seg_list_u+seg_list_curr);
-                    v_seg_curr = *(seg_list_v+seg_list_curr);
-
-                    // get address of current pixel in this segment
-                    addr_curr = getAddressOffsetImage(u_seg_curr,v_seg_curr,D_width);
-
-                    // fill list with neighbor positions
-                    u_neighbor[0] = u_seg_curr-1; v_neighbor[0] = v_seg_curr;
-                    u_neighbor[1] = u_seg_curr+1; v_neighbor[1] = v_seg_curr;
-                    u_neighbor[2] = u_seg_curr;   v_neighbor[2] = v_seg_curr-1;
-                    u_neighbor[3] = u_seg_curr;   v_neighbor[3] = v_seg_curr+1;
-
-                    // for all neighbors do
-                    for (int32_t i=0; i<4; i++) {
-
-                        // check if neighbor is inside image
-                        if (u_neighbor[i]>=0 && v_neighbor[i]>=0 && u_neighbor[i]<D_width && v_neighbor[i]<D_height) {
-
-                            // get neighbor pixel address
-                            addr_neighbor = getAddressOffsetImage(u_neighbor[i],v_neighbor[i],D_width);
-
-                            // check if neighbor has not been added yet and if it is valid
-                            if (*(D_done+addr_neighbor)==0 && *(D+addr_neighbor)>=0) {
-
-                                // is the neighbor similar to the current pixel
-                                // (=belonging to the current segment)
-                                if (fabs(*(D+addr_curr)-*(D+addr_neighbor))<=param.speckle_sim_threshold) {
-
-                                    // add neighbor coordinates to segment list
-                                    *(seg_list_u+seg_list_count) = u_neighbor[i];
-                                    *(seg_list_v+seg_list_count) = v_neighbor[i];
-                                    seg_list_count++;
-
-                                    // set neighbor pixel in I_done to "done"
-                                    // (otherwise a pixel may be added 2 times to the list, as
-                                    //  neighbor of one pixel and as neighbor of another pixel)
-                                    *(D_done+addr_neighbor) = 1;
-                                }
-                            }
-
-                        }
-                    }
-
-                    // set current pixel in seg_list to "done"
-                    seg_list_curr++;
-
-                    // set current pixel in I_done to "done"
-                    *(D_done+addr_curr) = 1;
-
-                } // end: while (seg_list_curr<seg_list_count)
-
-                // if segment NOT large enough => invalidate pixels
-                if (seg_list_count<D_speckle_size) {
-
-                    // for all pixels in current segment invalidate pixels
-                    for (int32_t i=0; i<seg_list_count; i++) {
-                        addr_curr = getAddressOffsetImage(*(seg_list_u+i),*(seg_list_v+i),D_width);
-                        *(D+addr_curr) = -10;
-                    }
-                }
-            } // end: if (*(I_done+addr_start)==0)
+    // segments are the connected components of valid pixels whose 4-neighbors
+    // have similar disparities (invalid pixels are segments of their own): they
+    // are labelled by union-find, in parallel over row bands, and the bands
+    // are merged afterwards along their borders
+    int32_t num_threads = getNumThreads(param.num_threads);
+    int32_t D_size      = D_width*D_height;
+    int32_t band_height = max((D_height+num_threads-1)/num_threads,1);
+    int32_t num_bands   = (D_height+band_height-1)/band_height;
+
+    // allocate memory on heap for union-find arrays
+    int32_t *parent   = (int32_t*)malloc(D_size*sizeof(int32_t));
+    int32_t *label    = (int32_t*)malloc(D_size*sizeof(int32_t));
+    int32_t *seg_size = (int32_t*)calloc(D_size,sizeof(int32_t));
+
+    // 1. label segments inside each band
+#pragma omp parallel for num_threads(num_threads)
+    for (int32_t b=0; b<num_bands; b++) {
+        int32_t v_min = b*band_height;
+        int32_t v_max = min((b+1)*band_height,D_height);
+        for (int32_t v=v_min; v<v_max; v++) {
+            for (int32_t u=0; u<D_width; u++) {
+                int32_t addr = getAddressOffsetImage(u,v,D_width);
+                parent[addr] = addr;
+                if (*(D+addr)<0)
+                    continue;
+                if (u>0 && *(D+addr-1)>=0 && fabs(*(D+addr)-*(D+addr-1))<=param.speckle_sim_threshold)
+                    uniteSegments(parent,addr-1,addr);
+                if (v>v_min && *(D+addr-D_width)>=0 && fabs(*(D+addr)-*(D+addr-D_width))<=param.speckle_sim_threshold)
+                    uniteSegments(parent,addr-D_width,addr);
+            }
+        }
+    }
 
+    // 2. merge segments across band borders
+    for (int32_t b=1; b<num_bands; b++) {
+        int32_t v = b*band_height;
+        for (int32_t u=0; u<D_width; u++) {
+            int32_t addr = getAddressOffsetImage(u,v,D_width);
+            if (*(D+addr)>=0 && *(D+addr-D_width)>=0 && fabs(*(D+addr)-*(D+addr-D_width))<=param.speckle_sim_threshold)
+                uniteSegments(parent,addr-D_width,addr);
         }
     }
 
+    // 3. compute segment sizes
+#pragma omp parallel for num_threads(num_threads)
+    for (int32_t i=0; i<D_size; i++) {
+        int32_t root = i;
+        while (parent[root]!=root)
+            root = parent[root];
+        label[i] = root;
+#pragma omp atomic
+        seg_size[root]++;
+    }
+
+    // 4. if segment NOT large enough => invalidate pixels
+#pragma omp parallel for num_threads(num_threads)
+    for (int32_t i=0; i<D_size; i++)
+        if (seg_size[label[i]]<D_speckle_size)
+            *(D+i) = -10;
+
     // free memory
-    free(D_done);
-    free(seg_list_u);
-    free(seg_list_v);
+    free(parent);
+    free(label);
+    free(seg_size);
 }
 
 void Elas::gapInterpolation(float* D) {
@@ -1164,8 +1608,12 @@ void Elas::gapInterpolation(float* D) {
     int32_t count,addr,v_first,v_last,u_first,u_last;
     float   d1,d2,d_ipol;
 
+    // number of threads
+    int32_t num_threads = getNumThreads(param.num_threads);
+
     // 1. Row-wise:
     // for each row do
+#pragma omp parallel for num_threads(num_threads) private(count,addr,u_first,u_last,d1,d2,d_ipol)
     for (int32_t v=0; v<D_height; v++) {
 
         // init counter
@@ -1247,6 +1695,7 @@ void Elas::gapInterpolation(float* D) {
 
     // 2. Column-wise:
     // for each column do
+#pragma omp parallel for num_threads(num_threads) private(count,addr,v_first,v_last,d1,d2,d_ipol)
     for (int32_t u=0; u<D_width; u++) {
 
         // init counter
@@ -1322,183 +1771,194 @@ void Elas::adaptiveMean (float* D) {
 
     __m128 xconst0 = _mm_set1_ps(0);
     __m128 xconst4 = _mm_set1_ps(4);
-    __m128 xval,xweight1,xweight2,xfactor1,xfactor2;
-
-    float *val     = (float *)_mm_malloc(8*sizeof(float),16);
-    float *weight  = (float*)_mm_malloc(4*sizeof(float),16);
-    float *factor  = (float*)_mm_malloc(4*sizeof(float),16);
 
     // set absolute mask
     __m128 xabsmask = _mm_set1_ps(0x7FFFFFFF);
 
-    // when doing subsampling: 4 pixel bilateral filter width
-    if (param.subsampling) {
+    // rows (horizontal filter) and then columns (vertical filter) are
+    // independent and filtered in parallel, each thread with its own buffers
+#pragma omp parallel num_threads(getNumThreads(param.num_threads))
+    {
+        __m128 xval,xweight1,xweight2,xfactor1,xfactor2;
+
+        float *val     = (float *)_mm_malloc(8*sizeof(float),16);
+        float *weight  = (float*)_mm_malloc(4*sizeof(float),16);
+        float *factor  = (float*)_mm_malloc(4*sizeof(float),16);
 
-        // horizontal filter
-        for (int32_t v=3; v<D_height-3; v++) {
+        // when doing subsampling: 4 pixel bilateral filter width
+        if (param.subsampling) {
 
-            // init
-            for (int32_t u=0; u<3; u++)
-                val[u] = *(D_copy+v*D_width+u);
+            // horizontal filter
+#pragma omp for
+            for (int32_t v=3; v<D_height-3; v++) {
 
-            // loop
-            for (int32_t u=3; u<D_width; u++) {
+                // init
+                for (int32_t u=0; u<3; u++)
+                    val[u] = *(D_copy+v*D_width+u);
 
-                // set
-                float val_curr = *(D_copy+v*D_width+(u-1));
-                val[u%4] = *(D_copy+v*D_width+u);
+                // loop
+                for (int32_t u=3; u<D_width; u++) {
 
-                xval     = _mm_load_ps(val);
-                xweight1 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
-                xweight1 = _mm_and_ps(xweight1,xabsmask);
-                xweight1 = _mm_sub_ps(xconst4,xweight1);
-                xweight1 = _mm_max_ps(xconst0,xweight1);
-                xfactor1 = _mm_mul_ps(xval,xweight1);
+                    // set
+                    float val_curr = *(D_copy+v*D_width+(u-1));
+                    val[u%4] = *(D_copy+v*D_width+u);
 
-                _mm_store_ps(weight,xweight1);
-                _mm_store_ps(factor,xfactor1);
+                    xval     = _mm_load_ps(val);
+                    xweight1 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
+                    xweight1 = _mm_and_ps(xweight1,xabsmask);
+                    xweight1 = _mm_sub_ps(xconst4,xweight1);
+                    xweight1 = _mm_max_ps(xconst0,xweight1);
+                    xfactor1 = _mm_mul_ps(xval,xweight1);
 
-                float weight_sum = weight[0]+weight[1]+weight[2]+weight[3];
-                float factor_sum = factor[0]+factor[1]+factor[2]+factor[3];
+                    _mm_store_ps(weight,xweight1);
+                    _mm_store_ps(factor,xfactor1);
 
-                if (weight_sum>0) {
-                    float d = factor_sum/weight_sum;
-                    if (d>=0) *(D_tmp+v*D_width+(u-1)) = d;
+                    float weight_sum = weight[0]+weight[1]+weight[2]+weight[3];
+                    float factor_sum = factor[0]+factor[1]+factor[2]+factor[3];
+
+                    if (weight_sum>0) {
+                        float d = factor_sum/weight_sum;
+                        if (d>=0) *(D_tmp+v*D_width+(u-1)) = d;
+                    }
                 }
             }
-        }
 
-        // vertical filter
-        for (int32_t u=3; u<D_width-3; u++) {
+            // vertical filter
+#pragma omp for
+            for (int32_t u=3; u<D_width-3; u++) {
 
-            // init
-            for (int32_t v=0; v<3; v++)
-                val[v] = *(D_tmp+v*D_width+u);
+                // init
+                for (int32_t v=0; v<3; v++)
+                    val[v] = *(D_tmp+v*D_width+u);
 
-            // loop
-            for (int32_t v=3; v<D_height; v++) {
+                // loop
+                for (int32_t v=3; v<D_height; v++) {
 
-                // set
-                float val_curr = *(D_tmp+(v-1)*D_width+u);
-                val[v%4] = *(D_tmp+v*D_width+u);
+                    // set
+                    float val_curr = *(D_tmp+(v-1)*D_width+u);
+                    val[v%4] = *(D_tmp+v*D_width+u);
 
-                xval     = _mm_load_ps(val);
-                xweight1 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
-                xweight1 = _mm_and_ps(xweight1,xabsmask);
-                xweight1 = _mm_sub_ps(xconst4,xweight1);
-                xweight1 = _mm_max_ps(xconst0,xweight1);
-                xfactor1 = _mm_mul_ps(xval,xweight1);
+                    xval     = _mm_load_ps(val);
+                    xweight1 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
+                    xweight1 = _mm_and_ps(xweight1,xabsmask);
+                    xweight1 = _mm_sub_ps(xconst4,xweight1);
+                    xweight1 = _mm_max_ps(xconst0,xweight1);
+                    xfactor1 = _mm_mul_ps(xval,xweight1);
 
-                _mm_store_ps(weight,xweight1);
-                _mm_store_ps(factor,xfactor1);
+                    _mm_store_ps(weight,xweight1);
+                    _mm_store_ps(factor,xfactor1);
 
-                float weight_sum = weight[0]+weight[1]+weight[2]+weight[3];
-                float factor_sum = factor[0]+factor[1]+factor[2]+factor[3];
+                    float weight_sum = weight[0]+weight[1]+weight[2]+weight[3];
+                    float factor_sum = factor[0]+factor[1]+factor[2]+factor[3];
 
-                if (weight_sum>0) {
-                    float d = factor_sum/weight_sum;
-                    if (d>=0) *(D+(v-1)*D_width+u) = d;
+                    if (weight_sum>0) {
+                        float d = factor_sum/weight_sum;
+                        if (d>=0) *(D+(v-1)*D_width+u) = d;
+                    }
                 }
             }
-        }
 
-        // full resolution: 8 pixel bilateral filter width
-    } else {
+            // full resolution: 8 pixel bilateral filter width
+        } else {
 
 
-        // horizontal filter
-        for (int32_t v=3; v<D_height-3; v++) {
+            // horizontal filter
+#pragma omp for
+            for (int32_t v=3; v<D_height-3; v++) {
 
-            // init
-            for (int32_t u=0; u<7; u++)
-                val[u] = *(D_copy+v*D_width+u);
+                // init
+                for (int32_t u=0; u<7; u++)
+                    val[u] = *(D_copy+v*D_width+u);
 
-            // loop
-            for (int32_t u=7; u<D_width; u++) {
+                // loop
+                for (int32_t u=7; u<D_width; u++) {
 
-                // set
-                float val_curr = *(D_copy+v*D_width+(u-3));
-                val[u%8] = *(D_copy+v*D_width+u);
+                    // set
+                    float val_curr = *(D_copy+v*D_width+(u-3));
+                    val[u%8] = *(D_copy+v*D_width+u);
 
-                xval     = _mm_load_ps(val);
-                xweight1 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
-                xweight1 = _mm_and_ps(xweight1,xabsmask);
-                xweight1 = _mm_sub_ps(xconst4,xweight1);
-                xweight1 = _mm_max_ps(xconst0,xweight1);
-                xfactor1 = _mm_mul_ps(xval,xweight1);
+                    xval     = _mm_load_ps(val);
+                    xweight1 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
+                    xweight1 = _mm_and_ps(xweight1,xabsmask);
+                    xweight1 = _mm_sub_ps(xconst4,xweight1);
+                    xweight1 = _mm_max_ps(xconst0,xweight1);
+                    xfactor1 = _mm_mul_ps(xval,xweight1);
 
-                xval     = _mm_load_ps(val+4);
-                xweight2 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
-                xweight2 = _mm_and_ps(xweight2,xabsmask);
-                xweight2 = _mm_sub_ps(xconst4,xweight2);
-                xweight2 = _mm_max_ps(xconst0,xweight2);
-                xfactor2 = _mm_mul_ps(xval,xweight2);
+                    xval     = _mm_load_ps(val+4);
+                    xweight2 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
+                    xweight2 = _mm_and_ps(xweight2,xabsmask);
+                    xweight2 = _mm_sub_ps(xconst4,xweight2);
+                    xweight2 = _mm_max_ps(xconst0,xweight2);
+                    xfactor2 = _mm_mul_ps(xval,xweight2);
 
-                xweight1 = _mm_add_ps(xweight1,xweight2);
-                xfactor1 = _mm_add_ps(xfactor1,xfactor2);
+                    xweight1 = _mm_add_ps(xweight1,xweight2);
+                    xfactor1 = _mm_add_ps(xfactor1,xfactor2);
 
-                _mm_store_ps(weight,xweight1);
-                _mm_store_ps(factor,xfactor1);
+                    _mm_store_ps(weight,xweight1);
+                    _mm_store_ps(factor,xfactor1);
 
-                float weight_sum = weight[0]+weight[1]+weight[2]+weight[3];
-                float factor_sum = factor[0]+factor[1]+factor[2]+factor[3];
+                    float weight_sum = weight[0]+weight[1]+weight[2]+weight[3];
+                    float factor_sum = factor[0]+factor[1]+factor[2]+factor[3];
 
-                if (weight_sum>0) {
-                    float d = factor_sum/weight_sum;
-                    if (d>=0) *(D_tmp+v*D_width+(u-3)) = d;
+                    if (weight_sum>0) {
+                        float d = factor_sum/weight_sum;
+                        if (d>=0) *(D_tmp+v*D_width+(u-3)) = d;
+                    }
                 }
             }
-        }
 
-        // vertical filter
-        for (int32_t u=3; u<D_width-3; u++) {
+            // vertical filter
+#pragma omp for
+            for (int32_t u=3; u<D_width-3; u++) {
 
-            // init
-            for (int32_t v=0; v<7; v++)
-                val[v] = *(D_tmp+v*D_width+u);
+                // init
+                for (int32_t v=0; v<7; v++)
+                    val[v] = *(D_tmp+v*D_width+u);
 
-            // loop
-            for (int32_t v=7; v<D_height; v++) {
+                // loop
+                for (int32_t v=7; v<D_height; v++) {
 
-                // set
-                float val_curr = *(D_tmp+(v-3)*D_width+u);
-                val[v%8] = *(D_tmp+v*D_width+u);
+                    // set
+                    float val_curr = *(D_tmp+(v-3)*D_width+u);
+                    val[v%8] = *(D_tmp+v*D_width+u);
 
-                xval     = _mm_load_ps(val);
-                xweight1 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
-                xweight1 = _mm_and_ps(xweight1,xabsmask);
-                xweight1 = _mm_sub_ps(xconst4,xweight1);
-                xweight1 = _mm_max_ps(xconst0,xweight1);
-                xfactor1 = _mm_mul_ps(xval,xweight1);
+                    xval     = _mm_load_ps(val);
+                    xweight1 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
+                    xweight1 = _mm_and_ps(xweight1,xabsmask);
+                    xweight1 = _mm_sub_ps(xconst4,xweight1);
+                    xweight1 = _mm_max_ps(xconst0,xweight1);
+                    xfactor1 = _mm_mul_ps(xval,xweight1);
 
-                xval     = _mm_load_ps(val+4);
-                xweight2 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
-                xweight2 = _mm_and_ps(xweight2,xabsmask);
-                xweight2 = _mm_sub_ps(xconst4,xweight2);
-                xweight2 = _mm_max_ps(xconst0,xweight2);
-                xfactor2 = _mm_mul_ps(xval,xweight2);
+                    xval     = _mm_load_ps(val+4);
+                    xweight2 = _mm_sub_ps(xval,_mm_set1_ps(val_curr));
+                    xweight2 = _mm_and_ps(xweight2,xabsmask);
+                    xweight2 = _mm_sub_ps(xconst4,xweight2);
+                    xweight2 = _mm_max_ps(xconst0,xweight2);
+                    xfactor2 = _mm_mul_ps(xval,xweight2);
 
-                xweight1 = _mm_add_ps(xweight1,xweight2);
-                xfactor1 = _mm_add_ps(xfactor1,xfactor2);
+                    xweight1 = _mm_add_ps(xweight1,xweight2);
+                    xfactor1 = _mm_add_ps(xfactor1,xfactor2);
 
-                _mm_store_ps(weight,xweight1);
-                _mm_store_ps(factor,xfactor1);
+                    _mm_store_ps(weight,xweight1);
+                    _mm_store_ps(factor,xfactor1);
 
-                float weight_sum = weight[0]+weight[1]+weight[2]+weight[3];
-                float factor_sum = factor[0]+factor[1]+factor[2]+factor[3];
+                    float weight_sum = weight[0]+weight[1]+weight[2]+weight[3];
+                    float factor_sum = factor[0]+factor[1]+factor[2]+factor[3];
 
-                if (weight_sum>0) {
-                    float d = factor_sum/weight_sum;
-                    if (d>=0) *(D+(v-3)*D_width+u) = d;
+                    if (weight_sum>0) {
+                        float d = factor_sum/weight_sum;
+                        if (d>=0) *(D+(v-3)*D_width+u) = d;
+                    }
                 }
             }
         }
+
+        _mm_free(val);
+        _mm_free(weight);
+        _mm_free(factor);
     }
 
     // free memory
-    _mm_free(val);
-    _mm_free(weight);
-    _mm_free(factor);
     free(D_copy);
     free(D_tmp);
 }
@@ -1518,55 +1978,63 @@ void Elas::median (float* D) {
 
     int32_t window_size = 3;
 
-    float *vals = new float[window_size*2+1];
-    int32_t i,j;
-    float temp;
-
-    // first step: horizontal median filter
-    for (int32_t u=window_size; u<D_width-window_size; u++) {
-        for (int32_t v=window_size; v<D_height-window_size; v++) {
-            if (*(D+getAddressOffsetImage(u,v,D_width))>=0) {
-                j = 0;
-                for (int32_t u2=u-window_size; u2<=u+window_size; u2++) {
-                    temp = *(D+getAddressOffsetImage(u2,v,D_width));
-                    i = j-1;
-                    while (i>=0 && *(vals+i)>temp) {
-                        *(vals+i+1) = *(vals+i);
-                        i--;
+    // columns are independent in both steps and filtered in parallel,
+    // each thread with its own sorting buffer
+#pragma omp parallel num_threads(getNumThreads(param.num_threads))
+    {
+        float *vals = new float[window_size*2+1];
+        int32_t i,j;
+        float temp;
+
+        // first step: horizontal median filter
+#pragma omp for
+        for (int32_t u=window_size; u<D_width-window_size; u++) {
+            for (int32_t v=window_size; v<D_height-window_size; v++) {
+                if (*(D+getAddressOffsetImage(u,v,D_width))>=0) {
+                    j = 0;
+                    for (int32_t u2=u-window_size; u2<=u+window_size; u2++) {
+                        temp = *(D+getAddressOffsetImage(u2,v,D_width));
+                        i = j-1;
+                        while (i>=0 && *(vals+i)>temp) {
+                            *(vals+i+1) = *(vals+i);
+                            i--;
+                        }
+                        *(vals+i+1) = temp;
+                        j++;
                     }
-                    *(vals+i+1) = temp;
-                    j++;
+                    *(D_temp+getAddressOffsetImage(u,v,D_width)) = *(vals+window_size);
+                } else {
+                    *(D_temp+getAddressOffsetImage(u,v,D_width)) = *(D+getAddressOffsetImage(u,v,D_width));
                 }
-                *(D_temp+getAddressOffsetImage(u,v,D_width)) = *(vals+window_size);
-            } else {
-                *(D_temp+getAddressOffsetImage(u,v,D_width)) = *(D+getAddressOffsetImage(u,v,D_width));
-            }
 
+            }
         }
-    }
 
-    // second step: vertical median filter
-    for (int32_t u=window_size; u<D_width-window_size; u++) {
-        for (int32_t v=window_size; v<D_height-window_size; v++) {
-            if (*(D+getAddressOffsetImage(u,v,D_width))>=0) {
-                j = 0;
-                for (int32_t v2=v-window_size; v2<=v+window_size; v2++) {
-                    temp = *(D_temp+getAddressOffsetImage(u,v2,D_width));
-                    i = j-1;
-                    while (i>=0 && *(vals+i)>temp) {
-                        *(vals+i+1) = *(vals+i);
-                        i--;
+        // second step: vertical median filter
+#pragma omp for
+        for (int32_t u=window_size; u<D_width-window_size; u++) {
+            for (int32_t v=window_size; v<D_height-window_size; v++) {
+                if (*(D+getAddressOffsetImage(u,v,D_width))>=0) {
+                    j = 0;
+                    for (int32_t v2=v-window_size; v2<=v+window_size; v2++) {
+                        temp = *(D_temp+getAddressOffsetImage(u,v2,D_width));
+                        i = j-1;
+                        while (i>=0 && *(vals+i)>temp) {
+                            *(vals+i+1) = *(vals+i);
+                            i--;
+                        }
+                        *(vals+i+1) = temp;
+                        j++;
                     }
-                    *(vals+i+1) = temp;
-                    j++;
+                    *(D+getAddressOffsetImage(u,v,D_width)) = *(vals+window_size);
+                } else {
+                    *(D+getAddressOffsetImage(u,v,D_width)) = *(D+getAddressOffsetImage(u,v,D_width));
                 }
-                *(D+getAddressOffsetImage(u,v,D_width)) = *(vals+window_size);
-            } else {
-                *(D+getAddressOffsetImage(u,v,D_width)) = *(D+getAddressOffsetImage(u,v,D_width));
             }
         }
+
+        delete[] vals;
     }
 
     free(D_temp);
-    free(vals);
 }
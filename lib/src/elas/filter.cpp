@@ -23,6 +23,9 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
 #include <string.h>
 #include <cassert>
 
+// the SSE2 filters, empty on the other targets (see kernels.h)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+
 #include "filter.h"
 
 // define fixed-width datatypes for Visual Studio projects
@@ -415,6 +418,12 @@ namespace filter {
     _mm_free( temp_v );
   }
   
+  void sobel3x3( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h, int16_t* temp_h, int16_t* temp_v ) {
+    detail::convolve_cols_3x3( in, temp_v, temp_h, w, h );
+    detail::convolve_101_row_3x3_16bit( temp_v, out_v, w, h );
+    detail::convolve_121_row_3x3_16bit( temp_h, out_h, w, h );
+  }
+  
   void sobel5x5( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h ) {
     int16_t* temp_h = (int16_t*)( _mm_malloc( w*h*sizeof( int16_t ), 16 ) );
     int16_t* temp_v = (int16_t*)( _mm_malloc( w*h*sizeof( int16_t ), 16 ) );
@@ -466,3 +475,5 @@ namespace filter {
     _mm_free( integral );
   }
 };
+
+#endif
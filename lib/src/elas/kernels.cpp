@@ -0,0 +1,381 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#include "kernels.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#ifdef ELAS_SSE2
+  #include "filter.h"
+  #if defined(_MSC_VER)
+    #include <intrin.h>
+  #endif
+#endif
+
+namespace kernels {
+
+  namespace detail {
+
+    // generic C++ implementation, reference for all other variants
+    // (same operation order and 16-bit arithmetic as filter::sobel3x3)
+    void sobel3x3_generic( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h,
+                           int16_t* temp_h, int16_t* temp_v ) {
+
+      // columns: (1,2,1) into temp_v, (1,0,-1) into temp_h
+      for( int v=1; v<h-1; v++ ) {
+        const uint8_t* i0 = in+(v-1)*w;
+        const uint8_t* i1 = i0+w;
+        const uint8_t* i2 = i1+w;
+        int16_t* rv = temp_v+v*w;
+        int16_t* rh = temp_h+v*w;
+        for( int u=0; u<w; u++ ) {
+          rv[u] = (int16_t)(i0[u]+2*i1[u]+i2[u]);
+          rh[u] = (int16_t)(i0[u]-i2[u]);
+        }
+      }
+
+      // rows: (1,0,-1) of temp_v into out_v, (1,2,1) of temp_h into out_h,
+      // scaled by 1/4, shifted by 128 and saturated to [0,255]
+      const int n = w*h-2;
+      for( int k=0; k<n; k++ ) {
+        int32_t a = ((temp_v[k]-temp_v[k+2])>>2)+128;
+        int32_t b = ((temp_h[k]+2*temp_h[k+1]+temp_h[k+2])>>2)+128;
+        out_v[k+1] = (uint8_t)(a<0 ? 0 : (a>255 ? 255 : a));
+        out_h[k+1] = (uint8_t)(b<0 ? 0 : (b>255 ? 255 : b));
+      }
+    }
+
+    inline int32_t sad16_generic( const uint8_t* a, const uint8_t* b ) {
+      int32_t sum = 0;
+      for( int i=0; i<16; i++ )
+        sum += abs((int32_t)a[i]-(int32_t)b[i]);
+      return sum;
+    }
+
+    void sadStrided_generic( const uint8_t* I1_block, const uint8_t* I2_block, int32_t step,
+                             int32_t n, int32_t* E ) {
+      for( int32_t i=0; i<n; i++ )
+        E[i] = sad16_generic(I1_block,I2_block+i*step);
+    }
+
+    void sadGather_generic( const uint8_t* I1_block, const uint8_t* const* I2_blocks,
+                            int32_t n, int32_t* E ) {
+      for( int32_t i=0; i<n; i++ )
+        E[i] = sad16_generic(I1_block,I2_blocks[i]);
+    }
+
+    void sadSupport_generic( const uint8_t* I1_block, const uint8_t* I2_block, int32_t step,
+                             const int32_t* offsets, int32_t n, int32_t* E ) {
+      for( int32_t i=0; i<n; i++ ) {
+        const uint8_t* I2_curr = I2_block+i*step;
+        E[i] = sad16_generic(I1_block+offsets[0],I2_curr+offsets[0])+
+               sad16_generic(I1_block+offsets[1],I2_curr+offsets[1])+
+               sad16_generic(I1_block+offsets[2],I2_curr+offsets[2])+
+               sad16_generic(I1_block+offsets[3],I2_curr+offsets[3]);
+      }
+    }
+
+#ifdef ELAS_SSE2
+
+    void sobel3x3_sse2( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h,
+                        int16_t* temp_h, int16_t* temp_v ) {
+      filter::sobel3x3(in,out_v,out_h,w,h,temp_h,temp_v);
+    }
+
+    inline int32_t sad16_sse2( const __m128i &xmm1, const uint8_t* b ) {
+      __m128i xmm2 = _mm_sad_epu8(xmm1,_mm_load_si128((const __m128i*)b));
+      return _mm_extract_epi16(xmm2,0)+_mm_extract_epi16(xmm2,4);
+    }
+
+    void sadStrided_sse2( const uint8_t* I1_block, const uint8_t* I2_block, int32_t step,
+                          int32_t n, int32_t* E ) {
+      __m128i xmm1 = _mm_load_si128((const __m128i*)I1_block);
+      for( int32_t i=0; i<n; i++ )
+        E[i] = sad16_sse2(xmm1,I2_block+i*step);
+    }
+
+    void sadGather_sse2( const uint8_t* I1_block, const uint8_t* const* I2_blocks,
+                         int32_t n, int32_t* E ) {
+      __m128i xmm1 = _mm_load_si128((const __m128i*)I1_block);
+      for( int32_t i=0; i<n; i++ )
+        E[i] = sad16_sse2(xmm1,I2_blocks[i]);
+    }
+
+    void sadSupport_sse2( const uint8_t* I1_block, const uint8_t* I2_block, int32_t step,
+                          const int32_t* offsets, int32_t n, int32_t* E ) {
+      __m128i xmm1 = _mm_load_si128((const __m128i*)(I1_block+offsets[0]));
+      __m128i xmm2 = _mm_load_si128((const __m128i*)(I1_block+offsets[1]));
+      __m128i xmm3 = _mm_load_si128((const __m128i*)(I1_block+offsets[2]));
+      __m128i xmm4 = _mm_load_si128((const __m128i*)(I1_block+offsets[3]));
+      __m128i xmm5,xmm6;
+      for( int32_t i=0; i<n; i++ ) {
+        const uint8_t* I2_curr = I2_block+i*step;
+        xmm6 = _mm_load_si128((const __m128i*)(I2_curr+offsets[0]));
+        xmm6 = _mm_sad_epu8(xmm1,xmm6);
+        xmm5 = _mm_load_si128((const __m128i*)(I2_curr+offsets[1]));
+        xmm6 = _mm_add_epi16(_mm_sad_epu8(xmm2,xmm5),xmm6);
+        xmm5 = _mm_load_si128((const __m128i*)(I2_curr+offsets[2]));
+        xmm6 = _mm_add_epi16(_mm_sad_epu8(xmm3,xmm5),xmm6);
+        xmm5 = _mm_load_si128((const __m128i*)(I2_curr+offsets[3]));
+        xmm6 = _mm_add_epi16(_mm_sad_epu8(xmm4,xmm5),xmm6);
+        E[i] = _mm_extract_epi16(xmm6,0)+_mm_extract_epi16(xmm6,4);
+      }
+    }
+
+#endif
+
+#ifdef ELAS_NEON
+
+    inline int32_t hsum_u16( const uint16x8_t &a ) {
+#ifdef __aarch64__
+      return vaddvq_u16(a);
+#else
+      uint64x2_t s = vpaddlq_u32(vpaddlq_u16(a));
+      return (int32_t)(vgetq_lane_u64(s,0)+vgetq_lane_u64(s,1));
+#endif
+    }
+
+    inline int32_t sad16_neon( const uint8x16_t &a, const uint8_t* b ) {
+      return hsum_u16(vpaddlq_u8(vabdq_u8(a,vld1q_u8(b))));
+    }
+
+    void sadStrided_neon( const uint8_t* I1_block, const uint8_t* I2_block, int32_t step,
+                          int32_t n, int32_t* E ) {
+      uint8x16_t a = vld1q_u8(I1_block);
+      for( int32_t i=0; i<n; i++ )
+        E[i] = sad16_neon(a,I2_block+i*step);
+    }
+
+    void sadGather_neon( const uint8_t* I1_block, const uint8_t* const* I2_blocks,
+                         int32_t n, int32_t* E ) {
+      uint8x16_t a = vld1q_u8(I1_block);
+      for( int32_t i=0; i<n; i++ )
+        E[i] = sad16_neon(a,I2_blocks[i]);
+    }
+
+    void sadSupport_neon( const uint8_t* I1_block, const uint8_t* I2_block, int32_t step,
+                          const int32_t* offsets, int32_t n, int32_t* E ) {
+      uint8x16_t a1 = vld1q_u8(I1_block+offsets[0]);
+      uint8x16_t a2 = vld1q_u8(I1_block+offsets[1]);
+      uint8x16_t a3 = vld1q_u8(I1_block+offsets[2]);
+      uint8x16_t a4 = vld1q_u8(I1_block+offsets[3]);
+      for( int32_t i=0; i<n; i++ ) {
+        const uint8_t* I2_curr = I2_block+i*step;
+        uint16x8_t s = vpaddlq_u8(vabdq_u8(a1,vld1q_u8(I2_curr+offsets[0])));
+        s = vpadalq_u8(s,vabdq_u8(a2,vld1q_u8(I2_curr+offsets[1])));
+        s = vpadalq_u8(s,vabdq_u8(a3,vld1q_u8(I2_curr+offsets[2])));
+        s = vpadalq_u8(s,vabdq_u8(a4,vld1q_u8(I2_curr+offsets[3])));
+        E[i] = hsum_u16(s);
+      }
+    }
+
+#endif
+
+    // runtime check of the AVX2 instruction set (CPU and OS support)
+    bool cpuHasAVX2() {
+#if defined(ELAS_HAVE_AVX2) && defined(_MSC_VER)
+      int info[4];
+      __cpuid(info,0);
+      if (info[0]<7)
+        return false;
+      __cpuid(info,1);
+      bool osxsave = (info[2]&(1<<27))!=0;
+      bool avx     = (info[2]&(1<<28))!=0;
+      if (!osxsave || !avx || (_xgetbv(0)&6)!=6)
+        return false;
+      __cpuidex(info,7,0);
+      return (info[1]&(1<<5))!=0;
+#elif defined(ELAS_HAVE_AVX2)
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2")!=0;
+#else
+      return false;
+#endif
+    }
+
+    const table* select() {
+      const table* t = generic();
+#ifdef ELAS_SSE2
+      t = sse2();
+#endif
+#ifdef ELAS_NEON
+      t = neon();
+#endif
+      if (avx2()!=0 && cpuHasAVX2())
+        t = avx2();
+
+      // explicit request (benchmarking, validation)
+      const char* forced = getenv("ELAS_KERNELS");
+      if (forced!=0) {
+        const table* all[4] = {generic(),sse2(),avx2(),neon()};
+        bool found = false;
+        for (int i=0; i<4; i++) {
+          if (all[i]!=0 && strcmp(all[i]->name,forced)==0 && (all[i]!=avx2() || cpuHasAVX2())) {
+            t = all[i];
+            found = true;
+          }
+        }
+        if (!found)
+          fprintf(stderr,"ELAS_KERNELS=%s is not available, using %s\n",forced,t->name);
+      }
+      return t;
+    }
+  }
+
+  const table* generic() {
+    static const table t = { "generic", detail::sobel3x3_generic, detail::sadStrided_generic,
+                             detail::sadGather_generic, detail::sadSupport_generic };
+    return &t;
+  }
+
+  const table* sse2() {
+#ifdef ELAS_SSE2
+    static const table t = { "sse2", detail::sobel3x3_sse2, detail::sadStrided_sse2,
+                             detail::sadGather_sse2, detail::sadSupport_sse2 };
+    return &t;
+#else
+    return 0;
+#endif
+  }
+
+  const table* neon() {
+#ifdef ELAS_NEON
+    static const table t = { "neon", detail::sobel3x3_generic, detail::sadStrided_neon,
+                             detail::sadGather_neon, detail::sadSupport_neon };
+    return &t;
+#else
+    return 0;
+#endif
+  }
+
+#ifndef ELAS_HAVE_AVX2
+  const table* avx2() {
+    return 0;
+  }
+#endif
+
+  const table& get() {
+    static const table* t = detail::select();
+    return *t;
+  }
+
+  namespace detail {
+
+    // deterministic pseudo-random bytes, the extremes included often
+    // (saturation of the filter, overflow of the sums)
+    struct random_bytes {
+      uint32_t state;
+      random_bytes() : state(12345) {}
+      uint8_t next() {
+        state = state*1664525u+1013904223u;
+        uint8_t x = (uint8_t)(state>>24);
+        return (x<16) ? 0 : ((x>=240) ? 255 : x);
+      }
+      void fill( uint8_t* p, int32_t n ) {
+        for( int32_t i=0; i<n; i++ )
+          p[i] = next();
+      }
+    };
+
+    bool checkSobel( const table& t, const table& reference, random_bytes& rnd ) {
+      const int w = 64, h = 24;
+      uint8_t* in     = (uint8_t*)_mm_malloc(w*h,16);
+      uint8_t* out[4];
+      for( int i=0; i<4; i++ ) {
+        out[i] = (uint8_t*)_mm_malloc(w*h,16);
+        memset(out[i],0,w*h);
+      }
+      int16_t* temp_h = (int16_t*)_mm_malloc(w*h*sizeof(int16_t),16);
+      int16_t* temp_v = (int16_t*)_mm_malloc(w*h*sizeof(int16_t),16);
+
+      rnd.fill(in,w*h);
+      t.sobel3x3(in,out[0],out[1],w,h,temp_h,temp_v);
+      reference.sobel3x3(in,out[2],out[3],w,h,temp_h,temp_v);
+
+      // the rows used by the descriptors, the borders are left undefined
+      bool ok = true;
+      for( int v=1; v<h-1; v++ )
+        ok = ok && memcmp(out[0]+v*w,out[2]+v*w,w)==0 && memcmp(out[1]+v*w,out[3]+v*w,w)==0;
+
+      _mm_free(in);
+      for( int i=0; i<4; i++ )
+        _mm_free(out[i]);
+      _mm_free(temp_h);
+      _mm_free(temp_v);
+      return ok;
+    }
+
+    bool checkSAD( const table& t, const table& reference, random_bytes& rnd ) {
+      const int32_t step = 32, blocks = (max_chunk+4)*step/16;
+      uint8_t* I1 = (uint8_t*)_mm_malloc(blocks*16,16);
+      uint8_t* I2 = (uint8_t*)_mm_malloc(blocks*16,16);
+      const uint8_t* gather[max_chunk];
+      int32_t E[max_chunk], E_ref[max_chunk];
+      bool ok = true;
+
+      for( int32_t trial=0; ok && trial<16; trial++ ) {
+        rnd.fill(I1,blocks*16);
+        rnd.fill(I2,blocks*16);
+        int32_t n = 1+(rnd.next()%max_chunk);
+
+        // offsets of the support window, 16-byte descriptors
+        int32_t offsets[4];
+        for( int32_t k=0; k<4; k++ )
+          offsets[k] = 16*(rnd.next()%4);
+        for( int32_t i=0; i<n; i++ )
+          gather[i] = I2+16*(rnd.next()%blocks);
+
+        t.sadStrided(I1,I2,step,n,E);
+        reference.sadStrided(I1,I2,step,n,E_ref);
+        ok = ok && memcmp(E,E_ref,n*sizeof(int32_t))==0;
+
+        t.sadGather(I1,gather,n,E);
+        reference.sadGather(I1,gather,n,E_ref);
+        ok = ok && memcmp(E,E_ref,n*sizeof(int32_t))==0;
+
+        t.sadSupport(I1,I2,step,offsets,n,E);
+        reference.sadSupport(I1,I2,step,offsets,n,E_ref);
+        ok = ok && memcmp(E,E_ref,n*sizeof(int32_t))==0;
+      }
+
+      _mm_free(I1);
+      _mm_free(I2);
+      return ok;
+    }
+  }
+
+  bool check( const table& t, const table& reference ) {
+    detail::random_bytes rnd;
+    return detail::checkSobel(t,reference,rnd) && detail::checkSAD(t,reference,rnd);
+  }
+
+  bool checkAll() {
+    const table* all[4] = {generic(),sse2(),avx2(),neon()};
+    bool ok = true;
+    for( int i=1; i<4; i++ ) {
+      if( all[i]==0 )
+        continue;
+      if( all[i]==avx2() && !detail::cpuHasAVX2() ) {
+        printf("kernels %s: not supported by the CPU\n",all[i]->name);
+        continue;
+      }
+      bool same = check(*all[i],*all[0]);
+      printf("kernels %s: %s\n",all[i]->name,same ? "same as generic" : "MISMATCH");
+      ok = ok && same;
+    }
+    return ok;
+  }
+}
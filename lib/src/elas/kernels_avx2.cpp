@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+// AVX2 variant of the kernels: two descriptors are matched per 256-bit SAD.
+// This is the only file compiled with AVX2 enabled; it must not include
+// headers with inline code shared with the rest of the library.
+
+#include "kernels.h"
+#include <immintrin.h>
+
+namespace filter {
+  void sobel3x3( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h, int16_t* temp_h, int16_t* temp_v );
+}
+
+namespace kernels {
+
+  namespace detail {
+
+    // the sobel filter is bound by memory bandwidth, keep the SSE2 version
+    void sobel3x3_avx2( const uint8_t* in, uint8_t* out_v, uint8_t* out_h, int w, int h,
+                        int16_t* temp_h, int16_t* temp_v ) {
+      filter::sobel3x3(in,out_v,out_h,w,h,temp_h,temp_v);
+    }
+
+    // two 16-byte blocks in the low and high lane
+    inline __m256i load2_avx2( const uint8_t* lo, const uint8_t* hi ) {
+      return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i*)lo)),
+                                     _mm_load_si128((const __m128i*)hi),1);
+    }
+
+    inline __m256i broadcast_avx2( const uint8_t* p ) {
+      __m128i a = _mm_load_si128((const __m128i*)p);
+      return _mm256_inserti128_si256(_mm256_castsi128_si256(a),a,1);
+    }
+
+    // stores the total SAD of the low lane in E[0] and of the high lane in E[1]
+    inline void store2_avx2( const __m256i &sad, int32_t* E ) {
+      __m256i s = _mm256_add_epi32(sad,_mm256_srli_si256(sad,8));
+      E[0] = _mm256_extract_epi32(s,0);
+      E[1] = _mm256_extract_epi32(s,4);
+    }
+
+    inline int32_t sad16_sse( const __m128i &a, const uint8_t* b ) {
+      __m128i s = _mm_sad_epu8(a,_mm_load_si128((const __m128i*)b));
+      return _mm_extract_epi16(s,0)+_mm_extract_epi16(s,4);
+    }
+
+    void sadStrided_avx2( const uint8_t* I1_block, const uint8_t* I2_block, int32_t step,
+                          int32_t n, int32_t* E ) {
+      __m256i a = broadcast_avx2(I1_block);
+      int32_t i = 0;
+      for( ; i+1<n; i+=2 )
+        store2_avx2(_mm256_sad_epu8(a,load2_avx2(I2_block+i*step,I2_block+(i+1)*step)),E+i);
+      if( i<n )
+        E[i] = sad16_sse(_mm256_castsi256_si128(a),I2_block+i*step);
+    }
+
+    void sadGather_avx2( const uint8_t* I1_block, const uint8_t* const* I2_blocks,
+                         int32_t n, int32_t* E ) {
+      __m256i a = broadcast_avx2(I1_block);
+      int32_t i = 0;
+      for( ; i+1<n; i+=2 )
+        store2_avx2(_mm256_sad_epu8(a,load2_avx2(I2_blocks[i],I2_blocks[i+1])),E+i);
+      if( i<n )
+        E[i] = sad16_sse(_mm256_castsi256_si128(a),I2_blocks[i]);
+    }
+
+    void sadSupport_avx2( const uint8_t* I1_block, const uint8_t* I2_block, int32_t step,
+                          const int32_t* offsets, int32_t n, int32_t* E ) {
+      __m256i a1 = broadcast_avx2(I1_block+offsets[0]);
+      __m256i a2 = broadcast_avx2(I1_block+offsets[1]);
+      __m256i a3 = broadcast_avx2(I1_block+offsets[2]);
+      __m256i a4 = broadcast_avx2(I1_block+offsets[3]);
+      int32_t i = 0;
+      for( ; i+1<n; i+=2 ) {
+        const uint8_t* b0 = I2_block+i*step;
+        const uint8_t* b1 = b0+step;
+        __m256i s =                   _mm256_sad_epu8(a1,load2_avx2(b0+offsets[0],b1+offsets[0]));
+        s = _mm256_add_epi32(s,_mm256_sad_epu8(a2,load2_avx2(b0+offsets[1],b1+offsets[1])));
+        s = _mm256_add_epi32(s,_mm256_sad_epu8(a3,load2_avx2(b0+offsets[2],b1+offsets[2])));
+        s = _mm256_add_epi32(s,_mm256_sad_epu8(a4,load2_avx2(b0+offsets[3],b1+offsets[3])));
+        store2_avx2(s,E+i);
+      }
+      if( i<n ) {
+        const uint8_t* b0 = I2_block+i*step;
+        E[i] = sad16_sse(_mm256_castsi256_si128(a1),b0+offsets[0])+
+               sad16_sse(_mm256_castsi256_si128(a2),b0+offsets[1])+
+               sad16_sse(_mm256_castsi256_si128(a3),b0+offsets[2])+
+               sad16_sse(_mm256_castsi256_si128(a4),b0+offsets[3]);
+      }
+    }
+  }
+
+  const table* avx2() {
+    static const table t = { "avx2", detail::sobel3x3_avx2, detail::sadStrided_avx2,
+                             detail::sadGather_avx2, detail::sadSupport_avx2 };
+    return &t;
+  }
+}
@@ -36,6 +36,12 @@ elasWrapper::elasWrapper(double _io_scaling_factor, string elas_setting) : Elas(
     param.postprocess_only_left = true;
 
     io_scaling_factor = _io_scaling_factor;
+
+    coarse = NULL;
+    refine_radius = 2;
+    coarse_time = 0.0;
+    if (elas_setting == "COARSE_TO_FINE")
+        coarse = new elasWrapper();
 }
 
 elasWrapper::elasWrapper() : Elas(parameters(ROBOTICS))
@@ -43,6 +49,78 @@ elasWrapper::elasWrapper() : Elas(parameters(ROBOTICS))
     param.postprocess_only_left = true;
 
     io_scaling_factor = 1.0;
+
+    coarse = NULL;
+    refine_radius = 2;
+    coarse_time = 0.0;
+}
+
+elasWrapper::~elasWrapper()
+{
+    delete coarse;
+}
+
+bool elasWrapper::match(cv::Mat &imL, cv::Mat &imR)
+{
+    const int32_t dims[3] = {imL.cols,imL.rows,(int32_t)imL.step};
+    coarse_time = 0.0;
+
+    if (coarse==NULL || param.subsampling)
+        return process((unsigned char*)imL.data,(unsigned char*)imR.data,
+                       (float*)dispL_buf.data, (float*)dispR_buf.data, dims);
+
+    // coarse level: same parameters on half the resolution and half the range
+    int64 coarse_begin = workBegin();
+    coarse->param = param;
+    coarse->param.disp_min = param.disp_min/2;
+    coarse->param.disp_max = (param.disp_max+1)/2 - 1;
+
+    Size coarse_size((imL.cols+1)/2, (imL.rows+1)/2);
+    create_aligned_input(coarse->imL_gray, coarse_size);
+    create_aligned_input(coarse->imR_gray, coarse_size);
+    pyrDown(imL, coarse->imL_gray, coarse_size);
+    pyrDown(imR, coarse->imR_gray, coarse_size);
+
+    dispL_coarse.create(coarse_size, CV_32FC1);
+    dispR_coarse.create(coarse_size, CV_32FC1);
+    const int32_t dims_coarse[3] = {coarse_size.width,coarse_size.height,(int32_t)coarse->imL_gray.step};
+
+    // too few support points at the coarse level: plain matching
+    bool coarse_success = coarse->process(coarse->imL_gray.data, coarse->imR_gray.data,
+                                          (float*)dispL_coarse.data, (float*)dispR_coarse.data, dims_coarse);
+    coarse_time = 1e3*workEnd(coarse_begin);
+    if (!coarse_success)
+        return process((unsigned char*)imL.data,(unsigned char*)imR.data,
+                       (float*)dispL_buf.data, (float*)dispR_buf.data, dims);
+
+    // the nearest neighbor keeps the invalid pixels apart (they stay negative)
+    resize(dispL_coarse, disp_prior, imL.size(), 0, 0, INTER_NEAREST);
+    disp_prior *= 2.0;
+
+    return refine((unsigned char*)imL.data,(unsigned char*)imR.data,(float*)disp_prior.data,
+                  refine_radius,(float*)dispL_buf.data,(float*)dispR_buf.data,dims);
+}
+
+void elasWrapper::reset_prior()
+{
+    resetPrior();
+    if (coarse!=NULL)
+        coarse->resetPrior();
+}
+
+void elasWrapper::copy_settings(const elasWrapper &other)
+{
+    param = other.param;
+    io_scaling_factor = other.io_scaling_factor;
+    refine_radius = other.refine_radius;
+
+    if (other.coarse!=NULL && coarse==NULL)
+        coarse = new elasWrapper();
+    else if (other.coarse==NULL && coarse!=NULL)
+    {
+        delete coarse;
+        coarse = NULL;
+    }
 }
 
 bool elasWrapper::compute_disparity(cv::Mat &imL, cv::Mat &imR, cv::Mat &dispL, int num_disparities)
@@ -62,57 +140,126 @@ bool elasWrapper::compute_disparity(cv::Mat &imL, cv::Mat &imR, cv::Mat &dispL,
 
     param.disp_max = num_disparities - 1;
 
-    Mat imR_scaled, imL_scaled;
+    // the input images are only read by Elas::process, hence they are
+    // never cloned: scaling and color conversion go to persistent buffers
+    Mat imL_in = imL, imR_in = imR;
     if (io_scaling_factor!=1.0)
     {
         resize(imR, imR_scaled, Size(), io_scaling_factor, io_scaling_factor);
         resize(imL, imL_scaled, Size(), io_scaling_factor, io_scaling_factor);
-    } else
-    {
-        imR_scaled = imR.clone();
-        imL_scaled = imL.clone();
+        imL_in = imL_scaled;
+        imR_in = imR_scaled;
     }
-    int width = imL_scaled.cols;
-    int height = imL_scaled.rows;
+    int width = imL_in.cols;
+    int height = imL_in.rows;
 
     int width_disp_data = param.subsampling ? width>>1 : width;
     int height_disp_data = param.subsampling ? height>>1 : height;
 
-    float *dispL_data = (float*) malloc(width_disp_data * height_disp_data * sizeof(float));
-    float *dispR_data = (float*) malloc(width_disp_data * height_disp_data * sizeof(float));
+    dispL_buf.create(height_disp_data, width_disp_data, CV_32FC1);
+    dispR_buf.create(height_disp_data, width_disp_data, CV_32FC1);
 
-    // prepare input images
-    if (imL_scaled.channels() == 3)
+    // prepare input images (the gray buffers have the aligned layout and
+    // are thus used in place by Elas::process)
+    if (imL_in.channels() == 3)
     {
-        cv::cvtColor(imL_scaled, imL_scaled, CV_BGR2GRAY);
-        cv::cvtColor(imR_scaled, imR_scaled, CV_BGR2GRAY);
+        create_aligned_input(imL_gray, imL_in.size());
+        create_aligned_input(imR_gray, imR_in.size());
+        cv::cvtColor(imL_in, imL_gray, CV_BGR2GRAY);
+        cv::cvtColor(imR_in, imR_gray, CV_BGR2GRAY);
+        imL_in = imL_gray;
+        imR_in = imR_gray;
     }
-    if (!imL_scaled.isContinuous())
-        imL_scaled = imL_scaled.clone();
-    if (!imR_scaled.isContinuous())
-        imR_scaled = imR_scaled.clone();
 
-    // compute disparity
-    const int32_t dims[3] = {width,height,width}; // bytes per line = width
+    // Elas::process handles any stride, provided it is shared by both images
+    if (imL_in.step != imR_in.step)
+    {
+        imL_in = imL_in.clone();
+        imR_in = imR_in.clone();
+    }
 
-    bool success = process((unsigned char*)imL_scaled.data,(unsigned char*)imR_scaled.data, dispL_data, dispR_data, dims);
+    // compute disparity
+    bool success = match(imL_in, imR_in);
 
     if (success)
     {
-        Mat dispL_scaled = Mat(height_disp_data, width_disp_data, CV_32FC1, dispL_data);
-
         if (io_scaling_factor!=1.0 || param.subsampling==true)
-            resize(dispL_scaled, dispL, im_size);
+            resize(dispL_buf, dispL, im_size);
         else
-            dispL = dispL_scaled.clone();
+            dispL_buf.copyTo(dispL);
     }
 
-    free(dispL_data);
-    free(dispR_data);
+    return success;
+}
+
+bool elasWrapper::compute_disparity_aligned(cv::Mat &imL, cv::Mat &imR, cv::Mat &dispL, int num_disparities)
+{
+    if (io_scaling_factor!=1.0)
+        return compute_disparity(imL, imR, dispL, num_disparities);
+
+    if (!is_aligned_input(imL) || !is_aligned_input(imR) || imL.size()!=imR.size())
+    {
+        cout << "ERROR: Images must be gray, of same size and allocated with create_aligned_input()" << endl;
+        return false;
+    }
+
+    param.disp_max = num_disparities - 1;
+
+    int width = imL.cols;
+    int height = imL.rows;
+
+    int width_disp_data = param.subsampling ? width>>1 : width;
+    int height_disp_data = param.subsampling ? height>>1 : height;
+
+    dispL_buf.create(height_disp_data, width_disp_data, CV_32FC1);
+    dispR_buf.create(height_disp_data, width_disp_data, CV_32FC1);
+
+    bool success = match(imL, imR);
+
+    if (success)
+    {
+        if (param.subsampling==true)
+            resize(dispL_buf, dispL, imL.size());
+        else
+            dispL_buf.copyTo(dispL);
+    }
 
     return success;
 }
 
+void elasWrapper::create_aligned_input(cv::Mat &im, cv::Size size)
+{
+    if (is_aligned_input(im) && im.size()==size)
+        return;
+
+    // allocate zeroed rows of bpl bytes (cv::fastMalloc aligns the data to at
+    // least 16 bytes) and keep a header to the valid columns only, so that the
+    // padding is never written afterwards
+    int bpl = Elas::getAlignedBytesPerLine(size.width);
+    Mat buf(size.height, bpl, CV_8UC1, Scalar(0));
+    im = buf.colRange(0, size.width);
+}
+
+bool elasWrapper::is_aligned_input(const cv::Mat &im)
+{
+    return !im.empty() && im.type()==CV_8UC1 &&
+           im.step==(size_t)Elas::getAlignedBytesPerLine(im.cols) &&
+           ((size_t)im.data)%16==0;
+}
+
+void elasWrapper::get_aligned_inputs(cv::Size size, cv::Mat &imL, cv::Mat &imR)
+{
+    create_aligned_input(imL_gray, size);
+    create_aligned_input(imR_gray, size);
+    imL = imL_gray;
+    imR = imR_gray;
+}
+
+double elasWrapper::get_io_scaling_factor()
+{
+    return io_scaling_factor;
+}
+
 int elasWrapper::get_disp_min()
 {
     return param.disp_min;
@@ -205,6 +352,34 @@ bool elasWrapper::get_subsampling()
 {
     return param.subsampling;
 }
+int elasWrapper::get_num_threads()
+{
+    return param.num_threads;
+}
+bool elasWrapper::get_temporal_prior()
+{
+    return param.temporal_prior;
+}
+int elasWrapper::get_prior_radius()
+{
+    return param.prior_radius;
+}
+int elasWrapper::get_prior_refresh()
+{
+    return param.prior_refresh;
+}
+float elasWrapper::get_prior_min_ratio()
+{
+    return param.prior_min_ratio;
+}
+bool elasWrapper::get_incremental_delaunay()
+{
+    return param.incremental_delaunay;
+}
+int elasWrapper::get_refine_radius()
+{
+    return refine_radius;
+}
 
 
 void elasWrapper::set_disp_min(int param_value)
@@ -299,3 +474,32 @@ void elasWrapper::set_subsampling(bool param_value)
 {
     param.subsampling = param_value;
 }
+void elasWrapper::set_num_threads(int param_value)
+{
+    param.num_threads = param_value;
+}
+void elasWrapper::set_temporal_prior(bool param_value)
+{
+    param.temporal_prior = param_value;
+    reset_prior();
+}
+void elasWrapper::set_prior_radius(int param_value)
+{
+    param.prior_radius = param_value;
+}
+void elasWrapper::set_prior_refresh(int param_value)
+{
+    param.prior_refresh = param_value;
+}
+void elasWrapper::set_prior_min_ratio(float param_value)
+{
+    param.prior_min_ratio = param_value;
+}
+void elasWrapper::set_incremental_delaunay(bool param_value)
+{
+    param.incremental_delaunay = param_value;
+}
+void elasWrapper::set_refine_radius(int param_value)
+{
+    refine_radius = param_value;
+}
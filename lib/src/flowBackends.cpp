@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#include <cstdio>
+
+#include <opencv2/opencv_modules.hpp>
+#if defined(HAVE_OPENCV_CUDAOPTFLOW) && defined(HAVE_OPENCV_CUDAIMGPROC)
+    #define FLOW_BACKEND_CUDA
+    #include <opencv2/cudaoptflow.hpp>
+    #include <opencv2/cudaimgproc.hpp>
+#endif
+
+#include "iCub/stereoVision/flowBackends.h"
+
+using namespace std;
+using namespace cv;
+using namespace yarp::os;
+
+
+namespace
+{
+    // Farneback at full resolution (the historical dense flow)
+    class FarnebackBackend : public FlowBackend
+    {
+        Mat grayPrev,grayNext;
+
+    public:
+        string getName() const { return "farneback"; }
+
+        void compute(const Mat &prev, const Mat &next, Mat &flow)
+        {
+            cvtColor(prev,grayPrev,COLOR_RGB2GRAY,1);
+            cvtColor(next,grayNext,COLOR_RGB2GRAY,1);
+            calcOpticalFlowFarneback(grayPrev,grayNext,flow,0.25,5,9,5,7,1.5,0);
+        }
+    };
+
+
+    // Farneback on downscaled images, the flow is upsampled and rescaled
+    class FarnebackPyrBackend : public FlowBackend
+    {
+        double scale;
+        Mat grayPrev,grayNext;
+        Mat smallPrev,smallNext;
+
+    public:
+        FarnebackPyrBackend(const double _scale) : scale(_scale) { }
+
+        string getName() const { return "farneback_pyr"; }
+
+        void compute(const Mat &prev, const Mat &next, Mat &flow)
+        {
+            cvtColor(prev,grayPrev,COLOR_RGB2GRAY,1);
+            cvtColor(next,grayNext,COLOR_RGB2GRAY,1);
+            resize(grayPrev,smallPrev,Size(),scale,scale,INTER_AREA);
+            resize(grayNext,smallNext,Size(),scale,scale,INTER_AREA);
+
+            // fewer levels are needed on the smaller images
+            Mat smallFlow;
+            calcOpticalFlowFarneback(smallPrev,smallNext,smallFlow,0.5,3,9,3,7,1.5,0);
+
+            resize(smallFlow,flow,prev.size(),0,0,INTER_LINEAR);
+            flow*=1.0/scale;
+        }
+    };
+
+
+#if CV_MAJOR_VERSION>=4
+    // DIS optical flow, fast preset
+    class DISBackend : public FlowBackend
+    {
+        Ptr<DISOpticalFlow> dis;
+        Mat grayPrev,grayNext;
+
+    public:
+        DISBackend() : dis(DISOpticalFlow::create(DISOpticalFlow::PRESET_FAST)) { }
+
+        string getName() const { return "dis"; }
+
+        void compute(const Mat &prev, const Mat &next, Mat &flow)
+        {
+            cvtColor(prev,grayPrev,COLOR_RGB2GRAY,1);
+            cvtColor(next,grayNext,COLOR_RGB2GRAY,1);
+            dis->calc(grayPrev,grayNext,flow);
+        }
+    };
+#endif
+
+
+#ifdef FLOW_BACKEND_CUDA
+    // Farneback on the GPU, the device buffers are kept across frames
+    class CudaFarnebackBackend : public FlowBackend
+    {
+        Ptr<cuda::FarnebackOpticalFlow> farneback;
+        cuda::GpuMat d_prev,d_next,d_grayPrev,d_grayNext,d_flow;
+
+    public:
+        CudaFarnebackBackend() :
+            farneback(cuda::FarnebackOpticalFlow::create(5,0.25,false,9,5,7,1.5,0)) { }
+
+        string getName() const { return "cuda"; }
+
+        void compute(const Mat &prev, const Mat &next, Mat &flow)
+        {
+            d_prev.upload(prev);
+            d_next.upload(next);
+            cuda::cvtColor(d_prev,d_grayPrev,COLOR_RGB2GRAY,1);
+            cuda::cvtColor(d_next,d_grayNext,COLOR_RGB2GRAY,1);
+            farneback->calc(d_grayPrev,d_grayNext,d_flow);
+            d_flow.download(flow);
+        }
+    };
+#endif
+}
+
+
+/******************************************************************************/
+FlowBackend* FlowBackend::createDense(const string &name, ResourceFinder &rf)
+{
+    if (name=="farneback")
+        return new FarnebackBackend();
+
+    if (name=="farneback_pyr")
+    {
+        double scale=rf.check("flowScale",Value(0.5)).asDouble();
+        if ((scale<=0.0) || (scale>1.0))
+            scale=0.5;
+        return new FarnebackPyrBackend(scale);
+    }
+
+#if CV_MAJOR_VERSION>=4
+    if (name=="dis")
+        return new DISBackend();
+#endif
+
+#ifdef FLOW_BACKEND_CUDA
+    if (name=="cuda")
+        return new CudaFarnebackBackend();
+#endif
+
+    return NULL;
+}
+
+
+/******************************************************************************/
+SparseFlowTracker::SparseFlowTracker(yarp::os::ResourceFinder &rf)
+{
+    maxCorners=rf.check("sparseMaxCorners",Value(1000)).asInt();
+    redetect=rf.check("sparseRedetect",Value(5)).asInt();
+    maxError=rf.check("sparseMaxError",Value(20.0)).asDouble();
+    winSize=7;
+    levels=5;
+    framesSinceDetection=0;
+}
+
+
+/******************************************************************************/
+void SparseFlowTracker::reset()
+{
+    pyrPrev.clear();
+    ptsPrev.clear();
+    lastImage.release();
+}
+
+
+/******************************************************************************/
+void SparseFlowTracker::compute(const Mat &prev, const Mat &next, Mat &flow)
+{
+    flow.create(next.rows,next.cols,CV_32FC2);
+    flow.setTo(Scalar(0));
+
+    // the previous image is the last current one: its pyramid is already there
+    if (lastImage.empty() || (prev.data!=lastImage.data) || pyrPrev.empty() ||
+        (grayPrev.size()!=prev.size()))
+    {
+        cvtColor(prev,grayPrev,COLOR_RGB2GRAY);
+        buildOpticalFlowPyramid(grayPrev,pyrPrev,Size(winSize,winSize),levels);
+        ptsPrev.clear();
+    }
+
+    if (ptsPrev.empty() || (framesSinceDetection>=redetect) || ((int)ptsPrev.size()<maxCorners/2))
+    {
+        goodFeaturesToTrack(grayPrev,ptsPrev,maxCorners,0.001,5.0,noArray(),3,false,0.04);
+        framesSinceDetection=0;
+    }
+
+    cvtColor(next,grayNext,COLOR_RGB2GRAY);
+    buildOpticalFlowPyramid(grayNext,pyrNext,Size(winSize,winSize),levels);
+
+    if (!ptsPrev.empty())
+        calcOpticalFlowPyrLK(pyrPrev,pyrNext,ptsPrev,ptsNext,status,err,Size(winSize,winSize),levels,
+                             TermCriteria(TermCriteria::COUNT|TermCriteria::EPS,20,0.3));
+    else
+        ptsNext.clear();
+
+    // the good tracks are kept to be tracked in the next frame
+    size_t kept=0;
+    for (size_t k=0; k<ptsNext.size(); k++)
+    {
+        if ((status[k]==0) || (err[k]>=maxError))
+            continue;
+
+        int u=cvRound(ptsPrev[k].x);
+        int v=cvRound(ptsPrev[k].y);
+        const Point2f &q=ptsNext[k];
+        if ((u<0) || (u>=flow.cols) || (v<0) || (v>=flow.rows) ||
+            (q.x<0) || (q.x>=flow.cols) || (q.y<0) || (q.y>=flow.rows))
+            continue;
+
+        float *f=flow.ptr<float>(v)+2*u;
+        f[0]=q.x-ptsPrev[k].x;
+        f[1]=q.y-ptsPrev[k].y;
+        ptsNext[kept++]=q;
+    }
+    ptsNext.resize(kept);
+
+    // the current frame becomes the previous one without copies
+    cv::swap(grayPrev,grayNext);
+    pyrPrev.swap(pyrNext);
+    ptsPrev.swap(ptsNext);
+    lastImage=next;
+    framesSinceDetection++;
+}
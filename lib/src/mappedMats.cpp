@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+#include "iCub/stereoVision/mappedMats.h"
+
+using namespace std;
+using namespace cv;
+
+
+namespace
+{
+    const char fileMagic[8]={'S','T','E','R','E','O','M','T'};
+    const uint32_t fileVersion=1;
+    const size_t fileAlign=64;
+    const uint32_t maxMats=256;
+
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t count;
+        uint64_t key;
+        char reserved[40];
+    };
+
+    struct MatHeader
+    {
+        int32_t rows,cols,type,reserved;
+        uint64_t offset;
+    };
+
+    inline size_t alignUp(const size_t x)
+    {
+        return (x+fileAlign-1)&~(fileAlign-1);
+    }
+}
+
+
+/******************************************************************************/
+MappedMatFile::MappedMatFile() : data(NULL), length(0), key(0)
+{
+#ifdef _WIN32
+    file=mapping=NULL;
+#else
+    fd=-1;
+#endif
+}
+
+
+/******************************************************************************/
+MappedMatFile::~MappedMatFile()
+{
+    close();
+}
+
+
+/******************************************************************************/
+bool MappedMatFile::write(const string &path, const uint64_t key, const vector<Mat> &mats)
+{
+    if (mats.size()>maxMats)
+        return false;
+
+    FileHeader header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,fileMagic,sizeof(fileMagic));
+    header.version=fileVersion;
+    header.count=(uint32_t)mats.size();
+    header.key=key;
+
+    vector<MatHeader> table(mats.size());
+    size_t off=alignUp(sizeof(FileHeader)+table.size()*sizeof(MatHeader));
+    for (size_t i=0; i<mats.size(); i++)
+    {
+        table[i].rows=mats[i].rows;
+        table[i].cols=mats[i].cols;
+        table[i].type=mats[i].type();
+        table[i].reserved=0;
+        table[i].offset=off;
+        off=alignUp(off+mats[i].total()*mats[i].elemSize());
+    }
+
+    // written aside and renamed, a reader never sees a partial file
+    string tmp=path+".tmp";
+    FILE *f=fopen(tmp.c_str(),"wb");
+    if (f==NULL)
+        return false;
+
+    static const char zeros[fileAlign]={0};
+    bool ok=(fwrite(&header,sizeof(header),1,f)==1) &&
+            (table.empty() || (fwrite(&table[0],sizeof(MatHeader),table.size(),f)==table.size()));
+    size_t pos=sizeof(FileHeader)+table.size()*sizeof(MatHeader);
+    for (size_t i=0; ok && (i<mats.size()); i++)
+    {
+        ok=(fwrite(zeros,1,(size_t)table[i].offset-pos,f)==(size_t)table[i].offset-pos);
+        pos=(size_t)table[i].offset;
+
+        size_t rowSize=mats[i].cols*mats[i].elemSize();
+        for (int v=0; ok && (v<mats[i].rows); v++)
+            ok=(fwrite(mats[i].ptr(v),1,rowSize,f)==rowSize);
+        pos+=rowSize*mats[i].rows;
+    }
+    ok=(fwrite(zeros,1,off-pos,f)==off-pos) && ok;
+    ok=(fclose(f)==0) && ok;
+
+#ifdef _WIN32
+    if (ok)
+        remove(path.c_str());
+#endif
+    if (!ok || (rename(tmp.c_str(),path.c_str())!=0))
+    {
+        remove(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+/******************************************************************************/
+bool MappedMatFile::open(const string &path)
+{
+    close();
+
+#ifdef _WIN32
+    file=CreateFileA(path.c_str(),GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,
+                     FILE_ATTRIBUTE_NORMAL,NULL);
+    if (file==INVALID_HANDLE_VALUE)
+    {
+        file=NULL;
+        return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file,&fileSize) || (fileSize.QuadPart<(LONGLONG)sizeof(FileHeader)))
+    {
+        close();
+        return false;
+    }
+    length=(size_t)fileSize.QuadPart;
+
+    mapping=CreateFileMappingA(file,NULL,PAGE_WRITECOPY,0,0,NULL);
+    if (mapping!=NULL)
+        data=(unsigned char*)MapViewOfFile(mapping,FILE_MAP_COPY,0,0,0);
+#else
+    fd=::open(path.c_str(),O_RDONLY);
+    if (fd<0)
+        return false;
+
+    struct stat st;
+    if ((fstat(fd,&st)!=0) || (st.st_size<(off_t)sizeof(FileHeader)))
+    {
+        close();
+        return false;
+    }
+    length=(size_t)st.st_size;
+
+    void *addr=mmap(NULL,length,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+    if (addr!=MAP_FAILED)
+        data=(unsigned char*)addr;
+#endif
+
+    if (data==NULL)
+    {
+        close();
+        return false;
+    }
+
+    const FileHeader *header=(const FileHeader*)data;
+    if ((memcmp(header->magic,fileMagic,sizeof(fileMagic))!=0) ||
+        (header->version!=fileVersion) || (header->count>maxMats) ||
+        (sizeof(FileHeader)+header->count*sizeof(MatHeader)>length))
+    {
+        close();
+        return false;
+    }
+
+    const MatHeader *table=(const MatHeader*)(data+sizeof(FileHeader));
+    mats.resize(header->count);
+    for (uint32_t i=0; i<header->count; i++)
+    {
+        const MatHeader &m=table[i];
+        if ((m.rows<0) || (m.cols<0) || (CV_MAT_TYPE(m.type)!=m.type) || (m.offset>length))
+        {
+            close();
+            return false;
+        }
+
+        // each factor is bounded by the bytes left after the offset before
+        // the product, which then cannot overflow
+        uint64_t left=length-m.offset;
+        uint64_t line=(uint64_t)m.cols*CV_ELEM_SIZE(m.type);
+        if ((line>left) || ((line>0) && ((uint64_t)m.rows>left/line)))
+        {
+            close();
+            return false;
+        }
+
+        // views on the mapped pages
+        if ((m.rows>0) && (m.cols>0))
+            mats[i]=Mat(m.rows,m.cols,m.type,data+m.offset);
+        else
+            mats[i]=Mat();
+    }
+
+    key=header->key;
+    return true;
+}
+
+
+/******************************************************************************/
+void MappedMatFile::close()
+{
+#ifdef _WIN32
+    if (data!=NULL)
+        UnmapViewOfFile(data);
+    if (mapping!=NULL)
+        CloseHandle(mapping);
+    if (file!=NULL)
+        CloseHandle(file);
+    file=mapping=NULL;
+#else
+    if (data!=NULL)
+        munmap(data,length);
+    if (fd>=0)
+        ::close(fd);
+    fd=-1;
+#endif
+
+    data=NULL;
+    length=0;
+    key=0;
+    mats.clear();
+}
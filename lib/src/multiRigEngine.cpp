@@ -0,0 +1,398 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#include <algorithm>
+
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+#include "iCub/stereoVision/multiRigEngine.h"
+
+using namespace std;
+using namespace cv;
+using namespace yarp::os;
+
+
+namespace
+{
+    // a buffer of the pool not referenced by anybody else
+    Mat freeBuffer(vector<Mat> &pool, const Size &size, const int type)
+    {
+        for (size_t i=0; i<pool.size(); i++)
+        {
+#ifdef OPENCV_GREATER_2
+            bool shared=(pool[i].u!=NULL) && (pool[i].u->refcount>1);
+#else
+            bool shared=(pool[i].refcount!=NULL) && (*pool[i].refcount>1);
+#endif
+            if (!shared)
+            {
+                pool[i].create(size,type);
+                return pool[i];
+            }
+        }
+
+        Mat buffer(size,type);
+        if (pool.size()<4)
+            pool.push_back(buffer);
+        return buffer;
+    }
+}
+
+
+/******************************************************************************/
+RigOptions::RigOptions() : priority(1), fps(0.0), reproject(true), map8(true),
+                           rectified(false)
+{
+    // the defaults of SFM
+    disparity.best=true;
+    disparity.uniquenessRatio=15;
+    disparity.speckleWindowSize=50;
+    disparity.speckleRange=16;
+    disparity.numberOfDisparities=96;
+    disparity.SADWindowSize=7;
+    disparity.minDisparity=0;
+    disparity.preFilterCap=63;
+    disparity.disp12MaxDiff=0;
+}
+
+
+/******************************************************************************/
+class MultiRigEngine::DisparityJob : public WorkerPool::Job
+{
+    MultiRigEngine &engine;
+    int rig;
+
+public:
+    DisparityJob(MultiRigEngine &_engine, const int _rig) : engine(_engine), rig(_rig) { }
+    void run() { engine.runDisparity(rig); }
+};
+
+
+/******************************************************************************/
+class MultiRigEngine::WorldJob : public WorkerPool::Job
+{
+    MultiRigEngine &engine;
+    int rig;
+
+public:
+    WorldJob(MultiRigEngine &_engine, const int _rig) : engine(_engine), rig(_rig) { }
+    void run() { engine.runWorld(rig); }
+};
+
+
+/******************************************************************************/
+MultiRigEngine::MultiRigEngine(const int threads) : pool(threads), busyRigs(0),
+                                                    running(false)
+{
+}
+
+
+/******************************************************************************/
+MultiRigEngine::~MultiRigEngine()
+{
+    stop();
+
+    for (size_t i=0; i<rigs.size(); i++)
+        delete rigs[i];
+}
+
+
+/******************************************************************************/
+int MultiRigEngine::addRig(StereoCamera *stereo, const RigOptions &options,
+                           RigListener *listener)
+{
+    if (running || (stereo==NULL))
+        return -1;
+
+    Rig *r=new Rig;
+    r->stereo=stereo;
+    r->options=options;
+    r->options.priority=std::max(0,std::min(options.priority,WorkerPool::numPriorities-1));
+    r->listener=listener;
+
+    r->stageQueue=r->stats.addStage("queue");
+    r->stageDisparity=r->stats.addStage("disparity");
+    r->stageWorld=r->stats.addStage("world3d");
+    r->stageFrame=r->stats.addStage("frame");
+    stereo->setStageStats(&r->stats);
+
+    r->busy=r->hasPending=false;
+    r->currentSubmitted=r->pendingSubmitted=0.0;
+    r->nextDue=r->lastDone=0.0;
+    r->counters.submitted=r->counters.processed=0;
+    r->counters.dropped=r->counters.throttled=0;
+    r->counters.fps=0.0;
+
+    rigs.push_back(r);
+    return (int)rigs.size()-1;
+}
+
+
+/******************************************************************************/
+bool MultiRigEngine::start()
+{
+    if (running)
+        return true;
+
+    if (!pool.start())
+        return false;
+
+    running=true;
+    return true;
+}
+
+
+/******************************************************************************/
+void MultiRigEngine::stop()
+{
+    if (!running)
+        return;
+
+    // once through the locks no frame can be submitted or started anymore
+    running=false;
+    for (size_t i=0; i<rigs.size(); i++)
+    {
+        LockGuard lg(rigs[i]->mutex);
+        if (rigs[i]->hasPending)
+        {
+            rigs[i]->counters.dropped++;
+            rigs[i]->pending=RigFrame();
+            rigs[i]->hasPending=false;
+        }
+    }
+
+    for (size_t i=0; i<rigs.size(); i++)
+        waitIdle((int)i);
+
+    pool.stop();
+}
+
+
+/******************************************************************************/
+bool MultiRigEngine::submit(const int rig, const RigFrame &frame)
+{
+    if ((rig<0) || (rig>=(int)rigs.size()))
+        return false;
+
+    Rig &r=*rigs[rig];
+    double now=StageStats::now();
+
+    r.mutex.lock();
+    if (!running)
+    {
+        r.mutex.unlock();
+        return false;
+    }
+
+    r.counters.submitted++;
+
+    // a quarter of period of jitter on the arrival of the frames is tolerated
+    if (r.options.fps>0.0)
+    {
+        double period=1.0/r.options.fps;
+        if (now<r.nextDue-0.25*period)
+        {
+            r.counters.throttled++;
+            r.mutex.unlock();
+            return false;
+        }
+        r.nextDue=std::max(r.nextDue,now-0.25*period)+period;
+    }
+
+    // the freshest frame waits for the one being processed
+    if (r.busy)
+    {
+        if (r.hasPending)
+            r.counters.dropped++;
+        r.pending=frame;
+        r.pendingSubmitted=now;
+        r.hasPending=true;
+        r.mutex.unlock();
+        return true;
+    }
+
+    r.busy=true;
+    r.current=frame;
+    r.currentSubmitted=now;
+    r.idle=JobHandle::create();
+    r.mutex.unlock();
+
+    mutexBusy.lock();
+    busyRigs++;
+    mutexBusy.unlock();
+
+    startFrame(rig);
+    return true;
+}
+
+
+/******************************************************************************/
+void MultiRigEngine::waitIdle(const int rig)
+{
+    if ((rig<0) || (rig>=(int)rigs.size()))
+        return;
+
+    Rig &r=*rigs[rig];
+    r.mutex.lock();
+    JobHandle idle=r.busy?r.idle:JobHandle();
+    r.mutex.unlock();
+
+    idle.wait();
+}
+
+
+/******************************************************************************/
+RigStats MultiRigEngine::getRigStats(const int rig)
+{
+    LockGuard lg(rigs[rig]->mutex);
+    return rigs[rig]->counters;
+}
+
+
+/******************************************************************************/
+void MultiRigEngine::startFrame(const int rig)
+{
+    pool.submit(Ptr<WorkerPool::Job>(new DisparityJob(*this,rig)),rigs[rig]->options.priority);
+}
+
+
+/******************************************************************************/
+void MultiRigEngine::setTeamSize()
+{
+#ifdef _OPENMP
+    mutexBusy.lock();
+    int busy=std::max(busyRigs,1);
+    mutexBusy.unlock();
+
+    // the team of the parallel regions opened by the calling worker
+    omp_set_num_threads(std::max(pool.getNumThreads()/busy,1));
+#endif
+}
+
+
+/******************************************************************************/
+void MultiRigEngine::runDisparity(const int rig)
+{
+    // while busy, the frame and the result are touched by the worker of the rig only
+    Rig &r=*rigs[rig];
+    RigFrame &frame=r.current;
+
+    double t0=StageStats::now();
+    r.stats.record(r.stageQueue,t0-r.currentSubmitted);
+
+    setTeamSize();
+
+    if (!frame.R.empty() && !frame.T.empty())
+    {
+        Mat R=frame.R.clone();
+        Mat T=frame.T.clone();
+        r.stereo->setRotation(R,0);
+        r.stereo->setTranslation(T,0);
+    }
+
+    IplImage left=frame.left;
+    IplImage right=frame.right;
+    r.stereo->setImages(&left,&right);
+
+    // the camera never writes an output buffer still referenced by a result
+    const DisparityParams &p=r.options.disparity;
+    r.stereo->setDisparityOutputs(r.options.map8,true,false);
+    r.stereo->computeDisparity(p.best,p.uniquenessRatio,p.speckleWindowSize,p.speckleRange,
+                               p.numberOfDisparities,p.SADWindowSize,p.minDisparity,
+                               p.preFilterCap,p.disp12MaxDiff);
+
+    r.result=RigResult();
+    r.result.rig=rig;
+    r.result.stamp=frame.stamp;
+    if (r.options.map8)
+        r.result.disp8=r.stereo->getDisparity();
+    r.result.disp16=r.stereo->getDisparity16();
+    if (r.options.rectified)
+        r.result.rectLeft=r.stereo->getLRectified().clone();
+
+    r.stats.stop(r.stageDisparity,t0);
+
+    // queued on this worker, it takes it next unless an idle one steals it
+    if (r.options.reproject && !r.result.disp16.empty())
+        pool.submit(Ptr<WorkerPool::Job>(new WorldJob(*this,rig)),r.options.priority);
+    else
+        finishFrame(rig);
+}
+
+
+/******************************************************************************/
+void MultiRigEngine::runWorld(const int rig)
+{
+    Rig &r=*rigs[rig];
+    double t0=StageStats::now();
+
+    Mat world=freeBuffer(r.worldPool,r.result.disp16.size(),CV_32FC3);
+    Mat H=r.current.H;
+    if (r.stereo->computeWorldImage(H,world))
+        r.result.world=world;
+
+    r.stats.stop(r.stageWorld,t0);
+    finishFrame(rig);
+}
+
+
+/******************************************************************************/
+void MultiRigEngine::finishFrame(const int rig)
+{
+    Rig &r=*rigs[rig];
+    double now=StageStats::now();
+    r.result.latency=now-r.currentSubmitted;
+    r.stats.record(r.stageFrame,r.result.latency);
+
+    if (r.listener!=NULL)
+        r.listener->frameDone(r.result);
+
+    r.mutex.lock();
+    r.counters.processed++;
+    if ((r.lastDone>0.0) && (now>r.lastDone))
+    {
+        double fps=1.0/(now-r.lastDone);
+        r.counters.fps=(r.counters.fps>0.0)?0.9*r.counters.fps+0.1*fps:fps;
+    }
+    r.lastDone=now;
+
+    // the buffers go back to the pools unless the listener kept them
+    r.result=RigResult();
+    r.current=RigFrame();
+
+    if (running && r.hasPending)
+    {
+        r.current=r.pending;
+        r.currentSubmitted=r.pendingSubmitted;
+        r.pending=RigFrame();
+        r.hasPending=false;
+        r.mutex.unlock();
+
+        startFrame(rig);
+        return;
+    }
+
+    r.busy=false;
+    JobHandle idle=r.idle;
+    r.mutex.unlock();
+
+    mutexBusy.lock();
+    busyRigs--;
+    mutexBusy.unlock();
+
+    idle.complete();
+}
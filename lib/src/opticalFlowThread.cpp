@@ -21,63 +21,132 @@
 using namespace cv;
 using namespace yarp::os;
 
-OpticalFlowThread::OpticalFlowThread(yarp::os::ResourceFinder &rf) : RateThread(10) 
+OpticalFlowThread::OpticalFlowThread(yarp::os::ResourceFinder &rf) : jobAvailable(0), sparse(rf)
 {
     work=false;
-    done=true;
     int useD= rf.check("denseFlow",Value(1)).asInt();
     this->dense= useD ? true : false;
-    fprintf(stdout, "Optical Flow Thread has started...\n");
+
+    std::string backend=rf.check("flowBackend",Value("farneback")).asString().c_str();
+    denseBackend=FlowBackend::createDense(backend,rf);
+    if (denseBackend==NULL)
+    {
+        fprintf(stdout, "Optical flow backend %s is not available, using farneback\n",backend.c_str());
+        denseBackend=FlowBackend::createDense("farneback",rf);
+    }
+
+    timeLast=timeSum=0.0;
+    timeCount=0;
+
+    fprintf(stdout, "Optical Flow Thread has started (%s)...\n",getBackendName().c_str());
 
 }
 
+OpticalFlowThread::~OpticalFlowThread()
+{
+    delete denseBackend;
+}
+
 void OpticalFlowThread::run() 
 {
-    if(work) 
+    while (!isStopping())
     {
-        if(dense)
-        {
-            Mat leftPrevGray;
-            Mat leftNextGray;
-            cvtColor(leftPrev,leftPrevGray,CV_RGB2GRAY,1);
-            cvtColor(leftNext,leftNextGray,CV_RGB2GRAY,1);
-            int flag=0;
-            if(!optFlow.empty())
-                optFlow.setTo(Scalar(0));
-            
-            calcOpticalFlowFarneback(leftPrevGray,leftNextGray,optFlow,0.25,5,9,5,7,1.5,flag);
-        }
-        else
+        // sleep until setImages() submits a pair (or the thread is stopped)
+        jobAvailable.wait();
+        if (isStopping())
+            break;
+
+        mutexJob.lock();
+        JobHandle running=job;
+        bool todo=work;
+        work=false;
+        FlowBackend *backend=dense?denseBackend:(FlowBackend*)&sparse;
+        Mat prev=leftPrev;
+        Mat next=leftNext;
+        mutexJob.unlock();
+
+        if (!todo)
+            continue;
+
+        Mat flow;
+        double t0=Time::now();
+        backend->compute(prev,next,flow);
+        double dt=Time::now()-t0;
+
+        // a new buffer per job: the previous flow may still be shared with the caller
+        mutexJob.lock();
+        optFlow=flow;
+        timeLast=dt;
+        timeSum+=dt;
+        timeCount++;
+        bool report=(timeCount%100==0);
+        mutexJob.unlock();
+        running.complete();
+
+        if (report)
         {
-            IplImage previous=leftPrev;
-            IplImage current=leftNext;
-            computeFlowSparse(&previous,&current,optFlow);
+            double last,mean;
+            getFlowTime(last,mean);
+            fprintf(stdout, "Optical flow [%s]: %.1f ms per frame (last %.1f ms)\n",
+                    backend->getName().c_str(),1000.0*mean,1000.0*last);
         }
-        done=true;
-        work=false;
-        this->suspend();
     }
+
+    // nobody must wait for a job that will never run
+    mutexJob.lock();
+    if (work)
+        job.drop();
+    work=false;
+    mutexJob.unlock();
 }
 
-void OpticalFlowThread::setImages(Mat &_leftPrev, Mat &_leftNext) 
+JobHandle OpticalFlowThread::setImages(Mat &_leftPrev, Mat &_leftNext) 
 {
+    // the images are taken by run() together with the job; a job
+    // not started yet is superseded by this one
+    mutexJob.lock();
+    if (work)
+        job.drop();
     leftPrev=_leftPrev;
     leftNext=_leftNext;
-    done=false;
-    work=true;
+    job=JobHandle::create();
+    JobHandle handle=job;
+    if (isRunning())
+        work=true;
+    else
+        job.complete();
+    mutexJob.unlock();
+
+    jobAvailable.post();
+    return handle;
 }
 
 void OpticalFlowThread::setFlow(int flowType) 
 {
+    LockGuard lg(mutexJob);
     if(flowType==DENSE)
         dense=true;
     else
         dense=false;
 }
 
+std::string OpticalFlowThread::getBackendName()
+{
+    LockGuard lg(mutexJob);
+    return dense?denseBackend->getName():sparse.getName();
+}
+
+void OpticalFlowThread::getFlowTime(double &last, double &mean)
+{
+    LockGuard lg(mutexJob);
+    last=timeLast;
+    mean=(timeCount>0)?timeSum/timeCount:0.0;
+}
+
 void OpticalFlowThread::getOptFlow(Mat &_optFlow) 
 {
-    _optFlow=optFlow.clone();
+    LockGuard lg(mutexJob);
+    _optFlow=optFlow;
 }
 
 bool OpticalFlowThread::threadInit() 
@@ -92,70 +161,11 @@ void OpticalFlowThread::threadRelease()
 
 bool OpticalFlowThread::checkDone() 
 {
-    return done;
+    LockGuard lg(mutexJob);
+    return job.isDone();
 }
-void OpticalFlowThread::computeFlowSparse(IplImage* previous, IplImage* current, Mat &optFlow)
-{
-    optFlow.setTo(Scalar(0));
-    optFlow.create(previous->height,previous->width,CV_32FC2);
-
-    IplImage* leftPrevGray = cvCreateImage(cvSize(previous->width,previous->height),previous->depth,1);
-    IplImage* leftNextGray = cvCreateImage(cvSize(previous->width,previous->height),previous->depth,1);;
-    IplImage *eigImg=cvCloneImage(previous);
-    IplImage *tmpImg=cvCloneImage(previous);
-    CvSize pyrSize=cvSize(previous->width+8,previous->height/3);
-    IplImage *prevPyr=cvCreateImage(pyrSize,IPL_DEPTH_32F,1);
-    IplImage *currPyr=cvCreateImage(pyrSize,IPL_DEPTH_32F,1);
-
-    cvCvtColor(previous,leftPrevGray,CV_RGB2GRAY);
-    cvCvtColor(current,leftNextGray,CV_RGB2GRAY);
-
-    int max_corners=previous->width*previous->height;;
-    int winSize=7;
-    int lk_error_thresh=200;
-    int corner_count=max_corners;
-
-    CvPoint2D32f *prevCorners=new CvPoint2D32f[max_corners];
-    CvPoint2D32f *currCorners=new CvPoint2D32f[max_corners];
-
-    char *features_found=new char[max_corners];
-    float *feature_errors=new float[max_corners];
-    cvGoodFeaturesToTrack(leftPrevGray,eigImg,tmpImg,prevCorners,&corner_count,0.001,5.0,0,3,0,0.04);
-
-    cvCalcOpticalFlowPyrLK(leftPrevGray,leftNextGray,prevPyr,currPyr,prevCorners,currCorners,corner_count,
-                                cvSize(winSize,winSize),5,features_found,feature_errors,
-                                cvTermCriteria( CV_TERMCRIT_ITER | CV_TERMCRIT_EPS, 20, .3 ),0);
-    for(int k=0; k<corner_count; k++)
-    {
-        if(features_found[k]!=0 && feature_errors[k]<lk_error_thresh)
-        {
-            double deltaX=currCorners[k].x - prevCorners[k].x; //deltaX
-            double deltaY=currCorners[k].y - prevCorners[k].y; // deltaY
-            double distance=sqrt(deltaX*deltaX + deltaY*deltaY);
-            distance=sqrt(distance);
-            optFlow.ptr<float>(cvRound(prevCorners[k].y))[2*cvRound(prevCorners[k].x)]=(float)deltaX;
-            optFlow.ptr<float>(cvRound(prevCorners[k].y))[2*cvRound(prevCorners[k].x)+1]=(float)deltaY;
-        }
-
-    }
-
-    cvReleaseImage(&leftPrevGray);
-    cvReleaseImage(&leftNextGray);
-    cvReleaseImage(&eigImg);
-    cvReleaseImage(&tmpImg);
-    cvReleaseImage(&prevPyr);
-    cvReleaseImage(&currPyr);
-    delete features_found;
-    delete feature_errors;
-    delete prevCorners;
-    delete currCorners;
-}
-
-
 void OpticalFlowThread::onStop()
 {
-    this->work=false;
-    this->done=true;
-
-
+    // wake up run() so that it can see the stop request
+    jobAvailable.post();
 }
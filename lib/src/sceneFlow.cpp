@@ -27,20 +27,46 @@ SceneFlow::SceneFlow(yarp::os::ResourceFinder &rf) : RateThread(10)
     string inputR=rf.check("rightCamera",Value("/icub/camcalib/right/out")).asString().c_str();
 
     string configFileDisparity=rf.check("ConfigDisparity",Value("icubEyes.ini")).asString().c_str();
-    imageL=new ImageOf<PixelRgb>;
-    imageR=new ImageOf<PixelRgb>;
 
     success=true;
     init=true;
-    initL=initR=false;
+    newest=0;
+    rayTableLast=0;
+
+    stageSync=stats.addStage("sync");
+    stageWorkers=stats.addStage("workers");
+    stageFlow=stats.addStage("optical_flow");
+    stageCollect=stats.addStage("collect");
+    stageFrame=stats.addStage("frame");
+    stageSceneFlow=stats.addStage("scene_flow");
 
     success=success & imagePortInLeft.open(localPortL.c_str());
     success=success & imagePortInRight.open(localPortR.c_str());
+    stereoSync=new StereoSynchronizer(&imagePortInLeft,&imagePortInRight,
+                                      rf.check("syncTolerance",Value(0.02)).asDouble());
 
     flowSem=new Semaphore(1);
 
-    success=success & Network::connect(inputL.c_str(),localPortL.c_str());
-    success=success & Network::connect(inputR.c_str(),localPortR.c_str());    
+    // the pairs of a stereo log replace the cameras
+    player=NULL;
+    string replay=rf.check("replay",Value("")).asString().c_str();
+    if (!replay.empty())
+    {
+        bool realTime=(rf.check("replayMode",Value("realtime")).asString()!="fast");
+        player=new StereoLogPlayer(realTime,rf.check("replayLoop"));
+        if (player->open(replay))
+            fprintf(stdout,"Replaying %d pairs from %s\n",player->size(),replay.c_str());
+        else
+        {
+            fprintf(stdout,"%s is not a stereo log\n",replay.c_str());
+            success=false;
+        }
+    }
+    else
+    {
+        success=success & Network::connect(inputL.c_str(),localPortL.c_str());
+        success=success & Network::connect(inputR.c_str(),localPortR.c_str());
+    }
 
     if(success)
     {
@@ -52,6 +78,8 @@ SceneFlow::SceneFlow(yarp::os::ResourceFinder &rf) : RateThread(10)
         cameraFinder.configure(argc,argv);
 
         disp=new DisparityThread("SceneFlow/disparity",cameraFinder,false,false);
+        string engine=rf.check("disparityEngine",Value("sgbm")).asString().c_str();
+        disp->setDisparityEngine(engine,rf);
         opt=new OpticalFlowThread(rf);
         
         fprintf(stdout, "Threads created...\n");
@@ -76,10 +104,7 @@ bool SceneFlow::isOpen()
 void SceneFlow::close()
 {
     flowSem->wait();
-    disp->suspend();
     disp->stop();
-
-    opt->suspend();
     opt->stop();
     flowSem->post();
     
@@ -93,10 +118,10 @@ void SceneFlow::threadRelease()
 {
     fprintf(stdout, "Scene Flow Closed...\n");
     delete disp;
-    delete imageL;
-    delete imageR;
+    delete stereoSync;
     delete flowSem;
     delete opt;
+    delete player;
 
 }
 
@@ -105,345 +130,317 @@ void SceneFlow::run()
     if(!success)
         return;        
     
-    ImageOf<PixelRgb> *tmpL = imagePortInLeft.read(false);
-    ImageOf<PixelRgb> *tmpR = imagePortInRight.read(false);
+    // nobody reads the slot after the newest one: it is filled without locking
+    FlowFrame &next=frames[(newest+1)%3];
 
-    if(tmpL!=NULL)
+    // only fresh pairs, matched by timestamp (or due, when replaying)
+    double tFrame=StageStats::now();
+    if (player!=NULL)
     {
-        *imageL=*tmpL;
-        imagePortInLeft.getEnvelope(TSLeft);
-        initL=true;
+        StereoLogFrame logged;
+        if (!player->read(logged,false))
+            return;
+
+        next.left=logged.left;
+        next.right=logged.right;
+        TSLeft=logged.stampL;
+        TSRight=logged.stampR;
     }
+    else if (!stereoSync->read(next.left,next.right,TSLeft,TSRight,false))
+        return;
+    double t0=stats.stop(stageSync,tFrame);
 
-    if(tmpR!=NULL) 
+    if (init)
     {
-        *imageR=*tmpR;
-        imagePortInRight.getEnvelope(TSRight);
-        initR=true;
-    }
+        fprintf(stdout, "Initializing Scene Flow..\n");
+        width=next.left.cols;
+        height=next.left.rows;
 
-    if(initL && initR )
+        disp->setImages(next.left,next.right).wait();
+        next.flow.release();
+    }
+    else
     {
-        if (init)
-        {
-            fprintf(stdout, "Initializing Scene Flow..\n");
-            flowSem->wait();
-            imgLNext= (IplImage*) imageL->getIplImage();
-            imgRNext= (IplImage*) imageR->getIplImage();
-            imgLPrev=NULL;
-            imgRPrev=NULL;
-            width=imgLNext->width;
-            height=imgLNext->height;
-
-            Mat tmpLNext=cvarrToMat(imgLNext);
-            Mat tmpRNext=cvarrToMat(imgRNext);
-            disp->setImages(tmpLNext,tmpRNext);
-            while (!disp->checkDone())
-                Time::delay(0.01);
-
-            disp->getDisparity(dispNew);
-            disp->getRectMatrix(RLNew);
-            disp->getMapper(mapperNew);
-            disp->getQMat(QNew);
-            disp->getDisparityFloat(dispFloatNew);
-
-
-            init=false;
-            initL=initR=false;
-
-            IplImage IplDispNew=dispNew;
-
-            if (imgLPrev!=NULL)
-                cvReleaseImage(&imgLPrev);
-            if (imgRPrev!=NULL)
-                cvReleaseImage(&imgRPrev);
-
-            imgLPrev=(IplImage*)cvClone(imgLNext);
-            imgRPrev=(IplImage*)cvClone(imgRNext);
-            flowSem->post();
-            fprintf(stdout, "Init Scene Flow Done...\n");
-        }
-        else
-        {
-        
-            flowSem->wait();
-            imgLNext= (IplImage*) imageL->getIplImage();
-            imgRNext= (IplImage*) imageR->getIplImage();
-
-
-            RLOld=RLNew.clone();
-            QOld=QNew.clone();
-            mapperOld=mapperNew.clone();
-            dispOld=dispNew.clone();
-            dispFloatOld=dispFloatNew.clone();
-            Mat tmpLNext=cvarrToMat(imgLNext);
-            Mat tmpRNext=cvarrToMat(imgRNext);
-            Mat tmpLPrev=cvarrToMat(imgLPrev);
-            disp->setImages(tmpLNext,tmpRNext);
-            opt->setImages(tmpLPrev,tmpLNext);
-            opt->resume();
-
-            
-            if(disp==NULL || opt==NULL)
-                return;
-                
-            while (!disp->checkDone()||!opt->checkDone())
-              Time::delay(0.01);
-
-            disp->getDisparity(dispNew);
-            disp->getDisparityFloat(dispFloatNew);
-            disp->getRectMatrix(RLNew);
-            disp->getMapper(mapperNew);
-            disp->getQMat(QNew);            
-            opt->getOptFlow(optFlow);
-
-                        
-
-            if (imgLPrev!=NULL)
-                cvReleaseImage(&imgLPrev);
-            if (imgRPrev!=NULL)
-                cvReleaseImage(&imgRPrev);
-
-            imgLPrev=(IplImage*)cvClone(imgLNext);
-            imgRPrev=(IplImage*)cvClone(imgRNext);
-            flowSem->post();
-        }
+        JobHandle dispJob=disp->setImages(next.left,next.right);
+        JobHandle optJob=opt->setImages(frames[newest].left,next.left);
+
+        // both workers run concurrently, we wake up when the slowest is done
+        dispJob.wait();
+        optJob.wait();
+
+        opt->getOptFlow(next.flow);
+
+        double last,mean;
+        opt->getFlowTime(last,mean);
+        stats.record(stageFlow,last);
     }
+    t0=stats.stop(stageWorkers,t0);
+
+    disp->getDisparity(next.disp);
+    disp->getDisparityFloat(next.dispFloat);
+    disp->getRectMatrix(next.RL);
+    disp->getMapper(next.mapper);
+    disp->getQMat(next.Q);
+
+    // the new frame becomes the newest one, the newest one the previous
+    flowSem->wait();
+    newest=(newest+1)%3;
+    flowSem->post();
 
+    stats.stop(stageCollect,t0);
+    stats.record(stageFrame,StageStats::now()-tFrame);
+
+    if (init)
+    {
+        init=false;
+        fprintf(stdout, "Init Scene Flow Done...\n");
+    }
 }
 
 
 
-void SceneFlow::triangulate(Point2f &pixel,Point3f &point,Mat &Mapper, Mat &disparity, Mat &Q, Mat &RLrect) 
+namespace
 {
-    int u=(int) pixel.x; 
-    int v=(int) pixel.y;
-
-    // Mapping from Rectified Cameras to Original Cameras
-    if(Mapper.empty()) 
+    // rays and disparity of one frame for the scene flow kernel
+    struct FlowRays
     {
-        point.x=0.0;
-        point.y=0.0;
-        point.z=0.0;
-        return;
-    }
+        const Mat *idx,*rayX,*rayY;
+        const short *disp;
+        float Q23,Q32,Q33;
+        float H[12];    // ROOT <- rectified left camera
+
+        FlowRays(const Mat &_idx, const Mat &_rayX, const Mat &_rayY, const Mat &disp16,
+                 const Mat &Q, const Mat &RL, const Mat &HL_root) :
+                 idx(&_idx), rayX(&_rayX), rayY(&_rayY)
+        {
+            disp=disp16.ptr<short>(0);
+            Q23=(float)Q.at<double>(2,3);
+            Q32=(float)Q.at<double>(3,2);
+            Q33=(float)Q.at<double>(3,3);
+
+            Mat Hrect=Mat::eye(4,4,CV_64F);
+            Mat RLt=RL.t();
+            RLt.convertTo(Hrect(Rect(0,0,3,3)),CV_64F);
+            Mat M=HL_root*Hrect;
+            for (int i=0; i<3; i++)
+                for (int j=0; j<4; j++)
+                    H[4*i+j]=(float)M.at<double>(i,j);
+        }
 
-    float usign=Mapper.ptr<float>(v)[2*u];
-    float vsign=Mapper.ptr<float>(v)[2*u+1]; 
+        // point wrt ROOT of the pixel (u,v) of the left image; false if not valid
+        // (no disparity, farther than 2.5 meters or behind the camera)
+        bool point(const int u, const int v, float *P) const
+        {
+            if ((u<0) || (v<0) || (u>=idx->cols) || (v>=idx->rows))
+                return false;
 
-    u=cvRound(usign);
-    v=cvRound(vsign);
+            int k=idx->ptr<int>(v)[u];
+            if (k<0)
+                return false;
 
-    IplImage disp16=disparity;
+            float w=(disp[k]/16.0f)*Q32+Q33;
+            float z=Q23/w;
+            if (!((z<=2.5f) && (z>=0.0f)))
+                return false;
 
-    if(u<0 || u>=disp16.width || v<0 || v>=disp16.height) 
-    {
-        point.x=0.0;
-        point.y=0.0;
-        point.z=0.0;
-        return;
-    }
-    else 
-    {
-        CvScalar scal=cvGet2D(&disp16,v,u);
-        double dispVal=scal.val[0]/16.0;
-        float w= (float) ((float) dispVal*Q.at<double>(3,2)) + ((float)Q.at<double>(3,3));
-        point.x= (float)((float) (usign+1)*Q.at<double>(0,0)) + ((float) Q.at<double>(0,3));
-        point.y=(float)((float) (vsign+1)*Q.at<double>(1,1)) + ((float) Q.at<double>(1,3));
-        point.z=(float) Q.at<double>(2,3);
-        
-        point.x=point.x/w;
-        point.y=point.y/w;
-        point.z=point.z/w;
+            float x=rayX->ptr<float>(v)[u]/w;
+            float y=rayY->ptr<float>(v)[u]/w;
 
-    }
-    // discard points far more than 2.5 meters or with not valid disparity (<0)
-    //fprintf(stdout, "Point Before Trans: %f %f %f %f %f\n",usign, vsign,point.x,point.y,point.z);
-    if(point.z>2.5 || point.z<0) 
-    {
-        point.x=0.0;
-        point.y=0.0;
-        point.z=0.0;
-        return;
-    } 
-    else 
-    {
-        Mat RLrecttemp=RLrect.t();
-        Mat Tfake = Mat::zeros(0,3,CV_64F);
-        Mat P(4,1,CV_64FC1);
-        P.at<double>(0,0)=point.x;
-        P.at<double>(1,0)=point.y;
-        P.at<double>(2,0)=point.z;
-        P.at<double>(3,0)=1;
-
-        Mat Hrect = Mat::eye(4, 4, CV_64F);
-        buildRotTras(RLrecttemp,Tfake,Hrect);
-      
-        P=HL_root*Hrect*P;
-        
+            P[0]=H[0]*x+H[1]*y+H[2]*z+H[3];
+            P[1]=H[4]*x+H[5]*y+H[6]*z+H[7];
+            P[2]=H[8]*x+H[9]*y+H[10]*z+H[11];
+            return true;
+        }
+    };
 
-        point.x=(float) ((float) P.at<double>(0,0)/P.at<double>(3,0));
-        point.y=(float) ((float) P.at<double>(1,0)/P.at<double>(3,0));
-        point.z=(float) ((float) P.at<double>(2,0)/P.at<double>(3,0));
-        //fprintf(stdout, "Point After Trans: %f %f %f \n",point.x,point.y,point.z);
-    }
+
+    // fills a band of rows of the subsampled scene flow
+    class SceneFlowBody : public cv::ParallelLoopBody
+    {
+        const FlowRays &prev,&curr;
+        const Mat &flow;
+        Rect roi;
+        int step;
+        Mat &flow3D;
+
+    public:
+        SceneFlowBody(const FlowRays &_prev, const FlowRays &_curr, const Mat &_flow,
+                      const Rect &_roi, const int _step, Mat &_flow3D) :
+                      prev(_prev), curr(_curr), flow(_flow), roi(_roi), step(_step), flow3D(_flow3D) { }
+
+        void operator()(const cv::Range &range) const
+        {
+            for (int i=range.start; i<range.end; i++)
+            {
+                int v=roi.y+i*step;
+                const float *f=flow.ptr<float>(v);
+                float *out=flow3D.ptr<float>(i);
+
+                for (int j=0; j<flow3D.cols; j++, out+=3)
+                {
+                    int u=roi.x+j*step;
+                    float P0[3],P1[3];
+                    if (!prev.point(u,v,P0))
+                        continue;
+                    if (!curr.point(u+cvRound(f[2*u]),v+cvRound(f[2*u+1]),P1))
+                        continue;
+
+                    out[0]=P1[0]-P0[0];
+                    out[1]=P1[1]-P0[1];
+                    out[2]=P1[2]-P0[2];
+                }
+            }
+        }
+    };
 }
 
-void SceneFlow::buildRotTras(Mat & R, Mat & T, Mat & A) 
+
+cv::Ptr<SceneFlow::RayTable> SceneFlow::getRayTable(const Mat &mapper, const Mat &Q, const Mat &disp)
 {
-    for(int i = 0; i < R.rows; i++)
+    LockGuard lg(mutexRays);
+    for (int i=0; i<2; i++)
     {
-        double* Mi = A.ptr<double>(i);
-        double* MRi = R.ptr<double>(i);
-        for(int j = 0; j < R.cols; j++)
-             Mi[j]=MRi[j];
+        const cv::Ptr<RayTable> &t=rayTables[i];
+        if (!t.empty() && (t->mapper.data==mapper.data) && (t->Q.data==Q.data) &&
+            (t->dispStep==disp.step1()) && (t->idx.size()==mapper.size()))
+            return t;
     }
-    for(int i = 0; i < T.rows; i++)
+
+    // the previous and the newest frame may use different generations
+    cv::Ptr<RayTable> t(new RayTable);
+    t->mapper=mapper;
+    t->Q=Q;
+    t->dispStep=disp.step1();
+    t->idx.create(mapper.size(),CV_32S);
+    t->rayX.create(mapper.size(),CV_32F);
+    t->rayY.create(mapper.size(),CV_32F);
+
+    float Q00=(float)Q.at<double>(0,0);
+    float Q03=(float)Q.at<double>(0,3);
+    float Q11=(float)Q.at<double>(1,1);
+    float Q13=(float)Q.at<double>(1,3);
+    for (int v=0; v<mapper.rows; v++)
     {
-        double* Mi = A.ptr<double>(i);
-        double* MRi = T.ptr<double>(i);
-        Mi[3]=MRi[0];
-     }
-}
+        const float *m=mapper.ptr<float>(v);
+        int *idx=t->idx.ptr<int>(v);
+        float *rx=t->rayX.ptr<float>(v);
+        float *ry=t->rayY.ptr<float>(v);
+        for (int u=0; u<mapper.cols; u++)
+        {
+            float usign=m[2*u];
+            float vsign=m[2*u+1];
+            int ur=cvRound(usign);
+            int vr=cvRound(vsign);
+            idx[u]=((ur<0) || (ur>=disp.cols) || (vr<0) || (vr>=disp.rows))?-1:
+                   (int)(vr*t->dispStep+ur);
+            rx[u]=(usign+1)*Q00+Q03;
+            ry[u]=(vsign+1)*Q11+Q13;
+        }
+    }
 
+    rayTableLast=1-rayTableLast;
+    rayTables[rayTableLast]=t;
+    return t;
+}
 
 
-Point3f SceneFlow::getSceneFlowPixel(int u, int v)
+bool SceneFlow::computeSceneFlow(Mat &flow3D, const Rect &roi, const int step)
 {
+    double t0=StageStats::now();
+
+    // the frames are shared: the ring can move on while we compute
     flowSem->wait();
-    Point3f flowPoint;
-    flowPoint.x=0.0;
-    flowPoint.y=0.0;
-    flowPoint.z=0.0;
+    FlowFrame prev=frames[(newest+2)%3];
+    FlowFrame curr=frames[newest];
+    flowSem->post();
 
-    if(v>=dispFloatNew.rows || u>=dispFloatNew.cols || optFlow.empty())
-    {
-        flowSem->post();
-        return flowPoint;
-    }
+    flow3D.setTo(Scalar(0));
+    if (HL_root.empty() || curr.flow.empty() || prev.dispFloat.empty() || curr.dispFloat.empty() ||
+        prev.mapper.empty() || curr.mapper.empty() || (curr.flow.size()!=prev.mapper.size()))
+        return false;
 
-    int valOld=(int)dispFloatOld.ptr<uchar>(v)[u];
-    int valNew=(int)dispFloatNew.ptr<uchar>(v+cvRound(optFlow.ptr<float>(v)[2*u+1]))[u+cvRound(optFlow.ptr<float>(v)[2*u])];
+    Rect r=roi & Rect(0,0,curr.flow.cols,curr.flow.rows);
+    if ((r.width<=0) || (r.height<=0))
+        return false;
 
-    if (valOld==0 || valNew==0)
-    {
-        flowSem->post();
-        return flowPoint;
-    }
+    cv::Ptr<RayTable> tPrev=getRayTable(prev.mapper,prev.Q,prev.dispFloat);
+    cv::Ptr<RayTable> tCurr=getRayTable(curr.mapper,curr.Q,curr.dispFloat);
+    FlowRays raysPrev(tPrev->idx,tPrev->rayX,tPrev->rayY,prev.dispFloat,prev.Q,prev.RL,HL_root);
+    FlowRays raysCurr(tCurr->idx,tCurr->rayX,tCurr->rayY,curr.dispFloat,curr.Q,curr.RL,HL_root);
 
-    Point2f point2Dold;
-    point2Dold.x=(float)u;
-    point2Dold.y=(float)v;
-    Point3f point3Dold;
-    triangulate(point2Dold,point3Dold,mapperOld,dispFloatOld,QOld,RLOld);
-    if (point3Dold.x==0.0)
-    {
-        flowSem->post();
-        return flowPoint;
-    }
+    int rows=std::min(flow3D.rows,(r.height+step-1)/step);
+    parallel_for_(Range(0,rows),SceneFlowBody(raysPrev,raysCurr,curr.flow,r,step,flow3D));
+
+    stats.stop(stageSceneFlow,t0);
+    return true;
+}
+
+
+void SceneFlow::getStageStats(Bottle &b)
+{
+    Bottle &sf=b.addList();
+    sf.addString("sceneFlow");
+    stats.toBottle(sf);
 
-    Point2f point2Dnew;
-    point2Dnew.x=u+optFlow.ptr<float>(v)[2*u];
-    point2Dnew.y=v+optFlow.ptr<float>(v)[2*u+1];
-    Point3f point3Dnew;
-    triangulate(point2Dnew,point3Dnew,mapperNew,dispFloatNew,QNew,RLNew);
-    if (point3Dnew.x==0.0)
+    if (success)
     {
-        flowSem->post();
-        return flowPoint;
+        Bottle &d=b.addList();
+        d.addString("disparity");
+        disp->getStageStats().toBottle(d);
     }
+}
 
-    flowPoint.x=point3Dnew.x-point3Dold.x;
-    flowPoint.y=point3Dnew.y-point3Dold.y;
-    flowPoint.z=point3Dnew.z-point3Dold.z;
-    flowSem->post();
-    return flowPoint;
 
+void SceneFlow::resetStageStats()
+{
+    stats.reset();
+    if (success)
+        disp->getStageStats().reset();
 }
+
+
+Point3f SceneFlow::getSceneFlowPixel(int u, int v)
+{
+    Mat flow3D(1,1,CV_32FC3);
+    computeSceneFlow(flow3D,Rect(u,v,1,1),1);
+    Vec3f f=flow3D.at<Vec3f>(0,0);
+    return Point3f(f[0],f[1],f[2]);
+}
+
+
 void SceneFlow::getSceneFlow(Mat &flow3D, int U1, int V1, int U2, int V2)
 {
-    flowSem->wait();
-    flow3D.create(optFlow.rows,optFlow.cols,CV_32FC3);
+    flow3D.create(height,width,CV_32FC3);
     flow3D.setTo(Scalar(0));
-    Point3f flowPoint;
-    flowPoint.x=0.0;
-    flowPoint.y=0.0;
-    flowPoint.z=0.0;
 
-    if(optFlow.empty())
-    {
-        flowSem->post();
+    Rect roi=Rect(U1,V1,U2-U1,V2-V1) & Rect(0,0,width,height);
+    if ((roi.width<=0) || (roi.height<=0))
         return;
-    }
-    
-    for (int v=V1; v<V2; v++)
-    {
-        for(int u=U1; u<U2; u++)
-        {
-            int valOld=(int)dispFloatOld.ptr<uchar>(v)[u];
-            int valNew=(int)dispFloatNew.ptr<uchar>(v+cvRound(optFlow.ptr<float>(v)[2*u+1]))[u+cvRound(optFlow.ptr<float>(v)[2*u])];
-
-            if (valOld==0 || valNew==0)
-            {
-                flow3D.ptr<float>(v)[2*u]=(float)0.0;
-                flow3D.ptr<float>(v)[2*u+1]=(float)0.0;
-                flow3D.ptr<float>(v)[2*u+2]=(float)0.0;
-                continue;
-            }
-
-            Point2f point2Dold;
-            point2Dold.x=(float)u;
-            point2Dold.y=(float)v;
-            Point3f point3Dold;
-            triangulate(point2Dold,point3Dold,mapperOld,dispFloatOld,QOld,RLOld);
-            if (point3Dold.x==0.0)
-            {
-                flow3D.ptr<float>(v)[2*u]=(float)0.0;
-                flow3D.ptr<float>(v)[2*u+1]=(float)0.0;
-                flow3D.ptr<float>(v)[2*u+2]=(float)0.0;
-                continue;
-            }
 
-            Point2f point2Dnew;
-            point2Dnew.x=u+optFlow.ptr<float>(v)[2*u];
-            point2Dnew.y=v+optFlow.ptr<float>(v)[2*u+1];
-            
-     
-            Point3f point3Dnew;
-            triangulate(point2Dnew,point3Dnew,mapperNew,dispFloatNew,QNew,RLNew);
-            if (point3Dnew.x==0.0)
-            {
-                flow3D.ptr<float>(v)[2*u]=(float)0.0;
-                flow3D.ptr<float>(v)[2*u+1]=(float)0.0;
-                flow3D.ptr<float>(v)[2*u+2]=(float)0.0;
-                continue;
-            }
-            
-            //fprintf(stdout, "2dFlow: %f %f %f %f 3dPoints %f %f %f %f %f %f\n",point2Dold.x,point2Dold.y, point2Dnew.x,point2Dnew.y,point3Dold.x,point3Dold.y,point3Dold.z,point3Dnew.x,point3Dnew.y,point3Dnew.z);
-            flowPoint.x=point3Dnew.x-point3Dold.x;
-            flowPoint.y=point3Dnew.y-point3Dold.y;
-            flowPoint.z=point3Dnew.z-point3Dold.z;
-
-            flow3D.ptr<float>(v)[2*u]=(float)flowPoint.x;
-            flow3D.ptr<float>(v)[2*u+1]=(float)flowPoint.y;
-            flow3D.ptr<float>(v)[2*u+2]=(float)flowPoint.z;
-            }
-    }
+    Mat flowRoi=flow3D(roi);
+    computeSceneFlow(flowRoi,Rect(U1,V1,U2-U1,V2-V1),1);
+}
 
-    flowSem->post();
 
+void SceneFlow::getSceneFlow(Mat &flow3D, const Rect &roi, const int step)
+{
+    int s=std::max(step,1);
+    Rect r=roi & Rect(0,0,width,height);
+    flow3D.create(std::max((r.height+s-1)/s,1),std::max((r.width+s-1)/s,1),CV_32FC3);
+    computeSceneFlow(flow3D,r,s);
 }
 
 
 void SceneFlow::getSceneFlow(Mat &flow3D)
 {
-    getSceneFlow(flow3D,0,0, flow3D.cols, flow3D.rows);
+    getSceneFlow(flow3D,0,0,width,height);
 }
 
 
 IplImage* SceneFlow::draw2DMotionField()
 {
     flowSem->wait();
+    FlowFrame &curr=frames[newest];
     int xSpace=7;
     int ySpace=7;
     float cutoff=1;
@@ -453,25 +450,26 @@ IplImage* SceneFlow::draw2DMotionField()
     CvPoint p0 = cvPoint(0,0);
     CvPoint p1 = cvPoint(0,0);
 
-    if(optFlow.empty() || imgLPrev==NULL)
+    if(curr.flow.empty() || curr.left.empty())
     {
         flowSem->post();
         return NULL;
     }
     
 
-    IplImage* imgMotion=(IplImage*) cvClone(imgLPrev);
+    IplImage left=curr.left;
+    IplImage* imgMotion=cvCloneImage(&left);
     
     float deltaX, deltaY, angle, hyp;
 
-    for(int i=0; i<optFlow.rows; i++) 
+    for(int i=0; i<curr.flow.rows; i++) 
     {
-        for (int j=0; j<optFlow.cols; j++)
+        for (int j=0; j<curr.flow.cols; j++)
         {
             p0.x = j;
             p0.y = i;
-            deltaX = optFlow.ptr<float>(i)[2*j];
-            deltaY = -optFlow.ptr<float>(i)[2*j+1];
+            deltaX = curr.flow.ptr<float>(i)[2*j];
+            deltaY = -curr.flow.ptr<float>(i)[2*j+1];
             angle = atan2(deltaY, deltaX);
             hyp = sqrt(deltaX*deltaX + deltaY*deltaY);
 
@@ -500,7 +498,7 @@ void SceneFlow::drawFlowModule(IplImage* imgMotion)
     IplImage * module =cvCreateImage(cvSize(imgMotion->width,imgMotion->height),32,1);
     IplImage * moduleU =cvCreateImage(cvSize(imgMotion->width,imgMotion->height),8,1);
     Mat vel[2];
-    split(optFlow,vel);
+    split(frames[newest].flow,vel);
     IplImage tx=(Mat)vel[0];
     IplImage ty=(Mat)vel[1];
 
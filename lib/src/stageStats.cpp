@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include <iCub/stereoVision/stageStats.h>
+
+using namespace std;
+using namespace yarp::os;
+
+
+/******************************************************************************/
+namespace
+{
+    // bin of a duration: 4 bins per octave of microseconds
+    inline int durationBin(const double seconds)
+    {
+        double us=seconds*1e6;
+        if (!(us>1.0))
+            return 0;
+
+        int bin=(int)(4.0*log(us)/log(2.0));
+        return std::min(bin,StageStats::numBins-1);
+    }
+
+    // upper edge of a bin [s]
+    inline double binEdge(const int bin)
+    {
+        return pow(2.0,(bin+1)/4.0)*1e-6;
+    }
+
+    // duration below which a fraction p of the recorded ones is [s]
+    double percentile(const unsigned int *bins, const int count, const double max, const double p)
+    {
+        unsigned int target=(unsigned int)ceil(p*count);
+        unsigned int sum=0;
+        for (int i=0; i<StageStats::numBins; i++)
+        {
+            sum+=bins[i];
+            if ((sum>=target) && (sum>0))
+                return std::min(binEdge(i),max);
+        }
+
+        return max;
+    }
+}
+
+
+/******************************************************************************/
+StageStats::StageStats() : numStages(0)
+{
+    for (int i=0; i<maxStages; i++)
+    {
+        memset(stages[i].bins,0,sizeof(stages[i].bins));
+        stages[i].count=0;
+        stages[i].sum=stages[i].last=stages[i].max=0.0;
+    }
+}
+
+
+/******************************************************************************/
+int StageStats::addStage(const string &name)
+{
+    LockGuard lg(mutexAdd);
+    for (int i=0; i<numStages; i++)
+        if (stages[i].name==name)
+            return i;
+
+    if (numStages>=maxStages)
+        return -1;
+
+    // the stage is visible to the readers only once it is complete
+    stages[numStages].name=name;
+    return numStages++;
+}
+
+
+/******************************************************************************/
+void StageStats::record(const int stage, const double seconds)
+{
+    if ((stage<0) || (stage>=numStages))
+        return;
+
+    int bin=durationBin(seconds);
+    Stage &s=stages[stage];
+    LockGuard lg(s.mutex);
+    s.bins[bin]++;
+    s.sum+=seconds;
+    s.last=seconds;
+    if (seconds>s.max)
+        s.max=seconds;
+    s.count++;
+}
+
+
+/******************************************************************************/
+void StageStats::reset()
+{
+    int n=numStages;
+    for (int i=0; i<n; i++)
+    {
+        Stage &s=stages[i];
+        LockGuard lg(s.mutex);
+        memset(s.bins,0,sizeof(s.bins));
+        s.count=0;
+        s.sum=s.last=s.max=0.0;
+    }
+}
+
+
+/******************************************************************************/
+void StageStats::getSummaries(vector<Summary> &summaries) const
+{
+    summaries.clear();
+    int n=numStages;
+    for (int i=0; i<n; i++)
+    {
+        // a copy of the stage, the percentiles are computed out of the lock
+        const Stage &s=stages[i];
+        unsigned int bins[numBins];
+        int count;
+        double total,last,max;
+        {
+            LockGuard lg(s.mutex);
+            memcpy(bins,s.bins,sizeof(bins));
+            count=s.count;
+            total=s.sum;
+            last=s.last;
+            max=s.max;
+        }
+
+        if (count<=0)
+            continue;
+
+        Summary sum;
+        sum.name=s.name;
+        sum.count=count;
+        sum.last=1e3*last;
+        sum.mean=1e3*total/count;
+        sum.p50=1e3*percentile(bins,count,max,0.50);
+        sum.p99=1e3*percentile(bins,count,max,0.99);
+        sum.max=1e3*max;
+        summaries.push_back(sum);
+    }
+}
+
+
+/******************************************************************************/
+void StageStats::toBottle(Bottle &b) const
+{
+    vector<Summary> summaries;
+    getSummaries(summaries);
+    for (size_t i=0; i<summaries.size(); i++)
+    {
+        Bottle &item=b.addList();
+        item.addString(summaries[i].name.c_str());
+        item.addInt(summaries[i].count);
+        item.addDouble(summaries[i].last);
+        item.addDouble(summaries[i].mean);
+        item.addDouble(summaries[i].p50);
+        item.addDouble(summaries[i].p99);
+        item.addDouble(summaries[i].max);
+    }
+}
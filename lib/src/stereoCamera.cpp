@@ -24,6 +24,9 @@
     #endif
 #endif 
 
+#include <cfloat>
+#include <algorithm>
+
 #include "iCub/stereoVision/stereoCamera.h"
 
 Mat StereoCamera::buildRotTras(Mat &R, Mat &T) {
@@ -62,14 +65,29 @@ const vector<Point2f>& StereoCamera::getMatchRight() const {
 
 StereoCamera::StereoCamera(bool rectify) {
     this->mutex=new Semaphore(1);
+    this->cameraChanged=true;
     this->rectify=rectify;
+    this->rectCurrent=-1;
+    this->rectClock=0;
+    this->rectTolerance=1e-4;
+    this->rectCacheSize=4;
+    this->rectFileSaved=false;
     this->epipolarTh=0.01;
 
 #if !defined(USING_GPU) && !defined(OPENCV_GREATER_2)
     cv::initModule_nonfree();
 #endif 
 
-    use_elas = false;
+    engine = new SgbmDisparityEngine();
+    dispROIMargin = 16;
+    stats = NULL;
+    stageRectification = stageDisparityMap = -1;
+    matchDetector = "sift";
+    matchMaxFeatures = 0;
+    matchGridCols = matchGridRows = 1;
+    matchEpipolarBand = 0.0;
+    outputMap8 = outputFixed16 = true;
+    outputFloat = false;
 }
 
 StereoCamera::StereoCamera(yarp::os::ResourceFinder &rf, bool rectify) {
@@ -83,13 +101,27 @@ StereoCamera::StereoCamera(yarp::os::ResourceFinder &rf, bool rectify) {
     this->cameraChanged=true;
     this->epipolarTh=0.01;
     this->rectify=rectify;
+    this->rectCurrent=-1;
+    this->rectClock=0;
+    this->rectTolerance=1e-4;
+    this->rectCacheSize=4;
+    this->rectFileSaved=false;
     buildUndistortRemap();
 
 #if !defined(USING_GPU) && !defined(OPENCV_GREATER_2)
     cv::initModule_nonfree();
 #endif 
 
-    use_elas = false;
+    engine = new SgbmDisparityEngine();
+    dispROIMargin = 16;
+    stats = NULL;
+    stageRectification = stageDisparityMap = -1;
+    matchDetector = "sift";
+    matchMaxFeatures = 0;
+    matchGridCols = matchGridRows = 1;
+    matchEpipolarBand = 0.0;
+    outputMap8 = outputFixed16 = true;
+    outputFloat = false;
 }
 
 StereoCamera::StereoCamera(Camera Left, Camera Right,bool rectify) {
@@ -102,79 +134,139 @@ StereoCamera::StereoCamera(Camera Left, Camera Right,bool rectify) {
     this->cameraChanged=true;
     this->rectify=rectify;
     this->epipolarTh=0.01;
+    this->rectCurrent=-1;
+    this->rectClock=0;
+    this->rectTolerance=1e-4;
+    this->rectCacheSize=4;
+    this->rectFileSaved=false;
     buildUndistortRemap();
 
 #if !defined(USING_GPU) && !defined(OPENCV_GREATER_2)
     cv::initModule_nonfree();
 #endif 
 
-    use_elas = false;
+    engine = new SgbmDisparityEngine();
+    dispROIMargin = 16;
+    stats = NULL;
+    stageRectification = stageDisparityMap = -1;
+    matchDetector = "sift";
+    matchMaxFeatures = 0;
+    matchGridCols = matchGridRows = 1;
+    matchEpipolarBand = 0.0;
+    outputMap8 = outputFixed16 = true;
+    outputFloat = false;
 }
 
 void StereoCamera::initELAS(yarp::os::ResourceFinder &rf)
 {
-    use_elas = true;
-
-    string elas_string = rf.check("elas_setting",Value("ROBOTICS")).asString().c_str();
-
-    double disp_scaling_factor = rf.check("disp_scaling_factor",Value(1.0)).asDouble();
-
-    elaswrap = new elasWrapper(disp_scaling_factor, elas_string);
-
-
-    if (rf.check("elas_subsampling"))
-        elaswrap->set_subsampling(true);
-
-    if (rf.check("elas_add_corners"))
-        elaswrap->set_add_corners(true);
-
-
-    elaswrap->set_ipol_gap_width(40);
-    if (rf.check("elas_ipol_gap_width"))
-        elaswrap->set_ipol_gap_width(rf.find("elas_ipol_gap_width").asInt());
-
-
-    if (rf.check("elas_support_threshold"))
-        elaswrap->set_support_threshold(rf.find("elas_support_threshold").asDouble());
-
-    if(rf.check("elas_gamma"))
-        elaswrap->set_gamma(rf.find("elas_gamma").asDouble());
-
-    if (rf.check("elas_sradius"))
-        elaswrap->set_sradius(rf.find("elas_sradius").asDouble());
+    setDisparityEngine("elas", rf);
+}
 
-    if (rf.check("elas_match_texture"))
-        elaswrap->set_match_texture(rf.find("elas_match_texture").asInt());
+bool StereoCamera::setDisparityEngine(const string &name, yarp::os::ResourceFinder &rf)
+{
+    DisparityEngine *e=DisparityEngine::create(name, rf);
+    if (e==NULL)
+    {
+        cout << "Disparity engine " << name << " is not available" << endl;
+        return false;
+    }
 
-    if (rf.check("elas_filter_median"))
-        elaswrap->set_filter_median(rf.find("elas_filter_median").asBool());
+    delete engine;
+    engine=e;
+    engine->setStageStats(stats);
+    cout << "Disparity engine: " << engine->getName() << endl;
+    return true;
+}
 
-    if (rf.check("elas_filter_adaptive_mean"))
-        elaswrap->set_filter_adaptive_mean(rf.find("elas_filter_adaptive_mean").asBool());
+void StereoCamera::setStageStats(StageStats *stats)
+{
+    this->stats=stats;
+    if (stats!=NULL)
+    {
+        stageRectification=stats->addStage("rectification");
+        stageDisparityMap=stats->addStage("disparity_map");
+    }
+    engine->setStageStats(stats);
+}
 
-    cout << endl << "ELAS parameters:" << endl << endl;
+string StereoCamera::getDisparityEngineName() const
+{
+    return engine->getName();
+}
 
-    cout << "disp_scaling_factor: " << disp_scaling_factor << endl;
+void StereoCamera::setDisparityROIs(const vector<Rect> &rois, int margin)
+{
+    this->dispROIs=rois;
+    this->dispROIMargin=std::max(margin,0);
+}
 
-    cout << "setting: " << elas_string << endl;
+const vector<Rect>& StereoCamera::getDisparityROIs() const
+{
+    return this->dispROIs;
+}
 
-    cout << "postprocess_only_left: " << elaswrap->get_postprocess_only_left() << endl;
-    cout << "subsampling: " << elaswrap->get_subsampling() << endl;
+Rect StereoCamera::getRectifiedWindow(const Rect &roi, int numberOfDisparities, int minDisparity) const
+{
+    Rect r=roi & Rect(0,0,MapperL.cols,MapperL.rows);
 
-    cout << "add_corners: " << elaswrap->get_add_corners() << endl;
+    // bounding box of the region in the rectified image
+    float minX=FLT_MAX, minY=FLT_MAX, maxX=-FLT_MAX, maxY=-FLT_MAX;
+    for (int v=r.y; v<r.y+r.height; v++)
+    {
+        const float *m=MapperL.ptr<float>(v);
+        for (int u=r.x; u<r.x+r.width; u++)
+        {
+            float x=m[2*u];
+            float y=m[2*u+1];
+            if ((x<0.0f) || (y<0.0f) || (x>=MapperL.cols) || (y>=MapperL.rows))
+                continue;
 
-    cout << "ipol_gap_width: " << elaswrap->get_ipol_gap_width() << endl;
+            minX=std::min(minX,x); maxX=std::max(maxX,x);
+            minY=std::min(minY,y); maxY=std::max(maxY,y);
+        }
+    }
 
-    cout << "support_threshold: " << elaswrap->get_support_threshold() << endl;
-    cout << "gamma: " << elaswrap->get_gamma() << endl;
-    cout << "sradius: " << elaswrap->get_sradius() << endl;
+    if (minX>maxX)
+        return Rect();
 
-    cout << "match_texture: " << elaswrap->get_match_texture() << endl;
+    // the matches in the right image lie up to the max disparity on the left
+    int margin=this->dispROIMargin;
+    Point tl(cvFloor(minX)-(minDisparity+numberOfDisparities)-margin,cvFloor(minY)-margin);
+    Point br(cvCeil(maxX)+margin+1,cvCeil(maxY)+margin+1);
+    return Rect(tl,br) & Rect(0,0,rmap11.cols,rmap11.rows);
+}
 
-    cout << "filter_median: " << elaswrap->get_filter_median() << endl;
-    cout << "filter_adaptive_mean: " << elaswrap->get_filter_adaptive_mean() << endl;
+bool StereoCamera::computeDisparityROIs(const DisparityParams &params, Mat &rectL, Mat &rectR, Mat &disp)
+{
+    Size size=this->imleft.size();
+    rectL=Mat::zeros(size,this->imleft.type());
+    rectR=Mat::zeros(size,this->imright.type());
+    disp.create(size,CV_16SC1);
+    disp.setTo(Scalar((params.minDisparity-1)*16));
+
+    // the same horizontal crop of both images does not change the disparity
+    bool success=false;
+    for (size_t i=0; i<dispROIs.size(); i++)
+    {
+        Rect window=getRectifiedWindow(dispROIs[i],params.numberOfDisparities,params.minDisparity);
+        if (window.area()==0)
+            continue;
+
+        Mat l,r,d;
+        if (engine->compute(this->imleft, this->imright, this->rmap11(window), this->rmap12(window),
+                            this->rmap21(window), this->rmap22(window), l, r, d, params))
+        {
+            l.copyTo(rectL(window));
+            r.copyTo(rectR(window));
+            if (d.depth()==CV_32F)
+                d.convertTo(disp(window),CV_16S,16.0);
+            else
+                d.copyTo(disp(window));
+            success=true;
+        }
+    }
 
-    cout << endl;
+    return success;
 }
 
 void StereoCamera::setImages(IplImage * left, IplImage * right) {
@@ -404,9 +496,10 @@ void StereoCamera::runStereoCalib(const vector<string>& imagelist, Size boardSiz
         }
         npoints += npt;
     }
-    Mat R1,R2,P1,P2;
+    Mat R1,R2,P1,P2,Qcalib;
     Rect roi1, roi2;
-    stereoRectify( this->Kleft, this->DistL, this->Kright, this->DistR, imageSize, this->R, this->T, R1, R2, P1, P2, this->Q, -1);
+    stereoRectify( this->Kleft, this->DistL, this->Kright, this->DistR, imageSize, this->R, this->T, R1, R2, P1, P2, Qcalib, -1);
+    this->Q=Qcalib; // Q may be shared with the rectification cache
     fprintf(stdout,"average reprojection err = %f\n",err/npoints);
 
 }
@@ -475,6 +568,10 @@ const Mat& StereoCamera::getDisparity() const {
     return this->Disparity;
 }
 
+const Mat& StereoCamera::getDisparityFloat() const {
+    return this->DisparityFloat;
+}
+
 const Mat& StereoCamera::getDisparity16() const {
     return this->Disparity16;
 }
@@ -495,172 +592,476 @@ void StereoCamera::rectifyImages()
     }
     Size img_size = this->imleft.size();
 
-    if(cameraChanged)
-    {
-        mutex->wait();
-        stereoRectify(this->Kleft, this->DistL, this->Kright, this->DistR, img_size, this->R, this->T, this->RLrect, this->RRrect, this->PLrect, this->PRrect, this->Q, -1);
-
-        mutex->post();
-    }
-
-    if(cameraChanged)
-    {
-        initUndistortRectifyMap(this->Kleft, this->DistL, this->RLrect, this->PLrect, img_size, CV_32FC1, this->map11, this->map12);
-        initUndistortRectifyMap(this->Kright,  this->DistR, this->RRrect, this->PRrect, img_size, CV_32FC1, this->map21, this->map22);
-    }
+    updateRectification(img_size, true);
 
     Mat img1r, img2r;
-    remap(this->imleft, img1r, this->map11, this->map12, cv::INTER_LINEAR);
-    remap(this->imright, img2r, this->map21,this->map22, cv::INTER_LINEAR);
+    remap(this->imleft, img1r, this->rmap11, this->rmap12, cv::INTER_LINEAR);
+    remap(this->imright, img2r, this->rmap21, this->rmap22, cv::INTER_LINEAR);
     imgLeftRect=img1r;
     imgRightRect=img2r;
 
 }
 
 
-void StereoCamera::computeDisparity(bool best, int uniquenessRatio, int speckleWindowSize,
-        int speckleRange, int numberOfDisparities, int SADWindowSize,
-        int minDisparity, int preFilterCap, int disp12MaxDiff)
+void StereoCamera::setRectificationTolerance(double tol, int size)
 {
+    mutex->wait();
+    this->rectTolerance=tol;
+    this->rectCacheSize=std::max(size,1);
+    this->rectCache.clear();
+    this->rectCurrent=-1;
+    this->cameraChanged=true;
+    mutex->post();
+}
 
-    if (this->Kleft.empty() || this->DistL.empty() || this->Kright.empty() || this->DistR.empty())
+
+bool StereoCamera::matchRectification(const RectificationEntry &entry, const Size &size, bool rect) const
+{
+    if (entry.size!=size || entry.rectify!=rect)
+        return false;
+
+    const Mat *cur[6]={&this->Kleft, &this->Kright, &this->DistL, &this->DistR, &this->R, &this->T};
+    const Mat *ref[6]={&entry.KL, &entry.KR, &entry.DistL, &entry.DistR, &entry.R, &entry.T};
+    for (int i=0; i<6; i++)
     {
-        cout <<" Cameras are not calibrated! Run the Calibration first!" << endl;
-        return;
+        if (cur[i]->size()!=ref[i]->size() || cur[i]->type()!=ref[i]->type())
+            return false;
+        if (!cur[i]->empty() && cv::norm(*cur[i],*ref[i],cv::NORM_INF)>this->rectTolerance)
+            return false;
     }
 
-    if (this->imleft.empty() || this->imright.empty())
+    return true;
+}
+
+
+void StereoCamera::setRectificationCacheFile(const string &path)
+{
+    mutex->wait();
+    this->rectFile=path;
+    this->rectFileSaved=false;
+    if (!path.empty())
     {
-        cout << "Images are not set! set the images first!" << endl;
-        return;
+        cv::Ptr<MappedMatFile> file(new MappedMatFile());
+        if (file->open(path))
+            this->rectMapped.push_back(file);
     }
+    mutex->post();
+}
 
-    Size img_size=this->imleft.size();
 
-    if (cameraChanged)
-    {
-        mutex->wait();
-        stereoRectify(this->Kleft, this->DistL, this->Kright, this->DistR, img_size,
-                this->R, this->T, this->RLrect, this->RRrect, this->PLrect,
-                this->PRrect, this->Q, -1);
+bool StereoCamera::saveRectificationCache()
+{
+    mutex->wait();
+    bool ok=!this->rectFile.empty() && (this->rectCurrent>=0) &&
+            saveRectification(this->rectCache[this->rectCurrent]);
+    mutex->post();
+    return ok;
+}
 
-        if (!rectify)
+
+namespace
+{
+    // order of the matrices of a rectification in the cache file
+    enum { RECT_KL, RECT_KR, RECT_DISTL, RECT_DISTR, RECT_R, RECT_T,
+           RECT_RL, RECT_RR, RECT_PL, RECT_PR, RECT_Q,
+           RECT_MAP11, RECT_MAP12, RECT_MAP21, RECT_MAP22,
+           RECT_RMAP11, RECT_RMAP12, RECT_RMAP21, RECT_RMAP22,
+           RECT_MAPPERL, RECT_MAPPERR, RECT_NUM };
+
+    // key of the cache file: FNV-1a of the image size and of the intrinsics, their layout included
+    uint64_t rectificationKey(const Size &size, bool rect, const Mat &KL, const Mat &KR,
+                              const Mat &DistL, const Mat &DistR)
+    {
+        uint64_t h=14695981039346656037ULL;
+        int32_t head[3]={size.width,size.height,rect?1:0};
+        const unsigned char *b=(const unsigned char*)head;
+        for (size_t i=0; i<sizeof(head); i++)
+            h=(h^b[i])*1099511628211ULL;
+
+        const Mat *intr[4]={&KL, &KR, &DistL, &DistR};
+        for (int k=0; k<4; k++)
         {
-            this->RLrect=Mat::eye(3,3,CV_32FC1);
-            this->RRrect=Mat::eye(3,3,CV_32FC1);
-            this->PLrect=this->Kleft;
-            this->PRrect=this->Kright;
+            Mat m=intr[k]->isContinuous()?*intr[k]:intr[k]->clone();
+            int32_t layout[3]={m.rows,m.cols,m.type()};
+            b=(const unsigned char*)layout;
+            for (size_t i=0; i<sizeof(layout); i++)
+                h=(h^b[i])*1099511628211ULL;
+            b=m.data;
+            for (size_t i=0; i<m.total()*m.elemSize(); i++)
+                h=(h^b[i])*1099511628211ULL;
         }
+
+        return h;
+    }
+}
+
+
+bool StereoCamera::loadRectification(const Size &size, bool rect, RectificationEntry &entry)
+{
+    if (this->rectFile.empty() || this->rectMapped.empty())
+        return false;
+
+    // the maps are views on the last file mapped
+    const MappedMatFile &file=*this->rectMapped.back();
+    const vector<Mat> &m=file.getMats();
+    if ((file.getKey()!=rectificationKey(size,rect,this->Kleft,this->Kright,this->DistL,this->DistR)) ||
+        (m.size()!=RECT_NUM) ||
+        (m[RECT_MAP11].size()!=size) || (m[RECT_MAPPERL].size()!=size))
+        return false;
+
+    entry.KL=m[RECT_KL]; entry.KR=m[RECT_KR];
+    entry.DistL=m[RECT_DISTL]; entry.DistR=m[RECT_DISTR];
+    entry.R=m[RECT_R]; entry.T=m[RECT_T];
+    entry.size=size;
+    entry.rectify=rect;
+    if (!matchRectification(entry,size,rect))
+        return false;
+
+    entry.RLrect=m[RECT_RL]; entry.RRrect=m[RECT_RR];
+    entry.PLrect=m[RECT_PL]; entry.PRrect=m[RECT_PR];
+    entry.Q=m[RECT_Q];
+    entry.map11=m[RECT_MAP11]; entry.map12=m[RECT_MAP12];
+    entry.map21=m[RECT_MAP21]; entry.map22=m[RECT_MAP22];
+    entry.rmap11=m[RECT_RMAP11]; entry.rmap12=m[RECT_RMAP12];
+    entry.rmap21=m[RECT_RMAP21]; entry.rmap22=m[RECT_RMAP22];
+    entry.MapperL=m[RECT_MAPPERL]; entry.MapperR=m[RECT_MAPPERR];
+    return true;
+}
+
+
+bool StereoCamera::saveRectification(const RectificationEntry &entry)
+{
+    vector<Mat> m(RECT_NUM);
+    m[RECT_KL]=entry.KL; m[RECT_KR]=entry.KR;
+    m[RECT_DISTL]=entry.DistL; m[RECT_DISTR]=entry.DistR;
+    m[RECT_R]=entry.R; m[RECT_T]=entry.T;
+    m[RECT_RL]=entry.RLrect; m[RECT_RR]=entry.RRrect;
+    m[RECT_PL]=entry.PLrect; m[RECT_PR]=entry.PRrect;
+    m[RECT_Q]=entry.Q;
+    m[RECT_MAP11]=entry.map11; m[RECT_MAP12]=entry.map12;
+    m[RECT_MAP21]=entry.map21; m[RECT_MAP22]=entry.map22;
+    m[RECT_RMAP11]=entry.rmap11; m[RECT_RMAP12]=entry.rmap12;
+    m[RECT_RMAP21]=entry.rmap21; m[RECT_RMAP22]=entry.rmap22;
+    m[RECT_MAPPERL]=entry.MapperL; m[RECT_MAPPERR]=entry.MapperR;
+
+    // keyed by the parameters the entry was built from
+    uint64_t key=rectificationKey(entry.size,entry.rectify,entry.KL,entry.KR,entry.DistL,entry.DistR);
+    bool ok=MappedMatFile::write(this->rectFile,key,m);
+    if (!ok)
+        cout << "Cannot store the rectification maps in " << rectFile << endl;
+    return ok;
+}
+
+
+void StereoCamera::updateRectification(const Size &size, bool rect)
+{
+    mutex->wait();
+
+    // steady gaze: the installed rectification is still valid
+    if (!cameraChanged && rectCurrent>=0 && rectCache[rectCurrent].size==size &&
+        rectCache[rectCurrent].rectify==rect)
+    {
         mutex->post();
+        return;
     }
 
-    if (cameraChanged)
+    int idx=-1;
+    if (rectCurrent>=0 && matchRectification(rectCache[rectCurrent],size,rect))
+        idx=rectCurrent;
+    for (size_t i=0; (idx<0) && (i<rectCache.size()); i++)
+        if (matchRectification(rectCache[i],size,rect))
+            idx=(int)i;
+
+    RectificationEntry entry;
+    if ((idx<0) && loadRectification(size,rect,entry))
     {
-        initUndistortRectifyMap(this->Kleft, this->DistL, this->RLrect, this->PLrect,
-                img_size, CV_32FC1, this->map11, this->map12);
-        initUndistortRectifyMap(this->Kright,  this->DistR, this->RRrect, this->PRrect,
-                img_size, CV_32FC1, this->map21, this->map22);
+        cout << "Rectification maps loaded from " << rectFile << endl;
+        rectFileSaved=true;
     }
+    else if (idx<0)
+    {
+        entry.KL=this->Kleft.clone();
+        entry.KR=this->Kright.clone();
+        entry.DistL=this->DistL.clone();
+        entry.DistR=this->DistR.clone();
+        entry.R=this->R.clone();
+        entry.T=this->T.clone();
+        entry.size=size;
+        entry.rectify=rect;
 
-    Mat img1r, img2r;
-    remap(this->imleft, img1r, this->map11, this->map12, cv::INTER_LINEAR);
-    remap(this->imright, img2r, this->map21,this->map22, cv::INTER_LINEAR);
+        stereoRectify(this->Kleft, this->DistL, this->Kright, this->DistR, size,
+                this->R, this->T, entry.RLrect, entry.RRrect, entry.PLrect,
+                entry.PRrect, entry.Q, -1);
 
-    imgLeftRect = img1r;
-    imgRightRect = img2r;
+        if (!rect)
+        {
+            entry.RLrect=Mat::eye(3,3,CV_32FC1);
+            entry.RRrect=Mat::eye(3,3,CV_32FC1);
+            entry.PLrect=entry.KL;
+            entry.PRrect=entry.KR;
+        }
 
-    Mat disp,disp8,map,dispTemp;
+        // float maps are kept for the point-wise lookups, remap uses the fixed-point ones
+        initUndistortRectifyMap(this->Kleft, this->DistL, entry.RLrect, entry.PLrect,
+                size, CV_32FC1, entry.map11, entry.map12);
+        initUndistortRectifyMap(this->Kright, this->DistR, entry.RRrect, entry.PRrect,
+                size, CV_32FC1, entry.map21, entry.map22);
+        convertMaps(entry.map11, entry.map12, entry.rmap11, entry.rmap12, CV_16SC2);
+        convertMaps(entry.map21, entry.map22, entry.rmap21, entry.rmap22, CV_16SC2);
+
+        // inverse maps: from original to rectified pixels
+        Mat inverseMapL(size.height*size.width,1,CV_32FC2);
+        Mat inverseMapR(size.height*size.width,1,CV_32FC2);
+        float *pL=inverseMapL.ptr<float>(0);
+        float *pR=inverseMapR.ptr<float>(0);
+        for (int y=0; y<size.height; y++)
+        {
+            for (int x=0; x<size.width; x++)
+            {
+                *pL++=(float)x; *pL++=(float)y;
+                *pR++=(float)x; *pR++=(float)y;
+            }
+        }
 
-    bool success;
+        undistortPoints(inverseMapL,inverseMapL,this->Kleft,this->DistL,entry.RLrect,entry.PLrect);
+        undistortPoints(inverseMapR,inverseMapR,this->Kright,this->DistR,entry.RRrect,entry.PRrect);
 
-    if (use_elas)
-    {
-        success = elaswrap->compute_disparity(img1r, img2r, disp, numberOfDisparities);
-        if (success)
+        entry.MapperL=inverseMapL.reshape(2,size.height);
+        entry.MapperR=inverseMapR.reshape(2,size.height);
+
+        // the first rectification built is the one of the next start
+        if (!rectFile.empty() && !rectFileSaved)
         {
-            map = disp * (255.0 / numberOfDisparities);
-            //threshold(map, map, 0, 255.0, THRESH_TOZERO);
+            saveRectification(entry);
+            rectFileSaved=true;
         }
-    } else
+    }
+
+    if (idx<0)
     {
-        int cn=this->imleft.channels();
-    #ifdef OPENCV_GREATER_2
-        Ptr<StereoSGBM> sgbm=cv::StereoSGBM::create(minDisparity,numberOfDisparities,SADWindowSize,
-                                                    8*cn*SADWindowSize*SADWindowSize,
-                                                    32*cn*SADWindowSize*SADWindowSize,
-                                                    disp12MaxDiff,preFilterCap,uniquenessRatio,
-                                                    speckleWindowSize,speckleRange,
-                                                    best?StereoSGBM::MODE_HH:StereoSGBM::MODE_SGBM);
-        sgbm->compute(img1r, img2r, disp);
-    #else
-        StereoSGBM sgbm;
-        sgbm.preFilterCap =         preFilterCap; //63
-        sgbm.SADWindowSize =        SADWindowSize;        
-        sgbm.P1 =                   8*cn*SADWindowSize*SADWindowSize;
-        sgbm.P2 =                   32*cn*SADWindowSize*SADWindowSize;
-        sgbm.minDisparity =         minDisparity; //-15
-        sgbm.numberOfDisparities =  numberOfDisparities;
-        sgbm.uniquenessRatio =      uniquenessRatio; //22
-        sgbm.speckleWindowSize =    speckleWindowSize; //100
-        sgbm.speckleRange =         speckleRange; //32
-        sgbm.disp12MaxDiff =        disp12MaxDiff;
-        sgbm.fullDP =               best; // alg == STEREO_HH
-
-        sgbm(img1r, img2r, disp);
-    #endif
+        // replace the least recently used entry when the cache is full
+        if ((int)rectCache.size()<rectCacheSize)
+        {
+            rectCache.push_back(entry);
+            idx=(int)rectCache.size()-1;
+        }
+        else
+        {
+            idx=0;
+            for (size_t i=1; i<rectCache.size(); i++)
+                if (rectCache[i].lastUsed<rectCache[idx].lastUsed)
+                    idx=(int)i;
+            rectCache[idx]=entry;
+        }
+    }
 
-        disp.convertTo(map, CV_32FC1, 1.0,0.0);
-        map.convertTo(map,CV_32FC1,255/(numberOfDisparities*16.));
-        //normalize(map,map, 0, 255, cv::NORM_MINMAX, CV_8UC1);
+    RectificationEntry &installed=rectCache[idx];
+    installed.lastUsed=++rectClock;
+    if (idx!=rectCurrent)
+    {
+        this->RLrect=installed.RLrect;
+        this->RRrect=installed.RRrect;
+        this->PLrect=installed.PLrect;
+        this->PRrect=installed.PRrect;
+        this->Q=installed.Q;
+        this->map11=installed.map11;
+        this->map12=installed.map12;
+        this->map21=installed.map21;
+        this->map22=installed.map22;
+        this->rmap11=installed.rmap11;
+        this->rmap12=installed.rmap12;
+        this->rmap21=installed.rmap21;
+        this->rmap22=installed.rmap22;
+        this->MapperL=installed.MapperL;
+        this->MapperR=installed.MapperR;
+        rectCurrent=idx;
+    }
+
+    cameraChanged=false;
+    mutex->post();
+}
 
-        success = true;
-    }
 
-    if (success)
+namespace
+{
+    // the outputs of computeDisparity() from the disparity of the engine (T: CV_16S scaled by 16,
+    // or CV_32F in pixels) in one pass per row: the 8 bit map is interpolated at the rectified
+    // position of each pixel of the left camera (0 outside), the conversions are element-wise
+    template<typename T>
+    class DisparityOutputBody : public cv::ParallelLoopBody
     {
-        if (cameraChanged)
+        const Mat &disp,&mapper;
+        Mat &out8,&out16,&outFloat;
+        float toPixels,scale8;
+
+        float at(const int x, const int y) const
         {
-            this->mutex->wait();
+            if ((x<0) || (y<0) || (x>=disp.cols) || (y>=disp.rows))
+                return 0.0f;
+            return (float)disp.ptr<T>(y)[x];
+        }
 
-            Mat inverseMapL(map.rows*map.cols,1,CV_32FC2);
-            Mat inverseMapR(map.rows*map.cols,1,CV_32FC2);
+    public:
+        DisparityOutputBody(const Mat &_disp, const Mat &_mapper, Mat &_out8, Mat &_out16, Mat &_outFloat,
+                            const float _toPixels, const int numberOfDisparities) :
+                            disp(_disp), mapper(_mapper), out8(_out8), out16(_out16), outFloat(_outFloat),
+                            toPixels(_toPixels), scale8(255.0f*_toPixels/numberOfDisparities) { }
 
-            for (int y=0; y<map.rows; y++)
+        void operator()(const cv::Range &range) const
+        {
+            for (int y=range.start; y<range.end; y++)
             {
-                for (int x=0; x<map.cols; x++)
+                const T *d=disp.ptr<T>(y);
+                if (!out16.empty())
+                {
+                    short *o=out16.ptr<short>(y);
+                    for (int x=0; x<disp.cols; x++)
+                        o[x]=cv::saturate_cast<short>(16.0f*toPixels*d[x]);
+                }
+
+                if (!outFloat.empty())
                 {
-                    inverseMapL.ptr<float>(y*map.cols+x)[0]=(float)x;
-                    inverseMapL.ptr<float>(y*map.cols+x)[1]=(float)y;
-                    inverseMapR.ptr<float>(y*map.cols+x)[0]=(float)x;
-                    inverseMapR.ptr<float>(y*map.cols+x)[1]=(float)y;
+                    float *o=outFloat.ptr<float>(y);
+                    for (int x=0; x<disp.cols; x++)
+                        o[x]=toPixels*d[x];
+                }
+
+                if (!out8.empty())
+                {
+                    const float *m=mapper.empty()?NULL:mapper.ptr<float>(y);
+                    uchar *o=out8.ptr<uchar>(y);
+                    for (int x=0; x<out8.cols; x++)
+                    {
+                        float u=(m!=NULL)?m[2*x]:(float)x;
+                        float v=(m!=NULL)?m[2*x+1]:(float)y;
+                        int u0=cvFloor(u), v0=cvFloor(v);
+                        float au=u-u0, av=v-v0;
+                        float val=(1.0f-av)*((1.0f-au)*at(u0,v0)+au*at(u0+1,v0))+
+                                  av*((1.0f-au)*at(u0,v0+1)+au*at(u0+1,v0+1));
+                        o[x]=cv::saturate_cast<uchar>(scale8*val);
+                    }
                 }
             }
+        }
+    };
+}
+
+Mat StereoCamera::pooledBuffer(vector<Mat> &pool, const Size &size, int type)
+{
+    // a buffer is free when the pool holds its only reference
+    for (size_t i=0; i<pool.size(); i++)
+    {
+#ifdef OPENCV_GREATER_2
+        bool shared=(pool[i].u!=NULL) && (pool[i].u->refcount>1);
+#else
+        bool shared=(pool[i].refcount!=NULL) && (*pool[i].refcount>1);
+#endif
+        if (!shared)
+        {
+            pool[i].create(size,type);
+            return pool[i];
+        }
+    }
+
+    // the consumers hold all the buffers: a new one, kept only if the pool is small
+    Mat buffer(size,type);
+    if (pool.size()<8)
+        pool.push_back(buffer);
+    return buffer;
+}
 
-            undistortPoints(inverseMapL,inverseMapL,this->Kleft,this->DistL,this->RLrect,this->PLrect);
-            undistortPoints(inverseMapR,inverseMapR,this->Kright,this->DistR,this->RRrect,this->PRrect);
+void StereoCamera::setDisparityOutputs(bool map8, bool fixed16, bool floating)
+{
+    mutex->wait();
+    outputMap8=map8;
+    outputFixed16=fixed16;
+    outputFloat=floating;
+    mutex->post();
+}
 
-            Mat mapperL=inverseMapL.reshape(2,map.rows);
-            Mat mapperR=inverseMapR.reshape(2,map.rows);
-            this->MapperL=mapperL;
-            this->MapperR=mapperR;
+void StereoCamera::computeDisparity(bool best, int uniquenessRatio, int speckleWindowSize,
+        int speckleRange, int numberOfDisparities, int SADWindowSize,
+        int minDisparity, int preFilterCap, int disp12MaxDiff)
+{
 
-            this->mutex->post();
+    if (this->Kleft.empty() || this->DistL.empty() || this->Kright.empty() || this->DistR.empty())
+    {
+        cout <<" Cameras are not calibrated! Run the Calibration first!" << endl;
+        return;
+    }
 
-            cameraChanged = false;
+    if (this->imleft.empty() || this->imright.empty())
+    {
+        cout << "Images are not set! set the images first!" << endl;
+        return;
+    }
+
+    Size img_size=this->imleft.size();
+
+    double t0=StageStats::now();
+    updateRectification(img_size, rectify);
+    if (stats!=NULL)
+        stats->stop(stageRectification,t0);
+
+    DisparityParams params;
+    params.best=best;
+    params.uniquenessRatio=uniquenessRatio;
+    params.speckleWindowSize=speckleWindowSize;
+    params.speckleRange=speckleRange;
+    params.numberOfDisparities=numberOfDisparities;
+    params.SADWindowSize=SADWindowSize;
+    params.minDisparity=minDisparity;
+    params.preFilterCap=preFilterCap;
+    params.disp12MaxDiff=disp12MaxDiff;
+
+    // the engine writes into a free buffer of the pool, unless it returns its own float disparity
+    Mat img1r,img2r,disp8,disp16,dispFloat;
+    Mat disp=pooledBuffer(dispPool16,img_size,CV_16SC1);
+
+    bool success;
+    if (dispROIs.empty())
+        success=engine->compute(this->imleft, this->imright, this->rmap11, this->rmap12,
+                                this->rmap21, this->rmap22, img1r, img2r, disp, params);
+    else
+        success=computeDisparityROIs(params, img1r, img2r, disp);
+
+    imgLeftRect = img1r;
+    imgRightRect = img2r;
+
+    if (success)
+    {
+        t0=StageStats::now();
+
+        bool floating=(disp.depth()==CV_32F);
+        Mat convert16;
+        if (outputMap8)
+            disp8=pooledBuffer(dispPool8,img_size,CV_8UC1);
+        if (outputFixed16)
+        {
+            if (floating)
+                convert16=disp16=pooledBuffer(dispPool16,disp.size(),CV_16SC1);
+            else
+                disp16=disp;
         }
+        if (outputFloat)
+            dispFloat=pooledBuffer(dispPoolFloat,disp.size(),CV_32FC1);
 
-        Mat x;
-        remap(map,dispTemp,this->MapperL,x,cv::INTER_LINEAR);
-        dispTemp.convertTo(disp8,CV_8U);
+        if (floating)
+            cv::parallel_for_(cv::Range(0,disp.rows),DisparityOutputBody<float>(disp,this->MapperL,
+                              disp8,convert16,dispFloat,1.0f,numberOfDisparities));
+        else
+            cv::parallel_for_(cv::Range(0,disp.rows),DisparityOutputBody<short>(disp,this->MapperL,
+                              disp8,convert16,dispFloat,1.0f/16.0f,numberOfDisparities));
 
-        if (use_elas)
-            disp.convertTo(disp, CV_16SC1, 16.0);
+        if (stats!=NULL)
+            stats->stop(stageDisparityMap,t0);
     }
 
     this->mutex->wait();
 
     this->Disparity = disp8;
-    this->Disparity16 = disp;
+    this->Disparity16 = disp16;
+    this->DisparityFloat = dispFloat;
 
     this->mutex->post();
 
@@ -695,6 +1096,159 @@ Point2f StereoCamera::fromRectifiedToOriginal(int u, int v, int camera)
 }
 
 
+namespace
+{
+    bool strongerResponse(const KeyPoint &a, const KeyPoint &b)
+    {
+        return (a.response>b.response);
+    }
+}
+
+bool StereoCamera::setMatchParameters(const string &detector, int maxFeatures, int gridCols, int gridRows, double epipolarBand)
+{
+    matchDetector=detector;
+    matchMaxFeatures=std::max(0,maxFeatures);
+    matchGridCols=std::max(1,gridCols);
+    matchGridRows=std::max(1,gridRows);
+    matchEpipolarBand=epipolarBand;
+
+    matchFeatures.release();
+    return createMatchFeatures();
+}
+
+bool StereoCamera::createMatchFeatures()
+{
+    // room for the bucketing to pick the strongest keypoints of each cell
+    int nfeatures=(matchMaxFeatures>0)?4*matchMaxFeatures:0;
+
+#ifdef OPENCV_GREATER_2
+    if (matchDetector=="orb")
+        matchFeatures=cv::ORB::create((nfeatures>0)?nfeatures:2000);
+    else if (matchDetector=="akaze")
+        matchFeatures=cv::AKAZE::create();
+    else
+        matchFeatures=cv::xfeatures2d::SIFT::create(nfeatures);
+#else
+    if ((matchDetector=="orb") || (matchDetector=="akaze"))
+    {
+        if (matchDetector=="akaze")
+            cout << "AKAZE requires OpenCV 3, using ORB" << endl;
+        matchFeatures=new cv::ORB((nfeatures>0)?nfeatures:2000);
+    }
+    else
+        matchFeatures=new cv::SIFT(nfeatures);
+#endif
+
+    return !matchFeatures.empty();
+}
+
+void StereoCamera::bucketKeypoints(vector<KeyPoint> &keypoints, const Size &size) const
+{
+    if ((matchMaxFeatures<=0) || ((int)keypoints.size()<=matchMaxFeatures))
+        return;
+
+    int perCell=std::max(1,matchMaxFeatures/(matchGridCols*matchGridRows));
+    vector<vector<KeyPoint> > cells(matchGridCols*matchGridRows);
+    for (size_t i=0; i<keypoints.size(); i++)
+    {
+        int cx=std::min(matchGridCols-1,std::max(0,(int)(keypoints[i].pt.x*matchGridCols/size.width)));
+        int cy=std::min(matchGridRows-1,std::max(0,(int)(keypoints[i].pt.y*matchGridRows/size.height)));
+        cells[cy*matchGridCols+cx].push_back(keypoints[i]);
+    }
+
+    keypoints.clear();
+    for (size_t c=0; c<cells.size(); c++)
+    {
+        vector<KeyPoint> &cell=cells[c];
+        if ((int)cell.size()>perCell)
+        {
+            std::nth_element(cell.begin(),cell.begin()+perCell,cell.end(),strongerResponse);
+            cell.resize(perCell);
+        }
+        keypoints.insert(keypoints.end(),cell.begin(),cell.end());
+    }
+}
+
+void StereoCamera::epipolarMatching(const Mat &Fm, const vector<KeyPoint> &keypoints1, const Mat &descriptors1,
+        const vector<KeyPoint> &keypoints2, const Mat &descriptors2, double radius,
+        vector<DMatch> &filteredMatches12) const
+{
+    filteredMatches12.clear();
+
+    // binary descriptors have no meaningful radius, the cross check and the band select them
+    bool binary=(descriptors1.depth()==CV_8U);
+    int normType=binary?cv::NORM_HAMMING:cv::NORM_L2;
+    float maxDistance=binary?FLT_MAX:(float)radius;
+
+    vector<int> best12(keypoints1.size(),-1), best21(keypoints2.size(),-1);
+    vector<float> dist12(keypoints1.size(),FLT_MAX), dist21(keypoints2.size(),FLT_MAX);
+
+    for (size_t i=0; i<keypoints1.size(); i++)
+    {
+        // epipolar line of the left keypoint in the right image (x_r' F x_l = 0)
+        double x=keypoints1[i].pt.x, y=keypoints1[i].pt.y;
+        double a=Fm.at<double>(0,0)*x+Fm.at<double>(0,1)*y+Fm.at<double>(0,2);
+        double b=Fm.at<double>(1,0)*x+Fm.at<double>(1,1)*y+Fm.at<double>(1,2);
+        double c=Fm.at<double>(2,0)*x+Fm.at<double>(2,1)*y+Fm.at<double>(2,2);
+        double n=sqrt(a*a+b*b);
+        if (n<=0.0)
+            continue;
+
+        a/=n; b/=n; c/=n;
+        for (size_t j=0; j<keypoints2.size(); j++)
+        {
+            if (fabs(a*keypoints2[j].pt.x+b*keypoints2[j].pt.y+c)>matchEpipolarBand)
+                continue;
+
+            float d=(float)cv::norm(descriptors1.row((int)i),descriptors2.row((int)j),normType);
+            if (d>maxDistance)
+                continue;
+
+            if (d<dist12[i])
+            {
+                dist12[i]=d;
+                best12[i]=(int)j;
+            }
+            if (d<dist21[j])
+            {
+                dist21[j]=d;
+                best21[j]=(int)i;
+            }
+        }
+    }
+
+    for (size_t i=0; i<keypoints1.size(); i++)
+    {
+        int j=best12[i];
+        if ((j>=0) && (best21[j]==(int)i))
+            filteredMatches12.push_back(DMatch((int)i,j,dist12[i]));
+    }
+}
+
+void StereoCamera::lshCrossCheckMatching(const Mat &descriptors1, const Mat &descriptors2,
+        vector<DMatch> &filteredMatches12) const
+{
+    filteredMatches12.clear();
+    if (descriptors1.empty() || descriptors2.empty())
+        return;
+
+    cv::FlannBasedMatcher matcher(Ptr<cv::flann::IndexParams>(new cv::flann::LshIndexParams(12,20,2)));
+    vector<vector<DMatch> > matches12, matches21;
+    matcher.knnMatch(descriptors1,descriptors2,matches12,1);
+    matcher.knnMatch(descriptors2,descriptors1,matches21,1);
+
+    for (size_t m=0; m<matches12.size(); m++)
+    {
+        if (matches12[m].empty())
+            continue;
+
+        DMatch forward=matches12[m][0];
+        if ((forward.trainIdx<(int)matches21.size()) && !matches21[forward.trainIdx].empty() &&
+            (matches21[forward.trainIdx][0].trainIdx==forward.queryIdx))
+            filteredMatches12.push_back(forward);
+    }
+}
+
 Mat StereoCamera::findMatch(bool visualize, double displacement, double radius)
 {
     if (this->imleftund.empty() || this->imrightund.empty())
@@ -718,32 +1272,44 @@ Mat StereoCamera::findMatch(bool visualize, double displacement, double radius)
     vector<KeyPoint> keypoints1,keypoints2;
     Mat descriptors1,descriptors2;
 
-#ifdef OPENCV_GREATER_2
-    Ptr<xfeatures2d::SIFT> sift=xfeatures2d::SIFT::create();
-    yAssert(sift!=NULL);
+    // the detector persists across the calls, the descriptors are computed
+    // only for the keypoints kept by the bucketing
+    if (matchFeatures.empty())
+        createMatchFeatures();
+    yAssert(!matchFeatures.empty());
 
-    sift->detect(grayleft,keypoints1);
-    sift->compute(grayleft,keypoints1,descriptors1);
-
-    sift->detect(grayright,keypoints2);
-    sift->compute(grayright,keypoints2,descriptors2);
-#else
-    Ptr<cv::FeatureDetector> detector=cv::FeatureDetector::create("SIFT");
-    Ptr<cv::DescriptorExtractor> descriptorExtractor=cv::DescriptorExtractor::create("SIFT");
+    matchFeatures->detect(grayleft,keypoints1);
+    bucketKeypoints(keypoints1,grayleft.size());
+    matchFeatures->compute(grayleft,keypoints1,descriptors1);
 
-    yAssert(detector!=NULL);
-    yAssert(descriptorExtractor!=NULL);
+    matchFeatures->detect(grayright,keypoints2);
+    bucketKeypoints(keypoints2,grayright.size());
+    matchFeatures->compute(grayright,keypoints2,descriptors2);
 
-    detector->detect(grayleft,keypoints1);
-    descriptorExtractor->compute(grayleft,keypoints1,descriptors1);
+    // the band around the epipolar lines is given by the expected extrinsics,
+    // or by the current ones when they are not set
+    Mat Fband;
+    if ((matchEpipolarBand>0.0) && !Kleft.empty() && !Kright.empty())
+    {
+        if (!R_exp.empty() && !T_exp.empty())
+        {
+            updateExpectedCameraMatrices();
+            Fband=FfromP(Pleft_exp,Pright_exp);
+        }
+        else if (!Pleft.empty() && !Pright.empty())
+            Fband=FfromP(Pleft,Pright);
+    }
 
-    detector->detect(grayright,keypoints2);
-    descriptorExtractor->compute(grayright,keypoints2,descriptors2);
-#endif
-    
-    cv::BFMatcher descriptorMatcher;
     vector<DMatch> filteredMatches;
-    crossCheckMatching(descriptorMatcher,descriptors1,descriptors2,filteredMatches,radius);
+    if (!Fband.empty())
+        epipolarMatching(Fband,keypoints1,descriptors1,keypoints2,descriptors2,radius,filteredMatches);
+    else if (descriptors1.depth()==CV_8U)
+        lshCrossCheckMatching(descriptors1,descriptors2,filteredMatches);
+    else
+    {
+        cv::BFMatcher descriptorMatcher;
+        crossCheckMatching(descriptorMatcher,descriptors1,descriptors2,filteredMatches,radius);
+    }
 
     for (size_t i=0; i<filteredMatches.size(); i++)
     {
@@ -2216,57 +2782,87 @@ vector<Point2f> StereoCamera::projectPoints3D(string camera, vector<Point3f> &po
     return points2D;
 }
 
-Mat StereoCamera::computeWorldImage(Mat &H)
+namespace
 {
+    // applies the 4x4 transform M to a band of rows of a CV_32FC3 point image,
+    // points farther than 100 (missing disparities) are set to zero
+    class WorldTransformBody : public cv::ParallelLoopBody
+    {
+        Mat &img;
+        float M[16];
+
+    public:
+        WorldTransformBody(Mat &_img, const Mat &_M) : img(_img)
+        {
+            for (int i=0; i<4; i++)
+                for (int j=0; j<4; j++)
+                    M[4*i+j]=(float)_M.at<double>(i,j);
+        }
+
+        void operator()(const cv::Range &range) const
+        {
+            for (int i=range.start; i<range.end; i++)
+            {
+                float *p=img.ptr<float>(i);
+                for (int j=0; j<img.cols; j++, p+=3)
+                {
+                    float x=p[0], y=p[1], z=p[2];
+                    if (z>100)
+                    {
+                        p[0]=p[1]=p[2]=0.0f;
+                        continue;
+                    }
 
-    Mat worldImg(Disparity16.rows,Disparity16.cols,CV_32FC3);
+                    float w=M[12]*x+M[13]*y+M[14]*z+M[15];
+                    p[0]=(M[0]*x+M[1]*y+M[2]*z+M[3])/w;
+                    p[1]=(M[4]*x+M[5]*y+M[6]*z+M[7])/w;
+                    p[2]=(M[8]*x+M[9]*y+M[10]*z+M[11])/w;
+                }
+            }
+        }
+    };
+}
+
+Mat StereoCamera::computeWorldImage(Mat &H)
+{
+    Mat worldImg;
+    computeWorldImage(H,worldImg);
+    return worldImg;
+}
 
+bool StereoCamera::computeWorldImage(Mat &H, Mat &worldImg)
+{
     if(H.empty())
         H=H.eye(4,4,CV_64FC1);
 
-    if(Disparity16.empty() || MapperL.empty() || Q.empty())
+    mutex->wait();
+    Mat disp16=this->Disparity16;
+    Mat mapper=this->MapperL;
+    Mat q=this->Q;
+    Mat RLrectTmp=this->RLrect.t();
+    mutex->post();
+
+    worldImg.create(disp16.rows,disp16.cols,CV_32FC3);
+
+    if(disp16.empty() || mapper.empty() || q.empty())
     {
         cout <<" Run computeDisparity() method first" << endl;
-        return worldImg;
+        return false;
     }
 
-
-    Mat dispTemp;
     Mat x;
-    remap(this->Disparity16,dispTemp,this->MapperL,x,cv::INTER_LINEAR);
-    reprojectImageTo3D(dispTemp, worldImg,this->Q,true);
+    remap(disp16,worldDispTmp,mapper,x,cv::INTER_LINEAR);
+    reprojectImageTo3D(worldDispTmp,worldImg,q,true);
 
-    for(int i=0; i<worldImg.rows; i++)
-    {
-        for(int j=0; j<worldImg.cols; j++)
-        {
-            Mat RLrectTmp=this->getRLrect().t();
-            Mat Tfake = Mat::zeros(0,3,CV_64F);
-            Mat P(4,1,CV_64FC1);
-            if((worldImg.data + worldImg.step * i)[j * worldImg.channels() + 2]>100)
-            {
-                P.at<double>(0,0)=0.0;
-                P.at<double>(1,0)=0.0;
-                P.at<double>(2,0)=0.0;
-                P.at<double>(3,0)=1.0;
-            }
-            else
-            {
-                P.at<double>(0,0)=(worldImg.data + worldImg.step * i)[j * worldImg.channels() + 0];
-                P.at<double>(1,0)=(worldImg.data + worldImg.step * i)[j * worldImg.channels() + 1];
-                P.at<double>(2,0)=(worldImg.data + worldImg.step * i)[j * worldImg.channels() + 2];
-                P.at<double>(3,0)=1;
+    // fold the rectification and H once
+    RLrectTmp.convertTo(RLrectTmp,CV_64F);
+    Mat Tfake=Mat::zeros(0,3,CV_64F);
+    Mat Hrect=buildRotTras(RLrectTmp,Tfake);
+    Mat M=H*Hrect;
 
-                Mat Hrect=buildRotTras(RLrectTmp,Tfake);
-                P=H*Hrect*P;
-            }
-            (worldImg.data + worldImg.step * i)[j * worldImg.channels() + 0]=(float) ((float) P.at<double>(0,0)/P.at<double>(3,0));
-            (worldImg.data + worldImg.step * i)[j * worldImg.channels() + 1]=(float) ((float) P.at<double>(1,0)/P.at<double>(3,0));
-            (worldImg.data + worldImg.step * i)[j * worldImg.channels() + 2]=(float) ((float) P.at<double>(2,0)/P.at<double>(3,0));
-        }
-    }
+    cv::parallel_for_(cv::Range(0,worldImg.rows),WorldTransformBody(worldImg,M));
 
-    return worldImg;
+    return true;
 }
 
 const Mat& StereoCamera::getDistCoeffLeft() const
@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#include <cstring>
+#include <stdint.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+#include "iCub/stereoVision/stereoLog.h"
+
+using namespace std;
+using namespace cv;
+using namespace yarp::os;
+using namespace yarp::sig;
+
+
+namespace
+{
+    const char logMagic[8]={'S','T','E','R','E','O','L','G'};
+    const uint32_t logVersion=1;
+    const uint32_t recordMagic=0x52465653;     // "SVFR"
+    const size_t logAlign=64;
+    const size_t fileHeaderSize=64;
+
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t align;
+        char reserved[fileHeaderSize-16];
+    };
+
+    // laid out without padding, offsets relative to the start of the record
+    struct RecordHeader
+    {
+        uint32_t magic;
+        uint32_t headerSize;
+        uint64_t size;          // the whole record, padding included
+        double time;
+        double stampL,stampR;
+        int32_t seqL,seqR;
+        int32_t nHead,hasPoses;
+        int32_t rowsL,colsL,typeL;
+        int32_t rowsR,colsR,typeR;
+        uint64_t offHead,offPoses,offL,offR;
+    };
+
+    inline size_t alignUp(const size_t x)
+    {
+        return (x+logAlign-1)&~(logAlign-1);
+    }
+
+    // a block of a record, without overflow
+    inline bool inRecord(const uint64_t off, const uint64_t size, const uint64_t recordSize)
+    {
+        return (off<=recordSize) && (size<=recordSize-off);
+    }
+
+    // the images are logged as gray or color 8 bit pixels
+    inline bool loggedType(const int type)
+    {
+        return (type==CV_8UC1) || (type==CV_8UC3);
+    }
+
+    // size of a logged image, false if it cannot fit in a record of recordSize bytes;
+    // each factor is bounded before the product, which then cannot overflow
+    inline bool imageSize(const int32_t rows, const int32_t cols, const int32_t type,
+                          const uint64_t recordSize, uint64_t &size)
+    {
+        if ((rows<0) || (cols<0) || !loggedType(type))
+            return false;
+
+        uint64_t line=(uint64_t)cols*CV_ELEM_SIZE(type);
+        if ((line>recordSize) || ((line>0) && ((uint64_t)rows>recordSize/line)))
+            return false;
+
+        size=line*rows;
+        return true;
+    }
+
+    // the record read from the file is trusted only once all its fields agree
+    bool validRecord(const RecordHeader *rec)
+    {
+        uint64_t sizeL,sizeR;
+        if ((rec->nHead<0) || !imageSize(rec->rowsL,rec->colsL,rec->typeL,rec->size,sizeL) ||
+            !imageSize(rec->rowsR,rec->colsR,rec->typeR,rec->size,sizeR))
+            return false;
+
+        uint64_t sizeHead=(uint64_t)rec->nHead*sizeof(double);
+        uint64_t sizePoses=rec->hasPoses?32*sizeof(double):0;
+
+        return (rec->offHead>=sizeof(RecordHeader)) &&
+               inRecord(rec->offHead,sizeHead,rec->offPoses) &&
+               inRecord(rec->offPoses,sizePoses,rec->offL) &&
+               inRecord(rec->offL,sizeL,rec->size) &&
+               inRecord(rec->offR,sizeR,rec->size);
+    }
+
+    bool writePadding(FILE *file, const size_t from, const size_t to)
+    {
+        static const char zeros[logAlign]={0};
+        return (to<=from) || (fwrite(zeros,1,to-from,file)==to-from);
+    }
+
+    bool writeImage(FILE *file, const Mat &img)
+    {
+        size_t rowSize=img.cols*img.elemSize();
+        if (img.isContinuous())
+            return (fwrite(img.data,1,rowSize*img.rows,file)==rowSize*img.rows);
+
+        for (int v=0; v<img.rows; v++)
+            if (fwrite(img.ptr(v),1,rowSize,file)!=rowSize)
+                return false;
+
+        return true;
+    }
+}
+
+
+/******************************************************************************/
+StereoLogWriter::StereoLogWriter() : file(NULL), frames(0)
+{
+}
+
+
+/******************************************************************************/
+StereoLogWriter::~StereoLogWriter()
+{
+    close();
+}
+
+
+/******************************************************************************/
+bool StereoLogWriter::open(const string &path)
+{
+    LockGuard lg(mutex);
+    if (file!=NULL)
+        fclose(file);
+
+    frames=0;
+    file=fopen(path.c_str(),"wb");
+    if (file==NULL)
+        return false;
+
+    FileHeader header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,logMagic,sizeof(logMagic));
+    header.version=logVersion;
+    header.align=logAlign;
+    if (fwrite(&header,sizeof(header),1,file)!=1)
+    {
+        fclose(file);
+        file=NULL;
+        return false;
+    }
+
+    return true;
+}
+
+
+/******************************************************************************/
+bool StereoLogWriter::write(const StereoLogFrame &frame)
+{
+    LockGuard lg(mutex);
+    if ((file==NULL) || !loggedType(frame.left.type()) || !loggedType(frame.right.type()))
+        return false;
+
+    bool poses=(frame.HL.rows()==4) && (frame.HL.cols()==4) &&
+               (frame.HR.rows()==4) && (frame.HR.cols()==4);
+
+    RecordHeader rec;
+    memset(&rec,0,sizeof(rec));
+    rec.magic=recordMagic;
+    rec.headerSize=sizeof(RecordHeader);
+    rec.time=frame.time;
+    rec.stampL=frame.stampL.getTime();
+    rec.stampR=frame.stampR.getTime();
+    rec.seqL=frame.stampL.getCount();
+    rec.seqR=frame.stampR.getCount();
+    rec.nHead=(int32_t)frame.head.length();
+    rec.hasPoses=poses?1:0;
+    rec.rowsL=frame.left.rows;  rec.colsL=frame.left.cols;  rec.typeL=frame.left.type();
+    rec.rowsR=frame.right.rows; rec.colsR=frame.right.cols; rec.typeR=frame.right.type();
+
+    size_t sizeL=frame.left.cols*frame.left.elemSize()*frame.left.rows;
+    size_t sizeR=frame.right.cols*frame.right.elemSize()*frame.right.rows;
+    rec.offHead=sizeof(RecordHeader);
+    rec.offPoses=rec.offHead+rec.nHead*sizeof(double);
+    rec.offL=alignUp(rec.offPoses+(poses?32*sizeof(double):0));
+    rec.offR=alignUp(rec.offL+sizeL);
+    rec.size=alignUp(rec.offR+sizeR);
+
+    bool ok=(fwrite(&rec,sizeof(rec),1,file)==1);
+    if (ok && (rec.nHead>0))
+        ok=(fwrite(frame.head.data(),sizeof(double),rec.nHead,file)==(size_t)rec.nHead);
+    if (ok && poses)
+        ok=(fwrite(frame.HL.data(),sizeof(double),16,file)==16) &&
+           (fwrite(frame.HR.data(),sizeof(double),16,file)==16);
+    ok=ok && writePadding(file,rec.offPoses+(poses?32*sizeof(double):0),rec.offL);
+    ok=ok && writeImage(file,frame.left);
+    ok=ok && writePadding(file,rec.offL+sizeL,rec.offR);
+    ok=ok && writeImage(file,frame.right);
+    ok=ok && writePadding(file,rec.offR+sizeR,rec.size);
+
+    if (ok)
+        frames++;
+
+    return ok;
+}
+
+
+/******************************************************************************/
+void StereoLogWriter::close()
+{
+    LockGuard lg(mutex);
+    if (file!=NULL)
+    {
+        fclose(file);
+        file=NULL;
+    }
+}
+
+
+/******************************************************************************/
+StereoLogReader::StereoLogReader() : data(NULL), length(0)
+{
+#ifdef _WIN32
+    file=mapping=NULL;
+#else
+    fd=-1;
+#endif
+}
+
+
+/******************************************************************************/
+StereoLogReader::~StereoLogReader()
+{
+    close();
+}
+
+
+/******************************************************************************/
+bool StereoLogReader::open(const string &path)
+{
+    close();
+
+#ifdef _WIN32
+    file=CreateFileA(path.c_str(),GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,
+                     FILE_FLAG_SEQUENTIAL_SCAN,NULL);
+    if (file==INVALID_HANDLE_VALUE)
+    {
+        file=NULL;
+        return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file,&fileSize) || (fileSize.QuadPart<(LONGLONG)fileHeaderSize))
+    {
+        close();
+        return false;
+    }
+    length=(size_t)fileSize.QuadPart;
+
+    mapping=CreateFileMappingA(file,NULL,PAGE_WRITECOPY,0,0,NULL);
+    if (mapping!=NULL)
+        data=(unsigned char*)MapViewOfFile(mapping,FILE_MAP_COPY,0,0,0);
+#else
+    fd=::open(path.c_str(),O_RDONLY);
+    if (fd<0)
+        return false;
+
+    struct stat st;
+    if ((fstat(fd,&st)!=0) || (st.st_size<(off_t)fileHeaderSize))
+    {
+        close();
+        return false;
+    }
+    length=(size_t)st.st_size;
+
+    void *addr=mmap(NULL,length,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+    if (addr!=MAP_FAILED)
+    {
+        data=(unsigned char*)addr;
+        madvise(data,length,MADV_SEQUENTIAL);
+    }
+#endif
+
+    if (data==NULL)
+    {
+        close();
+        return false;
+    }
+
+    const FileHeader *header=(const FileHeader*)data;
+    if ((memcmp(header->magic,logMagic,sizeof(logMagic))!=0) || (header->version!=logVersion) ||
+        (header->align!=logAlign))
+    {
+        close();
+        return false;
+    }
+
+    // the records are chained by their size, up to the last complete one
+    size_t off=fileHeaderSize;
+    while (off+sizeof(RecordHeader)<=length)
+    {
+        const RecordHeader *rec=(const RecordHeader*)(data+off);
+        if ((rec->magic!=recordMagic) || (rec->headerSize!=sizeof(RecordHeader)) ||
+            (rec->size<sizeof(RecordHeader)) || (rec->size>length-off))
+            break;
+
+        if (!validRecord(rec))
+            break;
+
+        index.push_back(off);
+        off+=(size_t)rec->size;
+    }
+
+    return true;
+}
+
+
+/******************************************************************************/
+bool StereoLogReader::get(const int i, StereoLogFrame &frame) const
+{
+    if ((data==NULL) || (i<0) || (i>=(int)index.size()))
+        return false;
+
+    unsigned char *base=data+index[i];
+    const RecordHeader *rec=(const RecordHeader*)base;
+
+    frame.time=rec->time;
+    frame.stampL=Stamp(rec->seqL,rec->stampL);
+    frame.stampR=Stamp(rec->seqR,rec->stampR);
+
+    frame.head.resize(rec->nHead);
+    if (rec->nHead>0)
+        memcpy(frame.head.data(),base+rec->offHead,rec->nHead*sizeof(double));
+
+    if (rec->hasPoses)
+    {
+        frame.HL.resize(4,4);
+        frame.HR.resize(4,4);
+        memcpy(frame.HL.data(),base+rec->offPoses,16*sizeof(double));
+        memcpy(frame.HR.data(),base+rec->offPoses+16*sizeof(double),16*sizeof(double));
+    }
+    else
+    {
+        frame.HL.resize(0,0);
+        frame.HR.resize(0,0);
+    }
+
+    // views on the mapped pages
+    frame.left=Mat(rec->rowsL,rec->colsL,rec->typeL,base+rec->offL);
+    frame.right=Mat(rec->rowsR,rec->colsR,rec->typeR,base+rec->offR);
+
+#ifndef _WIN32
+    // the next record is paged in while this one is processed
+    if (i+1<(int)index.size())
+    {
+        size_t page=(size_t)sysconf(_SC_PAGESIZE);
+        size_t start=index[i+1]&~(page-1);
+        size_t end=index[i+1]+(size_t)((const RecordHeader*)(data+index[i+1]))->size;
+        madvise(data+start,end-start,MADV_WILLNEED);
+    }
+#endif
+
+    return true;
+}
+
+
+/******************************************************************************/
+void StereoLogReader::close()
+{
+#ifdef _WIN32
+    if (data!=NULL)
+        UnmapViewOfFile(data);
+    if (mapping!=NULL)
+        CloseHandle(mapping);
+    if (file!=NULL)
+        CloseHandle(file);
+    file=mapping=NULL;
+#else
+    if (data!=NULL)
+        munmap(data,length);
+    if (fd>=0)
+        ::close(fd);
+    fd=-1;
+#endif
+
+    data=NULL;
+    length=0;
+    index.clear();
+}
+
+
+/******************************************************************************/
+StereoLogPlayer::StereoLogPlayer(const bool realTime, const bool loop) :
+                                 realTime(realTime), loop(loop), next(0),
+                                 originLog(0.0), originReplay(0.0)
+{
+}
+
+
+/******************************************************************************/
+bool StereoLogPlayer::open(const string &path)
+{
+    next=0;
+    return reader.open(path) && (reader.size()>0);
+}
+
+
+/******************************************************************************/
+void StereoLogPlayer::close()
+{
+    reader.close();
+    next=0;
+}
+
+
+/******************************************************************************/
+void StereoLogPlayer::rewind()
+{
+    next=0;
+}
+
+
+/******************************************************************************/
+bool StereoLogPlayer::read(StereoLogFrame &frame, const bool wait)
+{
+    if (next>=reader.size())
+    {
+        if (!loop || (reader.size()==0))
+            return false;
+        next=0;
+    }
+
+    if (!reader.get(next,frame))
+        return false;
+
+    if (realTime)
+    {
+        // the pacing restarts with the first pair
+        double now=Time::now();
+        if (next==0)
+        {
+            originLog=frame.time;
+            originReplay=now;
+        }
+
+        double delay=originReplay+(frame.time-originLog)-now;
+        if (delay>0.0)
+        {
+            if (!wait)
+                return false;
+            Time::delay(delay);
+        }
+    }
+
+    next++;
+    return true;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#include <cmath>
+
+#include "iCub/stereoVision/stereoSync.h"
+
+using namespace yarp::os;
+using namespace yarp::sig;
+
+
+/******************************************************************************/
+StereoSynchronizer::StereoSynchronizer(BufferedPort<ImageOf<PixelRgb> > *portL,
+                                       BufferedPort<ImageOf<PixelRgb> > *portR,
+                                       const double tolerance, const int maxPending) :
+                                       portL(portL), portR(portR), tolerance(tolerance),
+                                       maxPending(maxPending>0?maxPending:1)
+{
+    resetStats();
+}
+
+
+/******************************************************************************/
+bool StereoSynchronizer::grab(BufferedPort<ImageOf<PixelRgb> > *port, std::deque<Item> &pending,
+                              int &dropped, const bool wait)
+{
+    ImageOf<PixelRgb> *img=port->read(wait);
+    if (img==NULL)
+        return false;
+
+    // the port buffer is reused at the next read
+    Item item;
+    port->getEnvelope(item.stamp);
+    item.img=cv::cvarrToMat((IplImage*)img->getIplImage()).clone();
+    pending.push_back(item);
+
+    if (pending.size()>maxPending)
+    {
+        pending.pop_front();
+        LockGuard lg(mutex);
+        dropped++;
+    }
+
+    return true;
+}
+
+
+/******************************************************************************/
+bool StereoSynchronizer::match(cv::Mat &left, cv::Mat &right, Stamp &stampL, Stamp &stampR)
+{
+    LockGuard lg(mutex);
+
+    bool found=false;
+    double skew=0.0;
+    while (!pendingL.empty() && !pendingR.empty())
+    {
+        const Item &l=pendingL.front();
+        const Item &r=pendingR.front();
+        double dt=(l.stamp.isValid() && r.stamp.isValid())?
+                  (l.stamp.getTime()-r.stamp.getTime()):0.0;
+
+        if (fabs(dt)<=tolerance)
+        {
+            // a newer pair supersedes the one found so far
+            if (found)
+            {
+                stats.droppedLeft++;
+                stats.droppedRight++;
+            }
+
+            left=l.img; stampL=l.stamp;
+            right=r.img; stampR=r.stamp;
+            skew=dt;
+            found=true;
+
+            pendingL.pop_front();
+            pendingR.pop_front();
+        }
+        // the other side is already past this image: it will never be paired
+        else if (dt<0.0)
+        {
+            pendingL.pop_front();
+            stats.droppedLeft++;
+        }
+        else
+        {
+            pendingR.pop_front();
+            stats.droppedRight++;
+        }
+    }
+
+    if (found)
+    {
+        stats.pairs++;
+        stats.lastSkew=skew;
+        skewSum+=fabs(skew);
+        stats.meanSkew=skewSum/stats.pairs;
+        if (fabs(skew)>stats.maxSkew)
+            stats.maxSkew=fabs(skew);
+    }
+
+    return found;
+}
+
+
+/******************************************************************************/
+bool StereoSynchronizer::read(cv::Mat &left, cv::Mat &right, Stamp &stampL, Stamp &stampR,
+                              const bool wait)
+{
+    while (true)
+    {
+        // collect whatever is already there on both sides
+        while ((portL->getPendingReads()>0) && grab(portL,pendingL,stats.droppedLeft,false));
+        while ((portR->getPendingReads()>0) && grab(portR,pendingR,stats.droppedRight,false));
+
+        if (match(left,right,stampL,stampR))
+            return true;
+
+        if (!wait)
+            return false;
+
+        // wait for the side we miss (NULL on interrupt)
+        bool ok=pendingL.empty()?grab(portL,pendingL,stats.droppedLeft,true):
+                                 grab(portR,pendingR,stats.droppedRight,true);
+        if (!ok)
+            return false;
+    }
+}
+
+
+/******************************************************************************/
+void StereoSynchronizer::setTolerance(const double tolerance)
+{
+    LockGuard lg(mutex);
+    this->tolerance=tolerance;
+}
+
+
+/******************************************************************************/
+double StereoSynchronizer::getTolerance()
+{
+    LockGuard lg(mutex);
+    return tolerance;
+}
+
+
+/******************************************************************************/
+StereoSyncStats StereoSynchronizer::getStats()
+{
+    LockGuard lg(mutex);
+    return stats;
+}
+
+
+/******************************************************************************/
+void StereoSynchronizer::resetStats()
+{
+    LockGuard lg(mutex);
+    stats.pairs=0;
+    stats.droppedLeft=0;
+    stats.droppedRight=0;
+    stats.lastSkew=0.0;
+    stats.meanSkew=0.0;
+    stats.maxSkew=0.0;
+    skewSum=0.0;
+}
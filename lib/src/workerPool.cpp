@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#include <algorithm>
+
+#include "iCub/stereoVision/workerPool.h"
+
+using namespace std;
+using namespace cv;
+using namespace yarp::os;
+
+
+/******************************************************************************/
+class WorkerPool::Worker : public Thread
+{
+    WorkerPool &pool;
+    int index;
+
+public:
+
+    volatile long key;
+
+    Worker(WorkerPool &_pool, const int _index) : pool(_pool), index(_index), key(-1) { }
+
+    void run()
+    {
+        key=Thread::getKeyOfCaller();
+        pool.work(index);
+    }
+};
+
+
+/******************************************************************************/
+WorkerPool::WorkerPool(const int threads) : available(0), nextQueue(0), running(false)
+{
+    int n=(threads>0)?threads:std::max(getNumberOfCPUs(),1);
+    for (int i=0; i<n; i++)
+    {
+        Queue *q=new Queue;
+        for (int p=0; p<numPriorities; p++)
+            q->size[p]=0;
+        q->executed=q->stolen=0;
+        queues.push_back(q);
+        workers.push_back(new Worker(*this,i));
+    }
+}
+
+
+/******************************************************************************/
+WorkerPool::~WorkerPool()
+{
+    stop();
+
+    for (size_t i=0; i<workers.size(); i++)
+    {
+        delete workers[i];
+        delete queues[i];
+    }
+}
+
+
+/******************************************************************************/
+bool WorkerPool::start()
+{
+    if (running)
+        return true;
+
+    running=true;
+    for (size_t i=0; i<workers.size(); i++)
+    {
+        if (!workers[i]->start())
+        {
+            stop();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/******************************************************************************/
+void WorkerPool::stop()
+{
+    if (!running)
+        return;
+
+    // the workers woken up from now on find the pool stopped
+    running=false;
+    for (size_t i=0; i<workers.size(); i++)
+        available.post();
+    for (size_t i=0; i<workers.size(); i++)
+        if (workers[i]->isRunning())
+            workers[i]->stop();
+
+    for (size_t i=0; i<queues.size(); i++)
+    {
+        LockGuard lg(queues[i]->mutex);
+        for (int p=0; p<numPriorities; p++)
+        {
+            queues[i]->jobs[p].clear();
+            queues[i]->size[p]=0;
+        }
+    }
+    while (available.check());
+}
+
+
+/******************************************************************************/
+void WorkerPool::submit(const Ptr<Job> &job, const int priority)
+{
+    if (job.empty())
+        return;
+
+    int p=std::max(0,std::min(priority,numPriorities-1));
+    int w=getCurrentWorker();
+    if (w<0)
+    {
+        mutexSubmit.lock();
+        w=nextQueue;
+        nextQueue=(nextQueue+1)%(int)queues.size();
+        mutexSubmit.unlock();
+    }
+
+    Queue &q=*queues[w];
+    q.mutex.lock();
+    q.jobs[p].push_back(job);
+    q.size[p]=(int)q.jobs[p].size();
+    q.mutex.unlock();
+
+    available.post();
+}
+
+
+/******************************************************************************/
+int WorkerPool::getCurrentWorker() const
+{
+    long key=Thread::getKeyOfCaller();
+    for (size_t i=0; i<workers.size(); i++)
+        if (workers[i]->key==key)
+            return (int)i;
+
+    return -1;
+}
+
+
+/******************************************************************************/
+void WorkerPool::getCounters(int &executed, int &stolen) const
+{
+    executed=stolen=0;
+    for (size_t i=0; i<queues.size(); i++)
+    {
+        executed+=queues[i]->executed;
+        stolen+=queues[i]->stolen;
+    }
+}
+
+
+/******************************************************************************/
+Ptr<WorkerPool::Job> WorkerPool::take(const int worker)
+{
+    const int n=(int)queues.size();
+    for (int p=numPriorities-1; p>=0; p--)
+    {
+        // the own queue first, then the others starting from the next one
+        for (int k=0; k<n; k++)
+        {
+            Queue &q=*queues[(worker+k)%n];
+            if (q.size[p]==0)
+                continue;
+
+            LockGuard lg(q.mutex);
+            deque<Ptr<Job> > &jobs=q.jobs[p];
+            if (jobs.empty())
+                continue;
+
+            Ptr<Job> job;
+            if (k==0)
+            {
+                job=jobs.back();
+                jobs.pop_back();
+            }
+            else
+            {
+                job=jobs.front();
+                jobs.pop_front();
+                queues[worker]->stolen++;
+            }
+            q.size[p]=(int)jobs.size();
+            return job;
+        }
+    }
+
+    return Ptr<Job>();
+}
+
+
+/******************************************************************************/
+void WorkerPool::work(const int worker)
+{
+    while (true)
+    {
+        available.wait();
+        if (!running)
+            break;
+
+        // a job is queued for sure, the hints may just be stale
+        Ptr<Job> job;
+        while ((job=take(worker)).empty())
+            Time::yield();
+
+        job->run();
+        queues[worker]->executed++;
+    }
+}
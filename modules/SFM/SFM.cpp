@@ -63,19 +63,54 @@ bool SFM::configure(ResourceFinder &rf)
 
     leftImgPort.open(left.c_str());
     rightImgPort.open(right.c_str());
+    stereoSync=new StereoSynchronizer(&leftImgPort,&rightImgPort,
+                                      rf.check("syncTolerance",Value(0.02)).asDouble());
     outMatch.open(outMatchName.c_str());
     outDisp.open(outDispName.c_str());
     handlerPort.open(rpc_name.c_str());
     worldCartPort.open((world_name+"/cartesian:o").c_str());
     worldCylPort.open((world_name+"/cylindrical:o").c_str());
+    worldPointsPort.open((world_name+"/points:o").c_str());
     attach(handlerPort);
 
     outLeftRectImgPort.open(outLeftRectImgPortName.c_str());
     outRightRectImgPort.open(outRightRectImgPortName.c_str());
+    statsPort.open((sname+"/stats:o").c_str());
+
+    stageAcquire=stats.addStage("acquire");
+    stageCalibration=stats.addStage("calibration");
+    stageDisparity=stats.addStage("disparity");
+    stageOutputs=stats.addStage("outputs");
+    stagePublishRect=stats.addStage("publish_rect");
+    stageBilateral=stats.addStage("bilateral");
+    stageDispPort=stats.addStage("disp_port");
+    stageWorld=stats.addStage("world3d");
+    stageWorldPort=stats.addStage("world_port");
+    stageFrame=stats.addStage("frame");
+    statsPeriod=rf.check("statsPeriod",Value(1.0)).asDouble();
+    statsLast=0.0;
+
+    string format=rf.check("pointsFormat",Value("f32")).asString().c_str();
+    if (format=="f16")
+        pointsFormat=POINTS_F16;
+    else if (format=="q16")
+        pointsFormat=POINTS_Q16;
+    else
+        pointsFormat=POINTS_F32;
+    pointsStride=std::max(1,rf.check("pointsStride",Value(1)).asInt());
+    pointsQuantum=rf.check("pointsQuantum",Value(0.001)).asDouble();
 
     this->stereo = new StereoCamera(true);
+    stereo->setStageStats(&stats);
+    stereo->setRectificationTolerance(rf.check("rectTolerance",Value(1e-4)).asDouble());
+
+    string mapsFile=rf.check("rectMapsFile",Value("SFM_maps.bin")).asString().c_str();
+    if (mapsFile!="none")
+        stereo->setRectificationCacheFile(localCalibration.getHomeContextPath().c_str()+string("/")+mapsFile);
 
-    if (!rf.check("use_sgbm"))
+    string engine=rf.check("use_sgbm")?"sgbm":"elas";
+    engine=rf.check("disparityEngine",Value(engine)).asString().c_str();
+    if (!stereo->setDisparityEngine(engine,rf) && (engine!="elas"))
         stereo->initELAS(rf);
 
     Mat KL, KR, DistL, DistR;
@@ -97,17 +132,28 @@ bool SFM::configure(ResourceFinder &rf)
 
     this->numberOfDisparities = 96;
 
+    this->roiMargin=rf.check("roiMargin",Value(16)).asInt();
+    vector<cv::Rect> rois;
+    if (Bottle *pRoi=rf.find("roi").asList())
+    {
+        if (!parseROIs(*pRoi,0,rois))
+            cout << "roi must be a list of quadruples (tlx tly w h), using the whole image" << endl;
+    }
+    stereo->setDisparityROIs(rois,roiMargin);
+
     this->doBLF = true;
     bool skipBLF = rf.check("skipBLF");
     if (skipBLF){
         this->doBLF = false;}
     // this->doBLF = rf.check("doBLF",Value(true)).asBool();
     cout << " Bilateral filter set to " << doBLF << endl;
+    this->jointBLF = rf.check("jointBLF");
     this->sigmaColorBLF = 10.0;
     this->sigmaSpaceBLF = 10.0;
 
 
     this->HL_root=Mat::zeros(4,4,CV_64F);
+    this->rayDispStep=0;
     this->HR_root=Mat::zeros(4,4,CV_64F);
 
     if (useCalibrated)
@@ -118,41 +164,111 @@ bool SFM::configure(ResourceFinder &rf)
         this->stereo->setIntrinsics(KL,KR,zeroDist,zeroDist);
     }
 
+    // the recalibration matches the pairs on a camera of its own
+    calibStereo=new StereoCamera(true);
+    Mat KLc=this->stereo->getKleft().clone();
+    Mat KRc=this->stereo->getKright().clone();
+    Mat DistLc=this->stereo->getDistCoeffLeft().clone();
+    Mat DistRc=this->stereo->getDistCoeffRight().clone();
+    calibStereo->setIntrinsics(KLc,KRc,DistLc,DistRc);
+
+    int gridCols=4, gridRows=4;
+    if (Bottle *pGrid=rf.find("matchGrid").asList())
+    {
+        if (pGrid->size()>=2)
+        {
+            gridCols=pGrid->get(0).asInt();
+            gridRows=pGrid->get(1).asInt();
+        }
+    }
+    string matchDetector=rf.check("matchDetector",Value("sift")).asString().c_str();
+    if (!calibStereo->setMatchParameters(matchDetector,rf.check("matchMaxFeatures",Value(0)).asInt(),
+                                         gridCols,gridRows,rf.check("matchBand",Value(5.0)).asDouble()))
+        cout << "Features " << matchDetector << " not available" << endl;
+
     output_match=NULL;
+    disparityStage=NULL;
+    publishStage=NULL;
+    recalibrationStage=NULL;
+    pipelineDepth=0;
     init=true;
     numberOfTrials=0;
+    calibUpdated=false;
+    calibPending=false;
 
 #ifdef USING_GPU
     utils=new Utilities();
     utils->initSIFT_GPU();
 #endif
 
-    Property optionHead;
-    optionHead.put("device","remote_controlboard");
-    optionHead.put("remote",("/"+robot+"/head").c_str());
-    optionHead.put("local",(sname+"/headClient").c_str());
-    if (headCtrl.open(optionHead))
+    // a stereo log replaces the image ports and the robot
+    player=NULL;
+    recorder=NULL;
+    bool fastReplay=false;
+    string replay=rf.check("replay",Value("")).asString().c_str();
+    if (!replay.empty())
     {
-        headCtrl.view(iencs);
-        iencs->getAxes(&nHeadAxes);
+        fastReplay=(rf.check("replayMode",Value("realtime")).asString()=="fast");
+        player=new StereoLogPlayer(!fastReplay,rf.check("replayLoop"));
+
+        StereoLogFrame first;
+        if (!player->open(replay) || !player->peek(0,first) ||
+            (first.head.length()<3) || (first.HL.rows()!=4))
+        {
+            cout<<replay<<" is not a stereo log with head encoders and eye poses"<<endl;
+            delete player;
+            player=NULL;
+            return false;
+        }
+
+        nHeadAxes=(int)first.head.length();
+        replayHL=first.HL;
+        replayHR=first.HR;
+        cout<<"Replaying "<<player->size()<<" pairs from "<<replay<<(fastReplay?" as fast as possible":" in real time")<<endl;
     }
     else
     {
-        cout<<"Devices not available"<<endl;
-        return false;
-    }
+        Property optionHead;
+        optionHead.put("device","remote_controlboard");
+        optionHead.put("remote",("/"+robot+"/head").c_str());
+        optionHead.put("local",(sname+"/headClient").c_str());
+        if (headCtrl.open(optionHead))
+        {
+            headCtrl.view(iencs);
+            iencs->getAxes(&nHeadAxes);
+        }
+        else
+        {
+            cout<<"Devices not available"<<endl;
+            return false;
+        }
 
-    Property optionGaze;
-    optionGaze.put("device","gazecontrollerclient");
-    optionGaze.put("remote","/iKinGazeCtrl");
-    optionGaze.put("local",(sname+"/gazeClient").c_str());
-    if (gazeCtrl.open(optionGaze))
-        gazeCtrl.view(igaze);
-    else
-    {
-        cout<<"Devices not available"<<endl;
-        headCtrl.close();
-        return false;
+        Property optionGaze;
+        optionGaze.put("device","gazecontrollerclient");
+        optionGaze.put("remote","/iKinGazeCtrl");
+        optionGaze.put("local",(sname+"/gazeClient").c_str());
+        if (gazeCtrl.open(optionGaze))
+            gazeCtrl.view(igaze);
+        else
+        {
+            cout<<"Devices not available"<<endl;
+            headCtrl.close();
+            return false;
+        }
+
+        string record=rf.check("record",Value("")).asString().c_str();
+        if (!record.empty())
+        {
+            recorder=new StereoLogWriter;
+            if (recorder->open(record))
+                cout<<"Recording to "<<record<<endl;
+            else
+            {
+                cout<<"Cannot create "<<record<<", not recording"<<endl;
+                delete recorder;
+                recorder=NULL;
+            }
+        }
     }
 
     if (!R0.empty() && !T0.empty())
@@ -171,6 +287,22 @@ bool SFM::configure(ResourceFinder &rf)
     doSFM=false;
     updateViaGazeCtrl(false);
 
+    // acquisition (updateModule) -> disparity -> reprojection and publishing
+    pipelineDepth=rf.check("pipelineDepth",Value(1)).asInt();
+    if (pipelineDepth>0)
+    {
+        // replaying as fast as possible, no frame is dropped
+        frameQueue.setDepth(pipelineDepth,fastReplay);
+        resultQueue.setDepth(pipelineDepth,fastReplay);
+        disparityStage=new SFMStage(this,SFMStage::DISPARITY);
+        publishStage=new SFMStage(this,SFMStage::PUBLISH);
+        disparityStage->start();
+        publishStage->start();
+    }
+
+    recalibrationStage=new SFMStage(this,SFMStage::RECALIBRATION);
+    recalibrationStage->start();
+
     return true;
 }
 
@@ -215,11 +347,17 @@ void SFM::updateViaGazeCtrl(const bool update)
 {
     Matrix L1=getCameraHGazeCtrl(LEFT);
     Matrix R1=getCameraHGazeCtrl(RIGHT);
+    updateViaGazeCtrl(L1,R1,update);
+}
+
 
+/******************************************************************************/
+void SFM::extrinsicsFromGaze(const Matrix &L1, const Matrix &R1, Mat &R, Mat &T)
+{
     Matrix RT=SE3inv(R1)*L1;
 
-    Mat R=Mat::zeros(3,3,CV_64F);
-    Mat T=Mat::zeros(3,1,CV_64F);
+    R=Mat::zeros(3,3,CV_64F);
+    T=Mat::zeros(3,1,CV_64F);
 
     for (int i=0; i<R.rows; i++)
         for(int j=0; j<R.cols; j++)
@@ -227,6 +365,14 @@ void SFM::updateViaGazeCtrl(const bool update)
 
     for (int i=0; i<T.rows; i++)
         T.at<double>(i,0)=RT(i,3);
+}
+
+
+/******************************************************************************/
+void SFM::updateViaGazeCtrl(const Matrix &L1, const Matrix &R1, const bool update)
+{
+    Mat R,T;
+    extrinsicsFromGaze(L1,R1,R,T);
 
     if (update)
     {
@@ -248,9 +394,11 @@ bool SFM::interruptModule()
     outMatch.interrupt();
     worldCartPort.interrupt();
     worldCylPort.interrupt();
+    worldPointsPort.interrupt();
 
     outLeftRectImgPort.interrupt();
     outRightRectImgPort.interrupt();
+    statsPort.interrupt();
 
     return true;
 }
@@ -259,122 +407,361 @@ bool SFM::interruptModule()
 /******************************************************************************/
 bool SFM::close()
 {
+    // stop the pipeline before closing the ports it writes to
+    frameQueue.close();
+    resultQueue.close();
+    if (disparityStage!=NULL)
+    {
+        disparityStage->stop();
+        delete disparityStage;
+    }
+    if (publishStage!=NULL)
+    {
+        publishStage->stop();
+        delete publishStage;
+    }
+
+    // a pending calibrate request gets its (failed) answer
+    calibQueue.close();
+    if (recalibrationStage!=NULL)
+    {
+        recalibrationStage->stop();
+        delete recalibrationStage;
+    }
+    mutexRecalibration.lock();
+    if (doSFM)
+    {
+        calibUpdated=false;
+        doSFM=false;
+        calibEndEvent.signal();
+    }
+    mutexRecalibration.unlock();
+
     leftImgPort.close();
     rightImgPort.close();
+    delete stereoSync;
     outDisp.close();
     outMatch.close();
     handlerPort.close();
     worldCartPort.close();
     worldCylPort.close();
+    worldPointsPort.close();
 
     if (output_match!=NULL)
         cvReleaseImage(&output_match);
 
     outLeftRectImgPort.close();
     outRightRectImgPort.close();
+    statsPort.close();
 
     headCtrl.close();
     gazeCtrl.close();
 
+    delete recorder;
+
 #ifdef USING_GPU
     delete utils;
 #endif
 
     delete stereo;
+    delete calibStereo;
+
+    // the last frames may refer to the mapped log till here
+    delete player;
 
     return true;
 }
 
 
 /******************************************************************************/
-bool SFM::updateModule()
+void SFMStage::run()
 {
-    ImageOf<PixelRgb> *yarp_imgL=leftImgPort.read(true);
-    ImageOf<PixelRgb> *yarp_imgR=rightImgPort.read(true);
+    if (stage==DISPARITY)
+        sfm->runDisparityStage();
+    else if (stage==PUBLISH)
+        sfm->runPublishStage();
+    else
+        sfm->runRecalibrationStage();
+}
 
-    Stamp stamp_left, stamp_right;
-    leftImgPort.getEnvelope(stamp_left);
-    rightImgPort.getEnvelope(stamp_right);
 
-    if ((yarp_imgL==NULL) || (yarp_imgR==NULL))
+/******************************************************************************/
+bool SFM::updateModule()
+{
+    // the synchronizer returns copies of the freshest coherent pair,
+    // the player views on the mapped log with the recorded head state
+    Frame frame;
+    StereoLogFrame logged;
+    if (player!=NULL)
+    {
+        if (!player->read(logged))
+        {
+            // end of the log: the outputs of the last pair stay available
+            Time::delay(0.1);
+            return true;
+        }
+
+        frame.left=logged.left;
+        frame.right=logged.right;
+        frame.stamp_left=logged.stampL;
+        frame.stamp_right=logged.stampR;
+        replayHL=logged.HL;
+        replayHR=logged.HR;
+    }
+    else if (!stereoSync->read(frame.left,frame.right,frame.stamp_left,frame.stamp_right))
         return true;
+    frame.acquired=StageStats::now();
 
     // read encoders
-    iencs->getEncoder(nHeadAxes-3,&eyes[0]);
-    iencs->getEncoder(nHeadAxes-2,&eyes[1]);
-    iencs->getEncoder(nHeadAxes-1,&eyes[2]);
-
-    updateViaKinematics(eyes-eyes0);
-    updateViaGazeCtrl(false);
-
-    left=(IplImage*)yarp_imgL->getIplImage();
-    right=(IplImage*)yarp_imgR->getIplImage();
+    if (player==NULL)
+    {
+        logged.head.resize(nHeadAxes,0.0);
+        iencs->getEncoders(logged.head.data());
+    }
+    frame.eyes.resize(eyes.length(),0.0);
+    frame.eyes[0]=logged.head[nHeadAxes-3];
+    frame.eyes[1]=logged.head[nHeadAxes-2];
+    frame.eyes[2]=logged.head[nHeadAxes-1];
+    eyes=frame.eyes;
 
     if (init)
     {
-        output_match=cvCreateImage(cvSize(left->width*2,left->height),8,3);
-        this->numberOfDisparities=(left->width<=320)?96:128;
+        output_match=cvCreateImage(cvSize(frame.left.cols*2,frame.left.rows),8,3);
+        this->numberOfDisparities=(frame.left.cols<=320)?96:128;
 
         init=false;
     }
 
-    getCameraHGazeCtrl(LEFT);
-    getCameraHGazeCtrl(RIGHT);
+    // the gaze controller is queried only here, the other stages use the frame copies
+    frame.HL_gaze=getCameraHGazeCtrl(LEFT);
+    frame.HR_gaze=getCameraHGazeCtrl(RIGHT);
 
-    Mat leftMat=cvarrToMat(left);
-    Mat rightMat=cvarrToMat(right);
-    this->stereo->setImages(left,right);
+    if (recorder!=NULL)
+    {
+        logged.left=frame.left;
+        logged.right=frame.right;
+        logged.stampL=frame.stamp_left;
+        logged.stampR=frame.stamp_right;
+        logged.HL=frame.HL_gaze;
+        logged.HR=frame.HR_gaze;
+        logged.time=Time::now();
+        recorder->write(logged);
+    }
 
-    mutexRecalibration.lock();
-    if (doSFM)
+    mutexDisp.lock();
+    frame.HL_root=HL_root.clone();
+    mutexDisp.unlock();
+
+    stats.stop(stageAcquire,frame.acquired);
+
+    if (pipelineDepth>0)
+        frameQueue.push(frame);
+    else
     {
-#ifdef USING_GPU
-        utils->extractMatch_GPU(leftMat,rightMat);
-        vector<Point2f> leftM,rightM;
-        utils->getMatches(leftM,rightM);
-        mutexDisp.lock();
-        this->stereo->setMatches(leftM,rightM);
-#else
-        this->stereo->findMatch(false);
-#endif
-        this->stereo->estimateEssential();
-        bool ok=this->stereo->essentialDecomposition();
-        mutexDisp.unlock();
+        Result result;
+        computeFrame(frame,result);
+        publishResult(result);
+    }
+
+    return true;
+}
+
+
+/******************************************************************************/
+void SFM::runDisparityStage()
+{
+    Frame frame;
+    while (frameQueue.pop(frame))
+    {
+        Result result;
+        computeFrame(frame,result);
+        resultQueue.push(result);
+    }
+}
+
+
+/******************************************************************************/
+void SFM::runPublishStage()
+{
+    Result result;
+    while (resultQueue.pop(result))
+        publishResult(result);
+}
+
+
+/******************************************************************************/
+void SFM::runRecalibrationStage()
+{
+    CalibSnapshot snapshot;
+    while (calibQueue.pop(snapshot))
+    {
+        double t0=StageStats::now();
+        Mat R,T,matches;
+        bool ok=recalibrate(snapshot,R,T,matches);
+        stats.stop(stageCalibration,t0);
+
+        // the next frame takes the new extrinsics from R0,T0,eyes0 as a whole
+        LockGuard lg(mutexRecalibration);
+        calibMatches=matches;
+        calibPending=false;
+        if (!doSFM)
+            continue;
 
         if (ok)
         {
+            R0=R;
+            T0=T;
+            eyes0=snapshot.eyes;
             calibUpdated=true;
             doSFM=false;
             calibEndEvent.signal();
         }
-        else
+        else if (++numberOfTrials>5)
         {
-            if (++numberOfTrials>5)
-            {
-                calibUpdated=false;
-                doSFM=false;
-                calibEndEvent.signal();
-            }
+            calibUpdated=false;
+            doSFM=false;
+            calibEndEvent.signal();
         }
     }
+}
+
+
+/******************************************************************************/
+bool SFM::recalibrate(const CalibSnapshot &snapshot, Mat &R, Mat &T, Mat &matches)
+{
+    Mat R_kin=snapshot.R, T_kin=snapshot.T;
+    Mat R_exp=snapshot.R_exp, T_exp=snapshot.T_exp;
+    calibStereo->setRotation(R_kin,0);
+    calibStereo->setTranslation(T_kin,0);
+    calibStereo->setExpectedPosition(R_exp,T_exp);
+
+    IplImage left=snapshot.left;
+    IplImage right=snapshot.right;
+    calibStereo->setImages(&left,&right);
+
+#ifdef USING_GPU
+    utils->extractMatch_GPU(snapshot.left,snapshot.right);
+    vector<Point2f> leftM,rightM;
+    utils->getMatches(leftM,rightM);
+    calibStereo->setMatches(leftM,rightM);
+#else
+    calibStereo->findMatch(false);
+#endif
+    calibStereo->estimateEssential();
+    bool ok=calibStereo->essentialDecomposition();
+
+    if (outMatch.getOutputCount()>0)
+    {
+        matches=calibStereo->drawMatches();
+        cvtColor(matches,matches,CV_BGR2RGB);
+    }
+
+    if (ok)
+    {
+        R=calibStereo->getRotation().clone();
+        T=calibStereo->getTranslation().clone();
+    }
+
+    return ok;
+}
+
+
+/******************************************************************************/
+void SFM::computeFrame(const Frame &frame, Result &result)
+{
+    // the extrinsics of the frame follow from the last calibration, a new pair
+    // is handed to the recalibration only when the previous one is done
+    bool snapshot=false;
+    mutexRecalibration.lock();
+    updateViaKinematics(frame.eyes-eyes0);
+    if (doSFM && !calibPending)
+    {
+        calibPending=true;
+        snapshot=true;
+    }
+    if (outMatch.getOutputCount()>0)
+        result.matches=calibMatches;
     mutexRecalibration.unlock();
 
+    updateViaGazeCtrl(frame.HL_gaze,frame.HR_gaze,false);
+
+    // the images of the frame are never written, the recalibration shares them
+    if (snapshot)
+    {
+        CalibSnapshot calib;
+        calib.left=frame.left;
+        calib.right=frame.right;
+        calib.eyes=frame.eyes;
+        calib.R=this->stereo->getRotation().clone();
+        calib.T=this->stereo->getTranslation().clone();
+        extrinsicsFromGaze(frame.HL_gaze,frame.HR_gaze,calib.R_exp,calib.T_exp);
+        calibQueue.push(calib);
+    }
+
+    // the stereo camera refers to the images until the next frame
+    leftMat=frame.left;
+    rightMat=frame.right;
+    IplImage left=leftMat;
+    IplImage right=rightMat;
+    this->stereo->setImages(&left,&right);
+
+    double t0=StageStats::now();
+
+    // the stereo camera never writes an output buffer that is still referenced,
+    // hence the headers taken here stay valid while the next frame is processed;
+    // the 8 bit map is only published
     mutexDisp.lock();
+    this->stereo->setDisparityOutputs(outDisp.getOutputCount()>0,true,false);
     this->stereo->computeDisparity(this->useBestDisp,this->uniquenessRatio,this->speckleWindowSize,
             this->speckleRange,this->numberOfDisparities,this->SADWindowSize,
             this->minDisparity,this->preFilterCap,this->disp12MaxDiff);
+
+    result.disp8=this->stereo->getDisparity();
+    result.disp16=this->stereo->getDisparity16();
+    result.mapper=this->stereo->getMapperL();
+    result.Q=this->stereo->getQ();
+    result.RLrect=this->stereo->getRLrect();
+    result.rois=this->stereo->getDisparityROIs();
     mutexDisp.unlock();
 
+    t0=stats.stop(stageDisparity,t0);
+
+    result.acquired=frame.acquired;
+    result.stamp_left=frame.stamp_left;
+    result.stamp_right=frame.stamp_right;
+    result.HL_root=frame.HL_root;
+    result.size=frame.left.size();
+
+    if (outLeftRectImgPort.getOutputCount()>0)
+        result.rectLeft=this->stereo->getLRectified().clone();
+
+    // disp8 is mapped back to the unrectified left frame, so is its guide;
+    // the acquired images are never written once read
+    if (doBLF && jointBLF && (outDisp.getOutputCount()>0))
+        result.guide=frame.left;
+
+    if (outRightRectImgPort.getOutputCount()>0)
+        result.rectRight=this->stereo->getRRectified().clone();
+
+    stats.stop(stageOutputs,t0);
+
     // DEBUG
     /*int uR,vR;
     Point3f point = this->get3DPointsAndDisp(160,120,uR,vR,"ROOT");
     circle(leftMat,cvPoint(160,120),2,cvScalar(255,0,0),2);
     circle(rightMat,cvPoint(uR,vR),2,cvScalar(0,255,0),2);
      */
+}
 
-    if (outLeftRectImgPort.getOutputCount()>0)
+
+/******************************************************************************/
+void SFM::publishResult(Result &result)
+{
+    double t0=StageStats::now();
+
+    if ((outLeftRectImgPort.getOutputCount()>0) && !result.rectLeft.empty())
     {
-        Mat rectLeft = this->stereo->getLRectified();
+        Mat &rectLeft=result.rectLeft;
 
         ImageOf<PixelRgb>& rectLeftImage = outLeftRectImgPort.prepare();
         rectLeftImage.resize(rectLeft.cols,rectLeft.rows);
@@ -382,13 +769,13 @@ bool SFM::updateModule()
         Mat rectLeftImageMat=cvarrToMat((IplImage*)rectLeftImage.getIplImage());
         rectLeft.copyTo(rectLeftImageMat);
 
-        outLeftRectImgPort.setEnvelope(stamp_left);
+        outLeftRectImgPort.setEnvelope(result.stamp_left);
         outLeftRectImgPort.write();
     }
 
-    if (outRightRectImgPort.getOutputCount()>0)
+    if ((outRightRectImgPort.getOutputCount()>0) && !result.rectRight.empty())
     {
-        Mat rectRight = this->stereo->getRRectified();
+        Mat &rectRight=result.rectRight;
 
         ImageOf<PixelRgb>& rectRightImage = outRightRectImgPort.prepare();
         rectRightImage.resize(rectRight.cols,rectRight.rows);
@@ -396,38 +783,25 @@ bool SFM::updateModule()
         Mat rectRightImageMat=cvarrToMat((IplImage*)rectRightImage.getIplImage());
         rectRight.copyTo(rectRightImageMat);
 
-        outRightRectImgPort.setEnvelope(stamp_right);
+        outRightRectImgPort.setEnvelope(result.stamp_right);
         outRightRectImgPort.write();
     }
 
-    if (outMatch.getOutputCount()>0)
+    if ((outMatch.getOutputCount()>0) && !result.matches.empty())
     {
-        /*Mat F= this->stereo->getFundamental();
-
-        if(matchtmp.size()>0)
-        {
-            Mat m(matchtmp);
-            vector<Vec3f> lines;
-            cv::computeCorrespondEpilines(m,2,F,lines);
-            for (cv::vector<cv::Vec3f>::const_iterator it = lines.begin(); it!=lines.end(); ++it)
-            {
-                cv::line(matMatches, cv::Point(0,-(*it)[2]/(*it)[1]), cv::Point(left->width,-((*it)[2] + (*it)[0]*left->width)/(*it)[1]),cv::Scalar(0,0,255));
-            }        
-        }*/
-
-        Mat matches=this->stereo->drawMatches();
-        cvtColor(matches,matches,CV_BGR2RGB);
         ImageOf<PixelBgr>& imgMatch=outMatch.prepare();
-        imgMatch.resize(matches.cols,matches.rows);
-        IplImage tmpR=matches;
+        imgMatch.resize(result.matches.cols,result.matches.rows);
+        IplImage tmpR=result.matches;
 
         cvCopy(&tmpR,(IplImage*)imgMatch.getIplImage());
         outMatch.write();
     }
 
+    t0=stats.stop(stagePublishRect,t0);
+
     if (outDisp.getOutputCount()>0)
     {
-        outputDm = stereo->getDisparity();
+        outputDm = result.disp8;
 
         if (!outputDm.empty())
         {
@@ -435,7 +809,11 @@ bool SFM::updateModule()
             if (doBLF)
             {
                 Mat outputDfiltm;
-                cv_extend::bilateralFilter(outputDm,outputDfiltm, sigmaColorBLF, sigmaSpaceBLF);
+                if (jointBLF && (result.guide.size()==outputDm.size()))
+                    blf.filter(outputDm,result.guide,outputDfiltm,sigmaColorBLF,sigmaSpaceBLF);
+                else
+                    blf.filter(outputDm,outputDfiltm,sigmaColorBLF,sigmaSpaceBLF);
+                t0=stats.stop(stageBilateral,t0);
                 IplImage outputDfilt = outputDfiltm;
                 outim.wrapIplImage(&outputDfilt);
             } else
@@ -444,21 +822,60 @@ bool SFM::updateModule()
                 outim.wrapIplImage(&outputD);
             }
             outDisp.write();
+            t0=stats.stop(stageDispPort,t0);
         }
     }
 
-    ImageOf<PixelRgbFloat>& outcart=worldCartPort.prepare();
-    ImageOf<PixelRgbFloat>& outcyl=worldCylPort.prepare();
-    
-    outcart.resize(left->width,left->height);
-    outcyl.resize(left->width,left->height);
+    // a new world image at every frame, the batch queries may still read the previous one
+    Mat world;
+
+    // the cylindrical image is computed only if someone reads it
+    if (worldCylPort.getOutputCount()>0)
+    {
+        ImageOf<PixelRgbFloat>& outcyl=worldCylPort.prepare();
+        outcyl.resize(result.size.width,result.size.height);
+        fillWorld3D(result,world,&outcyl);
+        worldCylPort.write();
+    }
+    else
+        fillWorld3D(result,world,NULL);
+
+    t0=stats.stop(stageWorld,t0);
 
-    fillWorld3D(outcart,outcyl);
+    if (worldCartPort.getOutputCount()>0)
+    {
+        ImageOf<PixelRgbFloat>& outcart=worldCartPort.prepare();
+        outcart.resize(result.size.width,result.size.height);
+        for (int v=0; v<world.rows; v++)
+            memcpy(outcart.getRow(v),world.ptr(v),world.cols*sizeof(PixelRgbFloat));
+        worldCartPort.write();
+    }
 
-    worldCartPort.write();
-    worldCylPort.write();
+    if (worldPointsPort.getOutputCount()>0)
+    {
+        Bottle &points=worldPointsPort.prepare();
+        packPoints(world,points);
+        worldPointsPort.setEnvelope(result.stamp_left);
+        worldPointsPort.write();
+    }
 
-    return true;
+    mutexWorld.lock();
+    worldCart=world;
+    worldDisp16=result.disp16;
+    worldHL_root=result.HL_root;
+    mutexWorld.unlock();
+
+    t0=stats.stop(stageWorldPort,t0);
+    stats.record(stageFrame,t0-result.acquired);
+
+    if ((statsPort.getOutputCount()>0) && (t0-statsLast>=statsPeriod))
+    {
+        Bottle &b=statsPort.prepare();
+        b.clear();
+        stats.toBottle(b);
+        statsPort.write();
+        statsLast=t0;
+    }
 }
 
 
@@ -812,6 +1229,132 @@ Point3f SFM::get3DPoints(int u, int v, const string &drive)
 }
 
 
+/******************************************************************************/
+bool SFM::preparePointQuery(PointQuery &query)
+{
+    Mat Q,RLrect,HL;
+    mutexDisp.lock();
+    query.mapper=this->stereo->getMapperL();
+    query.disp16=this->stereo->getDisparity16();
+    Q=this->stereo->getQ().clone();
+    RLrect=this->stereo->getRLrect().t();
+    HL=HL_root.clone();
+    mutexDisp.unlock();
+
+    if (query.mapper.empty() || query.disp16.empty() || Q.empty())
+        return false;
+
+    query.Q00=(float)Q.at<double>(0,0);
+    query.Q03=(float)Q.at<double>(0,3);
+    query.Q11=(float)Q.at<double>(1,1);
+    query.Q13=(float)Q.at<double>(1,3);
+    query.Q23=(float)Q.at<double>(2,3);
+    query.Q32=(float)Q.at<double>(3,2);
+    query.Q33=(float)Q.at<double>(3,3);
+
+    RLrect.convertTo(RLrect,CV_64F);
+    Mat Tfake=Mat::zeros(0,3,CV_64F);
+    Mat H=HL*buildRotTras(RLrect,Tfake);
+    for (int i=0; i<3; i++)
+        for (int j=0; j<4; j++)
+            query.H[4*i+j]=(float)H.at<double>(i,j);
+
+    // the world image is the answer if it comes from the same disparity and pose
+    mutexWorld.lock();
+    if (!worldCart.empty() && (worldDisp16.data==query.disp16.data) &&
+        (worldCart.size()==query.mapper.size()) && (cv::norm(worldHL_root,HL,cv::NORM_INF)==0.0))
+        query.world=worldCart;
+    else
+        query.world.release();
+    mutexWorld.unlock();
+
+    return true;
+}
+
+
+/******************************************************************************/
+Point3f SFM::get3DPoint(const PointQuery &query, const int u, const int v) const
+{
+    Point3f point(0.0f,0.0f,0.0f);
+    if ((u<0) || (u>=query.mapper.cols) || (v<0) || (v>=query.mapper.rows))
+        return point;
+
+    if (!query.world.empty())
+    {
+        const Vec3f &p=query.world.at<Vec3f>(v,u);
+        return Point3f(p[0],p[1],p[2]);
+    }
+
+    const float *m=query.mapper.ptr<float>(v)+2*u;
+    float usign=m[0];
+    float vsign=m[1];
+
+    int ur=cvRound(usign);
+    int vr=cvRound(vsign);
+    if ((ur<0) || (ur>=query.disp16.cols) || (vr<0) || (vr>=query.disp16.rows))
+        return point;
+
+    // the same computation of the world image
+    float w=(query.disp16.at<short>(vr,ur)/16.0f)*query.Q32+query.Q33;
+    float z=query.Q23/w;
+    if (!((z<=10.0f) && (z>=0.0f)))
+        return point;
+
+    float x=((usign+1)*query.Q00+query.Q03)/w;
+    float y=((vsign+1)*query.Q11+query.Q13)/w;
+
+    const float *H=query.H;
+    point.x=H[0]*x+H[1]*y+H[2]*z+H[3];
+    point.y=H[4]*x+H[5]*y+H[6]*z+H[7];
+    point.z=H[8]*x+H[9]*y+H[10]*z+H[11];
+
+    return point;
+}
+
+
+/******************************************************************************/
+bool SFM::snapshotWorld(Mat &world)
+{
+    PointQuery query;
+    if (!preparePointQuery(query))
+        return false;
+
+    // the world image of the last frame if it is still current, otherwise
+    // it is computed from the state the point queries are answered from
+    if (!query.world.empty())
+        world=query.world;
+    else
+    {
+        world.create(query.mapper.size(),CV_32FC3);
+        for (int v=0; v<world.rows; v++)
+        {
+            Vec3f *w=world.ptr<Vec3f>(v);
+            for (int u=0; u<world.cols; u++)
+            {
+                Point3f p=get3DPoint(query,u,v);
+                w[u]=Vec3f(p.x,p.y,p.z);
+            }
+        }
+    }
+
+    return true;
+}
+
+
+/******************************************************************************/
+void SFM::get3DPoints(const vector<Point> &pixels, vector<Point3f> &points)
+{
+    points.assign(pixels.size(),Point3f(0.0f,0.0f,0.0f));
+
+    PointQuery query;
+    if (!preparePointQuery(query))
+        return;
+
+    for (size_t i=0; i<pixels.size(); i++)
+        points[i]=get3DPoint(query,pixels[i].x,pixels[i].y);
+}
+
+
 /******************************************************************************/
 Point3f SFM::get3DPointMatch(double u1, double v1, double u2, double v2, 
                              const string &drive)
@@ -928,23 +1471,29 @@ Mat SFM::buildRotTras(const Mat& R, const Mat& T)
 /******************************************************************************/
 Matrix SFM::getCameraHGazeCtrl(int camera)
 {
-    yarp::sig::Vector x_curr;
-    yarp::sig::Vector o_curr;
-    bool check=false;
-    if(camera==LEFT)
-        check=igaze->getLeftEyePose(x_curr, o_curr);
+    Matrix H_curr;
+    if (player!=NULL)
+        H_curr=(camera==LEFT)?replayHL:replayHR;
     else
-        check=igaze->getRightEyePose(x_curr, o_curr);
-
-    if(!check)
     {
-        Matrix H_curr(4, 4);
-        return H_curr;
-    }
+        yarp::sig::Vector x_curr;
+        yarp::sig::Vector o_curr;
+        bool check=false;
+        if(camera==LEFT)
+            check=igaze->getLeftEyePose(x_curr, o_curr);
+        else
+            check=igaze->getRightEyePose(x_curr, o_curr);
 
-    Matrix R_curr=axis2dcm(o_curr);
-    Matrix H_curr=R_curr;
-    H_curr.setSubcol(x_curr,0,3);
+        if(!check)
+        {
+            Matrix H_curr(4, 4);
+            return H_curr;
+        }
+
+        Matrix R_curr=axis2dcm(o_curr);
+        H_curr=R_curr;
+        H_curr.setSubcol(x_curr,0,3);
+    }
 
     if(camera==LEFT)
     {
@@ -997,44 +1546,47 @@ bool SFM::respond(const Bottle& command, Bottle& reply)
     if (command.get(0).asString()=="help") {
         reply.addVocab(Vocab::encode("many"));
         reply.addString("Available commands are:");
-        reply.addString("- [calibrate]: It recomputes the camera positions once.");
-        reply.addString("- [save]: It saves the current camera positions and uses it when the module starts.");
+        reply.addString("- [calibrate]: It recomputes the camera positions once, in background while the disparity keeps running.");
+        reply.addString("- [save]: It saves the current camera positions and uses it when the module starts, the current rectification maps are stored in rectMapsFile.");
         reply.addString("- [getH]: It returns the calibrated stereo matrix.");
+        reply.addString("- [getSync]: It returns the counters of the stereo pairing: pairs droppedLeft droppedRight lastSkew meanSkew maxSkew.");
         reply.addString("- [setNumDisp NumOfDisparities]: It sets the expected number of disparity (in pixel). Values must be divisible by 32. ");
+        reply.addString("- [setROI tlx tly w h ...]: It restricts the disparity and the world images to the given regions of the Left image.");
+        reply.addString("- [clearROI]: It computes the disparity on the whole image again.");
+        reply.addString("- [getROI]: It returns the regions the disparity is restricted to (tlx tly w h ...).");
+        reply.addString("- [stats]: It returns the latency statistics of the stages: (name count last mean p50 p99 max) in ms.");
+        reply.addString("- [resetStats]: It clears the latency statistics.");
         reply.addString("- [Point x y]: Given the pixel coordinate x,y in the Left image the response is the 3D Point: X Y Z computed using the depth map wrt the LEFT eye.");
         reply.addString("- [x y]: Given the pixel coordinate x,y in the Left image the response is the 3D Point: X Y Z ur vr computed using the depth map wrt the the ROOT reference system.(ur vr) is the corresponding pixel in the Right image. ");
         reply.addString("- [Left x y]: Given the pixel coordinate x,y in the Left image the response is the 3D Point: X Y Z computed using the depth map wrt the LEFT eye. Points with non valid disparity (i.e. occlusions) are handled with the value (0.0,0.0,0.0). ");
         reply.addString("- [Right x y]: Given the pixel coordinate x,y in the Left image the response is the 3D Point: X Y Z computed using the depth map wrt the RIGHT eye. Points with non valid disparity (i.e. occlusions) are handled with the value (0.0,0.0,0.0).");
         reply.addString("- [Root x y]: Given the pixel coordinate x,y in the Left image the response is the 3D Point: X Y Z computed using the depth map wrt the ROOT reference system. Points with non valid disparity (i.e. occlusions) are handled with the value (0.0,0.0,0.0).");
-        reply.addString("- [Rect tlx tly w h step]: Given the pixels in the rectangle defined by {(tlx,tly) (tlx+w,tly+h)} (parsed by columns), the response contains the corresponding 3D points in the ROOT frame. The optional parameter step defines the sampling quantum; by default step=1.");
-        reply.addString("- [Points u_1 v_1 ... u_n v_n]: Given a list of n pixels, the response contains the corresponding 3D points in the ROOT frame.");
+        reply.addString("- [Rect tlx tly w h step]: Given the pixels in the rectangle defined by {(tlx,tly) (tlx+w,tly+h)} (parsed by columns), the response contains the corresponding 3D points in the ROOT frame. The optional parameter step defines the sampling quantum; by default step=1. Points with non valid disparity are (0.0,0.0,0.0).");
+        reply.addString("- [Points u_1 v_1 ... u_n v_n]: Given a list of n pixels, the response contains the corresponding 3D points in the ROOT frame. Points with non valid disparity are (0.0,0.0,0.0).");
         reply.addString("- [Flood3D x y dist]: Perform 3D flood-fill on the seed point (x,y), returning the following info: [u_1 v_1 x_1 y_1 z_1 ...]. The optional parameter dist expressed in meters regulates the fill (by default = 0.004).");
+        reply.addString("- [Grow3D dist maxPoints u_1 v_1 ... u_n v_n]: Perform the 3D flood-fill of several seeds at once, returning (r_1 ... r_n) (size_1 ... size_m) (truncated_1 ... truncated_m) blob: the region of each seed (-1 if not valid), the size of each region, 1 if it is cut at maxPoints (0 = no limit), the points of the regions packed as u v (uint16) x y z (float32).");
         reply.addString("- [uL_1 vL_1 uR_1 vR_1 ... uL_n vL_n uR_n vR_n]: Given n quadruples uL_i vL_i uR_i vR_i, where uL_i vL_i are the pixel coordinates in the Left image and uR_i vR_i are the coordinates of the matched pixel in the Right image, the response is a set of 3D points (X1 Y1 Z1 ... Xn Yn Zn) wrt the ROOT reference system.");
         reply.addString("- [cart2stereo X Y Z]: Given a world point X Y Z wrt to ROOT reference frame the response is the projection (uL vL uR vR) in the Left and Right images.");
         reply.addString("- [doBLF flag]: activate Bilateral filter for flag = true, and skip it for flag = false.");
-        reply.addString("- [bilatfilt sigmaColor sigmaSpace]: Set the parameters for the bilateral filer (default sigmaColor = 10.0, sigmaSpace = 10.0 .");
+        reply.addString("- [bilatfilt sigmaColor sigmaSpace]: Set the parameters for the bilateral filer, both must be positive (default sigmaColor = 10.0, sigmaSpace = 10.0 .");
+        reply.addString("- [jointBLF flag]: guide the bilateral filter with the left image for flag = true.");
         reply.addString("For more details on the commands, check the module's documentation");
         return true;
     }
 
     if (command.get(0).asString()=="calibrate")
     {
+        // the recalibration installs the new extrinsics by itself
+        calibEndEvent.reset();
         mutexRecalibration.lock();
         numberOfTrials=0;
         doSFM=true;
         mutexRecalibration.unlock();
 
-        calibEndEvent.reset();
         calibEndEvent.wait();
 
         if (calibUpdated)
-        {
-            R0=this->stereo->getRotation();
-            T0=this->stereo->getTranslation();
-            eyes0=eyes;
-
             reply.addString("ACK");
-        }
         else
             reply.addString("Calibration failed after 5 trials.. Please show a non planar scene.");
 
@@ -1043,20 +1595,93 @@ bool SFM::respond(const Bottle& command, Bottle& reply)
 
     if (command.get(0).asString()=="save")
     {
-        updateExtrinsics(R0,T0,eyes0,"STEREO_DISPARITY");
+        mutexRecalibration.lock();
+        Mat R=R0.clone();
+        Mat T=T0.clone();
+        yarp::sig::Vector eyesR=eyes0;
+        mutexRecalibration.unlock();
+
+        updateExtrinsics(R,T,eyesR,"STEREO_DISPARITY");
+        stereo->saveRectificationCache();
         reply.addString("ACK");
         return true;
     }
 
     if (command.get(0).asString()=="getH")
     {
+        mutexRecalibration.lock();
         Mat RT0=buildRotTras(R0,T0);
+        mutexRecalibration.unlock();
         Matrix H0; convert(RT0,H0);
 
         reply.read(H0);
         return true;
     }
 
+    if (command.get(0).asString()=="getSync")
+    {
+        StereoSyncStats syncStats=stereoSync->getStats();
+        reply.addInt(syncStats.pairs);
+        reply.addInt(syncStats.droppedLeft);
+        reply.addInt(syncStats.droppedRight);
+        reply.addDouble(syncStats.lastSkew);
+        reply.addDouble(syncStats.meanSkew);
+        reply.addDouble(syncStats.maxSkew);
+        return true;
+    }
+
+    if (command.get(0).asString()=="stats")
+    {
+        stats.toBottle(reply);
+        return true;
+    }
+
+    if (command.get(0).asString()=="resetStats")
+    {
+        stats.reset();
+        reply.addString("ACK");
+        return true;
+    }
+
+    if (command.get(0).asString()=="setROI")
+    {
+        vector<cv::Rect> rois;
+        if ((command.size()>1) && parseROIs(command,1,rois))
+        {
+            mutexDisp.lock();
+            this->stereo->setDisparityROIs(rois,roiMargin);
+            mutexDisp.unlock();
+            reply.addString("ACK");
+        }
+        else
+            reply.addString("NACK: the regions must be quadruples tlx tly w h");
+        return true;
+    }
+
+    if (command.get(0).asString()=="clearROI")
+    {
+        mutexDisp.lock();
+        this->stereo->setDisparityROIs(vector<cv::Rect>(),roiMargin);
+        mutexDisp.unlock();
+        reply.addString("ACK");
+        return true;
+    }
+
+    if (command.get(0).asString()=="getROI")
+    {
+        mutexDisp.lock();
+        vector<cv::Rect> rois=this->stereo->getDisparityROIs();
+        mutexDisp.unlock();
+        for (size_t i=0; i<rois.size(); i++)
+        {
+            reply.addInt(rois[i].x);
+            reply.addInt(rois[i].y);
+            reply.addInt(rois[i].width);
+            reply.addInt(rois[i].height);
+        }
+        return true;
+    }
+
     if (command.get(0).asString()=="setNumDisp")
     {
         int dispNum=command.get(1).asInt();
@@ -1152,27 +1777,33 @@ bool SFM::respond(const Bottle& command, Bottle& reply)
         if (command.size()>=6)
             step=command.get(5).asInt();
 
+        vector<Point> pixels;
         for (int u=tl_u; u<br_u; u+=step)
-        {
             for (int v=tl_v; v<br_v; v+=step)
-            {
-                Point3f point=this->get3DPoints(u,v,"ROOT");
-                reply.addDouble(point.x);
-                reply.addDouble(point.y);
-                reply.addDouble(point.z);
-            }
+                pixels.push_back(Point(u,v));
+
+        vector<Point3f> points;
+        this->get3DPoints(pixels,points);
+        for (size_t i=0; i<points.size(); i++)
+        {
+            reply.addDouble(points[i].x);
+            reply.addDouble(points[i].y);
+            reply.addDouble(points[i].z);
         }
     }
     else if (command.get(0).asString()=="Points")
     {
+        vector<Point> pixels;
         for (int cnt=1; cnt<command.size()-1; cnt+=2)
+            pixels.push_back(Point(command.get(cnt).asInt(),command.get(cnt+1).asInt()));
+
+        vector<Point3f> points;
+        this->get3DPoints(pixels,points);
+        for (size_t i=0; i<points.size(); i++)
         {
-            int u=command.get(cnt).asInt();
-            int v=command.get(cnt+1).asInt();
-            Point3f point=this->get3DPoints(u,v,"ROOT");
-            reply.addDouble(point.x);
-            reply.addDouble(point.y);
-            reply.addDouble(point.z);
+            reply.addDouble(points[i].x);
+            reply.addDouble(points[i].y);
+            reply.addDouble(points[i].z);
         }
     }
     else if (command.get(0).asString()=="Flood3D")
@@ -1183,20 +1814,75 @@ bool SFM::respond(const Bottle& command, Bottle& reply)
         double dist=0.004;
         if (command.size()>=4)
             dist=command.get(3).asDouble();
-        
-        Point3f p=get3DPoints(seed.x,seed.y,"ROOT");
-        if (cv::norm(p)>0.0)
-        {
-            reply.addInt(seed.x);
-            reply.addInt(seed.y);
-            reply.addDouble(p.x);
-            reply.addDouble(p.y);
-            reply.addDouble(p.z);
 
-            set<int> visited;
-            visited.insert(seed.x*outputDm.cols+seed.y);
+        Mat world;
+        vector<RegionGrowing::Region> regions;
+        vector<int> seedRegion;
+        if (snapshotWorld(world))
+            regionGrowing.grow(world,vector<cv::Point>(1,seed),dist,0,regions,seedRegion);
+
+        if (!regions.empty())
+        {
+            const vector<int> &pixels=regions[0].pixels;
+            for (size_t i=0; i<pixels.size(); i++)
+            {
+                int u=pixels[i]%world.cols, v=pixels[i]/world.cols;
+                const Vec3f &p=world.at<Vec3f>(v,u);
+                reply.addInt(u);
+                reply.addInt(v);
+                reply.addDouble(p[0]);
+                reply.addDouble(p[1]);
+                reply.addDouble(p[2]);
+            }
+        }
+        else
+            reply.addString("NACK");
+    }
+    else if (command.get(0).asString()=="Grow3D")
+    {
+        double dist=command.get(1).asDouble();
+        int maxPoints=command.get(2).asInt();
+        vector<cv::Point> seeds;
+        for (int i=3; i+1<command.size(); i+=2)
+            seeds.push_back(cv::Point(command.get(i).asInt(),command.get(i+1).asInt()));
+
+        Mat world;
+        if ((dist>0.0) && !seeds.empty() && snapshotWorld(world))
+        {
+            vector<RegionGrowing::Region> regions;
+            vector<int> seedRegion;
+            regionGrowing.grow(world,seeds,dist,maxPoints,regions,seedRegion);
+
+            Bottle &r=reply.addList();
+            for (size_t i=0; i<seedRegion.size(); i++)
+                r.addInt(seedRegion[i]);
+
+            // the same records of the f32 format of the points port
+            const size_t pointSize=2*sizeof(unsigned short)+3*sizeof(float);
+            size_t count=0;
+            Bottle &sizes=reply.addList();
+            Bottle &truncated=reply.addList();
+            for (size_t j=0; j<regions.size(); j++)
+            {
+                sizes.addInt((int)regions[j].pixels.size());
+                truncated.addInt(regions[j].truncated?1:0);
+                count+=regions[j].pixels.size();
+            }
 
-            floodFill(seed,p,dist,visited,reply);
+            regionsBuffer.resize(std::max((size_t)1,count*pointSize));
+            unsigned char *p=&regionsBuffer[0];
+            for (size_t j=0; j<regions.size(); j++)
+            {
+                const vector<int> &pixels=regions[j].pixels;
+                for (size_t i=0; i<pixels.size(); i++, p+=pointSize)
+                {
+                    int u=pixels[i]%world.cols, v=pixels[i]/world.cols;
+                    unsigned short uv[2]={(unsigned short)u,(unsigned short)v};
+                    memcpy(p,uv,sizeof(uv));
+                    memcpy(p+sizeof(uv),world.ptr<float>(v)+3*u,3*sizeof(float));
+                }
+            }
+            reply.add(Value(&regionsBuffer[0],(int)(count*pointSize)));
         }
         else
             reply.addString("NACK");
@@ -1217,17 +1903,30 @@ bool SFM::respond(const Bottle& command, Bottle& reply)
     }
     else if (command.get(0).asString()=="bilatfilt" && command.size()==3)
     {
+        // the sigmas are the extents of the cells of the bilateral grid
+        double sigmaColor=command.get(1).asDouble();
+        double sigmaSpace=command.get(2).asDouble();
+        if ((sigmaColor<=0.0) || (sigmaSpace<=0.0))
+        {
+            reply.addString("NACK: sigmaColor and sigmaSpace must be positive");
+            return true;
+        }
         if (!doBLF){
             doBLF = true;
             reply.addString("Bilateral filter activated.");
         }
-        sigmaColorBLF = command.get(1).asDouble();
-        sigmaSpaceBLF = command.get(2).asDouble();
+        sigmaColorBLF = sigmaColor;
+        sigmaSpaceBLF = sigmaSpace;
         reply.addString("BLF sigmaColor ");
         reply.addDouble(sigmaColorBLF);
         reply.addString("BLF sigmaSpace ");
         reply.addDouble(sigmaSpaceBLF);
     }
+    else if (command.get(0).asString()=="jointBLF")
+    {
+        jointBLF=command.get(1).asBool();
+        reply.addString(jointBLF?"Joint Bilateral Filter ON":"Joint Bilateral Filter OFF");
+    }
     else if (command.get(0).asString()=="doBLF")
     {
         bool onoffBLF = command.get(1).asBool();
@@ -1299,102 +1998,271 @@ Point2f SFM::projectPoint(const string &camera, double x, double y, double z)
 
 
 /******************************************************************************/
-void SFM::fillWorld3D(ImageOf<PixelRgbFloat> &worldCartImg,
-                      ImageOf<PixelRgbFloat> &worldCylImg)
+void SFM::updateWorldRays(const Mat &Mapper, const Mat &Q, const Mat &disp16m)
 {
-    mutexDisp.lock();
-    const Mat& Mapper=this->stereo->getMapperL();
-    const Mat& disp16m=this->stereo->getDisparity16();
-    IplImage disp16=disp16m;
-    const Mat& Q=this->stereo->getQ();
-    const Mat& RLrect=this->stereo->getRLrect().t();
-    mutexDisp.unlock();
-    
-    worldCartImg.zero(); worldCylImg.zero();
-    if (Mapper.empty() || disp16m.empty() ||
-        (worldCartImg.width()!=worldCylImg.width()) ||
-        (worldCartImg.height()!=worldCylImg.height()))
+    if ((Mapper.data==rayMapper.data) && (Mapper.size()==rayMapper.size()) &&
+        !rayQ.empty() && (cv::norm(Q,rayQ,cv::NORM_INF)==0.0) &&
+        (disp16m.step1()==rayDispStep) && (rayIdx.size()==Mapper.size()))
         return;
 
-    Mat Tfake=Mat::zeros(0,3,CV_64F);
-    Mat Hrect=buildRotTras(RLrect,Tfake);
-    Hrect=HL_root*Hrect;
-
-    Mat P(4,1,CV_64FC1);
-    P.at<double>(3,0)=1.0;
-    double &x=P.at<double>(0,0);
-    double &y=P.at<double>(1,0);
-    double &z=P.at<double>(2,0);
+    rayIdx.create(Mapper.rows,Mapper.cols,CV_32S);
+    rayX.create(Mapper.rows,Mapper.cols,CV_32F);
+    rayY.create(Mapper.rows,Mapper.cols,CV_32F);
 
-    for (int v=0; v<worldCartImg.height(); v++)
+    for (int v=0; v<Mapper.rows; v++)
     {
-        for (int u=0; u<worldCartImg.width(); u++)
+        const float *m=Mapper.ptr<float>(v);
+        int *idx=rayIdx.ptr<int>(v);
+        float *x=rayX.ptr<float>(v);
+        float *y=rayY.ptr<float>(v);
+        for (int u=0; u<Mapper.cols; u++)
         {
-            float usign=Mapper.ptr<float>(v)[2*u];
-            float vsign=Mapper.ptr<float>(v)[2*u+1];
+            float usign=m[2*u];
+            float vsign=m[2*u+1];
 
             int u_=cvRound(usign); int v_=cvRound(vsign);
             if ((u_<0) || (u_>=disp16m.cols) || (v_<0) || (v_>=disp16m.rows))
-                continue;
+                idx[u]=-1;
+            else
+                idx[u]=v_*(int)disp16m.step1()+u_;
+
+            x[u]=(float)((usign+1)*Q.at<double>(0,0)+Q.at<double>(0,3));
+            y[u]=(float)((vsign+1)*Q.at<double>(1,1)+Q.at<double>(1,3));
+        }
+    }
 
-            x=(usign+1)*Q.at<double>(0,0)+Q.at<double>(0,3);
-            y=(vsign+1)*Q.at<double>(1,1)+Q.at<double>(1,3);
-            z=Q.at<double>(2,3);
+    rayMapper=Mapper;
+    rayQ=Q.clone();
+    rayDispStep=disp16m.step1();
+}
 
-            CvScalar scal=cvGet2D(&disp16,v_,u_);
-            double disparity=scal.val[0]/16.0;
-            double w=disparity*Q.at<double>(3,2)+Q.at<double>(3,3);
-            x/=w; y/=w; z/=w;
 
-            if ((z>10.0) || (z<0.0))
-                continue;
-            
-            P=Hrect*P;
-
-            PixelRgbFloat &pxCart=worldCartImg.pixel(u,v);
-            pxCart.r=(float)x;
-            pxCart.g=(float)y;
-            pxCart.b=(float)z;
-
-            PixelRgbFloat &pxCyl=worldCylImg.pixel(u,v);
-            pxCyl.r=(float)sqrt(x*x+y*y);
-            pxCyl.g=(float)atan2(y,x);
-            pxCyl.b=(float)z;
+/******************************************************************************/
+namespace
+{
+    // IEEE 754 half precision, rounded to nearest
+    inline unsigned short floatToHalf(const float f)
+    {
+        union { float f; unsigned int u; } x;
+        x.f=f;
+
+        unsigned short sign=(unsigned short)((x.u>>16)&0x8000);
+        int exp=(int)((x.u>>23)&0xff)-127+15;
+        unsigned int mant=x.u&0x7fffff;
+
+        if (exp<=0)
+        {
+            // subnormal
+            if (exp<-10)
+                return sign;
+
+            mant|=0x800000;
+            int shift=14-exp;
+            unsigned int h=mant>>shift;
+            if ((mant>>(shift-1))&1)
+                h++;
+            return (unsigned short)(sign|h);
         }
+
+        if (exp>=31)
+            return (unsigned short)(sign|0x7c00);
+
+        // a carry of the rounding into the exponent is still correct
+        unsigned int h=sign|(exp<<10)|(mant>>13);
+        if (mant&0x1000)
+            h++;
+        return (unsigned short)h;
     }
+
+    inline short quantize(const float x, const float invQuantum)
+    {
+        return (short)std::max(-32767,std::min(32767,cvRound(x*invQuantum)));
+    }
+
+
+    // fills a band of rows of the world images from the ray table
+    class WorldImageBody : public cv::ParallelLoopBody
+    {
+        const Mat &rayIdx,&rayX,&rayY;
+        int u0,u1;
+        const short *disp;
+        float Q23,Q32,Q33;
+        float H[12];
+        Mat &cart;
+        ImageOf<PixelRgbFloat> *cyl;
+
+    public:
+        WorldImageBody(const Mat &_rayIdx, const Mat &_rayX, const Mat &_rayY,
+                       const Mat &disp16m, const Mat &Q, const Mat &Hrect,
+                       Mat &_cart, ImageOf<PixelRgbFloat> *_cyl,
+                       const int _u0, const int _u1) :
+                       rayIdx(_rayIdx), rayX(_rayX), rayY(_rayY), u0(_u0), u1(_u1),
+                       cart(_cart), cyl(_cyl)
+        {
+            disp=disp16m.ptr<short>(0);
+            Q23=(float)Q.at<double>(2,3);
+            Q32=(float)Q.at<double>(3,2);
+            Q33=(float)Q.at<double>(3,3);
+            for (int i=0; i<3; i++)
+                for (int j=0; j<4; j++)
+                    H[4*i+j]=(float)Hrect.at<double>(i,j);
+        }
+
+        void operator()(const cv::Range &range) const
+        {
+            for (int v=range.start; v<range.end; v++)
+            {
+                const int *idx=rayIdx.ptr<int>(v);
+                const float *rx=rayX.ptr<float>(v);
+                const float *ry=rayY.ptr<float>(v);
+                PixelRgbFloat *pxCart=(PixelRgbFloat*)cart.ptr<float>(v);
+                PixelRgbFloat *pxCyl=(cyl!=NULL)?(PixelRgbFloat*)cyl->getRow(v):NULL;
+
+                for (int u=u0; u<u1; u++)
+                {
+                    if (idx[u]<0)
+                        continue;
+
+                    float w=(disp[idx[u]]/16.0f)*Q32+Q33;
+                    float z=Q23/w;
+                    if (!((z<=10.0f) && (z>=0.0f)))
+                        continue;
+
+                    float x=rx[u]/w;
+                    float y=ry[u]/w;
+
+                    float X=H[0]*x+H[1]*y+H[2]*z+H[3];
+                    float Y=H[4]*x+H[5]*y+H[6]*z+H[7];
+                    float Z=H[8]*x+H[9]*y+H[10]*z+H[11];
+
+                    pxCart[u].r=X;
+                    pxCart[u].g=Y;
+                    pxCart[u].b=Z;
+
+                    if (pxCyl!=NULL)
+                    {
+                        pxCyl[u].r=sqrt(X*X+Y*Y);
+                        pxCyl[u].g=atan2(Y,X);
+                        pxCyl[u].b=Z;
+                    }
+                }
+            }
+        }
+    };
 }
 
 
 /******************************************************************************/
-void SFM::floodFill(const Point &seed, const Point3f &p0, const double dist, 
-                    set<int> &visited, Bottle &res)
+void SFM::packPoints(const Mat &world, Bottle &points)
 {
-    for (int x=seed.x-1; x<=seed.x+1; x++)
+    int stride=pointsStride;
+    int format=pointsFormat;
+    size_t pointSize=2*sizeof(unsigned short)+((format==POINTS_F32)?3*sizeof(float):3*sizeof(short));
+    size_t maxPoints=(size_t)((world.rows+stride-1)/stride)*((world.cols+stride-1)/stride);
+    pointsBuffer.resize(std::max((size_t)1,maxPoints*pointSize));
+
+    // the world image is (0,0,0) where the point is not valid
+    unsigned char *p=&pointsBuffer[0];
+    int count=0;
+    float invQuantum=(float)(1.0/pointsQuantum);
+    for (int v=0; v<world.rows; v+=stride)
     {
-        for (int y=seed.y-1; y<=seed.y+1; y++)
+        const float *w=world.ptr<float>(v);
+        for (int u=0; u<world.cols; u+=stride)
         {
-            if ((x<0)||(y<0)||(x>outputDm.cols)||(y>outputDm.rows))
+            const float *xyz=w+3*u;
+            if ((xyz[0]==0.0f) && (xyz[1]==0.0f) && (xyz[2]==0.0f))
                 continue;
 
-            int idx=x*outputDm.cols+y;
-            set<int>::iterator el=visited.find(idx);
-            if (el==visited.end())
+            unsigned short uv[2]={(unsigned short)u,(unsigned short)v};
+            memcpy(p,uv,sizeof(uv));
+            if (format==POINTS_F32)
+                memcpy(p+sizeof(uv),xyz,3*sizeof(float));
+            else
             {
-                visited.insert(idx);
-                Point3f p=get3DPoints(x,y,"ROOT");
-                if ((cv::norm(p)>0.0) && (cv::norm(p-p0)<=dist))
-                {
-                    res.addInt(x);
-                    res.addInt(y);
-                    res.addDouble(p.x);
-                    res.addDouble(p.y);
-                    res.addDouble(p.z);
-
-                    floodFill(Point(x,y),p,dist,visited,res);
-                }
+                short c[3];
+                for (int i=0; i<3; i++)
+                    c[i]=(format==POINTS_F16)?(short)floatToHalf(xyz[i]):quantize(xyz[i],invQuantum);
+                memcpy(p+sizeof(uv),c,sizeof(c));
             }
+
+            p+=pointSize;
+            count++;
+        }
+    }
+
+    points.clear();
+    points.addString((format==POINTS_F32)?"f32":((format==POINTS_F16)?"f16":"q16"));
+    points.addInt(world.cols);
+    points.addInt(world.rows);
+    points.addInt(stride);
+    points.addDouble(pointsQuantum);
+    points.addInt(count);
+    points.add(Value(&pointsBuffer[0],(int)(count*pointSize)));
+}
+
+
+/******************************************************************************/
+void SFM::fillWorld3D(const Result &result, Mat &worldCartImg,
+                      ImageOf<PixelRgbFloat> *worldCylImg)
+{
+    const Mat &Mapper=result.mapper;
+    const Mat &disp16m=result.disp16;
+    const Mat &Q=result.Q;
+    Mat RLrect=result.RLrect.t();
+
+    worldCartImg=Mat::zeros(result.size,CV_32FC3);
+    if (worldCylImg!=NULL)
+        worldCylImg->zero();
+
+    if (Mapper.empty() || disp16m.empty() || Q.empty() ||
+        (Mapper.cols!=worldCartImg.cols) || (Mapper.rows!=worldCartImg.rows) ||
+        ((worldCylImg!=NULL) && ((worldCartImg.cols!=worldCylImg->width()) ||
+                                 (worldCartImg.rows!=worldCylImg->height()))))
+        return;
+
+    updateWorldRays(Mapper,Q,disp16m);
+
+    RLrect.convertTo(RLrect,CV_64F);
+    Mat Tfake=Mat::zeros(0,3,CV_64F);
+    Mat Hrect=buildRotTras(RLrect,Tfake);
+    Hrect=result.HL_root*Hrect;
+
+    // only the regions the disparity is computed for
+    vector<cv::Rect> areas=result.rois;
+    if (areas.empty())
+        areas.push_back(cv::Rect(0,0,Mapper.cols,Mapper.rows));
+
+    for (size_t i=0; i<areas.size(); i++)
+    {
+        cv::Rect area=areas[i] & cv::Rect(0,0,Mapper.cols,Mapper.rows);
+        if (area.area()>0)
+            cv::parallel_for_(cv::Range(area.y,area.y+area.height),
+                              WorldImageBody(rayIdx,rayX,rayY,disp16m,Q,Hrect,worldCartImg,worldCylImg,
+                                             area.x,area.x+area.width));
+    }
+}
+
+
+/******************************************************************************/
+bool SFM::parseROIs(const Bottle &b, const int first, vector<cv::Rect> &rois)
+{
+    rois.clear();
+    if ((b.size()-first)%4!=0)
+        return false;
+
+    for (int i=first; i<b.size(); i+=4)
+    {
+        cv::Rect roi(b.get(i).asInt(),b.get(i+1).asInt(),b.get(i+2).asInt(),b.get(i+3).asInt());
+        if ((roi.width<=0) || (roi.height<=0))
+        {
+            rois.clear();
+            return false;
         }
+        rois.push_back(roi);
     }
+
+    return true;
 }
 
 
@@ -91,7 +91,17 @@ The OpenMP accelerated version of the LIBELAS is used under UNIX systems, if Ope
 
 --outWorldPort \e /world
 - The parameter \e /world specifies the output suffix for the world images. The final
-tags \e /cartesian:o and \e /cylindrical:o are appended.
+tags \e /cartesian:o, \e /cylindrical:o and \e /points:o are appended.
+
+--pointsFormat \e f32
+- Encoding of the coordinates on \e /SFM/world/points:o: \e f32 (float), \e f16 (half float)
+or \e q16 (16 bit integers in units of \e pointsQuantum).
+
+--pointsStride \e 1
+- Only the pixels whose coordinates are multiple of the stride are sent on \e /SFM/world/points:o.
+
+--pointsQuantum \e 0.001
+- Unit (in meters) of the \e q16 encoding.
 
 --CommandPort \e comm
 - The parameter \e comm specifies the command port for rpc protocol.
@@ -99,10 +109,101 @@ tags \e /cartesian:o and \e /cylindrical:o are appended.
 --skipBLF
 - Disable Bilateral filter.
 
+--jointBLF
+- The bilateral filter of the disparity is guided by the left image (joint bilateral
+filter), which preserves the edges of the objects better at the same cost; the guide is
+the unrectified left image, since the published disparity is mapped back to its frame.
+The non valid disparities are left as they are.
+
+--pipelineDepth \e 1
+- The acquisition, the disparity computation and the 3D reprojection with the publishing of
+the outputs run in three stages, so that the disparity of a frame is computed while the
+previous one is reprojected and published. This is the maximum number of frames waiting
+between two stages: when a stage is late the oldest frame is dropped.
+Set it to \e 0 to run all the stages sequentially in the module thread.
+
+--syncTolerance \e 0.02
+- Maximum difference (in seconds) between the timestamps of the left and right images
+of a stereo pair. Images that cannot be paired within this tolerance are discarded, as well as
+older pairs when a newer one is available, so that the disparity is always computed on the
+freshest coherent pair. Images sent without timestamp are paired in order of arrival.
+
+--rectTolerance \e 0.0001
+- The rectification maps are cached and rebuilt only when the extrinsics (R, T) or the intrinsics
+differ by more than this value (absolute, element-wise) from the ones of a cached rectification.
+This avoids rebuilding the maps at every frame because of small jitters of the eyes encoders.
+Set it to \e 0 to rebuild the maps at every change.
+
+--rectMapsFile \e SFM_maps.bin
+- Binary cache of the rectification maps in the home of the \e cameraCalibration context.
+At start-up it is memory-mapped and, if it was built for the same image size, intrinsics and
+(within \e rectTolerance) extrinsics, the first frame is rectified without building the maps.
+Otherwise the first rectification built is stored in it; the \e save command stores the current
+one together with the extrinsics. \e none disables the cache.
+
+--roi \e "(tlx tly w h ...)"
+- Restrict the disparity computation, the rectification and the world images to these regions
+of the left image from the start (see the \e setROI rpc command). By default the whole image is used.
+
+--roiMargin \e 16
+- Margin (in pixels) added around each region in the rectified images.
+
+--matchDetector \e sift
+- Features matched by the recalibration (\e calibrate rpc command): \e sift, \e orb or \e akaze
+(OpenCV 3 only). The ORB and AKAZE descriptors are binary and matched with LSH, they are much faster
+than SIFT on the CPU.
+
+--matchMaxFeatures \e 0
+- Keypoints kept per image by the recalibration, the strongest ones of each cell of a grid spread
+over the image. Set it to \e 0 to keep them all.
+
+--matchGrid \e "(4 4)"
+- Columns and rows of that grid.
+
+--matchBand \e 5.0
+- The keypoints are matched only within this distance (in pixels) from their epipolar lines given
+by the kinematics, the estimation drops the matches far from those lines anyway.
+Set it to \e 0 to search the whole image.
+
+--statsPeriod \e 1.0
+- Period (in seconds) of the latency statistics written on \e /SFM/stats:o.
+
+--record \e file
+- Records the stereo pairs with their timestamps, the head encoders and the poses of the
+eyes in a stereo log (see StereoLogWriter).
+
+--replay \e file
+- Replays a stereo log in place of the image ports, the head and the gaze controller, which
+are not needed: the pairs are processed with the recorded encoders, poses and timestamps.
+
+--replayMode \e realtime
+- \e realtime paces the pairs as recorded (dropping frames as on the robot when a stage is late),
+\e fast replays them as fast as they are processed, and none is dropped.
+
+--replayLoop
+- Replays the log endlessly; otherwise the module stays idle at its end.
+
 --use_sgbm
 - By default LIBELAS is used to compute the disparity. However, if you prefer to continue using the
 OpenCV's SGBM algorithm, you just need to pass the parameter \e use_sgbm.
 
+--disparityEngine \e elas
+- The algorithm of the disparity: \e elas (LIBELAS), \e sgbm (OpenCV's SGBM, same as \e use_sgbm)
+or \e cuda_sgm (OpenCV's semi-global matching on the GPU: the rectification maps stay on the device
+and the images are rectified there; it needs OpenCV 4.2 or greater built with CUDA and it supports
+64, 128 or 256 disparities, the configured number is rounded up).
+If the engine is not available in this build, LIBELAS is used.
+
+--sgbm_3way
+- With OpenCV 3.1 or greater, the \e sgbm engine uses the 3-way variant of SGBM, much faster
+than the full 8-directions one computed by default.
+
+--cuda_sgm_P1 \e 10
+- Penalty of the disparity changes by one between neighbours for \e cuda_sgm.
+
+--cuda_sgm_P2 \e 120
+- Penalty of the larger disparity changes between neighbours for \e cuda_sgm.
+
 If you use LIBELAS, there is the possibility of setting the following parameters:
 
 --disp_scaling_factor \e 1.0
@@ -122,6 +223,11 @@ This module gives the possibility of modifying (eventually tuning to individual
 those parameters which differ between the two settings, plus a couple of others
 (\e elas_subsampling and \e elas_add_corners). The remaining parameters are supposed to be
 fixed to the values proposed by the authors of LIBELAS.
+With \e COARSE_TO_FINE the \e ROBOTICS parameters are used on a pyramid: LIBELAS computes the
+disparity at half resolution (half range as well), and each pixel of the full resolution map is then
+matched only in a band of +/- \e elas_refine_radius disparities around the upsampled coarse map.
+The quality is close to the one at full resolution, for a cost close to the one at half resolution;
+it is not combined with \e elas_subsampling.
 
 Here we list those LIBELAS parameters that can be passed to this module;
 see <a href="https://github.com/robotology/stereo-vision/tree/master/lib/elas/include/elas.h">elas.h</a>
@@ -171,36 +277,95 @@ set to \e true in \e MIDDLEBURY and \e false in \e ROBOTICS.
 - This is the \e filter_adaptive_mean parameter in <a href="https://github.com/robotology/stereo-vision/tree/master/lib/elas/include/elas.h">elas.h</a>,
 set to \e false in \e MIDDLEBURY and \e true in \e ROBOTICS.
 
+--elas_num_threads \e 0
+- Number of threads used by the OpenMP version of LIBELAS. The matching, the support points
+computation and the post-processing filters are split into row bands shared among the threads.
+With \e 0 (default) the OpenMP default is used (usually the number of cores).
+
+--elas_temporal_prior
+- Use the support points of the previous frame as a prior: until the next full search, only the
+support points found in the previous frame are matched again, in a narrow disparity range around
+their previous value. This is meant for static scenes and slow motions of the head.
+A full search is done whenever the rectification changes.
+
+--elas_prior_radius \e 3
+- Half width (in disparities) of the search range around the previous support points and
+around the previous disparity of each pixel.
+
+--elas_prior_refresh \e 10
+- A full search of the support points is done every \e elas_prior_refresh frames, so that the
+new structures of the scene are picked up.
+
+--elas_prior_min_ratio \e 0.6
+- If less than this fraction of the support points of the last full search is confirmed (large motion),
+the support points of the frame are searched again over the full disparity range.
+
+--elas_incremental_delaunay
+- Keep the Delaunay triangulations of the support points across frames: only the support points
+that appeared, disappeared or changed disparity are removed from and inserted in them, and the
+disparity planes are recomputed only for the triangles that changed. A full triangulation is done
+when more than a quarter of the support points changed. This pays off together with
+\e elas_temporal_prior, whose support points are stable from frame to frame. The result may
+differ from the standard triangulation in the split of cocircular support points and in thin
+triangles along the border of the support points.
+
+--elas_refine_radius \e 2
+- Half width (in disparities) of the full resolution search band in the \e COARSE_TO_FINE setting.
+
 \section portsc_sec Ports Created
 - <i> /SFM/left:i </i> accepts the incoming images from the left eye.
 - <i> /SFM/right:i </i> accepts the incoming images from the right eye.
 
 - <i> /SFM/disp:o </i> outputs the disparity map in grayscale values.
 - <i> /SFM/world/cartesian:o</i> outputs the world image (3-channel float with X Y Z values).
+  It is written only when the port has connections.
 - <i> /SFM/world/cylindrical:o</i> outputs the world image (3-channel float with R Theta Z values).
+  It is computed only when the port has connections.
+- <i> /SFM/world/points:o</i> outputs the valid points of the world image only, every
+  \e pointsStride pixels, as a bottle (format width height stride quantum count data) with the
+  envelope of the left image: \e data is a blob of \e count records, each with u and v
+  (16 bit unsigned) followed by X Y Z in the root frame encoded as \e format (see \e pointsFormat),
+  in the byte order of the machine running the module (little-endian on x86).
 - <i> /SFM/match:o</i> outputs the match image.
 
 - <i> /SFM/rect_left:o</i> outputs the rectified left image.
 - <i> /SFM/rect_right:o</i> outputs the rectified right image.
 
+- <i> /SFM/stats:o</i> outputs every \e statsPeriod seconds the latency statistics of the stages,
+  a list (name count last mean p50 p99 max) per stage with the durations in milliseconds:
+  \e acquire (encoders and gaze of a new pair), \e calibration (one recalibration trial), \e disparity (with the stages of the
+  disparity engine: \e rectification, \e rectify, \e sgbm or \e elas_*, \e disparity_map), \e outputs
+  (copies of the rectified images), \e publish_rect, \e bilateral, \e disp_port, \e world3d,
+  \e world_port and \e frame (from the acquisition to the end of the publication).
+
 - <i> /SFM/rpc </i> for terminal commands communication.
-    - [calibrate]: It recomputes the camera positions once.
-    - [save]: It saves the current camera positions and uses it when the module starts.
+    - [calibrate]: It recomputes the camera positions once. The estimation runs in background on
+      the next pairs (up to 5 trials), the disparity keeps being computed with the previous positions
+      and switches to the new ones at the first pair after the estimation succeeds.
+    - [save]: It saves the current camera positions and uses it when the module starts, the current rectification maps are stored in \e rectMapsFile.
     - [getH]: It returns the calibrated stereo matrix.
+    - [getSync]: It returns the counters of the stereo pairing: pairs droppedLeft droppedRight lastSkew meanSkew maxSkew (skews in seconds, left minus right).
     - [setNumDisp NumOfDisparities]: It sets the expected number of disparity (in pixel). Values must be divisible by 32. Good values are 64 for 320x240 images and 128 for 640x480 images.
     - [setMinDisp minDisparity]: It sets the minimum disparity (in pixel).
+    - [setROI tlx tly w h ...]: It restricts the disparity and the world images to one or more regions of the Left image (one quadruple per region); each region is enlarged in the rectified images by the disparity range and by \e roiMargin. The 3D points outside the regions are (0.0,0.0,0.0).
+    - [clearROI]: It computes the disparity on the whole image again.
+    - [getROI]: It returns the regions the disparity is restricted to (tlx tly w h ...), empty if it is computed on the whole image.
+    - [stats]: It returns the latency statistics of the stages, as written on /SFM/stats:o.
+    - [resetStats]: It clears the latency statistics.
     - [Point x y]: Given the pixel coordinate x,y in the Left image the response is the 3D Point: X Y Z computed using the depth map wrt the LEFT eye. Points with non valid disparity (i.e. occlusions) are handled with the value (0.0,0.0,0.0).
     - [x y]: Given the pixel coordinate x,y in the Left image the response is the 3D Point: X Y Z ur vr computed using the depth map wrt the the ROOT reference system; (ur vr) is the corresponding pixel in the Right image. Points with non valid disparity (i.e. occlusions) are handled with the value (0.0,0.0,0.0).
     - [Left x y]: Given the pixel coordinate x,y in the Left image the response is the 3D Point: X Y Z computed using the depth map wrt the LEFT eye. Points with non valid disparity (i.e. occlusions) are handled with the value (0.0,0.0,0.0).
     - [Right x y]: Given the pixel coordinate x,y in the Left image the response is the 3D Point: X Y Z computed using the depth map wrt the RIGHT eye. Points with non valid disparity (i.e. occlusions) are handled with the value (0.0,0.0,0.0).
     - [Root x y]: Given the pixel coordinate x,y in the Left image the response is the 3D Point: X Y Z computed using the depth map wrt the ROOT reference system. Points with non valid disparity (i.e. occlusions) are handled with the value (0.0,0.0,0.0).
-    - [Rect tlx tly w h step]: Given the pixels in the rectangle defined by {(tlx,tly) (tlx+w,tly+h)} (parsed by columns), the response contains the corresponding 3D points in the ROOT frame. The optional parameter step defines the sampling quantum; by default step=1.
-    - [Points u_1 v_1 ... u_n v_n]: Given a list of n pixels, the response contains the corresponding 3D points in the ROOT frame.
-    - [Flood3D x y dist]: Perform 3D flood-fill on the seed point (x,y), returning the following info: [u_1 v_1 x_1 y_1 z_1 ...]. The optional parameter dist expressed in meters regulates the fill (by default = 0.004).
+    - [Rect tlx tly w h step]: Given the pixels in the rectangle defined by {(tlx,tly) (tlx+w,tly+h)} (parsed by columns), the response contains the corresponding 3D points in the ROOT frame. The optional parameter step defines the sampling quantum; by default step=1. Points with non valid disparity are (0.0,0.0,0.0).
+    - [Points u_1 v_1 ... u_n v_n]: Given a list of n pixels, the response contains the corresponding 3D points in the ROOT frame. Points with non valid disparity are (0.0,0.0,0.0).
+    - [Flood3D x y dist]: Perform 3D flood-fill on the seed point (x,y), returning the following info: [u_1 v_1 x_1 y_1 z_1 ...]. The optional parameter dist expressed in meters regulates the fill (by default = 0.004): a pixel is added if the 3D point of one of its 8 neighbours in the region is not farther than dist.
+    - [Grow3D dist maxPoints u_1 v_1 ... u_n v_n]: Perform the 3D flood-fill of several seed points at once on the same world image, returning (r_1 ... r_n) (size_1 ... size_m) (truncated_1 ... truncated_m) blob. r_i is the region of the i-th seed (-1 if its point is not valid), seeds lying in the same region share it; size_j is the number of points of the j-th region and truncated_j is 1 if it has been cut at maxPoints points (0 = no limit). The blob holds the points of the regions one after the other, each one packed as u,v (16 bit unsigned) and x,y,z (32 bit float, ROOT frame), in the byte order of the machine, the seed first.
     - [uL_1 vL_1 uR_1 vR_1 ... uL_n vL_n uR_n vR_n]: Given n quadruples uL_i vL_i uR_i vR_i, where uL_i vL_i are the pixel coordinates in the Left image and uR_i vR_i are the coordinates of the matched pixel in the Right image, the response is a set of 3D points (X1 Y1 Z1 ... Xn Yn Zn) wrt the ROOT reference system.
     - [cart2stereo X Y Z]: Given a world point X Y Z wrt to ROOT reference frame the response is the projection (uL vL uR vR) in the Left and Right images.
     - [doBLF flag]: activate Bilateral filter for flag = true, and skip it for flag = false (default by config).
-    - [bilatfilt sigmaColor sigmaSpace]: Set the parameters for the bilateral filer (default sigmaColor = 10.0, sigmaSpace = 10.0 .
+    - [bilatfilt sigmaColor sigmaSpace]: Set the parameters for the bilateral filer, both must be positive (default sigmaColor = 10.0, sigmaSpace = 10.0 .
+    - [jointBLF flag]: the bilateral filter is guided by the left image for flag = true (default by config).
 
 \section in_files_sec Input Data Files
 None.
@@ -219,7 +384,6 @@ against OpenCV versions: 2.4.
 #include <string>
 #include <iostream>
 #include <fstream>
-#include <set>
 #include <deque>
 
 #include <yarp/os/all.h>
@@ -230,8 +394,12 @@ against OpenCV versions: 2.4.
 #include <iCub/ctrl/math.h>
 #include <iCub/iKin/iKinFwd.h>
 #include <iCub/stereoVision/stereoCamera.h>
+#include <iCub/stereoVision/stereoSync.h>
+#include <iCub/stereoVision/stageStats.h>
+#include <iCub/stereoVision/stereoLog.h>
 
-#include "fastBilateral.hpp"
+#include "bilateralGrid.h"
+#include "regionGrowing.h"
 
 #ifdef USING_GPU
     #include <iCub/stereoVision/utils.h>
@@ -249,10 +417,120 @@ using namespace iCub::ctrl;
 using namespace iCub::iKin;
 
 
+/**
+* Bounded queue between two stages of the SFM pipeline. When it is full the
+* oldest element is dropped, so that the consumer always gets the freshest data,
+* unless the queue is blocking (replay as fast as possible).
+*/
+template<typename T>
+class StageQueue
+{
+    deque<T> items;
+    size_t depth;
+    bool closed;
+    unsigned int dropped;
+    yarp::os::Mutex mtx;
+    yarp::os::Semaphore available;
+    bool blocking;
+    yarp::os::Semaphore space;
+
+public:
+    StageQueue() : depth(1), closed(false), dropped(0), available(0), blocking(false), space(0) { }
+
+    // a blocking queue makes push() wait for room instead of dropping
+    void setDepth(const int d, const bool block=false)
+    {
+        depth=(d>1)?(size_t)d:1;
+        blocking=block;
+        if (blocking)
+            for (size_t i=0; i<depth; i++)
+                space.post();
+    }
+
+    unsigned int getDropped()
+    {
+        LockGuard lg(mtx);
+        return dropped;
+    }
+
+    void push(const T &item)
+    {
+        if (blocking)
+            space.wait();
+
+        mtx.lock();
+        if (closed)
+        {
+            mtx.unlock();
+            if (blocking)
+                space.post();   // wakes up the next producer
+            return;
+        }
+
+        bool full=(items.size()>=depth);
+        if (full)
+        {
+            items.pop_front();
+            dropped++;
+        }
+        items.push_back(item);
+        mtx.unlock();
+
+        if (!full)
+            available.post();
+    }
+
+    // blocks until an element is available, returns false once the queue is closed
+    bool pop(T &item)
+    {
+        available.wait();
+        LockGuard lg(mtx);
+        if (closed || items.empty())
+            return false;
+
+        item=items.front();
+        items.pop_front();
+        if (blocking)
+            space.post();
+        return true;
+    }
+
+    void close()
+    {
+        mtx.lock();
+        closed=true;
+        items.clear();
+        mtx.unlock();
+        available.post();
+        if (blocking)
+            space.post();
+    }
+};
+
+
+class SFM;
+
+/**
+* Worker thread running one stage of the SFM pipeline.
+*/
+class SFMStage : public yarp::os::Thread
+{
+public:
+    enum { DISPARITY, PUBLISH, RECALIBRATION };
+
+    SFMStage(SFM *_sfm, const int _stage) : sfm(_sfm), stage(_stage) { }
+    void run();
+
+private:
+    SFM *sfm;
+    int stage;
+};
+
+
 class SFM: public yarp::os::RFModule
 {
-    IplImage*     left;
-    IplImage*     right;
+    friend class SFMStage;
+
     StereoCamera* stereo;
     IplImage*     output_match;
     Mat           outputDm;
@@ -267,8 +545,13 @@ class SFM: public yarp::os::RFModule
     yarp::os::Port rpc;
     yarp::os::BufferedPort<yarp::sig::ImageOf<yarp::sig::PixelRgb> > leftImgPort;
     yarp::os::BufferedPort<yarp::sig::ImageOf<yarp::sig::PixelRgb> > rightImgPort;
+    StereoSynchronizer *stereoSync;
+    StereoLogPlayer *player;        // replaces the ports and the robot if not NULL
+    StereoLogWriter *recorder;
+    Matrix replayHL,replayHR;       // the recorded poses of the eyes, when replaying
     BufferedPort<ImageOf<PixelRgbFloat> > worldCartPort;
     BufferedPort<ImageOf<PixelRgbFloat> > worldCylPort;
+    BufferedPort<Bottle> worldPointsPort;
     Port handlerPort;
 
     BufferedPort<ImageOf<PixelMono> > outDisp;
@@ -276,6 +559,7 @@ class SFM: public yarp::os::RFModule
 
     BufferedPort<ImageOf<PixelRgb> >  outLeftRectImgPort;
     BufferedPort<ImageOf<PixelRgb> >  outRightRectImgPort;
+    BufferedPort<Bottle> statsPort;
 
     int numberOfTrials;
     string camCalibFile;
@@ -293,9 +577,12 @@ class SFM: public yarp::os::RFModule
     double sigmaColorBLF;
     double sigmaSpaceBLF;
     bool doBLF;
-    yarp::os::Mutex mutexRecalibration;
+    bool jointBLF;
+    BilateralGrid blf;      // used by the publishing stage only
+    yarp::os::Mutex mutexRecalibration;     // doSFM, calibPending, numberOfTrials, R0, T0, eyes0, calibMatches
     Event calibEndEvent;
     yarp::os::Mutex mutexDisp;
+    int roiMargin;
 
     PolyDriver headCtrl,gazeCtrl;
     IEncoders* iencs;
@@ -306,16 +593,118 @@ class SFM: public yarp::os::RFModule
     Mat HR_root;
     Mat R0,T0;
 
+    // acquired stereo pair with the robot state at acquisition time
+    struct Frame
+    {
+        Mat left,right;
+        Stamp stamp_left,stamp_right;
+        yarp::sig::Vector eyes;
+        Matrix HL_gaze,HR_gaze;
+        Mat HL_root;
+        double acquired;    // StageStats::now() when the pair is read
+    };
+
+    // outputs of the stereo camera for one frame
+    struct Result
+    {
+        Stamp stamp_left,stamp_right;
+        Size size;
+        Mat disp8,disp16;
+        Mat mapper,Q,RLrect,HL_root;
+        Mat rectLeft,rectRight,matches;
+        Mat guide;              // left image (unrectified, as disp8) guiding the joint bilateral filter
+        vector<cv::Rect> rois;  // regions the disparity is computed for (empty = whole image)
+        double acquired;
+    };
+
+    // latency of the stages, each one recorded by the thread that runs it
+    StageStats stats;
+    int stageAcquire,stageCalibration,stageDisparity,stageOutputs;
+    int stagePublishRect,stageBilateral,stageDispPort,stageWorld,stageWorldPort,stageFrame;
+    double statsPeriod,statsLast;
+
+    // pipeline: updateModule() acquires, disparityStage computes the disparity,
+    // publishStage reprojects and writes the ports (0 = everything in updateModule())
+    int pipelineDepth;
+    StageQueue<Frame>  frameQueue;
+    StageQueue<Result> resultQueue;
+    SFMStage *disparityStage;
+    SFMStage *publishStage;
+
+    // pair handed to the recalibration, with the extrinsics of the frame
+    // (from the kinematics) and the ones expected from the gaze controller
+    struct CalibSnapshot
+    {
+        Mat left,right;
+        yarp::sig::Vector eyes;
+        Mat R,T,R_exp,T_exp;
+    };
+
+    // the recalibration runs on its own camera in recalibrationStage: the disparity
+    // keeps using the previous extrinsics till the new R0,T0,eyes0 are swapped in
+    StereoCamera *calibStereo;
+    StageQueue<CalibSnapshot> calibQueue;
+    SFMStage *recalibrationStage;
+    bool calibPending;      // a pair is being processed
+    Mat calibMatches;       // inliers of the last attempt, drawn on its pair
+
+    // per-pixel rays of the left camera in the rectified frame (from MapperL and Q),
+    // rebuilt only when a new rectification is installed
+    Mat rayIdx;     // offset of the rectified pixel in the 16 bit disparity (-1 if outside)
+    Mat rayX,rayY;  // numerators of the x and y coordinates
+    Mat rayMapper;  // mapper the rays are built from
+    Mat rayQ;       // Q the rays are built from
+    size_t rayDispStep;
+
+    // packed output of the valid points of the world image
+    enum { POINTS_F32, POINTS_F16, POINTS_Q16 };
+    int pointsFormat;
+    int pointsStride;
+    double pointsQuantum;
+    vector<unsigned char> pointsBuffer;
+
+    // region growing of the Flood3D and Grow3D commands (rpc thread only)
+    RegionGrowing regionGrowing;
+    vector<unsigned char> regionsBuffer;
+
+    // last cartesian world image, with the disparity and the pose it is computed from
+    Mat worldCart;
+    Mat worldDisp16,worldHL_root;
+    yarp::os::Mutex mutexWorld;
+
+    // the state a batch of 3D point queries (in the root frame) is answered from,
+    // taken once per batch
+    struct PointQuery
+    {
+        Mat mapper,disp16;
+        float Q00,Q03,Q11,Q13,Q23,Q32,Q33;
+        float H[12];    // from the rectified left camera to the root frame
+        Mat world;      // the world image, if it is computed from disp16 and the current pose
+    };
+
     bool loadIntrinsics(yarp::os::ResourceFinder &rf, Mat &KL, Mat &KR, Mat &DistL, Mat &DistR);
     Mat buildRotTras(const Mat& R, const Mat& T);
     Matrix getCameraHGazeCtrl(int camera);
     void convert(Matrix& matrix, Mat& mat);
     void convert(Mat& mat, Matrix& matrix);
-    void fillWorld3D(ImageOf<PixelRgbFloat> &worldCartImg, ImageOf<PixelRgbFloat> &worldCylImg);
-    void floodFill(const Point &seed,const Point3f &p0, const double dist, set<int> &visited, Bottle &res);
+    void updateWorldRays(const Mat &Mapper, const Mat &Q, const Mat &disp16m);
+    void fillWorld3D(const Result &result, Mat &worldCartImg, ImageOf<PixelRgbFloat> *worldCylImg);
+    void packPoints(const Mat &world, Bottle &points);
+    void computeFrame(const Frame &frame, Result &result);
+    void publishResult(Result &result);
+    void runDisparityStage();
+    void runPublishStage();
+    void runRecalibrationStage();
+    bool recalibrate(const CalibSnapshot &snapshot, Mat &R, Mat &T, Mat &matches);
+    bool preparePointQuery(PointQuery &query);
+    Point3f get3DPoint(const PointQuery &query, const int u, const int v) const;
+    bool snapshotWorld(Mat &world);
+    bool parseROIs(const Bottle &b, const int first, vector<cv::Rect> &rois);
     bool loadExtrinsics(yarp::os::ResourceFinder& rf, Mat& Ro, Mat& To, yarp::sig::Vector& eyes);
     bool updateExtrinsics(Mat& Rot, Mat& Tr, yarp::sig::Vector& eyes, const string& groupname);
     void updateViaGazeCtrl(const bool update);
+    void updateViaGazeCtrl(const Matrix &L1, const Matrix &R1, const bool update);
+    void extrinsicsFromGaze(const Matrix &L1, const Matrix &R1, Mat &R, Mat &T);
     void updateViaKinematics(const yarp::sig::Vector& deyes);
     bool init;
 
@@ -334,6 +723,16 @@ public:
     Point3f get3DPoints(int u, int v, const string &drive="LEFT");
     Point3f get3DPointsAndDisp(int u, int v, int &uR, int &vR, const string &drive);
 
+    /**
+    * Batch version of get3DPoints() in the ROOT frame: the calibration and the
+    * disparity are taken once for all the pixels, and the last world image is
+    * read directly when it is computed from the current disparity and pose.
+    * @param pixels the pixels of the left image.
+    * @param points the 3D points, (0,0,0) where the disparity is not valid
+    * or the point is farther than 10 meters.
+    */
+    void get3DPoints(const vector<Point> &pixels, vector<Point3f> &points);
+
     Point3f get3DPointMatch(double u1, double v1, double u2, double v2, const string &drive="LEFT");
     Point2f projectPoint(const string &camera, double x, double y, double z);
 };
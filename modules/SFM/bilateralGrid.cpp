@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#include <cstring>
+#include <algorithm>
+
+#include "bilateralGrid.h"
+
+using namespace std;
+using namespace cv;
+
+
+namespace
+{
+    const int padding=2;
+
+    // accumulates the pixels of a band of cell rows: the rows of the image
+    // falling in different cell rows are disjoint, so no cell is shared
+    class SplatBody : public ParallelLoopBody
+    {
+        const Mat &src,&range;
+        const int *cellX,*rowStart;
+        float *grid;
+        int W,D;
+        float zmin,sigmaColor;
+        bool joint;
+
+    public:
+        SplatBody(const Mat &_src, const Mat &_range, const int *_cellX, const int *_rowStart,
+                  float *_grid, const int _W, const int _D, const float _zmin,
+                  const float _sigmaColor, const bool _joint) :
+                  src(_src), range(_range), cellX(_cellX), rowStart(_rowStart), grid(_grid),
+                  W(_W), D(_D), zmin(_zmin), sigmaColor(_sigmaColor), joint(_joint) { }
+
+        void operator()(const Range &r) const
+        {
+            for (int k=r.start; k<r.end; k++)
+            {
+                float *cellRow=grid+2*(size_t)k*W*D;
+                for (int y=rowStart[k]; y<rowStart[k+1]; y++)
+                {
+                    const float *s=src.ptr<float>(y);
+                    const float *z=range.ptr<float>(y);
+                    for (int x=0; x<src.cols; x++)
+                    {
+                        if (joint && (s[x]==0.0f))
+                            continue;
+
+                        int cz=(int)((z[x]-zmin)/sigmaColor+0.5f)+padding;
+                        float *cell=cellRow+2*((size_t)cellX[x]*D+cz);
+                        cell[0]+=s[x];
+                        cell[1]+=1.0f;
+                    }
+                }
+            }
+        }
+    };
+
+
+    // one [1 2 1]/4 pass along an axis (offset between neighbors in floats), interior cells only
+    class BlurBody : public ParallelLoopBody
+    {
+        const float *in;
+        float *out;
+        int W,D,off;
+
+    public:
+        BlurBody(const float *_in, float *_out, const int _W, const int _D, const int _off) :
+                 in(_in), out(_out), W(_W), D(_D), off(_off) { }
+
+        void operator()(const Range &r) const
+        {
+            for (int y=r.start; y<r.end; y++)
+            {
+                for (int x=1; x<W-1; x++)
+                {
+                    size_t base=2*(((size_t)y*W+x)*D+1);
+                    const float *b=in+base;
+                    float *d=out+base;
+                    for (int z=1; z<D-1; z++,b+=2,d+=2)
+                    {
+                        d[0]=(b[-off]+b[off]+2.0f*b[0])*0.25f;
+                        d[1]=(b[1-off]+b[1+off]+2.0f*b[1])*0.25f;
+                    }
+                }
+            }
+        }
+    };
+
+
+    class NormalizeBody : public ParallelLoopBody
+    {
+        float *grid;
+        size_t sliceSize;
+
+    public:
+        NormalizeBody(float *_grid, const size_t _sliceSize) : grid(_grid), sliceSize(_sliceSize) { }
+
+        void operator()(const Range &r) const
+        {
+            float *c=grid+2*sliceSize*r.start;
+            float *end=grid+2*sliceSize*r.end;
+            for (; c<end; c+=2)
+                if (c[1]!=0.0f)
+                    c[0]/=c[1];
+        }
+    };
+
+
+    // trilinear interpolation of the normalized grid at every pixel
+    class SliceBody : public ParallelLoopBody
+    {
+        const Mat &src,&range;
+        Mat &dst;
+        const float *grid;
+        int H,W,D;
+        float zmin,sigmaColor,sigmaSpace;
+        bool joint;
+
+    public:
+        SliceBody(const Mat &_src, const Mat &_range, Mat &_dst, const float *_grid,
+                  const int _H, const int _W, const int _D, const float _zmin,
+                  const float _sigmaColor, const float _sigmaSpace, const bool _joint) :
+                  src(_src), range(_range), dst(_dst), grid(_grid), H(_H), W(_W), D(_D),
+                  zmin(_zmin), sigmaColor(_sigmaColor), sigmaSpace(_sigmaSpace), joint(_joint) { }
+
+        void operator()(const Range &r) const
+        {
+            for (int y=r.start; y<r.end; y++)
+            {
+                const float *s=src.ptr<float>(y);
+                const float *z=range.ptr<float>(y);
+                float *d=dst.ptr<float>(y);
+
+                float py=y/sigmaSpace+padding;
+                int y0=std::min((int)py,H-1);
+                int y1=std::min(y0+1,H-1);
+                float ay=py-y0;
+
+                for (int x=0; x<dst.cols; x++)
+                {
+                    if (joint && (s[x]==0.0f))
+                    {
+                        d[x]=0.0f;
+                        continue;
+                    }
+
+                    float px=x/sigmaSpace+padding;
+                    float pz=(z[x]-zmin)/sigmaColor+padding;
+                    int x0=std::min((int)px,W-1);
+                    int x1=std::min(x0+1,W-1);
+                    int z0=std::min((int)pz,D-1);
+                    int z1=std::min(z0+1,D-1);
+                    float ax=px-x0;
+                    float az=pz-z0;
+
+                    const float *c00=grid+2*(((size_t)y0*W+x0)*D);
+                    const float *c01=grid+2*(((size_t)y0*W+x1)*D);
+                    const float *c10=grid+2*(((size_t)y1*W+x0)*D);
+                    const float *c11=grid+2*(((size_t)y1*W+x1)*D);
+
+                    float v0=(1.0f-ay)*((1.0f-ax)*c00[2*z0]+ax*c01[2*z0])+
+                             ay*((1.0f-ax)*c10[2*z0]+ax*c11[2*z0]);
+                    float v1=(1.0f-ay)*((1.0f-ax)*c00[2*z1]+ax*c01[2*z1])+
+                             ay*((1.0f-ax)*c10[2*z1]+ax*c11[2*z1]);
+                    d[x]=(1.0f-az)*v0+az*v1;
+                }
+            }
+        }
+    };
+}
+
+
+/******************************************************************************/
+BilateralGrid::BilateralGrid() : gridH(0), gridW(0), gridD(0)
+{
+}
+
+
+/******************************************************************************/
+void BilateralGrid::filter(const Mat &src, Mat &dst, const double sigmaColor,
+                           const double sigmaSpace)
+{
+    CV_Assert(src.channels()==1);
+
+    src.convertTo(srcF,CV_32F);
+    apply(srcF,srcF,sigmaColor,sigmaSpace,false);
+    dstF.convertTo(dst,src.type());
+}
+
+
+/******************************************************************************/
+void BilateralGrid::filter(const Mat &src, const Mat &guide, Mat &dst,
+                           const double sigmaColor, const double sigmaSpace)
+{
+    CV_Assert((src.channels()==1) && (guide.size()==src.size()));
+
+    src.convertTo(srcF,CV_32F);
+    if (guide.channels()==3)
+    {
+        cvtColor(guide,guideGray,CV_RGB2GRAY);
+        guideGray.convertTo(rangeF,CV_32F);
+    }
+    else
+        guide.convertTo(rangeF,CV_32F);
+
+    apply(srcF,rangeF,sigmaColor,sigmaSpace,true);
+    dstF.convertTo(dst,src.type());
+}
+
+
+/******************************************************************************/
+void BilateralGrid::apply(const Mat &src, const Mat &range, const double sigmaColor,
+                          const double sigmaSpace, const bool joint)
+{
+    // extents of the cells, the coordinates of the grid are divided by them
+    CV_Assert((sigmaColor>0.0) && (sigmaSpace>0.0));
+
+    const int height=src.rows, width=src.cols;
+    double zmin,zmax;
+    minMaxLoc(range,&zmin,&zmax);
+
+    gridH=(int)((height-1)/sigmaSpace)+1+2*padding;
+    gridW=(int)((width-1)/sigmaSpace)+1+2*padding;
+    gridD=(int)((zmax-zmin)/sigmaColor)+1+2*padding;
+
+    // the buffers only grow; both are cleared, the blur never writes the borders
+    size_t cells=(size_t)gridH*gridW*gridD;
+    if (grid.size()<2*cells)
+    {
+        grid.resize(2*cells);
+        buffer.resize(2*cells);
+    }
+    memset(&grid[0],0,2*cells*sizeof(float));
+    memset(&buffer[0],0,2*cells*sizeof(float));
+
+    // cells of the rows and of the columns, rounded to the nearest
+    cellX.resize(width);
+    for (int x=0; x<width; x++)
+        cellX[x]=(int)(x/sigmaSpace+0.5)+padding;
+
+    rowStart.assign(gridH+1,height);
+    for (int y=height-1; y>=0; y--)
+        rowStart[(int)(y/sigmaSpace+0.5)+padding]=y;
+    for (int k=gridH-1; k>=0; k--)
+        rowStart[k]=std::min(rowStart[k],rowStart[k+1]);
+
+    parallel_for_(Range(0,gridH),SplatBody(src,range,&cellX[0],&rowStart[0],&grid[0],
+                                           gridW,gridD,(float)zmin,(float)sigmaColor,joint));
+
+    // two passes per axis, the result is back in grid after the six of them
+    const int offsets[3]={2*gridW*gridD,2*gridD,2};
+    float *in=&grid[0], *out=&buffer[0];
+    for (int dim=0; dim<3; dim++)
+    {
+        for (int i=0; i<2; i++)
+        {
+            parallel_for_(Range(1,gridH-1),BlurBody(in,out,gridW,gridD,offsets[dim]));
+            std::swap(in,out);
+        }
+    }
+
+    parallel_for_(Range(0,gridH),NormalizeBody(in,(size_t)gridW*gridD));
+
+    dstF.create(src.size(),CV_32F);
+    parallel_for_(Range(0,height),SliceBody(src,range,dstF,in,gridH,gridW,gridD,(float)zmin,
+                                            (float)sigmaColor,(float)sigmaSpace,joint));
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#ifndef __BILATERAL_GRID_H__
+#define __BILATERAL_GRID_H__
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+/**
+* Fast approximation of the bilateral filter on a bilateral grid
+* (S. Paris and F. Durand, ECCV 2006, http://people.csail.mit.edu/sparis/bf/):
+* the image is accumulated in a 3D grid with cells of sigmaSpace x sigmaSpace
+* pixels by sigmaColor intensity levels, the grid is blurred and the filtered
+* image is interpolated back from it.
+*
+* Single precision, each step runs in parallel and the grid is kept allocated
+* across frames (it grows only when a frame needs a larger one). In the joint
+* (cross) mode the intensity axis of the grid is the one of a guide image, so
+* that the edges of the guide are preserved, and the pixels that are 0 in the
+* filtered image (not valid disparities) are neither accumulated nor filled.
+*/
+class BilateralGrid
+{
+    std::vector<float> grid,buffer;     // (value,weight) per cell
+    std::vector<int> cellX,rowStart;    // cell of each column, first row of each cell row
+    cv::Mat srcF,rangeF,guideGray,dstF;
+    int gridH,gridW,gridD;
+
+    // filters src into dstF, with the intensity axis of the grid taken from range
+    void apply(const cv::Mat &src, const cv::Mat &range, const double sigmaColor,
+               const double sigmaSpace, const bool joint);
+
+public:
+
+    BilateralGrid();
+
+    /**
+    * Bilateral filter.
+    * @param src the single channel image.
+    * @param dst the filtered image, same size and type of src.
+    * @param sigmaColor the intensity extent of a cell (> 0).
+    * @param sigmaSpace the spatial extent of a cell [pixels] (> 0).
+    */
+    void filter(const cv::Mat &src, cv::Mat &dst, const double sigmaColor,
+                const double sigmaSpace);
+
+    /**
+    * Joint bilateral filter.
+    * @param src the single channel image (0 where not valid).
+    * @param guide the guide image (gray or color), same size of src.
+    * @param dst the filtered image, same size and type of src.
+    * @param sigmaColor the intensity extent of a cell, in levels of the guide (> 0).
+    * @param sigmaSpace the spatial extent of a cell [pixels] (> 0).
+    */
+    void filter(const cv::Mat &src, const cv::Mat &guide, cv::Mat &dst,
+                const double sigmaColor, const double sigmaSpace);
+};
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#include <algorithm>
+
+#include "regionGrowing.h"
+
+using namespace std;
+using namespace cv;
+
+
+namespace
+{
+    inline bool isValid(const float *p)
+    {
+        return (p[0]!=0.0f) || (p[1]!=0.0f) || (p[2]!=0.0f);
+    }
+
+    inline bool testBit(const unsigned int *bits, const int i)
+    {
+        return ((bits[i>>5]>>(i&31))&1)!=0;
+    }
+
+    inline void setBit(unsigned int *bits, const int i)
+    {
+        bits[i>>5]|=1u<<(i&31);
+    }
+
+    inline void clearBit(unsigned int *bits, const int i)
+    {
+        bits[i>>5]&=~(1u<<(i&31));
+    }
+
+    // grows the region of the seeds of a batch (the pixels queued are the region
+    // itself), each one with the bitmap of its slot, cleared again afterwards
+    class GrowBody : public ParallelLoopBody
+    {
+        const Mat &world;
+        const vector<int> &batch;
+        vector<vector<unsigned int> > &visited;
+        vector<RegionGrowing::Region> &regions;
+        float dist2;
+        size_t maxPoints;
+
+    public:
+        GrowBody(const Mat &_world, const vector<int> &_batch,
+                 vector<vector<unsigned int> > &_visited,
+                 vector<RegionGrowing::Region> &_regions, const float _dist2,
+                 const size_t _maxPoints) :
+                 world(_world), batch(_batch), visited(_visited), regions(_regions),
+                 dist2(_dist2), maxPoints(_maxPoints) { }
+
+        void operator()(const Range &r) const
+        {
+            const int cols=world.cols, rows=world.rows;
+            const float *w=world.ptr<float>(0);
+            const size_t step=world.step1();
+
+            for (int k=r.start; k<r.end; k++)
+            {
+                vector<int> &queue=regions[k].pixels;
+                regions[k].truncated=false;
+                queue.clear();
+
+                // only the accepted pixels are marked: a pixel too far from one
+                // neighbour can still be reached from another one
+                unsigned int *bits=&visited[k][0];
+                int s=batch[k];
+                setBit(bits,s);
+                queue.push_back(s);
+
+                for (size_t head=0; (head<queue.size()) && !regions[k].truncated; head++)
+                {
+                    int u0=queue[head]%cols, v0=queue[head]/cols;
+                    const float *p0=w+v0*step+3*u0;
+
+                    for (int v=std::max(v0-1,0); v<=std::min(v0+1,rows-1); v++)
+                    {
+                        const float *row=w+v*step;
+                        for (int u=std::max(u0-1,0); u<=std::min(u0+1,cols-1); u++)
+                        {
+                            int i=v*cols+u;
+                            if (testBit(bits,i))
+                                continue;
+
+                            const float *p=row+3*u;
+                            if (!isValid(p))
+                                continue;
+
+                            float dx=p[0]-p0[0], dy=p[1]-p0[1], dz=p[2]-p0[2];
+                            if (dx*dx+dy*dy+dz*dz>dist2)
+                                continue;
+
+                            if ((maxPoints>0) && (queue.size()>=maxPoints))
+                            {
+                                regions[k].truncated=true;
+                                continue;
+                            }
+
+                            setBit(bits,i);
+                            queue.push_back(i);
+                        }
+                    }
+                }
+
+                for (size_t i=0; i<queue.size(); i++)
+                    clearBit(bits,queue[i]);
+            }
+        }
+    };
+}
+
+
+/******************************************************************************/
+void RegionGrowing::grow(const Mat &world, const vector<Point> &seeds,
+                         const double dist, const int maxPoints, vector<Region> &regions,
+                         vector<int> &seedRegion)
+{
+    CV_Assert(world.type()==CV_32FC3);
+
+    const int cols=world.cols, rows=world.rows;
+    const float *w=world.ptr<float>(0);
+    const size_t step=world.step1();
+
+    // the region of each labelled pixel, the first one reaching it
+    vector<int> label((size_t)rows*cols,-1);
+    size_t words=((size_t)rows*cols+31)/32;
+    int slots=std::max(getNumThreads(),1);
+    vector<vector<unsigned int> > visited;
+    vector<Region> grown;
+
+    regions.clear();
+    seedRegion.assign(seeds.size(),-1);
+
+    vector<int> batch;
+    vector<size_t> batchSeeds;
+    for (size_t k=0; k<seeds.size(); )
+    {
+        // the next seeds not in the region of a previous seed
+        batch.clear();
+        batchSeeds.clear();
+        for (; (k<seeds.size()) && ((int)batch.size()<slots); k++)
+        {
+            const Point &seed=seeds[k];
+            if ((seed.x<0) || (seed.x>=cols) || (seed.y<0) || (seed.y>=rows) ||
+                !isValid(w+seed.y*step+3*seed.x))
+                continue;
+
+            int s=seed.y*cols+seed.x;
+            if (label[s]>=0)
+                seedRegion[k]=label[s];
+            else
+            {
+                batch.push_back(s);
+                batchSeeds.push_back(k);
+            }
+        }
+
+        if (batch.empty())
+            continue;
+
+        if (visited.size()<batch.size())
+        {
+            visited.resize(batch.size(),vector<unsigned int>(words,0));
+            grown.resize(batch.size());
+        }
+
+        parallel_for_(Range(0,(int)batch.size()),
+                      GrowBody(world,batch,visited,grown,(float)(dist*dist),
+                               (size_t)std::max(maxPoints,0)));
+
+        // a seed of the batch inside the region of a previous one of the batch
+        // shares it: only the regions of the same surface grown together are
+        // grown more than once
+        for (size_t j=0; j<batch.size(); j++)
+        {
+            int s=batch[j];
+            if (label[s]>=0)
+            {
+                seedRegion[batchSeeds[j]]=label[s];
+                continue;
+            }
+
+            int index=(int)regions.size();
+            seedRegion[batchSeeds[j]]=index;
+            regions.push_back(Region());
+            regions.back().pixels.swap(grown[j].pixels);
+            regions.back().truncated=grown[j].truncated;
+
+            const vector<int> &pixels=regions.back().pixels;
+            for (size_t i=0; i<pixels.size(); i++)
+                if (label[pixels[i]]<0)
+                    label[pixels[i]]=index;
+        }
+    }
+}
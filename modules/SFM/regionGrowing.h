@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+ */
+
+#ifndef __REGION_GROWING_H__
+#define __REGION_GROWING_H__
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+/**
+* Region growing on a world image (the 3D point of each pixel, (0,0,0) where
+* not valid): the region of a seed is made of the pixels reachable from it
+* through 8-connected neighbours whose 3D points are not farther apart than a
+* given distance, so it does not depend on the order of the visit.
+*
+* Each region is grown breadth first with an explicit queue and a visited
+* bitmap. The seeds are taken in batches of as many as the threads, grown in
+* parallel, and the pixels of the regions are labelled in a label image: a
+* seed lying in the region of a previous seed is assigned to that region and
+* it is not grown again. The buffers only live during grow().
+*/
+class RegionGrowing
+{
+public:
+
+    struct Region
+    {
+        std::vector<int> pixels;    // v*cols+u, breadth first (the seed first)
+        bool truncated;             // the limit on the points was reached
+    };
+
+    /**
+    * Grows the regions of a set of seeds.
+    * @param world the world image (CV_32FC3).
+    * @param seeds the seed pixels.
+    * @param dist the max distance between the points of two neighbouring pixels [m].
+    * @param maxPoints the max points of a region (0 = no limit).
+    * @param regions the regions.
+    * @param seedRegion the index of the region of each seed, -1 if its point
+    * is not valid.
+    */
+    void grow(const cv::Mat &world, const std::vector<cv::Point> &seeds,
+              const double dist, const int maxPoints, std::vector<Region> &regions,
+              std::vector<int> &seedRegion);
+};
+
+#endif
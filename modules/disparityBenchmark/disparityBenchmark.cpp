@@ -0,0 +1,835 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+*/
+
+/**
+\defgroup disparityBenchmark disparityBenchmark
+
+Offline benchmark of the disparity engines on recorded stereo pairs.
+
+Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+
+CopyPolicy: Released under the terms of the GNU GPL v2.0.
+
+\section intro_sec Description
+The module runs the disparity engines of the library (see DisparityEngine)
+over folders of rectified stereo pairs, without any robot, port or
+name server, and reports for each engine and dataset the durations of the
+stages (see StageStats), the frame rate, the peak memory and, where a
+ground truth is available, the accuracy. The results are written as JSON
+so that they can be tracked across versions.
+
+The layouts of the datasets are:
+- \e middlebury: one folder per scene with \e im0.png, \e im1.png, the optional
+  ground truth \e disp0GT.pfm (infinity where not known) and the optional
+  \e calib.txt the number of disparities is read from (MiddEval3, 2014).
+- \e kitti: the folders \e image_2 and \e image_3 with the pairs \e *_10.png
+  and the optional ground truth \e disp_noc_0 (16 bit PNG, disparity times 256,
+  0 where not known); \e disp_occ_0 is used if \e kittiOcc is given.
+- \e pairs: the folders \e left and \e right with images paired by name order
+  (e.g. two yarpdatadumper image logs) and the optional folder \e disp with
+  ground truths in either of the formats above; the pairs are a sequence, so
+  the state of the engines (e.g. the temporal prior of ELAS) carries over.
+
+The accuracy of a pair is measured on the pixels with a ground truth: the bad
+pixels are those whose estimate is missing or off by more than
+\e badThreshold, the density is the fraction with an estimate and the
+average error is computed on these ones.
+The peak memory is the resident set of the process while an engine runs on a
+dataset (Linux; elsewhere the process peak).
+
+\section lib_sec Libraries
+stereoVision library, YARP (just for the configuration) and OpenCV.
+
+\section parameters_sec Parameters
+--datasets \e "((middlebury /data/MiddEval3/trainingQ) (kitti /data/kitti/training))"
+- The datasets, a list of (layout folder).
+
+--engines \e "(elas sgbm)"
+- The engines run on each dataset. An entry that names a group of the
+  configuration file is a variant: the group holds the engine options
+  (e.g. \e elas_setting, \e sgbm_3way) and the engine name as \e engine.
+  Entries not available in this build are skipped.
+
+--out \e disparityBenchmark.json
+- The output file.
+
+--label \e ""
+- A label stored in the output (e.g. the commit), for trend tracking.
+
+--numberOfDisparities \e 128
+- The number of disparities, unless a Middlebury scene gives its own.
+
+--minDisparity \e 0, --SADWindowSize \e 7, --uniquenessRatio \e 15, --speckleWindowSize \e 50,
+--speckleRange \e 16, --preFilterCap \e 63, --disp12MaxDiff \e 0, --best \e true
+- The other disparity parameters, with the defaults of SFM.
+
+--scale \e 1.0
+- Scale of the images (and of the ground truth) before the computation.
+
+--gray
+- Feed the engines with gray images instead of color ones.
+
+--badThreshold \e 2.0
+- Error (in pixels, at the computed scale) above which an estimate is bad.
+
+--repeat \e 1
+- Computations timed per pair.
+
+--warmup \e 1
+- Computations per dataset and engine not timed, on the first pair.
+
+--maxPairs \e 0
+- Maximum number of pairs per dataset, 0 for all of them.
+
+--kittiOcc
+- Use the KITTI ground truth with the occluded pixels.
+
+--checkKernels
+- Only compare the SIMD kernels of LIBELAS compiled into this build (and supported
+  by the CPU) with the generic ones on random inputs, then exit with 0 if they agree.
+
+Any other option of the engines (\e elas_*, \e sgbm_3way, \e cuda_sgm_*)
+applies to all of them.
+
+\section tested_os_sec Tested OS
+Linux.
+
+\author iCub Facility
+*/
+
+#include <cstdio>
+#include <cmath>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <limits>
+#include <algorithm>
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <psapi.h>
+#else
+    #include <sys/resource.h>
+#endif
+
+#include <opencv2/opencv.hpp>
+
+#include <yarp/os/all.h>
+
+#include <iCub/stereoVision/disparityEngine.h>
+#include <iCub/stereoVision/stageStats.h>
+
+using namespace std;
+using namespace cv;
+using namespace yarp::os;
+
+
+/******************************************************************************/
+struct Sample
+{
+    string name;
+    string left,right;
+    string gt;          // empty if no ground truth
+    int ndisp;          // 0 if the dataset does not give it
+};
+
+
+/******************************************************************************/
+struct Dataset
+{
+    string layout;
+    string folder;
+    vector<Sample> samples;
+    bool sequence;      // the pairs are consecutive frames
+};
+
+
+/******************************************************************************/
+struct SampleResult
+{
+    string name;
+    Size size;
+    double ms;          // mean duration of the computation
+    bool hasGt;
+    double bad,density,avgError;
+};
+
+
+/******************************************************************************/
+namespace
+{
+    bool fileExists(const string &path)
+    {
+        ifstream f(path.c_str());
+        return f.good();
+    }
+
+
+    string baseName(const string &path)
+    {
+        size_t pos=path.find_last_of("/\\");
+        return (pos==string::npos)?path:path.substr(pos+1);
+    }
+
+
+    string stripExtension(const string &name)
+    {
+        size_t pos=name.find_last_of('.');
+        return (pos==string::npos)?name:name.substr(0,pos);
+    }
+
+
+    bool isImage(const string &path)
+    {
+        string ext=path.substr(path.find_last_of('.')+1);
+        transform(ext.begin(),ext.end(),ext.begin(),::tolower);
+        return (ext=="png") || (ext=="ppm") || (ext=="pgm") || (ext=="jpg") ||
+               (ext=="jpeg") || (ext=="bmp") || (ext=="tif") || (ext=="tiff");
+    }
+
+
+    vector<string> listImages(const string &pattern)
+    {
+        vector<String> files;
+        glob(pattern,files,false);
+
+        vector<string> images;
+        for (size_t i=0; i<files.size(); i++)
+            if (isImage(files[i]))
+                images.push_back(files[i]);
+
+        sort(images.begin(),images.end());
+        return images;
+    }
+
+
+    // the ndisp of a Middlebury calib.txt, 0 if not there
+    int readMiddleburyNdisp(const string &calib)
+    {
+        ifstream f(calib.c_str());
+        string line;
+        while (getline(f,line))
+            if (line.compare(0,6,"ndisp=")==0)
+                return atoi(line.c_str()+6);
+
+        return 0;
+    }
+
+
+    // a single channel PFM (Middlebury ground truth), rows bottom to top
+    bool readPFM(const string &path, Mat &img)
+    {
+        FILE *f=fopen(path.c_str(),"rb");
+        if (f==NULL)
+            return false;
+
+        char type[3]={0};
+        int w,h;
+        float scale;
+        bool ok=(fscanf(f,"%2s %d %d %f",type,&w,&h,&scale)==4) &&
+                (string(type)=="Pf") && (w>0) && (h>0);
+        if (ok)
+        {
+            fgetc(f);   // the single whitespace before the data
+            img.create(h,w,CV_32FC1);
+            for (int v=h-1; ok && (v>=0); v--)
+                ok=(fread(img.ptr<float>(v),sizeof(float),w,f)==(size_t)w);
+
+            // the data are little-endian if scale<0
+            unsigned int one=1;
+            bool littleEndian=(*(unsigned char*)&one==1);
+            if (ok && ((scale<0.0f)!=littleEndian))
+            {
+                for (int v=0; v<h; v++)
+                {
+                    unsigned char *p=img.ptr<unsigned char>(v);
+                    for (int u=0; u<w; u++,p+=4)
+                    {
+                        swap(p[0],p[3]);
+                        swap(p[1],p[2]);
+                    }
+                }
+            }
+        }
+
+        fclose(f);
+        return ok;
+    }
+
+
+    // the ground truth as CV_32F, NaN where not known
+    bool readGroundTruth(const string &path, Mat &gt)
+    {
+        if (path.substr(path.find_last_of('.')+1)=="pfm")
+        {
+            if (!readPFM(path,gt))
+                return false;
+
+            for (int v=0; v<gt.rows; v++)
+            {
+                float *p=gt.ptr<float>(v);
+                for (int u=0; u<gt.cols; u++)
+                    if (!(fabs(p[u])<=numeric_limits<float>::max()))
+                        p[u]=numeric_limits<float>::quiet_NaN();
+            }
+            return true;
+        }
+
+        // KITTI: 16 bit, disparity times 256, 0 where not known
+        Mat raw=imread(path,IMREAD_ANYDEPTH);
+        if (raw.empty() || (raw.depth()!=CV_16U))
+            return false;
+
+        raw.convertTo(gt,CV_32F,1.0/256.0);
+        for (int v=0; v<gt.rows; v++)
+        {
+            const unsigned short *r=raw.ptr<unsigned short>(v);
+            float *p=gt.ptr<float>(v);
+            for (int u=0; u<gt.cols; u++)
+                if (r[u]==0)
+                    p[u]=numeric_limits<float>::quiet_NaN();
+        }
+        return true;
+    }
+
+
+    bool loadDataset(const string &layout, const string &folder, const bool kittiOcc,
+                     const int maxPairs, Dataset &dataset)
+    {
+        dataset.layout=layout;
+        dataset.folder=folder;
+        dataset.samples.clear();
+        dataset.sequence=(layout=="pairs");
+
+        if (layout=="middlebury")
+        {
+            vector<string> scenes=listImages(folder+"/*/im0.png");
+            for (size_t i=0; i<scenes.size(); i++)
+            {
+                string dir=scenes[i].substr(0,scenes[i].find_last_of("/\\"));
+                Sample s;
+                s.name=baseName(dir);
+                s.left=scenes[i];
+                s.right=dir+"/im1.png";
+                s.gt=fileExists(dir+"/disp0GT.pfm")?dir+"/disp0GT.pfm":"";
+                s.ndisp=readMiddleburyNdisp(dir+"/calib.txt");
+                if (fileExists(s.right))
+                    dataset.samples.push_back(s);
+            }
+        }
+        else if (layout=="kitti")
+        {
+            string gtDir=folder+(kittiOcc?"/disp_occ_0/":"/disp_noc_0/");
+            vector<string> lefts=listImages(folder+"/image_2/*_10.png");
+            for (size_t i=0; i<lefts.size(); i++)
+            {
+                Sample s;
+                s.name=stripExtension(baseName(lefts[i]));
+                s.left=lefts[i];
+                s.right=folder+"/image_3/"+baseName(lefts[i]);
+                s.gt=fileExists(gtDir+baseName(lefts[i]))?gtDir+baseName(lefts[i]):"";
+                s.ndisp=0;
+                if (fileExists(s.right))
+                    dataset.samples.push_back(s);
+            }
+        }
+        else if (layout=="pairs")
+        {
+            vector<string> lefts=listImages(folder+"/left/*");
+            vector<string> rights=listImages(folder+"/right/*");
+            vector<String> gts;
+            glob(folder+"/disp/*",gts,false);
+            sort(gts.begin(),gts.end());
+
+            if (lefts.size()!=rights.size())
+                cout << folder << ": " << lefts.size() << " left and " << rights.size()
+                     << " right images, the exceeding ones are skipped" << endl;
+
+            size_t n=std::min(lefts.size(),rights.size());
+            for (size_t i=0; i<n; i++)
+            {
+                Sample s;
+                s.name=stripExtension(baseName(lefts[i]));
+                s.left=lefts[i];
+                s.right=rights[i];
+                s.gt=(gts.size()==n)?string(gts[i]):"";
+                s.ndisp=0;
+                dataset.samples.push_back(s);
+            }
+        }
+        else
+        {
+            cout << "unknown dataset layout " << layout << endl;
+            return false;
+        }
+
+        if ((maxPairs>0) && ((int)dataset.samples.size()>maxPairs))
+            dataset.samples.resize(maxPairs);
+
+        return !dataset.samples.empty();
+    }
+
+
+    // the peak resident memory [MB] since the last resetPeakMemory()
+    double getPeakMemory()
+    {
+#if defined(_WIN32)
+        PROCESS_MEMORY_COUNTERS pmc;
+        if (GetProcessMemoryInfo(GetCurrentProcess(),&pmc,sizeof(pmc)))
+            return pmc.PeakWorkingSetSize/(1024.0*1024.0);
+        return -1.0;
+#else
+#if defined(__linux__)
+        ifstream status("/proc/self/status");
+        string line;
+        while (getline(status,line))
+            if (line.compare(0,6,"VmHWM:")==0)
+                return atof(line.c_str()+6)/1024.0;
+#endif
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF,&usage)!=0)
+            return -1.0;
+#if defined(__APPLE__)
+        return usage.ru_maxrss/(1024.0*1024.0);
+#else
+        return usage.ru_maxrss/1024.0;
+#endif
+#endif
+    }
+
+
+    void resetPeakMemory()
+    {
+#if defined(__linux__)
+        // resets VmHWM to the current resident set (Linux 4.0 or greater)
+        ofstream clear("/proc/self/clear_refs");
+        clear << "5";
+#endif
+    }
+
+
+    // bad pixels, density and average error of disp (CV_16S scaled by 16,
+    // invalid below minDisp) against gt (CV_32F, NaN where not known)
+    void evaluate(const Mat &disp, const Mat &gt, const int minDisp, const double threshold,
+                  SampleResult &res)
+    {
+        int known=0,estimated=0,bad=0;
+        double error=0.0;
+        short invalid=(short)std::max(0,16*minDisp);
+        for (int v=0; v<gt.rows; v++)
+        {
+            const float *g=gt.ptr<float>(v);
+            const short *d=disp.ptr<short>(v);
+            for (int u=0; u<gt.cols; u++)
+            {
+                if (g[u]!=g[u])
+                    continue;
+
+                known++;
+                if (d[u]<invalid)
+                {
+                    bad++;
+                    continue;
+                }
+
+                double e=fabs(d[u]/16.0-g[u]);
+                estimated++;
+                error+=e;
+                if (e>threshold)
+                    bad++;
+            }
+        }
+
+        res.hasGt=(known>0);
+        res.bad=(known>0)?(100.0*bad)/known:0.0;
+        res.density=(known>0)?(100.0*estimated)/known:0.0;
+        res.avgError=(estimated>0)?error/estimated:0.0;
+    }
+
+
+    string jsonString(const string &s)
+    {
+        ostringstream out;
+        out << '"';
+        for (size_t i=0; i<s.size(); i++)
+        {
+            unsigned char c=s[i];
+            if ((c=='"') || (c=='\\'))
+                out << '\\' << c;
+            else if (c<0x20)
+                out << "\\u" << hex << setw(4) << setfill('0') << (int)c << dec;
+            else
+                out << c;
+        }
+        out << '"';
+        return out.str();
+    }
+
+
+    string jsonNumber(const double x)
+    {
+        if (!(fabs(x)<=numeric_limits<double>::max()))
+            return "null";
+
+        ostringstream out;
+        out << setprecision(6) << x;
+        return out.str();
+    }
+}
+
+
+/******************************************************************************/
+class Benchmark
+{
+    ResourceFinder &rf;
+    DisparityParams params;
+    int numberOfDisparities;
+    double scale;
+    bool gray;
+    double badThreshold;
+    int repeat,warmup;
+
+    ostringstream runs;
+    int numRuns;
+
+    bool loadPair(const Sample &s, Mat &left, Mat &right, Mat &gt) const
+    {
+        int flags=gray?IMREAD_GRAYSCALE:IMREAD_COLOR;
+        left=imread(s.left,flags);
+        right=imread(s.right,flags);
+        if (left.empty() || right.empty() || (left.size()!=right.size()))
+        {
+            cout << s.name << ": cannot read the pair" << endl;
+            return false;
+        }
+
+        gt.release();
+        if (!s.gt.empty() && (!readGroundTruth(s.gt,gt) || (gt.size()!=left.size())))
+        {
+            cout << s.name << ": cannot read the ground truth " << s.gt << endl;
+            gt.release();
+        }
+
+        if (scale!=1.0)
+        {
+            Size size(cvRound(left.cols*scale),cvRound(left.rows*scale));
+            resize(left,left,size,0,0,INTER_AREA);
+            resize(right,right,size,0,0,INTER_AREA);
+            if (!gt.empty())
+            {
+                resize(gt,gt,size,0,0,INTER_NEAREST);
+                gt*=scale;
+            }
+        }
+
+        return true;
+    }
+
+    void run(const string &variant, ResourceFinder &engineRf, const Dataset &dataset)
+    {
+        string name=engineRf.check("engine",Value(variant)).asString().c_str();
+        DisparityEngine *engine=DisparityEngine::create(name,engineRf);
+        if (engine==NULL)
+        {
+            cout << "engine " << name << " is not available, skipped" << endl;
+            return;
+        }
+
+        cout << variant << " on " << dataset.layout << " " << dataset.folder
+             << " (" << dataset.samples.size() << " pairs)" << endl;
+
+        StageStats *stats=new StageStats;
+        int stageTotal=stats->addStage("total");
+        engine->setStageStats(stats);
+
+        vector<SampleResult> results;
+        Size mapSize;
+        Mat mapL1,mapL2,mapR1,mapR2,rectL,rectR,disp;
+        double totalTime=0.0;
+        int frames=0;
+        bool warmedUp=false;
+
+        resetPeakMemory();
+        for (size_t i=0; i<dataset.samples.size(); i++)
+        {
+            const Sample &s=dataset.samples[i];
+            Mat left,right,gt;
+            if (!loadPair(s,left,right,gt))
+                continue;
+
+            // the pairs are rectified already: identity maps, which are
+            // new ones (so the engines drop their state) for each pair
+            // unless the pairs are a sequence
+            if (!dataset.sequence || (left.size()!=mapSize))
+            {
+                Mat K=Mat::eye(3,3,CV_64F);
+                Mat newL1,newL2,newR1,newR2;
+                initUndistortRectifyMap(K,Mat(),Mat(),K,left.size(),CV_16SC2,newL1,newL2);
+                initUndistortRectifyMap(K,Mat(),Mat(),K,left.size(),CV_16SC2,newR1,newR2);
+                mapL1=newL1; mapL2=newL2;
+                mapR1=newR1; mapR2=newR2;
+                mapSize=left.size();
+            }
+
+            params.numberOfDisparities=numberOfDisparities;
+            if ((s.ndisp>0) && !rf.check("numberOfDisparities"))
+                params.numberOfDisparities=16*((cvRound(s.ndisp*scale)+15)/16);
+
+            if (!warmedUp)
+            {
+                for (int k=0; k<warmup; k++)
+                    engine->compute(left,right,mapL1,mapL2,mapR1,mapR2,rectL,rectR,disp,params);
+                stats->reset();
+                warmedUp=true;
+            }
+
+            double sampleTime=0.0;
+            bool ok=true;
+            for (int k=0; ok && (k<repeat); k++)
+            {
+                double t0=StageStats::now();
+                ok=engine->compute(left,right,mapL1,mapL2,mapR1,mapR2,rectL,rectR,disp,params);
+                double t1=StageStats::now();
+                if (ok)
+                {
+                    stats->record(stageTotal,t1-t0);
+                    sampleTime+=t1-t0;
+                    frames++;
+                }
+            }
+
+            if (!ok)
+            {
+                cout << s.name << ": the engine failed" << endl;
+                continue;
+            }
+
+            totalTime+=sampleTime;
+
+            SampleResult res;
+            res.name=s.name;
+            res.size=left.size();
+            res.ms=1e3*sampleTime/repeat;
+            res.hasGt=false;
+            res.bad=res.density=res.avgError=0.0;
+            if (!gt.empty())
+            {
+                // engines may return the float disparity in pixels
+                Mat disp16=disp;
+                if (disp.depth()==CV_32F)
+                    disp.convertTo(disp16,CV_16S,16.0);
+                evaluate(disp16,gt,params.minDisparity,badThreshold,res);
+            }
+            results.push_back(res);
+        }
+        double peakMemory=getPeakMemory();
+
+        engine->setStageStats(NULL);
+        delete engine;
+
+        // averages over the pairs with a ground truth
+        int numGt=0;
+        double bad=0.0,density=0.0,avgError=0.0;
+        for (size_t i=0; i<results.size(); i++)
+        {
+            if (results[i].hasGt)
+            {
+                bad+=results[i].bad;
+                density+=results[i].density;
+                avgError+=results[i].avgError;
+                numGt++;
+            }
+        }
+
+        double fps=(totalTime>0.0)?frames/totalTime:0.0;
+        cout << "  " << frames << " frames, " << fps << " fps, peak memory "
+             << peakMemory << " MB";
+        if (numGt>0)
+            cout << ", bad " << bad/numGt << "%, density " << density/numGt << "%";
+        cout << endl;
+
+        vector<StageStats::Summary> summaries;
+        stats->getSummaries(summaries);
+        delete stats;
+
+        if (numRuns>0)
+            runs << ",";
+        runs << endl << "    {" << endl;
+        runs << "      \"engine\": " << jsonString(name) << "," << endl;
+        runs << "      \"variant\": " << jsonString(variant) << "," << endl;
+        runs << "      \"dataset\": " << jsonString(dataset.layout) << "," << endl;
+        runs << "      \"folder\": " << jsonString(dataset.folder) << "," << endl;
+        runs << "      \"frames\": " << frames << "," << endl;
+        runs << "      \"fps\": " << jsonNumber(fps) << "," << endl;
+        runs << "      \"peak_memory_mb\": " << jsonNumber(peakMemory) << "," << endl;
+        if (numGt>0)
+        {
+            runs << "      \"bad_percent\": " << jsonNumber(bad/numGt) << "," << endl;
+            runs << "      \"density_percent\": " << jsonNumber(density/numGt) << "," << endl;
+            runs << "      \"avg_error\": " << jsonNumber(avgError/numGt) << "," << endl;
+        }
+
+        runs << "      \"stages\": {";
+        for (size_t i=0; i<summaries.size(); i++)
+        {
+            const StageStats::Summary &sum=summaries[i];
+            runs << ((i>0)?",":"") << endl << "        " << jsonString(sum.name) << ": {"
+                 << "\"count\": " << sum.count
+                 << ", \"mean_ms\": " << jsonNumber(sum.mean)
+                 << ", \"p50_ms\": " << jsonNumber(sum.p50)
+                 << ", \"p99_ms\": " << jsonNumber(sum.p99)
+                 << ", \"max_ms\": " << jsonNumber(sum.max) << "}";
+        }
+        runs << endl << "      }," << endl;
+
+        runs << "      \"samples\": [";
+        for (size_t i=0; i<results.size(); i++)
+        {
+            const SampleResult &res=results[i];
+            runs << ((i>0)?",":"") << endl << "        {\"name\": " << jsonString(res.name)
+                 << ", \"width\": " << res.size.width << ", \"height\": " << res.size.height
+                 << ", \"ms\": " << jsonNumber(res.ms);
+            if (res.hasGt)
+                runs << ", \"bad_percent\": " << jsonNumber(res.bad)
+                     << ", \"density_percent\": " << jsonNumber(res.density)
+                     << ", \"avg_error\": " << jsonNumber(res.avgError);
+            runs << "}";
+        }
+        runs << endl << "      ]" << endl << "    }";
+        numRuns++;
+    }
+
+public:
+    Benchmark(ResourceFinder &rf) : rf(rf), numRuns(0)
+    {
+        params.best=rf.check("best",Value("true")).asString()=="true";
+        params.uniquenessRatio=rf.check("uniquenessRatio",Value(15)).asInt();
+        params.speckleWindowSize=rf.check("speckleWindowSize",Value(50)).asInt();
+        params.speckleRange=rf.check("speckleRange",Value(16)).asInt();
+        params.SADWindowSize=rf.check("SADWindowSize",Value(7)).asInt();
+        params.minDisparity=rf.check("minDisparity",Value(0)).asInt();
+        params.preFilterCap=rf.check("preFilterCap",Value(63)).asInt();
+        params.disp12MaxDiff=rf.check("disp12MaxDiff",Value(0)).asInt();
+        numberOfDisparities=rf.check("numberOfDisparities",Value(128)).asInt();
+        params.numberOfDisparities=numberOfDisparities;
+
+        scale=rf.check("scale",Value(1.0)).asDouble();
+        gray=rf.check("gray");
+        badThreshold=rf.check("badThreshold",Value(2.0)).asDouble();
+        repeat=std::max(1,rf.check("repeat",Value(1)).asInt());
+        warmup=std::max(0,rf.check("warmup",Value(1)).asInt());
+    }
+
+    int execute()
+    {
+        Bottle *pDatasets=rf.find("datasets").asList();
+        if (pDatasets==NULL)
+        {
+            cout << "datasets must be given as ((layout folder) ...)" << endl;
+            return 1;
+        }
+
+        Bottle engines;
+        if (Bottle *pEngines=rf.find("engines").asList())
+            engines=*pEngines;
+        else
+            engines.fromString("elas sgbm");
+
+        bool kittiOcc=rf.check("kittiOcc");
+        int maxPairs=rf.check("maxPairs",Value(0)).asInt();
+
+        for (int i=0; i<pDatasets->size(); i++)
+        {
+            Bottle *pDataset=pDatasets->get(i).asList();
+            if ((pDataset==NULL) || (pDataset->size()<2))
+            {
+                cout << "skipped dataset " << pDatasets->get(i).toString().c_str()
+                     << ", it must be (layout folder)" << endl;
+                continue;
+            }
+
+            Dataset dataset;
+            string layout=pDataset->get(0).asString().c_str();
+            string folder=pDataset->get(1).asString().c_str();
+            if (!loadDataset(layout,folder,kittiOcc,maxPairs,dataset))
+            {
+                cout << "no pairs in " << layout << " " << folder << endl;
+                continue;
+            }
+
+            for (int j=0; j<engines.size(); j++)
+            {
+                string variant=engines.get(j).asString().c_str();
+                if (!rf.findGroup(variant.c_str()).isNull())
+                {
+                    ResourceFinder engineRf=rf.findNestedResourceFinder(variant.c_str());
+                    run(variant,engineRf,dataset);
+                }
+                else
+                    run(variant,rf,dataset);
+            }
+        }
+
+        string out=rf.check("out",Value("disparityBenchmark.json")).asString().c_str();
+        ofstream f(out.c_str());
+        if (!f.is_open())
+        {
+            cout << "cannot write " << out << endl;
+            return 1;
+        }
+
+        char date[32];
+        time_t now=time(NULL);
+        strftime(date,sizeof(date),"%Y-%m-%dT%H:%M:%SZ",gmtime(&now));
+
+        f << "{" << endl;
+        f << "  \"label\": " << jsonString(rf.check("label",Value("")).asString().c_str()) << "," << endl;
+        f << "  \"date\": " << jsonString(date) << "," << endl;
+        f << "  \"opencv\": " << jsonString(CV_VERSION) << "," << endl;
+        f << "  \"scale\": " << jsonNumber(scale) << "," << endl;
+        f << "  \"gray\": " << (gray?"true":"false") << "," << endl;
+        f << "  \"bad_threshold\": " << jsonNumber(badThreshold) << "," << endl;
+        f << "  \"repeat\": " << repeat << "," << endl;
+        f << "  \"runs\": [" << runs.str() << endl << "  ]" << endl;
+        f << "}" << endl;
+
+        cout << "results written to " << out << endl;
+        return 0;
+    }
+};
+
+
+/******************************************************************************/
+int main(int argc, char *argv[])
+{
+    // no name server is needed: YARP is used just for the configuration
+    Network yarp;
+
+    ResourceFinder rf;
+    rf.setVerbose(true);
+    rf.setDefaultContext("stereoVision");
+    rf.setDefaultConfigFile("disparityBenchmark.ini");
+    rf.configure(argc,argv);
+
+    if (rf.check("checkKernels"))
+        return kernels::checkAll()?0:1;
+
+    Benchmark benchmark(rf);
+    return benchmark.execute();
+}
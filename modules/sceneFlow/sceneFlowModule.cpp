@@ -64,9 +64,9 @@ bool sceneFlowModule::updateModule()
     if(!flow3D.empty())
     {
 
-        Pflow3D.x=flow3D.ptr<float>(v)[2*u]; // Flow DeltaX
-        Pflow3D.y=flow3D.ptr<float>(v)[2*u+1]; // Flow DeltaY
-        Pflow3D.z=flow3D.ptr<float>(v)[2*u+2]; // Flow DeltaZ
+        Pflow3D.x=flow3D.ptr<float>(v)[3*u]; // Flow DeltaX
+        Pflow3D.y=flow3D.ptr<float>(v)[3*u+1]; // Flow DeltaY
+        Pflow3D.z=flow3D.ptr<float>(v)[3*u+2]; // Flow DeltaZ
         
         fprintf(stdout,"3D Motion of Pixel (%i,%i): (%f, %f, %f) \n",u,v,Pflow3D.x,Pflow3D.y,Pflow3D.z);
 
@@ -42,12 +42,55 @@ YARP libraries and OpenCV 2.4 (or gretear)
 --denseFlow \e val 
 - The parameter \e val specifies the flow type: dense if val=1; sparse if val=0.
 
+--disparityEngine \e sgbm
+- The algorithm of the disparity: \e sgbm (OpenCV's SGBM), \e elas (LIBELAS, configured by the
+\e elas_* options of the \ref SFM module) or \e cuda_sgm (semi-global matching on the GPU, OpenCV 4.2
+or greater with CUDA only; \e cuda_sgm_P1 \e 10 and \e cuda_sgm_P2 \e 120 are its penalties).
+If the engine is not available in this build, \e sgbm is used.
+
+--sgbm_3way
+- With OpenCV 3.1 or greater, the \e sgbm engine uses the faster 3-way variant of SGBM.
+
+--flowBackend \e farneback
+- The algorithm of the dense flow: \e farneback (full resolution), \e farneback_pyr
+(on images downscaled by \e flowScale), \e dis (DIS optical flow with the fast preset,
+OpenCV 4 only) or \e cuda (Farneback on the GPU, OpenCV with CUDA only).
+If the backend is not available in this build, \e farneback is used.
+The mean time per frame of the backend is printed every 100 frames.
+
+--flowScale \e 0.5
+- Downscaling factor of the images for the \e farneback_pyr backend, in (0,1].
+
+--sparseMaxCorners \e 1000
+- Maximum number of corners tracked by the sparse flow.
+
+--sparseRedetect \e 5
+- The sparse flow keeps tracking the same corners across frames; they are detected
+again every \e sparseRedetect frames, or earlier if less than half of the maximum survive.
+
+--sparseMaxError \e 20.0
+- Tracks whose Lucas-Kanade error (mean absolute difference of the patches) is at least this value are discarded.
+
 --leftCamera \e left
 - The parameter \e left specifies the left camera port (e.g. /icub/camcalib/left/out).
 
 --rightCamera \e right
 - The parameter \e right specifies the right camera port (e.g. /icub/camcalib/right/out).
 
+--syncTolerance \e 0.02
+- Maximum difference (in seconds) between the timestamps of the left and right images.
+Only pairs within this tolerance are processed, the unpaired images are discarded.
+
+--replay \e file
+- Replays a stereo log recorded by the \ref SFM module (\e --record) in place of the cameras;
+the disparity still takes the kinematics from the gaze controller.
+
+--replayMode \e realtime
+- \e realtime paces the pairs as recorded, \e fast replays them as fast as they are processed.
+
+--replayLoop
+- Replays the log endlessly.
+
 \section portsc_sec Ports Created
 
 
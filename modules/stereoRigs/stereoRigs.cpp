@@ -0,0 +1,426 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+*/
+
+#include <cstring>
+#include <iostream>
+
+#include "stereoRigs.h"
+
+
+/******************************************************************************/
+StereoRig::StereoRig(StereoRigs *_module, const string &_name) :
+                     module(_module), engine(NULL), index(-1), name(_name),
+                     gaze(false), sync(NULL)
+{
+}
+
+
+/******************************************************************************/
+StereoRig::~StereoRig()
+{
+    delete sync;
+}
+
+
+/******************************************************************************/
+bool StereoRig::open(const string &stem, const Bottle &group, const double syncTolerance)
+{
+    gaze=group.check("gaze");
+
+    H=Mat();
+    if (Bottle *pH=group.find("H").asList())
+    {
+        if (pH->size()!=16)
+        {
+            cout << name << ": H must be a 4x4 matrix by rows" << endl;
+            return false;
+        }
+
+        H=Mat(4,4,CV_64F);
+        for (int i=0; i<16; i++)
+            H.at<double>(i/4,i%4)=pH->get(i).asDouble();
+    }
+
+    string prefix=stem+"/"+name;
+    bool ok=leftPort.open((prefix+"/left:i").c_str());
+    ok&=rightPort.open((prefix+"/right:i").c_str());
+    ok&=dispPort.open((prefix+"/disp:o").c_str());
+    ok&=worldPort.open((prefix+"/world:o").c_str());
+    if (!ok)
+        return false;
+
+    sync=new StereoSynchronizer(&leftPort,&rightPort,syncTolerance);
+    return true;
+}
+
+
+/******************************************************************************/
+void StereoRig::interrupt()
+{
+    leftPort.interrupt();
+    rightPort.interrupt();
+    dispPort.interrupt();
+    worldPort.interrupt();
+}
+
+
+/******************************************************************************/
+void StereoRig::close()
+{
+    leftPort.close();
+    rightPort.close();
+    dispPort.close();
+    worldPort.close();
+}
+
+
+/******************************************************************************/
+void StereoRig::run()
+{
+    while (!isStopping())
+    {
+        // the images read are copies, the engine shares them until the frame is done
+        RigFrame frame;
+        Stamp stampR;
+        if (!sync->read(frame.left,frame.right,frame.stamp,stampR,true))
+            continue;
+
+        if (gaze)
+        {
+            if (!module->getGazeExtrinsics(frame.R,frame.T,frame.H))
+                continue;
+        }
+        else
+            frame.H=H;
+
+        engine->submit(index,frame);
+    }
+}
+
+
+/******************************************************************************/
+void StereoRig::onStop()
+{
+    leftPort.interrupt();
+    rightPort.interrupt();
+}
+
+
+/******************************************************************************/
+void StereoRig::frameDone(const RigResult &result)
+{
+    Stamp stamp=result.stamp;
+    if ((dispPort.getOutputCount()>0) && !result.disp8.empty())
+    {
+        ImageOf<PixelMono> &disp=dispPort.prepare();
+        disp.resize(result.disp8.cols,result.disp8.rows);
+        for (int v=0; v<result.disp8.rows; v++)
+            memcpy(disp.getRow(v),result.disp8.ptr(v),result.disp8.cols);
+        dispPort.setEnvelope(stamp);
+        dispPort.write();
+    }
+
+    if ((worldPort.getOutputCount()>0) && !result.world.empty())
+    {
+        ImageOf<PixelRgbFloat> &world=worldPort.prepare();
+        world.resize(result.world.cols,result.world.rows);
+        for (int v=0; v<result.world.rows; v++)
+            memcpy(world.getRow(v),result.world.ptr(v),result.world.cols*sizeof(PixelRgbFloat));
+        worldPort.setEnvelope(stamp);
+        worldPort.write();
+    }
+}
+
+
+/******************************************************************************/
+bool StereoRigs::openGaze(const string &stem)
+{
+    if (gazeCtrl.isValid())
+        return true;
+
+    Property optionGaze;
+    optionGaze.put("device","gazecontrollerclient");
+    optionGaze.put("remote","/iKinGazeCtrl");
+    optionGaze.put("local",(stem+"/gazeClient").c_str());
+    if (!gazeCtrl.open(optionGaze))
+        return false;
+
+    gazeCtrl.view(igaze);
+    return (igaze!=NULL);
+}
+
+
+/******************************************************************************/
+bool StereoRigs::getGazeExtrinsics(Mat &R, Mat &T, Mat &H)
+{
+    yarp::sig::Vector xL,oL,xR,oR;
+    mutexGaze.lock();
+    bool ok=igaze->getLeftEyePose(xL,oL) && igaze->getRightEyePose(xR,oR);
+    mutexGaze.unlock();
+    if (!ok)
+        return false;
+
+    Matrix L1=axis2dcm(oL);
+    L1.setSubcol(xL,0,3);
+    Matrix R1=axis2dcm(oR);
+    R1.setSubcol(xR,0,3);
+
+    // the extrinsics as in SFM, the world image in the root frame
+    Matrix RT=SE3inv(R1)*L1;
+    R=Mat(3,3,CV_64F);
+    T=Mat(3,1,CV_64F);
+    H=Mat(4,4,CV_64F);
+    for (int i=0; i<3; i++)
+    {
+        for (int j=0; j<3; j++)
+            R.at<double>(i,j)=RT(i,j);
+        T.at<double>(i,0)=RT(i,3);
+    }
+    for (int i=0; i<4; i++)
+        for (int j=0; j<4; j++)
+            H.at<double>(i,j)=L1(i,j);
+
+    return true;
+}
+
+
+/******************************************************************************/
+StereoCamera* StereoRigs::createCamera(ResourceFinder &rf, const Bottle &group)
+{
+    string calibration=group.check("calibration",Value("icubEyes.ini")).asString().c_str();
+
+    ResourceFinder calibRf;
+    calibRf.setContext("cameraCalibration");
+    calibRf.setDefaultConfigFile(calibration.c_str());
+    calibRf.configure(0,NULL);
+
+    Bottle left=calibRf.findGroup("CAMERA_CALIBRATION_LEFT");
+    Bottle right=calibRf.findGroup("CAMERA_CALIBRATION_RIGHT");
+    if (left.isNull() || right.isNull())
+    {
+        cout << calibration << " has not the calibration of the cameras" << endl;
+        return NULL;
+    }
+
+    StereoCamera *stereo=new StereoCamera(calibRf,true);
+
+    // images already undistorted by the camera drivers, as in SFM
+    int calib=rf.check("useCalibrated",Value(1)).asInt();
+    if (group.check("useCalibrated",Value(calib)).asInt()!=0)
+    {
+        Mat KL=stereo->getKleft();
+        Mat KR=stereo->getKright();
+        Mat zeroDist=Mat::zeros(1,8,CV_64FC1);
+        stereo->setIntrinsics(KL,KR,zeroDist,zeroDist);
+    }
+
+    stereo->setRectificationTolerance(group.check("rectTolerance",Value(1e-4)).asDouble());
+
+    string mapsFile=group.check("rectMapsFile",Value("none")).asString().c_str();
+    if (mapsFile!="none")
+        stereo->setRectificationCacheFile(calibRf.getHomeContextPath().c_str()+string("/")+mapsFile);
+
+    string engineName=rf.check("disparityEngine",Value("elas")).asString().c_str();
+    engineName=group.check("disparityEngine",Value(engineName.c_str())).asString().c_str();
+    if (!stereo->setDisparityEngine(engineName,rf) && (engineName!="elas"))
+        stereo->initELAS(rf);
+
+    return stereo;
+}
+
+
+/******************************************************************************/
+bool StereoRigs::configure(ResourceFinder &rf)
+{
+    string name=rf.check("name",Value("stereoRigs")).asString().c_str();
+    string stem="/"+name;
+    double syncTolerance=rf.check("syncTolerance",Value(0.02)).asDouble();
+    statsPeriod=rf.check("statsPeriod",Value(1.0)).asDouble();
+
+    Bottle *pRigs=rf.find("rigs").asList();
+    if ((pRigs==NULL) || (pRigs->size()==0))
+    {
+        cout << "No rigs given" << endl;
+        return false;
+    }
+
+    engine=new MultiRigEngine(rf.check("threads",Value(0)).asInt());
+
+    for (int i=0; i<pRigs->size(); i++)
+    {
+        string rigName=pRigs->get(i).asString().c_str();
+        Bottle &group=rf.findGroup(rigName.c_str());
+        if (group.isNull())
+        {
+            cout << "No group [" << rigName << "]" << endl;
+            close();
+            return false;
+        }
+
+        if (group.check("gaze") && !openGaze(stem))
+        {
+            cout << rigName << ": the gaze controller is not available" << endl;
+            close();
+            return false;
+        }
+
+        StereoCamera *stereo=createCamera(rf,group);
+        if (stereo==NULL)
+        {
+            close();
+            return false;
+        }
+        cameras.push_back(stereo);
+
+        StereoRig *rig=new StereoRig(this,rigName);
+        rigs.push_back(rig);
+        if (!rig->open(stem,group,syncTolerance))
+        {
+            close();
+            return false;
+        }
+
+        RigOptions options;
+        options.name=rigName;
+        options.priority=group.check("priority",Value(1)).asInt();
+        options.fps=group.check("fps",Value(0.0)).asDouble();
+        options.reproject=group.check("world");
+        options.disparity.numberOfDisparities=group.check("numberOfDisparities",Value(96)).asInt();
+        options.disparity.minDisparity=group.check("minDisparity",Value(0)).asInt();
+        rig->setEngine(engine,engine->addRig(stereo,options,rig));
+
+        cout << rigName << ": priority " << engine->getRigOptions(i).priority
+             << ", target frame rate " << options.fps << (options.reproject?", world images":"") << endl;
+    }
+
+    statsPort.open((stem+"/stats:o").c_str());
+
+    if (!engine->start())
+    {
+        cout << "Cannot start the workers" << endl;
+        close();
+        return false;
+    }
+    cout << "Rigs running on " << engine->getPool().getNumThreads() << " workers" << endl;
+
+    for (size_t i=0; i<rigs.size(); i++)
+        rigs[i]->start();
+
+    return true;
+}
+
+
+/******************************************************************************/
+bool StereoRigs::interruptModule()
+{
+    for (size_t i=0; i<rigs.size(); i++)
+        rigs[i]->interrupt();
+    statsPort.interrupt();
+    return true;
+}
+
+
+/******************************************************************************/
+bool StereoRigs::close()
+{
+    // no more frames, then the ones being processed are published
+    for (size_t i=0; i<rigs.size(); i++)
+        if (rigs[i]->isRunning())
+            rigs[i]->stop();
+
+    if (engine!=NULL)
+        engine->stop();
+
+    for (size_t i=0; i<rigs.size(); i++)
+    {
+        rigs[i]->close();
+        delete rigs[i];
+    }
+    rigs.clear();
+
+    delete engine;
+    engine=NULL;
+
+    for (size_t i=0; i<cameras.size(); i++)
+        delete cameras[i];
+    cameras.clear();
+
+    if (gazeCtrl.isValid())
+        gazeCtrl.close();
+
+    statsPort.close();
+    return true;
+}
+
+
+/******************************************************************************/
+bool StereoRigs::updateModule()
+{
+    if (statsPort.getOutputCount()>0)
+    {
+        Bottle b;
+        int executed,stolen;
+        engine->getPool().getCounters(executed,stolen);
+        Bottle &workers=b.addList();
+        workers.addInt(engine->getPool().getNumThreads());
+        workers.addInt(executed);
+        workers.addInt(stolen);
+
+        for (int i=0; i<engine->getNumRigs(); i++)
+        {
+            RigStats s=engine->getRigStats(i);
+            Bottle &rig=b.addList();
+            rig.addString(engine->getRigOptions(i).name.c_str());
+            Bottle &counters=rig.addList();
+            counters.addInt(s.submitted);
+            counters.addInt(s.processed);
+            counters.addInt(s.dropped);
+            counters.addInt(s.throttled);
+            counters.addDouble(s.fps);
+            engine->getStageStats(i).toBottle(rig);
+        }
+
+        statsPort.write(b);
+    }
+
+    return true;
+}
+
+
+/******************************************************************************/
+double StereoRigs::getPeriod()
+{
+    return statsPeriod;
+}
+
+
+/******************************************************************************/
+int main(int argc, char *argv[])
+{
+    Network yarp;
+
+    if (!yarp.checkNetwork())
+        return 1;
+
+    ResourceFinder rf;
+    rf.setVerbose(true);
+    rf.setDefaultConfigFile("stereoRigs.ini");
+    rf.setDefaultContext("stereoVision");
+    rf.configure(argc,argv);
+
+    StereoRigs mod;
+
+    return mod.runModule(rf);
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+ * Permission is granted to copy, distribute, and/or modify this program
+ * under the terms of the GNU General Public License, version 2 or any
+ * later version published by the Free Software Foundation.
+ *
+ * A copy of the license can be found at
+ * http://www.robotcub.org/icub/license/gpl.txt
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details
+*/
+
+/**
+\defgroup stereoRigs stereoRigs
+
+Disparity and world images of several stereo rigs in one process.
+
+Copyright (C) 2015 iCub Facility - Istituto Italiano di Tecnologia
+
+CopyPolicy: Released under the terms of the GNU GPL v2.0.
+
+\section intro_sec Description
+The module computes the disparity and the world image of several stereo pairs
+(e.g. the iCub eyes and external rigs) at once. Instead of one \ref SFM process per
+rig, each with its own threads competing for the cores, the rigs share the
+workers of a MultiRigEngine: the frames of the rigs with a higher priority are
+processed first and each rig can be limited to a target frame rate, so that the
+others get the cores left.
+
+Each rig is described by a group of the configuration file, with the calibration
+of its cameras. The extrinsics are either the calibrated ones (fixed rigs) or, for
+the eyes of the robot, the ones given by the gaze controller at each pair; the
+online refinement of the extrinsics and the rpc commands of \ref SFM are not
+available here.
+
+\section lib_sec Libraries
+YARP libraries, OpenCV and the stereoVision library.
+
+\section parameters_sec Parameters
+--name \e stereoRigs
+- The stem name of the ports created by the module.
+
+--rigs \e "(eyes)"
+- The rigs, each one the name of a group of the configuration file.
+
+--threads \e 0
+- The workers shared by the rigs, 0 for one per core. The OpenMP team of LIBELAS
+is the share of the workers of the rigs being processed.
+
+--syncTolerance \e 0.02
+- Maximum difference (in seconds) between the timestamps of the left and right images
+of a pair (see \ref SFM).
+
+--statsPeriod \e 1.0
+- Period (in seconds) of the statistics written on \e /stereoRigs/stats:o.
+
+--disparityEngine \e elas
+- The default algorithm of the disparity (see \ref SFM), with the \e elas_*, \e sgbm_3way
+and \e cuda_sgm_* options, which apply to all the rigs.
+
+--useCalibrated \e 1
+- The default for the rigs: if not 0 the images are already undistorted (e.g. by the
+camera drivers), hence the distortion of the calibration is not applied, as in \ref SFM.
+
+The group of a rig accepts:
+
+calibration \e icubEyes.ini
+- The file of the \e cameraCalibration context with the intrinsics
+(\e CAMERA_CALIBRATION_LEFT and \e CAMERA_CALIBRATION_RIGHT) and the extrinsics
+(\e HN of \e STEREO_DISPARITY), as for \ref SFM.
+
+priority \e 1
+- From 0 to 3, the jobs of the rigs with a higher priority are taken first.
+
+fps \e 0
+- Target frame rate, the pairs in excess are dropped; 0 processes as many pairs as possible.
+
+gaze
+- The extrinsics of each pair and the root frame of its world image are given by the
+gaze controller (the iCub eyes); otherwise the calibrated extrinsics are used.
+
+H \e "(1 0 0 0 0 1 0 0 0 0 1 0 0 0 0 1)"
+- Without \e gaze, the pose of the left camera in the frame of the world image
+(4x4, by rows); by default the world image is in the frame of the left camera.
+
+disparityEngine \e elas
+- The algorithm of the disparity of the rig.
+
+useCalibrated \e 1
+- The images of the rig are already undistorted (default as \e --useCalibrated).
+
+numberOfDisparities \e 96, minDisparity \e 0
+- The disparity range.
+
+rectTolerance \e 0.0001, rectMapsFile \e none
+- The cache of the rectification maps (see \ref SFM); the maps file is in the home of the
+\e cameraCalibration context.
+
+world
+- Compute the world images; by default only the disparity is computed.
+
+\section portsc_sec Ports Created
+For each rig \e rig:
+- <i> /stereoRigs/rig/left:i </i> and <i> /stereoRigs/rig/right:i </i> accept the images of the rig.
+- <i> /stereoRigs/rig/disp:o </i> outputs the disparity map in grayscale values.
+- <i> /stereoRigs/rig/world:o </i> outputs the world image (3-channel float with X Y Z values,
+  (0,0,0) where not valid), if \e world is given.
+
+The outputs have the envelope of the left image.
+
+- <i> /stereoRigs/stats:o </i> outputs every \e statsPeriod seconds the list
+  (threads executed stolen) of the workers (jobs run and jobs taken from the queue of
+  another worker) followed, for each rig, by the list (name (submitted processed dropped
+  throttled fps) stages): the pairs dropped because a newer one arrived while the rig was
+  busy or because of the target frame rate, and the latency statistics of the stages as
+  written by \ref SFM: \e queue, \e disparity (with the stages of the disparity engine),
+  \e world3d and \e frame (from the pair to the result).
+
+\section in_files_sec Input Data Files
+The calibration files of the rigs.
+
+\section out_data_sec Output Data Files
+None.
+
+\section tested_os_sec Tested OS
+Linux.
+
+\author iCub Facility
+*/
+
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include <yarp/os/all.h>
+#include <yarp/dev/all.h>
+#include <yarp/sig/all.h>
+#include <yarp/math/Math.h>
+
+#include <iCub/ctrl/math.h>
+#include <iCub/stereoVision/stereoCamera.h>
+#include <iCub/stereoVision/stereoSync.h>
+#include <iCub/stereoVision/multiRigEngine.h>
+
+using namespace std;
+using namespace yarp::os;
+using namespace yarp::dev;
+using namespace yarp::sig;
+using namespace yarp::math;
+using namespace iCub::ctrl;
+
+
+class StereoRigs;
+
+/**
+* The ports of a rig: it waits for the pairs, submits them to the engine and
+* publishes the results.
+*/
+class StereoRig : public Thread, public RigListener
+{
+    StereoRigs *module;
+    MultiRigEngine *engine;
+    int index;
+    string name;
+    bool gaze;
+    Mat H;
+
+    BufferedPort<ImageOf<PixelRgb> > leftPort,rightPort;
+    BufferedPort<ImageOf<PixelMono> > dispPort;
+    BufferedPort<ImageOf<PixelRgbFloat> > worldPort;
+    StereoSynchronizer *sync;
+
+public:
+
+    StereoRig(StereoRigs *_module, const string &_name);
+    ~StereoRig();
+
+    bool open(const string &stem, const Bottle &group, const double syncTolerance);
+    void setEngine(MultiRigEngine *_engine, const int _index) { engine=_engine; index=_index; }
+    void interrupt();
+    void close();
+
+    void run();
+    void onStop();
+    void frameDone(const RigResult &result);
+};
+
+
+class StereoRigs : public RFModule
+{
+    friend class StereoRig;
+
+    MultiRigEngine *engine;
+    vector<StereoRig*> rigs;
+    vector<StereoCamera*> cameras;
+
+    PolyDriver gazeCtrl;
+    IGazeControl *igaze;
+    Mutex mutexGaze;
+
+    Port statsPort;
+    double statsPeriod;
+
+    bool openGaze(const string &stem);
+    bool getGazeExtrinsics(Mat &R, Mat &T, Mat &H);
+    StereoCamera* createCamera(ResourceFinder &rf, const Bottle &group);
+
+public:
+
+    StereoRigs() : engine(NULL), igaze(NULL), statsPeriod(1.0) { }
+
+    bool configure(ResourceFinder &rf);
+    bool interruptModule();
+    bool close();
+    bool updateModule();
+    double getPeriod();
+};